@@ -38,6 +38,8 @@
 
 #include "basicusb.h"
 
+OSR_TRACE BasicUsbTrace;
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  DriverEntry
@@ -76,6 +78,7 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
 {
     WDF_DRIVER_CONFIG config;
     NTSTATUS          status;
+    WDFDRIVER         driver;
 
 #ifdef _KERNEL_MODE
 
@@ -102,7 +105,7 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
                              RegistryPath,
                              WDF_NO_OBJECT_ATTRIBUTES,
                              &config,
-                             WDF_NO_HANDLE
+                             &driver
                             );
 
     if (!NT_SUCCESS(status)) {
@@ -110,8 +113,18 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
         DbgPrint("WdfDriverCreate failed 0x%0x\n",
                  status);
 #endif
+        goto Done;
     }
 
+    //
+    // Set up our trace ring.  We can live without it, so if this fails
+    // we just won't trace.
+    //
+    (VOID)OsrTraceInitialize(&BasicUsbTrace,
+                             driver);
+
+Done:
+
     return (status);
 }
 
@@ -812,11 +825,12 @@ BasicUsbInterruptPipeReadComplete(WDFUSBPIPE Pipe,
         dataBuffer = (PUCHAR)WdfMemoryGetBuffer(Buffer,
                                                 nullptr);
 
-#if DBG
-        DbgPrint("Interrupt read complete. Bytes transferred = 0x%x, Data = 0x%x\n",
-                 (ULONG)NumBytesTransferred,
-                 *dataBuffer);
-#endif
+        OsrTrace<OSR_TRACE_LEVEL_INFO>(&BasicUsbTrace,
+                                       OSR_TRACE_BASICUSB_INTERRUPT,
+                                       nullptr,
+                                       *dataBuffer,
+                                       NumBytesTransferred,
+                                       STATUS_SUCCESS);
 
     }
 }
@@ -860,11 +874,12 @@ BasicUsbEvtRead(WDFQUEUE   Queue,
 {
     PBASICUSB_DEVICE_CONTEXT devContext;
 
-    UNREFERENCED_PARAMETER(Length);
-
-#if DBG
-    DbgPrint("BasicUsbEvtRead\n");
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&BasicUsbTrace,
+                                      OSR_TRACE_BASICUSB_READ,
+                                      Request,
+                                      Length,
+                                      0,
+                                      STATUS_SUCCESS);
 
     //
     // Get a pointer to our device extension, just to show how it's done.
@@ -924,11 +939,12 @@ BasicUsbEvtWrite(WDFQUEUE   Queue,
     NTSTATUS                 status;
     ULONG_PTR                bytesWritten;
 
-    UNREFERENCED_PARAMETER(Length);
-
-#if DBG
-    DbgPrint("BasicUsbEvtWrite\n");
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&BasicUsbTrace,
+                                      OSR_TRACE_BASICUSB_WRITE,
+                                      Request,
+                                      Length,
+                                      0,
+                                      STATUS_SUCCESS);
 
     devContext = BasicUsbGetContextFromDevice(
                                               WdfIoQueueGetDevice(Queue));
@@ -1002,10 +1018,13 @@ BasicUsbEvtWrite(WDFQUEUE   Queue,
         // failure status and complete the request ourselves..
         //
         status = WdfRequestGetStatus(Request);
-#if DBG
-        DbgPrint("WdfRequestSend failed 0x%0x\n",
-                 status);
-#endif
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&BasicUsbTrace,
+                                        OSR_TRACE_BASICUSB_SEND_FAILED,
+                                        Request,
+                                        0,
+                                        0,
+                                        status);
         bytesWritten = 0;
 
         goto Done;
@@ -1080,11 +1099,12 @@ BasicUsbEvtRequestWriteCompletionRoutine(WDFREQUEST                     Request,
     //
     usbParams = Params->Parameters.Usb.Completion;
 
-#if DBG
-    DbgPrint("USB write completed with 0x%0x. Bytes transferred 0x%x\n",
-             Params->IoStatus.Status,
-             (ULONG)usbParams->Parameters.PipeWrite.Length);
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&BasicUsbTrace,
+                                      OSR_TRACE_BASICUSB_WRITE_COMPLETE,
+                                      Request,
+                                      usbParams->Parameters.PipeWrite.Length,
+                                      0,
+                                      Params->IoStatus.Status);
 
     //
     // Now complete the request back to the user, specifying the
@@ -1142,9 +1162,12 @@ BasicUsbEvtDeviceControl(WDFQUEUE   Queue,
     PBASICUSB_DEVICE_CONTEXT devContext;
     ULONG_PTR                bytesReadOrWritten;
 
-#if DBG
-    DbgPrint("BasicUsbEvtDeviceControl\n");
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&BasicUsbTrace,
+                                      OSR_TRACE_BASICUSB_IOCTL,
+                                      Request,
+                                      IoControlCode,
+                                      0,
+                                      STATUS_SUCCESS);
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
 
@@ -1179,6 +1202,21 @@ BasicUsbEvtDeviceControl(WDFQUEUE   Queue,
             goto Done;
         }
 
+        case IOCTL_OSR_BASICUSB_TRACE_LEVEL:
+
+            //
+            // These complete the Request themselves
+            //
+            OsrTraceProcessLevel(&BasicUsbTrace,
+                                 Request);
+            return;
+
+        case IOCTL_OSR_BASICUSB_TRACE_DUMP:
+
+            OsrTraceProcessDump(&BasicUsbTrace,
+                                Request);
+            return;
+
             //
             // Other IOCTL cases would be handled here
             //
@@ -1321,6 +1359,13 @@ BasicUsbDoSetBarGraph(PBASICUSB_DEVICE_CONTEXT DevContext,
         goto Done;
     }
 
+    OsrTrace<OSR_TRACE_LEVEL_INFO>(&BasicUsbTrace,
+                                   OSR_TRACE_BASICUSB_BAR_GRAPH,
+                                   Request,
+                                   *(PUCHAR)WdfMemoryGetBuffer(inputMemory, nullptr),
+                                   0,
+                                   status);
+
     status    = STATUS_SUCCESS;
     byteCount = sizeof(UCHAR);
 
@@ -76,6 +76,7 @@ DEFINE_GUID (GUID_DEVINTERFACE_BASICUSB,
              0x79963ae7, 0x45de, 0x4a31, 0x8f, 0x34, 0xf0, 0xe8, 0x90, 0xb, 0xc2, 0x18);
 
 #include "BASICUSB_IOCTL.h"
+#include <osrtrace.h>
 
 //
 // BasicUsb device context structure
@@ -121,6 +122,11 @@ constexpr UCHAR USBFX2LK_SET_7SEGMENT_DISPLAY = 0xDB;
 //
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(BASICUSB_DEVICE_CONTEXT, BasicUsbGetContextFromDevice)
 
+//
+// Our trace ring, shared by all our devices
+//
+extern OSR_TRACE BasicUsbTrace;
+
 //
 // Forward declarations
 //
@@ -51,6 +51,15 @@
                                                  METHOD_BUFFERED,    \
                                                  FILE_WRITE_ACCESS)
 
+//
+// Trace control
+//
+// Let an app set the trace level and dump the driver's trace ring (see
+// osrtrace_format.h)
+//
+#define IOCTL_OSR_BASICUSB_TRACE_LEVEL OSR_TRACE_IOCTL_LEVEL(FILE_DEVICE_BASICUSB)
+#define IOCTL_OSR_BASICUSB_TRACE_DUMP  OSR_TRACE_IOCTL_DUMP(FILE_DEVICE_BASICUSB)
+
 
 #endif /* __BASICUSB_IOCTL_H__ */
 
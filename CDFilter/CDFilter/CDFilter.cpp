@@ -38,6 +38,8 @@
 
 #include "CDFilter.h"
 
+OSR_TRACE CDFilterTrace;
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  DriverEntry
@@ -76,6 +78,7 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
 {
     WDF_DRIVER_CONFIG driverConfig;
     NTSTATUS          status;
+    WDFDRIVER         driver;
 
 #if DBG
     DbgPrint("CDFilter: OSR CDFILTER Filter Driver...Compiled %s %s\n",
@@ -97,15 +100,25 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
                              RegistryPath,
                              WDF_NO_OBJECT_ATTRIBUTES,
                              &driverConfig,
-                             WDF_NO_HANDLE);
+                             &driver);
 
     if (!NT_SUCCESS(status)) {
 #if DBG
         DbgPrint("WdfDriverCreate failed - 0x%x\n",
                  status);
 #endif
+        goto Done;
     }
 
+    //
+    // Set up our trace ring.  We can live without it, so if this fails
+    // we just won't trace.
+    //
+    (VOID)OsrTraceInitialize(&CDFilterTrace,
+                             driver);
+
+Done:
+
     return status;
 }
 
@@ -146,8 +159,10 @@ CDFilterEvtDeviceAdd(WDFDRIVER       Driver,
 {
     NTSTATUS              status;
     WDF_OBJECT_ATTRIBUTES objAtttributes;
+    WDF_OBJECT_ATTRIBUTES requestAttributes;
     WDFDEVICE             wdfDevice;
     PFILTER_DEVICE_CONTEXT filterContext;
+    WDF_IO_QUEUE_CONFIG   queueConfig;
 
     UNREFERENCED_PARAMETER(Driver);
 
@@ -163,12 +178,28 @@ CDFilterEvtDeviceAdd(WDFDRIVER       Driver,
     //
     WdfFdoInitSetFilter(DeviceInit);
 
+    //
+    // Every Request that arrives gets our request context, so that our
+    // completion routines know what the Request was for
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes,
+                                            FILTER_REQUEST_CONTEXT);
+
+    WdfDeviceInitSetRequestAttributes(DeviceInit,
+                                      &requestAttributes);
+
     //
     // Setup our device attributes to have our context type
     //
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&objAtttributes,
                                             FILTER_DEVICE_CONTEXT);
 
+    //
+    // Our cache isn't a WDF object, so we need to free it ourselves when
+    // the device goes away
+    //
+    objAtttributes.EvtCleanupCallback = CDFilterEvtDeviceCleanup;
+
     //
     // And create our WDF device
     //
@@ -186,7 +217,52 @@ CDFilterEvtDeviceAdd(WDFDRIVER       Driver,
 
     filterContext = CDFilterGetDeviceContext(wdfDevice);
 
-    filterContext->WdfDevice = wdfDevice;
+    filterContext->WdfDevice   = wdfDevice;
+    filterContext->LocalTarget = WdfDeviceGetIoTarget(wdfDevice);
+
+    //
+    // We can get along fine without a cache, or without splitting reads,
+    // so these don't fail
+    //
+    CDFilterSetupCache(filterContext);
+
+    CDFilterSetupSplit(filterContext);
+
+    CDFilterSetupCoalesce(filterContext);
+
+    CDFilterSetupElevator(filterContext);
+
+    //
+    // We want to see reads (to trace and cache them), writes (so that we
+    // know what's no longer in the cache) and device controls (for our
+    // own IOCTLs, and to notice the media changing).  Everything else is
+    // still forwarded for us automagically.
+    //
+    // We never hold on to a Request for long (only while the chunks of a
+    // read we split are on their way, or while a read waits to be merged
+    // or for the elevator), so our Queue is parallel and isn't power
+    // managed.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
+                                           WdfIoQueueDispatchParallel);
+
+    queueConfig.EvtIoRead          = CDFilterEvtRead;
+    queueConfig.EvtIoWrite         = CDFilterEvtWrite;
+    queueConfig.EvtIoDeviceControl = CDFilterEvtDeviceControl;
+    queueConfig.PowerManaged       = WdfFalse;
+
+    status = WdfIoQueueCreate(wdfDevice,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              WDF_NO_HANDLE);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfIoQueueCreate failed - 0x%x\n",
+                 status);
+#endif
+        goto Done;
+    }
 
     status = STATUS_SUCCESS;
 
@@ -194,3 +270,3036 @@ Done:
 
     return status;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtDeviceCleanup
+//
+//    This routine is called by the framework when one of our devices is
+//    being deleted
+//
+//  INPUTS:
+//
+//      Object - One of our WDFDEVICE objects
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      The cache is zeroed if it was never set up, and destroying it is
+//      harmless.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtDeviceCleanup(WDFOBJECT Object)
+{
+    PFILTER_DEVICE_CONTEXT filterContext;
+
+    filterContext = CDFilterGetDeviceContext((WDFDEVICE)Object);
+
+    filterContext->CacheEnabled = FALSE;
+
+    OsrSectorCacheDestroy(&filterContext->Cache);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtRead
+//
+//    This routine is called by the framework when there is a
+//    read request for us to process
+//
+//  INPUTS:
+//
+//      Queue    - Our default queue
+//
+//      Request  - A read request
+//
+//      Length   - The length of the read operation
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      If we have a cache and everything the read wants is in it, we
+//      complete the read right here.  Otherwise it goes down as-is, and
+//      if it came from kernel mode what comes back goes in the cache.
+//
+//      Once the drive notices that the media has changed, it sets
+//      DO_VERIFY_VOLUME and fails reads until the file system has checked
+//      the new media.  Whatever we have cached is from the old media, so
+//      we throw it all away and let the read go down and fail.
+//
+//      Every read that the cache could have satisfied, hit or miss, is
+//      also shown to read-ahead, after the read itself is on its way.
+//
+//      A read that misses and is longer than SplitThreshold goes down in
+//      chunks instead (see CDFilterSplitRead).  Any other read waits for
+//      the elevator if it's on (see CDFilterElevatorRead), or if it's
+//      small it might wait a little to be merged with its neighbours (see
+//      CDFilterCoalesceRead).
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtRead(WDFQUEUE   Queue,
+                WDFREQUEST Request,
+                size_t     Length)
+{
+    PFILTER_DEVICE_CONTEXT  filterContext;
+    PFILTER_REQUEST_CONTEXT requestContext;
+    WDF_REQUEST_PARAMETERS  params;
+    NTSTATUS                status;
+    PVOID                   buffer;
+    PDEVICE_OBJECT          lowerDevice;
+    ULONG64                 offset;
+    BOOLEAN                 missed = FALSE;
+    BOOLEAN                 sent   = FALSE;
+
+    filterContext  = CDFilterGetDeviceContext(WdfIoQueueGetDevice(Queue));
+    requestContext = CDFilterGetRequestContext(Request);
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_READ,
+                                      Request,
+                                      Length,
+                                      (ULONG64)params.Parameters.Read.DeviceOffset,
+                                      STATUS_SUCCESS);
+
+    offset = (ULONG64)params.Parameters.Read.DeviceOffset;
+
+    requestContext->Cacheable    = FALSE;
+    requestContext->DeviceOffset = offset;
+    requestContext->Length       = Length;
+
+    if (filterContext->CacheEnabled && Length != 0) {
+
+        lowerDevice = WdfIoTargetWdmGetTargetDeviceObject(filterContext->LocalTarget);
+
+        if ((lowerDevice->Flags & DO_VERIFY_VOLUME) != 0) {
+
+            CDFilterFlushCache(filterContext,
+                               (ULONG)STATUS_VERIFY_REQUIRED);
+
+        } else {
+
+            status = WdfRequestRetrieveOutputBuffer(Request,
+                                                    Length,
+                                                    &buffer,
+                                                    nullptr);
+
+            //
+            // If we can't map the buffer, the read just goes down without
+            // the cache's help
+            //
+            if (NT_SUCCESS(status)) {
+
+                if (OsrSectorCacheRead(&filterContext->Cache,
+                                       offset,
+                                       Length,
+                                       buffer)) {
+
+                    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                                      OSR_TRACE_CDFILTER_CACHE_HIT,
+                                                      Request,
+                                                      Length,
+                                                      offset,
+                                                      STATUS_SUCCESS);
+
+                    WdfRequestCompleteWithInformation(Request,
+                                                      STATUS_SUCCESS,
+                                                      Length);
+
+                    CDFilterReadAhead(filterContext,
+                                      offset,
+                                      Length,
+                                      TRUE);
+                    return;
+                }
+
+                missed = TRUE;
+
+                //
+                // The data comes back in the caller's buffer.  If that's a
+                // user mode buffer, the app can change it after the drive
+                // has filled it in and before we copy it into the cache,
+                // and then we'd hand whatever it wrote to everyone else.
+                // So only kernel mode reads fill the cache.  User mode
+                // reads still get hits, read-aheads and merged reads,
+                // which all use buffers of our own.
+                //
+                if (WdfRequestGetRequestorMode(Request) == KernelMode) {
+
+                    requestContext->Cacheable       = TRUE;
+                    requestContext->CacheGeneration =
+                        OsrSectorCacheGeneration(&filterContext->Cache);
+                }
+            }
+        }
+    }
+
+    if (filterContext->SplitEnabled &&
+        Length > filterContext->SplitThreshold) {
+
+        sent = CDFilterSplitRead(filterContext,
+                                 Request,
+                                 offset,
+                                 Length);
+
+    } else if (filterContext->ElevatorEnabled) {
+
+        sent = CDFilterElevatorRead(filterContext,
+                                    Request);
+
+    } else if (filterContext->CoalesceEnabled &&
+               Length != 0 &&
+               Length <= CDFILTER_COALESCE_SMALL_READ) {
+
+        sent = CDFilterCoalesceRead(filterContext,
+                                    Request);
+    }
+
+    if (!sent) {
+
+        sent = CDFilterSendRead(filterContext,
+                                Request);
+    }
+
+    if (sent && missed) {
+
+        CDFilterReadAhead(filterContext,
+                          offset,
+                          Length,
+                          FALSE);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtReadComplete
+//
+//    This routine is called by the framework when a read we sent
+//    down has been completed
+//
+//  INPUTS:
+//
+//      Request  - The read request
+//
+//      Target   - The I/O target we sent the read to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The context supplied to
+//                 WdfRequestSetCompletionRoutine (NULL in
+//                 our case)
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A read that worked goes in the cache if it's Cacheable (it came from
+//      kernel mode), unless something was invalidated while it was on its
+//      way (in which case the insert quietly does nothing).
+//      A read that failed because the media is gone or different means the
+//      cache is no good any more.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtReadComplete(WDFREQUEST                     Request,
+                        WDFIOTARGET                    Target,
+                        PWDF_REQUEST_COMPLETION_PARAMS Params,
+                        WDFCONTEXT                     Context)
+{
+    PFILTER_DEVICE_CONTEXT  filterContext;
+    PFILTER_REQUEST_CONTEXT requestContext;
+    NTSTATUS                status;
+    PVOID                   buffer;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_READ_COMPLETE,
+                                      Request,
+                                      Params->IoStatus.Information,
+                                      0,
+                                      Params->IoStatus.Status);
+
+    filterContext  = CDFilterGetDeviceContext(WdfIoTargetGetDevice(Target));
+    requestContext = CDFilterGetRequestContext(Request);
+
+    if (requestContext->Cacheable &&
+        NT_SUCCESS(Params->IoStatus.Status) &&
+        Params->IoStatus.Information != 0) {
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+                                                Params->IoStatus.Information,
+                                                &buffer,
+                                                nullptr);
+
+        if (NT_SUCCESS(status)) {
+
+            OsrSectorCacheInsert(&filterContext->Cache,
+                                 requestContext->DeviceOffset,
+                                 Params->IoStatus.Information,
+                                 buffer,
+                                 requestContext->CacheGeneration);
+        }
+    }
+
+    CDFilterCheckMedia(filterContext,
+                       Params->IoStatus.Status);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      Params->IoStatus.Status,
+                                      Params->IoStatus.Information);
+
+    CDFilterReadDone(filterContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtWrite
+//
+//    This routine is called by the framework when there is a
+//    write request for us to process
+//
+//  INPUTS:
+//
+//      Queue    - Our default queue
+//
+//      Request  - A write request
+//
+//      Length   - The length of the write operation
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We throw away whatever we have cached for the range being written
+//      before the write goes down, and again when it completes.  A read of
+//      the same range that's on its way at the same time could otherwise
+//      put the old data back.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtWrite(WDFQUEUE   Queue,
+                 WDFREQUEST Request,
+                 size_t     Length)
+{
+    PFILTER_DEVICE_CONTEXT  filterContext;
+    PFILTER_REQUEST_CONTEXT requestContext;
+    WDF_REQUEST_PARAMETERS  params;
+    NTSTATUS                status;
+
+    filterContext = CDFilterGetDeviceContext(WdfIoQueueGetDevice(Queue));
+
+    if (!filterContext->CacheEnabled) {
+
+        CDFilterSendAndForget(filterContext,
+                              Request);
+        return;
+    }
+
+    requestContext = CDFilterGetRequestContext(Request);
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    requestContext->Cacheable    = FALSE;
+    requestContext->DeviceOffset = (ULONG64)params.Parameters.Write.DeviceOffset;
+    requestContext->Length       = Length;
+
+    OsrSectorCacheInvalidate(&filterContext->Cache,
+                             requestContext->DeviceOffset,
+                             Length);
+
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    WdfRequestSetCompletionRoutine(Request,
+                                   CDFilterEvtWriteComplete,
+                                   nullptr);
+
+    if (!WdfRequestSend(Request,
+                        filterContext->LocalTarget,
+                        WDF_NO_SEND_OPTIONS)) {
+
+        status = WdfRequestGetStatus(Request);
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&CDFilterTrace,
+                                        OSR_TRACE_CDFILTER_SEND_FAILED,
+                                        Request,
+                                        0,
+                                        0,
+                                        status);
+
+        WdfRequestComplete(Request,
+                           status);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtWriteComplete
+//
+//    This routine is called by the framework when a write we sent
+//    down has been completed
+//
+//  INPUTS:
+//
+//      Request  - The write request
+//
+//      Target   - The I/O target we sent the write to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The context supplied to
+//                 WdfRequestSetCompletionRoutine (NULL in
+//                 our case)
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      We invalidate the whole range the write was for, whether it worked
+//      or not.  A failed write could still have changed some of it.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtWriteComplete(WDFREQUEST                     Request,
+                         WDFIOTARGET                    Target,
+                         PWDF_REQUEST_COMPLETION_PARAMS Params,
+                         WDFCONTEXT                     Context)
+{
+    PFILTER_DEVICE_CONTEXT  filterContext;
+    PFILTER_REQUEST_CONTEXT requestContext;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    filterContext  = CDFilterGetDeviceContext(WdfIoTargetGetDevice(Target));
+    requestContext = CDFilterGetRequestContext(Request);
+
+    OsrSectorCacheInvalidate(&filterContext->Cache,
+                             requestContext->DeviceOffset,
+                             requestContext->Length);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      Params->IoStatus.Status,
+                                      Params->IoStatus.Information);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtDeviceControl
+//
+//    This routine is called by the framework when there is a
+//    device control request for us to process
+//
+//  INPUTS:
+//
+//      Queue    - Our default queue
+//
+//      Request  - A device control request
+//
+//      OutputBufferLength - The length of the output buffer
+//
+//      InputBufferLength  - The length of the input buffer
+//
+//      IoControlCode      - The operation being performed
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Everything but our own IOCTLs goes straight down the stack.  We
+//      empty the cache on the way past anything that can change the media
+//      or write to it without us seeing a write.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtDeviceControl(WDFQUEUE   Queue,
+                         WDFREQUEST Request,
+                         size_t     OutputBufferLength,
+                         size_t     InputBufferLength,
+                         ULONG      IoControlCode)
+{
+    PFILTER_DEVICE_CONTEXT filterContext;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    filterContext = CDFilterGetDeviceContext(WdfIoQueueGetDevice(Queue));
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_IOCTL,
+                                      Request,
+                                      IoControlCode,
+                                      0,
+                                      STATUS_SUCCESS);
+
+    switch (IoControlCode) {
+
+        case IOCTL_OSR_CDFILTER_TRACE_LEVEL:
+
+            OsrTraceProcessLevel(&CDFilterTrace,
+                                 Request);
+            return;
+
+        case IOCTL_OSR_CDFILTER_TRACE_DUMP:
+
+            OsrTraceProcessDump(&CDFilterTrace,
+                                Request);
+            return;
+
+        case IOCTL_OSR_CDFILTER_CACHE_STATS:
+
+            CDFilterCacheStats(filterContext,
+                               Request);
+            return;
+
+        case IOCTL_OSR_CDFILTER_READAHEAD_STATS:
+
+            CDFilterReadAheadStats(filterContext,
+                                   Request);
+            return;
+
+        case IOCTL_OSR_CDFILTER_ELEVATOR_STATS:
+
+            CDFilterElevatorStats(filterContext,
+                                  Request);
+            return;
+
+        case IOCTL_STORAGE_EJECT_MEDIA:
+        case IOCTL_STORAGE_LOAD_MEDIA:
+        case IOCTL_STORAGE_LOAD_MEDIA2:
+        case IOCTL_SCSI_PASS_THROUGH:
+        case IOCTL_SCSI_PASS_THROUGH_DIRECT:
+        case IOCTL_SCSI_PASS_THROUGH_EX:
+        case IOCTL_SCSI_PASS_THROUGH_DIRECT_EX:
+
+            CDFilterFlushCache(filterContext,
+                               IoControlCode);
+            break;
+
+        default:
+            break;
+    }
+
+    CDFilterSendAndForget(filterContext,
+                          Request);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSendAndForget
+//
+//    This routine passes a Request we don't care about down to our
+//    Local I/O Target
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The Request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterSendAndForget(PFILTER_DEVICE_CONTEXT FilterContext,
+                      WDFREQUEST             Request)
+{
+    WDF_REQUEST_SEND_OPTIONS options;
+    NTSTATUS                 status;
+
+    WDF_REQUEST_SEND_OPTIONS_INIT(&options,
+                                  WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+
+    if (!WdfRequestSend(Request,
+                        FilterContext->LocalTarget,
+                        &options)) {
+
+        status = WdfRequestGetStatus(Request);
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&CDFilterTrace,
+                                        OSR_TRACE_CDFILTER_SEND_FAILED,
+                                        Request,
+                                        0,
+                                        0,
+                                        status);
+
+        WdfRequestComplete(Request,
+                           status);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSendRead
+//
+//    This routine sends a read down as-is, but with a completion routine
+//    so that we get to see how it turned out
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The read, with its request context filled in
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the read was sent, FALSE if it couldn't be, in which case
+//      we've completed it
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+BOOLEAN
+CDFilterSendRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                 WDFREQUEST             Request)
+{
+    InterlockedIncrement(&FilterContext->ReadsInFlight);
+
+    return CDFilterSendCountedRead(FilterContext,
+                                   Request);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSendCountedRead
+//
+//    This routine is CDFilterSendRead for a read that's already been
+//    counted in ReadsInFlight
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The read, with its request context filled in
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the read was sent, FALSE if it couldn't be, in which case
+//      we've completed it
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The elevator counts its reads while it's picking them, so that it
+//      doesn't pick more than it's allowed.
+//
+///////////////////////////////////////////////////////////////////////////////
+BOOLEAN
+CDFilterSendCountedRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                        WDFREQUEST             Request)
+{
+    NTSTATUS status;
+
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    WdfRequestSetCompletionRoutine(Request,
+                                   CDFilterEvtReadComplete,
+                                   nullptr);
+
+    if (!WdfRequestSend(Request,
+                        FilterContext->LocalTarget,
+                        WDF_NO_SEND_OPTIONS)) {
+
+        status = WdfRequestGetStatus(Request);
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&CDFilterTrace,
+                                        OSR_TRACE_CDFILTER_SEND_FAILED,
+                                        Request,
+                                        0,
+                                        0,
+                                        status);
+
+        WdfRequestComplete(Request,
+                           status);
+
+        CDFilterReadDone(FilterContext);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterReadDone
+//
+//    This routine is called when one of the reads we sent down (of any
+//    kind) has been completed
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The drive is ready for more, so any small reads waiting to be
+//      merged don't need to wait any longer, and the elevator can send
+//      its next read.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterReadDone(PFILTER_DEVICE_CONTEXT FilterContext)
+{
+    InterlockedDecrement(&FilterContext->ReadsInFlight);
+
+    if (FilterContext->CoalesceEnabled) {
+        CDFilterCoalesceFlush(FilterContext);
+    }
+
+    if (FilterContext->ElevatorEnabled) {
+        CDFilterElevatorDispatch(FilterContext);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSetupCache
+//
+//    This routine reads the cache settings from our service's Parameters
+//    key and sets up the device's cache and read-ahead
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//  OUTPUTS:
+//
+//      FilterContext->Cache, FilterContext->CacheEnabled,
+//      FilterContext->ReadAhead and FilterContext->ReadAheadEnabled
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      There's no cache unless CacheSize is there.  CachePageSize is
+//      optional and defaults to one sector.  If the settings are no good,
+//      or there isn't enough memory, we carry on without a cache.
+//
+//      Read-ahead goes into the cache, so there's none without a cache,
+//      or if ReadAheadMaximum is zero.  ReadAheadMinimum is the window a
+//      stream starts with.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterSetupCache(PFILTER_DEVICE_CONTEXT FilterContext)
+{
+    NTSTATUS status;
+    WDFKEY   key;
+    ULONG    cacheSize = 0;
+    ULONG    pageSize  = OSR_SECTOR_SIZE;
+    ULONG    minWindow = CDFILTER_DEFAULT_READAHEAD_MIN;
+    ULONG    maxWindow = CDFILTER_DEFAULT_READAHEAD_MAX;
+
+    DECLARE_CONST_UNICODE_STRING(cacheSizeName,
+                                 L"CacheSize");
+    DECLARE_CONST_UNICODE_STRING(cachePageSizeName,
+                                 L"CachePageSize");
+    DECLARE_CONST_UNICODE_STRING(readAheadMinimumName,
+                                 L"ReadAheadMinimum");
+    DECLARE_CONST_UNICODE_STRING(readAheadMaximumName,
+                                 L"ReadAheadMaximum");
+
+    FilterContext->CacheEnabled     = FALSE;
+    FilterContext->ReadAheadEnabled = FALSE;
+
+    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(),
+                                                KEY_READ,
+                                                WDF_NO_OBJECT_ATTRIBUTES,
+                                                &key);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfDriverOpenParametersRegistryKey failed 0x%0x, "
+                 "no cache\n",
+                 status);
+#endif
+        return;
+    }
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &cacheSizeName,
+                                &cacheSize);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &cachePageSizeName,
+                                &pageSize);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &readAheadMinimumName,
+                                &minWindow);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &readAheadMaximumName,
+                                &maxWindow);
+
+    WdfRegistryClose(key);
+
+    if (cacheSize == 0) {
+        return;
+    }
+
+    if (!OsrSectorCacheInitialize(&FilterContext->Cache,
+                                  cacheSize,
+                                  pageSize)) {
+#if DBG
+        DbgPrint("OsrSectorCacheInitialize failed for 0x%lx bytes in pages "
+                 "of 0x%lx, no cache\n",
+                 cacheSize,
+                 pageSize);
+#endif
+        OsrSectorCacheDestroy(&FilterContext->Cache);
+        return;
+    }
+
+    FilterContext->CacheEnabled = TRUE;
+
+    if (maxWindow != 0) {
+
+        FilterContext->ReadAheadEnabled =
+            OsrReadAheadInitialize(&FilterContext->ReadAhead,
+                                   minWindow,
+                                   maxWindow);
+    }
+
+#if DBG
+    DbgPrint("CDFilter: 0x%lx byte cache in pages of 0x%lx, read-ahead "
+             "window 0x%lx to 0x%lx%s\n",
+             cacheSize,
+             pageSize,
+             minWindow,
+             maxWindow,
+             FilterContext->ReadAheadEnabled ? "" : " (off)");
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterFlushCache
+//
+//    This routine empties the device's cache, and forgets about any
+//    streams we were reading ahead of, because the media might have
+//    changed
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Reason        - The IOCTL or status that told us, for the trace
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterFlushCache(PFILTER_DEVICE_CONTEXT FilterContext,
+                   ULONG64                Reason)
+{
+    if (!FilterContext->CacheEnabled) {
+        return;
+    }
+
+    OsrTrace<OSR_TRACE_LEVEL_INFO>(&CDFilterTrace,
+                                   OSR_TRACE_CDFILTER_CACHE_FLUSHED,
+                                   nullptr,
+                                   Reason,
+                                   0,
+                                   STATUS_SUCCESS);
+
+    OsrSectorCacheInvalidateAll(&FilterContext->Cache);
+
+    if (FilterContext->ReadAheadEnabled) {
+        OsrReadAheadReset(&FilterContext->ReadAhead);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterCheckMedia
+//
+//    This routine looks at how a read we sent down turned out, and empties
+//    the cache if it says the media is gone or different
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Status        - The read's status
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterCheckMedia(PFILTER_DEVICE_CONTEXT FilterContext,
+                   NTSTATUS               Status)
+{
+    switch (Status) {
+
+        case STATUS_VERIFY_REQUIRED:
+        case STATUS_NO_MEDIA_IN_DEVICE:
+        case STATUS_UNRECOGNIZED_MEDIA:
+        case STATUS_DEVICE_NOT_READY:
+
+            CDFilterFlushCache(FilterContext,
+                               (ULONG)Status);
+            break;
+
+        default:
+            break;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterCacheStats
+//
+//    This routine handles IOCTL_OSR_CDFILTER_CACHE_STATS
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The IOCTL
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Fails with STATUS_INVALID_DEVICE_REQUEST if there's no cache.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterCacheStats(PFILTER_DEVICE_CONTEXT FilterContext,
+                   WDFREQUEST             Request)
+{
+    NTSTATUS                status;
+    POSR_SECTOR_CACHE_STATS stats;
+
+    if (!FilterContext->CacheEnabled) {
+
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(OSR_SECTOR_CACHE_STATS),
+                                            (PVOID *)&stats,
+                                            nullptr);
+
+    if (!NT_SUCCESS(status)) {
+
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    OsrSectorCacheQueryStats(&FilterContext->Cache,
+                             stats);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(OSR_SECTOR_CACHE_STATS));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterReadAhead
+//
+//    This routine tells read-ahead about a read, and sends a read-ahead
+//    down if it says to
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Offset        - The device offset of the read
+//
+//      Length        - The length of the read
+//
+//      Hit           - TRUE if the read was satisfied from the cache
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The read-ahead is a Request of our own, with its own buffer, that
+//      we delete when it completes.  If we can't build or send it we just
+//      tell read-ahead that it failed.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterReadAhead(PFILTER_DEVICE_CONTEXT FilterContext,
+                  ULONG64                Offset,
+                  size_t                 Length,
+                  BOOLEAN                Hit)
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDFREQUEST              request = nullptr;
+    WDFMEMORY               memory;
+    PFILTER_REQUEST_CONTEXT requestContext;
+    ULONG64                 aheadOffset;
+    ULONG                   aheadLength;
+    ULONG                   cookie;
+    LONGLONG                deviceOffset;
+
+    if (!FilterContext->ReadAheadEnabled) {
+        return;
+    }
+
+    if (!OsrReadAheadObserve(&FilterContext->ReadAhead,
+                             Offset,
+                             Length,
+                             Hit,
+                             &aheadOffset,
+                             &aheadLength,
+                             &cookie)) {
+        return;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes,
+                                            FILTER_REQUEST_CONTEXT);
+
+    attributes.ParentObject = FilterContext->WdfDevice;
+
+    status = WdfRequestCreate(&attributes,
+                              FilterContext->LocalTarget,
+                              &request);
+
+    if (!NT_SUCCESS(status)) {
+        request = nullptr;
+        goto Done;
+    }
+
+    //
+    // The buffer goes away with the Request
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+
+    attributes.ParentObject = request;
+
+    status = WdfMemoryCreate(&attributes,
+                             NonPagedPoolNx,
+                             OSR_SECTOR_CACHE_POOL_TAG,
+                             aheadLength,
+                             &memory,
+                             nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        goto Done;
+    }
+
+    deviceOffset = (LONGLONG)aheadOffset;
+
+    status = WdfIoTargetFormatRequestForRead(FilterContext->LocalTarget,
+                                             request,
+                                             memory,
+                                             nullptr,
+                                             &deviceOffset);
+
+    if (!NT_SUCCESS(status)) {
+        goto Done;
+    }
+
+    requestContext = CDFilterGetRequestContext(request);
+
+    requestContext->Cacheable       = TRUE;
+    requestContext->DeviceOffset    = aheadOffset;
+    requestContext->Length          = aheadLength;
+    requestContext->CacheGeneration = OsrSectorCacheGeneration(&FilterContext->Cache);
+    requestContext->ReadAheadCookie = cookie;
+
+    WdfRequestSetCompletionRoutine(request,
+                                   CDFilterEvtReadAheadComplete,
+                                   nullptr);
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_READ_AHEAD,
+                                      request,
+                                      aheadLength,
+                                      aheadOffset,
+                                      STATUS_SUCCESS);
+
+    InterlockedIncrement(&FilterContext->ReadsInFlight);
+
+    if (!WdfRequestSend(request,
+                        FilterContext->LocalTarget,
+                        WDF_NO_SEND_OPTIONS)) {
+
+        InterlockedDecrement(&FilterContext->ReadsInFlight);
+
+        status = WdfRequestGetStatus(request);
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&CDFilterTrace,
+                                        OSR_TRACE_CDFILTER_SEND_FAILED,
+                                        request,
+                                        0,
+                                        0,
+                                        status);
+        goto Done;
+    }
+
+    return;
+
+Done:
+
+    OsrReadAheadDone(&FilterContext->ReadAhead,
+                     cookie,
+                     FALSE);
+
+    if (request != nullptr) {
+        WdfObjectDelete(request);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtReadAheadComplete
+//
+//    This routine is called by the framework when one of our read-aheads
+//    has been completed
+//
+//  INPUTS:
+//
+//      Request  - The read-ahead
+//
+//      Target   - The I/O target we sent the read-ahead to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The context supplied to
+//                 WdfRequestSetCompletionRoutine (NULL in
+//                 our case)
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Nobody is waiting for this, so all we do is put the data in the
+//      cache and delete the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtReadAheadComplete(WDFREQUEST                     Request,
+                             WDFIOTARGET                    Target,
+                             PWDF_REQUEST_COMPLETION_PARAMS Params,
+                             WDFCONTEXT                     Context)
+{
+    PFILTER_DEVICE_CONTEXT  filterContext;
+    PFILTER_REQUEST_CONTEXT requestContext;
+    NTSTATUS                status = Params->IoStatus.Status;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    filterContext  = CDFilterGetDeviceContext(WdfIoTargetGetDevice(Target));
+    requestContext = CDFilterGetRequestContext(Request);
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_READ_COMPLETE,
+                                      Request,
+                                      Params->IoStatus.Information,
+                                      0,
+                                      status);
+
+    if (NT_SUCCESS(status)) {
+
+        OsrSectorCacheInsert(&filterContext->Cache,
+                             requestContext->DeviceOffset,
+                             Params->IoStatus.Information,
+                             WdfMemoryGetBuffer(Params->Parameters.Read.Buffer,
+                                                nullptr),
+                             requestContext->CacheGeneration);
+    }
+
+    OsrReadAheadDone(&filterContext->ReadAhead,
+                     requestContext->ReadAheadCookie,
+                     NT_SUCCESS(status));
+
+    CDFilterCheckMedia(filterContext,
+                       status);
+
+    WdfObjectDelete(Request);
+
+    CDFilterReadDone(filterContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterReadAheadStats
+//
+//    This routine handles IOCTL_OSR_CDFILTER_READAHEAD_STATS
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The IOCTL
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Fails with STATUS_INVALID_DEVICE_REQUEST if read-ahead is off.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterReadAheadStats(PFILTER_DEVICE_CONTEXT FilterContext,
+                       WDFREQUEST             Request)
+{
+    NTSTATUS             status;
+    POSR_READAHEAD_STATS stats;
+
+    if (!FilterContext->ReadAheadEnabled) {
+
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(OSR_READAHEAD_STATS),
+                                            (PVOID *)&stats,
+                                            nullptr);
+
+    if (!NT_SUCCESS(status)) {
+
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    OsrReadAheadQueryStats(&FilterContext->ReadAhead,
+                           stats);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(OSR_READAHEAD_STATS));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSetupSplit
+//
+//    This routine reads the settings for splitting large reads from our
+//    service's Parameters key
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//  OUTPUTS:
+//
+//      FilterContext->SplitEnabled, FilterContext->SplitThreshold,
+//      FilterContext->SplitChunkSize and FilterContext->SplitMaxInFlight
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      We don't split reads unless SplitThreshold is there and isn't zero.
+//      SplitChunkSize is rounded down to whole sectors, and both it and
+//      SplitMaxInFlight are optional.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterSetupSplit(PFILTER_DEVICE_CONTEXT FilterContext)
+{
+    NTSTATUS status;
+    WDFKEY   key;
+    ULONG    threshold = 0;
+    ULONG    chunkSize = CDFILTER_DEFAULT_SPLIT_CHUNK;
+    ULONG    inFlight  = CDFILTER_DEFAULT_SPLIT_IN_FLIGHT;
+
+    DECLARE_CONST_UNICODE_STRING(splitThresholdName,
+                                 L"SplitThreshold");
+    DECLARE_CONST_UNICODE_STRING(splitChunkSizeName,
+                                 L"SplitChunkSize");
+    DECLARE_CONST_UNICODE_STRING(splitMaxInFlightName,
+                                 L"SplitMaxInFlight");
+
+    FilterContext->SplitEnabled = FALSE;
+
+    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(),
+                                                KEY_READ,
+                                                WDF_NO_OBJECT_ATTRIBUTES,
+                                                &key);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfDriverOpenParametersRegistryKey failed 0x%0x, "
+                 "not splitting reads\n",
+                 status);
+#endif
+        return;
+    }
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &splitThresholdName,
+                                &threshold);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &splitChunkSizeName,
+                                &chunkSize);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &splitMaxInFlightName,
+                                &inFlight);
+
+    WdfRegistryClose(key);
+
+    chunkSize -= chunkSize % OSR_SECTOR_SIZE;
+
+    if (threshold == 0 ||
+        chunkSize == 0 ||
+        inFlight == 0 ||
+        inFlight > CDFILTER_MAX_SPLIT_IN_FLIGHT) {
+        return;
+    }
+
+    FilterContext->SplitThreshold   = threshold;
+    FilterContext->SplitChunkSize   = chunkSize;
+    FilterContext->SplitMaxInFlight = inFlight;
+    FilterContext->SplitEnabled     = TRUE;
+
+#if DBG
+    DbgPrint("CDFilter: splitting reads over 0x%lx bytes into chunks of "
+             "0x%lx, %lu at a time\n",
+             threshold,
+             chunkSize,
+             inFlight);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSplitRead
+//
+//    This routine sends a large read down in chunks, several at a time
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The read
+//
+//      Offset        - The device offset of the read
+//
+//      Length        - The length of the read
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if we've taken the read, FALSE if the caller should send it
+//      down the usual way
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Chunks start and end on multiples of SplitChunkSize on the device,
+//      except for the first and last, and each one reads straight into
+//      its part of the read's buffer.  We create up to SplitMaxInFlight
+//      Requests of our own and send each one down with a chunk.  When one
+//      completes it's reused for the next chunk that hasn't been sent,
+//      until there are none left.  The read is completed when the last
+//      chunk is done.
+//
+//      The read gets a FILTER_SPLIT_CONTEXT for keeping track of all this.
+//      If we can't get that, or any Requests at all, we leave the read
+//      alone.  If we get fewer Requests than we wanted, we make do.
+//
+///////////////////////////////////////////////////////////////////////////////
+BOOLEAN
+CDFilterSplitRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                  WDFREQUEST             Request,
+                  ULONG64                Offset,
+                  size_t                 Length)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    PFILTER_SPLIT_CONTEXT splitContext;
+    WDFMEMORY             memory;
+    WDFSPINLOCK           lock;
+    WDFREQUEST            chunks[CDFILTER_MAX_SPLIT_IN_FLIGHT];
+    ULONG64               chunkCount;
+    ULONG                 created;
+    ULONG                 index;
+
+    status = WdfRequestRetrieveOutputMemory(Request,
+                                            &memory);
+
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes,
+                                            FILTER_SPLIT_CONTEXT);
+
+    status = WdfObjectAllocateContext(Request,
+                                      &attributes,
+                                      (PVOID *)&splitContext);
+
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    //
+    // The lock goes away with the read
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+
+    attributes.ParentObject = Request;
+
+    status = WdfSpinLockCreate(&attributes,
+                               &lock);
+
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    chunkCount = ((Offset + Length + FilterContext->SplitChunkSize - 1) /
+                  FilterContext->SplitChunkSize) -
+                 (Offset / FilterContext->SplitChunkSize);
+
+    //
+    // The chunks are ours, so they belong to the device and we delete
+    // them when we're done with them
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes,
+                                            FILTER_REQUEST_CONTEXT);
+
+    attributes.ParentObject = FilterContext->WdfDevice;
+
+    for (created = 0;
+         created < FilterContext->SplitMaxInFlight && created < chunkCount;
+         created++) {
+
+        status = WdfRequestCreate(&attributes,
+                                  FilterContext->LocalTarget,
+                                  &chunks[created]);
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+    }
+
+    if (created == 0) {
+        return FALSE;
+    }
+
+    splitContext->Lock         = lock;
+    splitContext->Memory       = memory;
+    splitContext->DeviceOffset = Offset;
+    splitContext->Length       = Length;
+    splitContext->NextOffset   = 0;
+    splitContext->Outstanding  = 1;
+    splitContext->GoodLength   = Length;
+    splitContext->Status       = STATUS_SUCCESS;
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_SPLIT,
+                                      Request,
+                                      Length,
+                                      chunkCount,
+                                      STATUS_SUCCESS);
+
+    for (index = 0; index < created; index++) {
+
+        if (!CDFilterSplitSendChunk(FilterContext,
+                                    Request,
+                                    chunks[index])) {
+
+            WdfObjectDelete(chunks[index]);
+        }
+    }
+
+    //
+    // Chunks might have finished already, but the read can't be completed
+    // until we let go of it
+    //
+    CDFilterSplitRelease(Request);
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSplitSendChunk
+//
+//    This routine sends the next chunk of a read we split down, using one
+//    of our chunk Requests
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The read we split
+//
+//      Chunk         - One of our chunk Requests, which isn't in use
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if Chunk was sent, FALSE if there was nothing left to send or
+//      it couldn't be sent, in which case the caller deletes Chunk
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      There's nothing left to send once the chunks reach the end of the
+//      read, or the start of a chunk that failed.  We also stop if the
+//      read has been cancelled, and complete it with STATUS_CANCELLED once
+//      the chunks that are already on their way are done.
+//
+//      The caller holds a count on the read (for the chunk that just
+//      completed, or the one CDFilterSplitRead starts with), so the read
+//      can't be completed underneath us.
+//
+///////////////////////////////////////////////////////////////////////////////
+BOOLEAN
+CDFilterSplitSendChunk(PFILTER_DEVICE_CONTEXT FilterContext,
+                       WDFREQUEST             Request,
+                       WDFREQUEST             Chunk)
+{
+    NTSTATUS                 status;
+    PFILTER_SPLIT_CONTEXT    splitContext;
+    PFILTER_REQUEST_CONTEXT  chunkContext;
+    WDF_REQUEST_REUSE_PARAMS reuseParams;
+    WDFMEMORY_OFFSET         memoryOffset;
+    size_t                   bufferOffset;
+    size_t                   length;
+    ULONG64                  offset;
+    LONGLONG                 deviceOffset;
+
+    splitContext = CDFilterGetSplitContext(Request);
+
+    WdfSpinLockAcquire(splitContext->Lock);
+
+    if (splitContext->NextOffset < splitContext->GoodLength &&
+        WdfRequestIsCanceled(Request)) {
+
+        splitContext->GoodLength = splitContext->NextOffset;
+        splitContext->Status     = STATUS_CANCELLED;
+    }
+
+    if (splitContext->NextOffset >= splitContext->GoodLength) {
+
+        WdfSpinLockRelease(splitContext->Lock);
+        return FALSE;
+    }
+
+    bufferOffset = splitContext->NextOffset;
+    offset       = splitContext->DeviceOffset + bufferOffset;
+
+    length = min(FilterContext->SplitChunkSize -
+                     (size_t)(offset % FilterContext->SplitChunkSize),
+                 splitContext->Length - bufferOffset);
+
+    splitContext->NextOffset += length;
+    splitContext->Outstanding++;
+
+    WdfSpinLockRelease(splitContext->Lock);
+
+    //
+    // The chunk might have been sent before
+    //
+    WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams,
+                                  WDF_REQUEST_REUSE_NO_FLAGS,
+                                  STATUS_SUCCESS);
+
+    (VOID)WdfRequestReuse(Chunk,
+                          &reuseParams);
+
+    memoryOffset.BufferOffset = bufferOffset;
+    memoryOffset.BufferLength = length;
+
+    deviceOffset = (LONGLONG)offset;
+
+    status = WdfIoTargetFormatRequestForRead(FilterContext->LocalTarget,
+                                             Chunk,
+                                             splitContext->Memory,
+                                             &memoryOffset,
+                                             &deviceOffset);
+
+    if (NT_SUCCESS(status)) {
+
+        chunkContext = CDFilterGetRequestContext(Chunk);
+
+        chunkContext->Cacheable    = FALSE;
+        chunkContext->DeviceOffset = offset;
+        chunkContext->Length       = length;
+        chunkContext->SplitRead    = Request;
+        chunkContext->BufferOffset = bufferOffset;
+
+        WdfRequestSetCompletionRoutine(Chunk,
+                                       CDFilterEvtSplitComplete,
+                                       nullptr);
+
+        InterlockedIncrement(&FilterContext->ReadsInFlight);
+
+        if (WdfRequestSend(Chunk,
+                           FilterContext->LocalTarget,
+                           WDF_NO_SEND_OPTIONS)) {
+            return TRUE;
+        }
+
+        InterlockedDecrement(&FilterContext->ReadsInFlight);
+
+        status = WdfRequestGetStatus(Chunk);
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&CDFilterTrace,
+                                        OSR_TRACE_CDFILTER_SEND_FAILED,
+                                        Chunk,
+                                        0,
+                                        0,
+                                        status);
+    }
+
+    //
+    // Nothing from here on can be read without a gap
+    //
+    WdfSpinLockAcquire(splitContext->Lock);
+
+    if (bufferOffset < splitContext->GoodLength) {
+
+        splitContext->GoodLength = bufferOffset;
+        splitContext->Status     = status;
+    }
+
+    splitContext->Outstanding--;
+
+    WdfSpinLockRelease(splitContext->Lock);
+
+    return FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtSplitComplete
+//
+//    This routine is called by the framework when a chunk of a read we
+//    split has been completed
+//
+//  INPUTS:
+//
+//      Request  - The chunk
+//
+//      Target   - The I/O target we sent the chunk to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The context supplied to
+//                 WdfRequestSetCompletionRoutine (NULL in
+//                 our case)
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A chunk that failed, or came back short, means the read is only
+//      good up to the end of what the chunk did get.  Chunks can finish in
+//      any order, so the read ends up with the status of whichever such
+//      chunk is closest to its start, and the length up to there.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtSplitComplete(WDFREQUEST                     Request,
+                         WDFIOTARGET                    Target,
+                         PWDF_REQUEST_COMPLETION_PARAMS Params,
+                         WDFCONTEXT                     Context)
+{
+    PFILTER_DEVICE_CONTEXT  filterContext;
+    PFILTER_REQUEST_CONTEXT chunkContext;
+    PFILTER_REQUEST_CONTEXT readContext;
+    PFILTER_SPLIT_CONTEXT   splitContext;
+    WDFREQUEST              splitRead;
+    NTSTATUS                status = Params->IoStatus.Status;
+    size_t                  information;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    filterContext = CDFilterGetDeviceContext(WdfIoTargetGetDevice(Target));
+    chunkContext  = CDFilterGetRequestContext(Request);
+    splitRead     = chunkContext->SplitRead;
+    splitContext  = CDFilterGetSplitContext(splitRead);
+    readContext   = CDFilterGetRequestContext(splitRead);
+
+    information = min(Params->IoStatus.Information,
+                      chunkContext->Length);
+
+    if (readContext->Cacheable &&
+        NT_SUCCESS(status) &&
+        information != 0) {
+
+        OsrSectorCacheInsert(&filterContext->Cache,
+                             chunkContext->DeviceOffset,
+                             information,
+                             (PUCHAR)WdfMemoryGetBuffer(splitContext->Memory,
+                                                        nullptr) +
+                                 chunkContext->BufferOffset,
+                             readContext->CacheGeneration);
+    }
+
+    if (!NT_SUCCESS(status) || information < chunkContext->Length) {
+
+        OsrTrace<OSR_TRACE_LEVEL_INFO>(&CDFilterTrace,
+                                       OSR_TRACE_CDFILTER_READ_COMPLETE,
+                                       Request,
+                                       information,
+                                       0,
+                                       status);
+
+        WdfSpinLockAcquire(splitContext->Lock);
+
+        if (chunkContext->BufferOffset + information < splitContext->GoodLength) {
+
+            splitContext->GoodLength = chunkContext->BufferOffset + information;
+            splitContext->Status     = status;
+        }
+
+        WdfSpinLockRelease(splitContext->Lock);
+    }
+
+    CDFilterCheckMedia(filterContext,
+                       status);
+
+    //
+    // On to the next chunk, if there is one
+    //
+    if (!CDFilterSplitSendChunk(filterContext,
+                                splitRead,
+                                Request)) {
+
+        WdfObjectDelete(Request);
+    }
+
+    CDFilterSplitRelease(splitRead);
+
+    CDFilterReadDone(filterContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSplitRelease
+//
+//    This routine lets go of a read we split, and completes it if that
+//    was the last count on it
+//
+//  INPUTS:
+//
+//      Request - The read we split
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterSplitRelease(WDFREQUEST Request)
+{
+    PFILTER_SPLIT_CONTEXT splitContext;
+    ULONG                 outstanding;
+
+    splitContext = CDFilterGetSplitContext(Request);
+
+    WdfSpinLockAcquire(splitContext->Lock);
+
+    outstanding = --splitContext->Outstanding;
+
+    WdfSpinLockRelease(splitContext->Lock);
+
+    if (outstanding != 0) {
+        return;
+    }
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_READ_COMPLETE,
+                                      Request,
+                                      splitContext->GoodLength,
+                                      0,
+                                      splitContext->Status);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      splitContext->Status,
+                                      splitContext->GoodLength);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSetupCoalesce
+//
+//    This routine reads the settings for coalescing small reads from our
+//    service's Parameters key, and creates what we need to do it
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//  OUTPUTS:
+//
+//      FilterContext->CoalesceEnabled and the rest of the Coalesce fields
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      We don't hold reads unless CoalesceWindow is there and isn't zero.
+//      CoalesceMaxLength is optional.  The queue, timer and lock belong to
+//      the device, so if we fail part way through whatever we did create
+//      goes away with it.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterSetupCoalesce(PFILTER_DEVICE_CONTEXT FilterContext)
+{
+    NTSTATUS              status;
+    WDFKEY                key;
+    WDF_IO_QUEUE_CONFIG   queueConfig;
+    WDF_TIMER_CONFIG      timerConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    ULONG                 window    = 0;
+    ULONG                 maxLength = CDFILTER_DEFAULT_COALESCE_LENGTH;
+
+    DECLARE_CONST_UNICODE_STRING(coalesceWindowName,
+                                 L"CoalesceWindow");
+    DECLARE_CONST_UNICODE_STRING(coalesceMaxLengthName,
+                                 L"CoalesceMaxLength");
+
+    FilterContext->CoalesceEnabled = FALSE;
+
+    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(),
+                                                KEY_READ,
+                                                WDF_NO_OBJECT_ATTRIBUTES,
+                                                &key);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfDriverOpenParametersRegistryKey failed 0x%0x, "
+                 "not coalescing reads\n",
+                 status);
+#endif
+        return;
+    }
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &coalesceWindowName,
+                                &window);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &coalesceMaxLengthName,
+                                &maxLength);
+
+    WdfRegistryClose(key);
+
+    if (window == 0 ||
+        maxLength < 2 * OSR_SECTOR_SIZE) {
+        return;
+    }
+
+    //
+    // Small reads wait here.  The framework takes care of them being
+    // cancelled while they wait.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+                             WdfIoQueueDispatchManual);
+
+    queueConfig.PowerManaged = WdfFalse;
+
+    status = WdfIoQueueCreate(FilterContext->WdfDevice,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &FilterContext->CoalesceQueue);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfIoQueueCreate for coalescing failed 0x%0x\n",
+                 status);
+#endif
+        return;
+    }
+
+    //
+    // The window is short, so we want better than the usual clock tick
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig,
+                          CDFilterEvtCoalesceTimer);
+
+    timerConfig.AutomaticSerialization = FALSE;
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+
+    attributes.ParentObject = FilterContext->WdfDevice;
+
+    status = WdfTimerCreate(&timerConfig,
+                            &attributes,
+                            &FilterContext->CoalesceTimer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfTimerCreate failed 0x%0x\n",
+                 status);
+#endif
+        return;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+
+    attributes.ParentObject = FilterContext->WdfDevice;
+
+    status = WdfSpinLockCreate(&attributes,
+                               &FilterContext->CoalesceLock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                 status);
+#endif
+        return;
+    }
+
+    FilterContext->CoalesceWindow    = window;
+    FilterContext->CoalesceMaxLength = maxLength;
+    FilterContext->CoalesceTimerSet  = FALSE;
+    FilterContext->CoalesceEnabled   = TRUE;
+
+#if DBG
+    DbgPrint("CDFilter: coalescing small reads for up to %lu us, into reads "
+             "of up to 0x%lx bytes\n",
+             window,
+             maxLength);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterCoalesceRead
+//
+//    This routine holds on to a small read for a little while, so that it
+//    can be merged with its neighbours
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The read, with its request context filled in
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if we're holding the read, FALSE if the caller should send it
+//      down the usual way
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Holding a read only makes sense when the drive is busy anyway.  If
+//      none of our reads are at the drive, the read goes straight down and
+//      doesn't wait at all.  Otherwise it waits until one of them is done
+//      (see CDFilterReadDone), the window closes, or there are enough
+//      reads waiting, whichever comes first.
+//
+///////////////////////////////////////////////////////////////////////////////
+BOOLEAN
+CDFilterCoalesceRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                     WDFREQUEST             Request)
+{
+    NTSTATUS status;
+    ULONG    waiting;
+
+    if (FilterContext->ReadsInFlight == 0) {
+        return FALSE;
+    }
+
+    status = WdfRequestForwardToIoQueue(Request,
+                                        FilterContext->CoalesceQueue);
+
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    WdfIoQueueGetState(FilterContext->CoalesceQueue,
+                       &waiting,
+                       nullptr);
+
+    //
+    // If the drive finished while we were queuing the read, nothing else
+    // is going to come along and send it
+    //
+    if (waiting >= CDFILTER_MAX_COALESCE ||
+        FilterContext->ReadsInFlight == 0) {
+
+        CDFilterCoalesceFlush(FilterContext);
+        return TRUE;
+    }
+
+    //
+    // The window starts with the first read to wait, and isn't pushed out
+    // by the ones after it
+    //
+    WdfSpinLockAcquire(FilterContext->CoalesceLock);
+
+    if (!FilterContext->CoalesceTimerSet) {
+
+        FilterContext->CoalesceTimerSet = TRUE;
+
+        (VOID)WdfTimerStart(FilterContext->CoalesceTimer,
+                            WDF_REL_TIMEOUT_IN_US(FilterContext->CoalesceWindow));
+    }
+
+    WdfSpinLockRelease(FilterContext->CoalesceLock);
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtCoalesceTimer
+//
+//    This routine is called by the framework when the window for the
+//    small reads that are waiting has closed
+//
+//  INPUTS:
+//
+//      Timer - Our coalescing timer
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtCoalesceTimer(WDFTIMER Timer)
+{
+    PFILTER_DEVICE_CONTEXT filterContext;
+
+    filterContext = CDFilterGetDeviceContext((WDFDEVICE)WdfTimerGetParentObject(Timer));
+
+    CDFilterCoalesceFlush(filterContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterCoalesceFlush
+//
+//    This routine sends down the small reads that are waiting, merging
+//    the ones that are next to each other
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We take the reads off the queue under the lock, so that two of us
+//      flushing at once don't each end up with half of a run.  Then we
+//      sort them by offset, and every run of reads that are contiguous or
+//      overlap (up to CoalesceMaxLength in all) becomes one read.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterCoalesceFlush(PFILTER_DEVICE_CONTEXT FilterContext)
+{
+    NTSTATUS                status;
+    WDFREQUEST              reads[CDFILTER_MAX_COALESCE];
+    WDFREQUEST              read;
+    PFILTER_REQUEST_CONTEXT readContext;
+    ULONG                   count;
+    ULONG                   first;
+    ULONG                   last;
+    ULONG                   index;
+    ULONG64                 start;
+    ULONG64                 end;
+
+    do {
+
+        count = 0;
+
+        WdfSpinLockAcquire(FilterContext->CoalesceLock);
+
+        FilterContext->CoalesceTimerSet = FALSE;
+
+        while (count < CDFILTER_MAX_COALESCE) {
+
+            status = WdfIoQueueRetrieveNextRequest(FilterContext->CoalesceQueue,
+                                                   &reads[count]);
+
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            count++;
+        }
+
+        WdfSpinLockRelease(FilterContext->CoalesceLock);
+
+        //
+        // Sort by offset.  There aren't many of them.
+        //
+        for (first = 1; first < count; first++) {
+
+            read  = reads[first];
+            start = CDFilterGetRequestContext(read)->DeviceOffset;
+
+            for (index = first;
+                 index > 0 &&
+                 CDFilterGetRequestContext(reads[index - 1])->DeviceOffset > start;
+                 index--) {
+
+                reads[index] = reads[index - 1];
+            }
+
+            reads[index] = read;
+        }
+
+        for (first = 0; first < count; first = last) {
+
+            readContext = CDFilterGetRequestContext(reads[first]);
+
+            start = readContext->DeviceOffset;
+            end   = start + readContext->Length;
+
+            for (last = first + 1; last < count; last++) {
+
+                readContext = CDFilterGetRequestContext(reads[last]);
+
+                if (readContext->DeviceOffset > end ||
+                    max(end, readContext->DeviceOffset + readContext->Length) - start >
+                        FilterContext->CoalesceMaxLength) {
+                    break;
+                }
+
+                end = max(end,
+                          readContext->DeviceOffset + readContext->Length);
+            }
+
+            CDFilterSendMergedRead(FilterContext,
+                                   &reads[first],
+                                   last - first,
+                                   start,
+                                   (size_t)(end - start));
+        }
+
+    } while (count == CDFILTER_MAX_COALESCE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSendMergedRead
+//
+//    This routine sends one read down in place of a run of small reads
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Reads         - The small reads, sorted by offset
+//
+//      Count         - How many there are
+//
+//      Offset        - The device offset of the first one
+//
+//      Length        - How much they cover between them
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The merged read is a Request of our own, with its own buffer.  A
+//      run of one read just goes down by itself, and so does every read
+//      in the run if we can't build or send the merged one.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterSendMergedRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                       WDFREQUEST            *Reads,
+                       ULONG                  Count,
+                       ULONG64                Offset,
+                       size_t                 Length)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFREQUEST            request = nullptr;
+    WDFMEMORY             memory;
+    PFILTER_MERGE_CONTEXT mergeContext;
+    LONGLONG              deviceOffset;
+    ULONG                 index;
+
+    if (Count == 1) {
+        goto Done;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes,
+                                            FILTER_MERGE_CONTEXT);
+
+    attributes.ParentObject = FilterContext->WdfDevice;
+
+    status = WdfRequestCreate(&attributes,
+                              FilterContext->LocalTarget,
+                              &request);
+
+    if (!NT_SUCCESS(status)) {
+        request = nullptr;
+        goto Done;
+    }
+
+    //
+    // The buffer goes away with the Request
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+
+    attributes.ParentObject = request;
+
+    status = WdfMemoryCreate(&attributes,
+                             NonPagedPoolNx,
+                             OSR_SECTOR_CACHE_POOL_TAG,
+                             Length,
+                             &memory,
+                             nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        goto Done;
+    }
+
+    deviceOffset = (LONGLONG)Offset;
+
+    status = WdfIoTargetFormatRequestForRead(FilterContext->LocalTarget,
+                                             request,
+                                             memory,
+                                             nullptr,
+                                             &deviceOffset);
+
+    if (!NT_SUCCESS(status)) {
+        goto Done;
+    }
+
+    mergeContext = CDFilterGetMergeContext(request);
+
+    mergeContext->DeviceOffset    = Offset;
+    mergeContext->Length          = Length;
+    mergeContext->CacheGeneration = OsrSectorCacheGeneration(&FilterContext->Cache);
+    mergeContext->Count           = Count;
+
+    RtlCopyMemory(mergeContext->Reads,
+                  Reads,
+                  Count * sizeof(WDFREQUEST));
+
+    WdfRequestSetCompletionRoutine(request,
+                                   CDFilterEvtMergedReadComplete,
+                                   nullptr);
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_COALESCED,
+                                      request,
+                                      Count,
+                                      Length,
+                                      STATUS_SUCCESS);
+
+    InterlockedIncrement(&FilterContext->ReadsInFlight);
+
+    if (WdfRequestSend(request,
+                       FilterContext->LocalTarget,
+                       WDF_NO_SEND_OPTIONS)) {
+        return;
+    }
+
+    InterlockedDecrement(&FilterContext->ReadsInFlight);
+
+    OsrTrace<OSR_TRACE_LEVEL_ERROR>(&CDFilterTrace,
+                                    OSR_TRACE_CDFILTER_SEND_FAILED,
+                                    request,
+                                    0,
+                                    0,
+                                    WdfRequestGetStatus(request));
+
+Done:
+
+    if (request != nullptr) {
+        WdfObjectDelete(request);
+    }
+
+    for (index = 0; index < Count; index++) {
+
+        (VOID)CDFilterSendRead(FilterContext,
+                               Reads[index]);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterEvtMergedReadComplete
+//
+//    This routine is called by the framework when a read we sent down in
+//    place of several small ones has been completed
+//
+//  INPUTS:
+//
+//      Request  - The merged read
+//
+//      Target   - The I/O target we sent the read to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The context supplied to
+//                 WdfRequestSetCompletionRoutine (NULL in
+//                 our case)
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Each small read that the merged read got all of the data for gets
+//      its part copied into its buffer and is completed.  Any others (all
+//      of them, if the merged read failed) go down again by themselves,
+//      so that each one finds out how it really turns out.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterEvtMergedReadComplete(WDFREQUEST                     Request,
+                              WDFIOTARGET                    Target,
+                              PWDF_REQUEST_COMPLETION_PARAMS Params,
+                              WDFCONTEXT                     Context)
+{
+    PFILTER_DEVICE_CONTEXT  filterContext;
+    PFILTER_MERGE_CONTEXT   mergeContext;
+    PFILTER_REQUEST_CONTEXT readContext;
+    NTSTATUS                status = Params->IoStatus.Status;
+    size_t                  information = 0;
+    PUCHAR                  buffer;
+    WDFMEMORY               readMemory;
+    WDFREQUEST              read;
+    size_t                  start;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    filterContext = CDFilterGetDeviceContext(WdfIoTargetGetDevice(Target));
+    mergeContext  = CDFilterGetMergeContext(Request);
+
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&CDFilterTrace,
+                                      OSR_TRACE_CDFILTER_READ_COMPLETE,
+                                      Request,
+                                      Params->IoStatus.Information,
+                                      0,
+                                      status);
+
+    buffer = (PUCHAR)WdfMemoryGetBuffer(Params->Parameters.Read.Buffer,
+                                        nullptr);
+
+    if (NT_SUCCESS(status)) {
+
+        information = min(Params->IoStatus.Information,
+                          mergeContext->Length);
+
+        if (filterContext->CacheEnabled && information != 0) {
+
+            OsrSectorCacheInsert(&filterContext->Cache,
+                                 mergeContext->DeviceOffset,
+                                 information,
+                                 buffer,
+                                 mergeContext->CacheGeneration);
+        }
+    }
+
+    CDFilterCheckMedia(filterContext,
+                       status);
+
+    for (ULONG index = 0; index < mergeContext->Count; index++) {
+
+        read        = mergeContext->Reads[index];
+        readContext = CDFilterGetRequestContext(read);
+        start       = (size_t)(readContext->DeviceOffset - mergeContext->DeviceOffset);
+
+        if (start + readContext->Length > information) {
+
+            (VOID)CDFilterSendRead(filterContext,
+                                   read);
+            continue;
+        }
+
+        status = WdfRequestRetrieveOutputMemory(read,
+                                                &readMemory);
+
+        if (NT_SUCCESS(status)) {
+
+            status = WdfMemoryCopyFromBuffer(readMemory,
+                                             0,
+                                             buffer + start,
+                                             readContext->Length);
+        }
+
+        WdfRequestCompleteWithInformation(read,
+                                          status,
+                                          NT_SUCCESS(status) ? readContext->Length : 0);
+    }
+
+    WdfObjectDelete(Request);
+
+    CDFilterReadDone(filterContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterSetupElevator
+//
+//    This routine reads the elevator's settings from our service's
+//    Parameters key, and creates what we need to run it
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//  OUTPUTS:
+//
+//      FilterContext->ElevatorEnabled and the rest of the Elevator fields
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      There's no elevator unless ElevatorDepth is there and isn't zero.
+//      ElevatorDeadline is optional, and is in milliseconds.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterSetupElevator(PFILTER_DEVICE_CONTEXT FilterContext)
+{
+    NTSTATUS              status;
+    WDFKEY                key;
+    WDF_IO_QUEUE_CONFIG   queueConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    ULONG                 depth    = 0;
+    ULONG                 deadline = CDFILTER_DEFAULT_ELEVATOR_DEADLINE;
+
+    DECLARE_CONST_UNICODE_STRING(elevatorDepthName,
+                                 L"ElevatorDepth");
+    DECLARE_CONST_UNICODE_STRING(elevatorDeadlineName,
+                                 L"ElevatorDeadline");
+
+    FilterContext->ElevatorEnabled = FALSE;
+
+    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(),
+                                                KEY_READ,
+                                                WDF_NO_OBJECT_ATTRIBUTES,
+                                                &key);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfDriverOpenParametersRegistryKey failed 0x%0x, "
+                 "no elevator\n",
+                 status);
+#endif
+        return;
+    }
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &elevatorDepthName,
+                                &depth);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &elevatorDeadlineName,
+                                &deadline);
+
+    WdfRegistryClose(key);
+
+    if (depth == 0 ||
+        depth > CDFILTER_MAX_ELEVATOR_DEPTH) {
+        return;
+    }
+
+    //
+    // Reads wait here.  The framework takes care of them being cancelled
+    // while they wait.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+                             WdfIoQueueDispatchManual);
+
+    queueConfig.PowerManaged = WdfFalse;
+
+    status = WdfIoQueueCreate(FilterContext->WdfDevice,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &FilterContext->ElevatorQueue);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfIoQueueCreate for the elevator failed 0x%0x\n",
+                 status);
+#endif
+        return;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+
+    attributes.ParentObject = FilterContext->WdfDevice;
+
+    status = WdfSpinLockCreate(&attributes,
+                               &FilterContext->ElevatorLock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                 status);
+#endif
+        return;
+    }
+
+    //
+    // Interrupt time is in 100ns units
+    //
+    OsrElevatorInitialize(&FilterContext->Elevator,
+                          (ULONG64)deadline * 10000);
+
+    FilterContext->ElevatorDepth   = depth;
+    FilterContext->ElevatorEnabled = TRUE;
+
+#if DBG
+    DbgPrint("CDFilter: elevator with %lu reads at the drive, %lu ms "
+             "deadline\n",
+             depth,
+             deadline);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterElevatorRead
+//
+//    This routine hands a read to the elevator
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The read, with its request context filled in
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the elevator has the read, FALSE if the caller should send
+//      it down the usual way
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      If the drive has room for it, the read goes straight back out
+//      again.
+//
+///////////////////////////////////////////////////////////////////////////////
+BOOLEAN
+CDFilterElevatorRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                     WDFREQUEST             Request)
+{
+    NTSTATUS status;
+
+    CDFilterGetRequestContext(Request)->ArrivalTime = KeQueryInterruptTime();
+
+    status = WdfRequestForwardToIoQueue(Request,
+                                        FilterContext->ElevatorQueue);
+
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    CDFilterElevatorDispatch(FilterContext);
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterElevatorDispatch
+//
+//    This routine sends reads that are waiting for the elevator down, in
+//    C-SCAN order, until the drive has ElevatorDepth of ours
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We look at every waiting read to find the best one, so this is
+//      linear in how many are waiting.  There are only ever as many as
+//      there are threads reading, which isn't many.
+//
+//      Reads are picked and counted under the lock, but sent after we've
+//      let go of it.  The drive could finish one while we're still
+//      holding the lock, and then we'd be called again.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterElevatorDispatch(PFILTER_DEVICE_CONTEXT FilterContext)
+{
+    NTSTATUS                status;
+    WDFREQUEST              reads[CDFILTER_MAX_ELEVATOR_DEPTH];
+    WDFREQUEST              found;
+    WDFREQUEST              previous;
+    WDFREQUEST              best;
+    WDFREQUEST              read;
+    PFILTER_REQUEST_CONTEXT readContext;
+    PFILTER_REQUEST_CONTEXT bestContext = nullptr;
+    ULONG64                 now;
+    ULONG                   count = 0;
+
+    WdfSpinLockAcquire(FilterContext->ElevatorLock);
+
+    while (count < CDFILTER_MAX_ELEVATOR_DEPTH &&
+           (ULONG)FilterContext->ReadsInFlight < FilterContext->ElevatorDepth) {
+
+        now      = KeQueryInterruptTime();
+        best     = nullptr;
+        previous = nullptr;
+
+        //
+        // Each Request we find has a reference on it, which we give back
+        // once we've used it to find the next one.  We keep our own
+        // reference on the best so far.
+        //
+        for (;;) {
+
+            status = WdfIoQueueFindRequest(FilterContext->ElevatorQueue,
+                                           previous,
+                                           nullptr,
+                                           nullptr,
+                                           &found);
+
+            if (previous != nullptr) {
+                WdfObjectDereference(previous);
+            }
+
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            readContext = CDFilterGetRequestContext(found);
+
+            if (best == nullptr ||
+                OsrElevatorBetter(&FilterContext->Elevator,
+                                  now,
+                                  readContext->DeviceOffset,
+                                  readContext->ArrivalTime,
+                                  bestContext->DeviceOffset,
+                                  bestContext->ArrivalTime)) {
+
+                if (best != nullptr) {
+                    WdfObjectDereference(best);
+                }
+
+                WdfObjectReference(found);
+
+                best        = found;
+                bestContext = readContext;
+            }
+
+            previous = found;
+        }
+
+        if (best == nullptr) {
+            break;
+        }
+
+        status = WdfIoQueueRetrieveFoundRequest(FilterContext->ElevatorQueue,
+                                                best,
+                                                &read);
+
+        WdfObjectDereference(best);
+
+        if (!NT_SUCCESS(status)) {
+
+            //
+            // It was cancelled while we were looking
+            //
+            continue;
+        }
+
+        OsrElevatorDispatched(&FilterContext->Elevator,
+                              now,
+                              bestContext->DeviceOffset,
+                              bestContext->Length,
+                              bestContext->ArrivalTime);
+
+        InterlockedIncrement(&FilterContext->ReadsInFlight);
+
+        reads[count++] = read;
+    }
+
+    WdfSpinLockRelease(FilterContext->ElevatorLock);
+
+    for (ULONG index = 0; index < count; index++) {
+
+        (VOID)CDFilterSendCountedRead(FilterContext,
+                                      reads[index]);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CDFilterElevatorStats
+//
+//    This routine handles IOCTL_OSR_CDFILTER_ELEVATOR_STATS
+//
+//  INPUTS:
+//
+//      FilterContext - Our device context
+//
+//      Request       - The IOCTL
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Fails with STATUS_INVALID_DEVICE_REQUEST if the elevator is off.
+//      The deadline comes back in 100ns units.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+CDFilterElevatorStats(PFILTER_DEVICE_CONTEXT FilterContext,
+                      WDFREQUEST             Request)
+{
+    NTSTATUS            status;
+    POSR_ELEVATOR_STATS stats;
+
+    if (!FilterContext->ElevatorEnabled) {
+
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(OSR_ELEVATOR_STATS),
+                                            (PVOID *)&stats,
+                                            nullptr);
+
+    if (!NT_SUCCESS(status)) {
+
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    WdfSpinLockAcquire(FilterContext->ElevatorLock);
+
+    OsrElevatorQueryStats(&FilterContext->Elevator,
+                          stats);
+
+    WdfSpinLockRelease(FilterContext->ElevatorLock);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(OSR_ELEVATOR_STATS));
+}
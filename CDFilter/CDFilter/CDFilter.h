@@ -40,15 +40,122 @@
 
 #include <wdm.h>
 #include <wdf.h>
+#include <ntddstor.h>
+#include <ntddscsi.h>
+
+#include <osrtrace.h>
+#include <osrsector.h>
+#include <osrreadahead.h>
+#include <osrelevator.h>
+
+//
+// Our own device control codes.  We're a filter, so these arrive on the
+// CD-ROM device's stack, and we keep them for ourselves instead of passing
+// them down.  The device type is arbitrarily chosen from the space defined
+// by Microsoft as being "for non-Microsoft use".
+//
+#define FILE_DEVICE_CDFILTER 0xCF54
+
+#define IOCTL_OSR_CDFILTER_TRACE_LEVEL OSR_TRACE_IOCTL_LEVEL(FILE_DEVICE_CDFILTER)
+#define IOCTL_OSR_CDFILTER_TRACE_DUMP  OSR_TRACE_IOCTL_DUMP(FILE_DEVICE_CDFILTER)
+#define IOCTL_OSR_CDFILTER_CACHE_STATS OSR_SECTOR_CACHE_IOCTL_STATS(FILE_DEVICE_CDFILTER)
+#define IOCTL_OSR_CDFILTER_READAHEAD_STATS OSR_READAHEAD_IOCTL_STATS(FILE_DEVICE_CDFILTER)
+#define IOCTL_OSR_CDFILTER_ELEVATOR_STATS  OSR_ELEVATOR_IOCTL_STATS(FILE_DEVICE_CDFILTER)
+
+//
+// Read-ahead windows, if the Parameters key doesn't say
+//
+#define CDFILTER_DEFAULT_READAHEAD_MIN (64 * 1024)
+#define CDFILTER_DEFAULT_READAHEAD_MAX (1024 * 1024)
+
+//
+// Splitting large reads, if the Parameters key doesn't say.  There's no
+// default threshold, because we don't split unless we're told to.
+//
+#define CDFILTER_DEFAULT_SPLIT_CHUNK     (256 * 1024)
+#define CDFILTER_DEFAULT_SPLIT_IN_FLIGHT 4
+#define CDFILTER_MAX_SPLIT_IN_FLIGHT     32
+
+//
+// Coalescing small reads.  Reads up to CDFILTER_COALESCE_SMALL_READ are
+// held for merging, at most CDFILTER_MAX_COALESCE of them at a time.
+// There's no default window, because we don't hold reads unless we're
+// told to.
+//
+#define CDFILTER_COALESCE_SMALL_READ      (16 * 1024)
+#define CDFILTER_MAX_COALESCE             32
+#define CDFILTER_DEFAULT_COALESCE_LENGTH  (64 * 1024)
+
+//
+// The elevator.  There's no default depth, because we don't hold reads
+// unless we're told to.  The deadline is in milliseconds.
+//
+#define CDFILTER_MAX_ELEVATOR_DEPTH       8
+#define CDFILTER_DEFAULT_ELEVATOR_DEADLINE 1000
 
 //
 // Our per device context
 //
 typedef struct _FILTER_DEVICE_CONTEXT {
 
-    WDFDEVICE   WdfDevice;
+    WDFDEVICE        WdfDevice;
+
+    WDFIOTARGET      LocalTarget;
+
+    //
+    // Our read cache.  There isn't one unless CacheSize is set in the
+    // service's Parameters key.
+    //
+    BOOLEAN          CacheEnabled;
+    OSR_SECTOR_CACHE Cache;
 
-    WDFIOTARGET LocalTarget;
+    //
+    // Read-ahead of sequential streams, into the cache.  Only if there's
+    // a cache and ReadAheadMaximum isn't zero.
+    //
+    BOOLEAN          ReadAheadEnabled;
+    OSR_READAHEAD    ReadAhead;
+
+    //
+    // Reads longer than SplitThreshold are sent down in chunks of
+    // SplitChunkSize, up to SplitMaxInFlight at a time.  Only if
+    // SplitThreshold is set in the service's Parameters key.
+    //
+    BOOLEAN          SplitEnabled;
+    ULONG            SplitThreshold;
+    ULONG            SplitChunkSize;
+    ULONG            SplitMaxInFlight;
+
+    //
+    // Reads of ours that the drive has right now
+    //
+    volatile LONG    ReadsInFlight;
+
+    //
+    // While the drive is busy, small reads wait on CoalesceQueue for up
+    // to CoalesceWindow microseconds, to be merged into reads of up to
+    // CoalesceMaxLength.  Only if CoalesceWindow is set in the service's
+    // Parameters key.
+    //
+    BOOLEAN          CoalesceEnabled;
+    ULONG            CoalesceWindow;
+    ULONG            CoalesceMaxLength;
+    WDFQUEUE         CoalesceQueue;
+    WDFTIMER         CoalesceTimer;
+    WDFSPINLOCK      CoalesceLock;
+    BOOLEAN          CoalesceTimerSet;
+
+    //
+    // With the elevator on, reads wait on ElevatorQueue and are sent down
+    // in C-SCAN order, no more than ElevatorDepth of ours at the drive at
+    // once.  Only if ElevatorDepth is set in the service's Parameters key.
+    // The lock covers Elevator.
+    //
+    BOOLEAN          ElevatorEnabled;
+    ULONG            ElevatorDepth;
+    WDFQUEUE         ElevatorQueue;
+    WDFSPINLOCK      ElevatorLock;
+    OSR_ELEVATOR     Elevator;
 
 } FILTER_DEVICE_CONTEXT, *PFILTER_DEVICE_CONTEXT;
 
@@ -59,8 +166,200 @@ typedef struct _FILTER_DEVICE_CONTEXT {
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_DEVICE_CONTEXT,
                                    CDFilterGetDeviceContext)
 
+//
+// Our per request context, for the reads and writes that we send down,
+// and for the read-aheads we create ourselves
+//
+typedef struct _FILTER_REQUEST_CONTEXT {
+
+    //
+    // For a read, set if the data that comes back can go in the cache, in
+    // which case CacheGeneration is the cache's generation from before we
+    // sent it
+    //
+    BOOLEAN Cacheable;
+    ULONG64 DeviceOffset;
+    size_t  Length;
+    LONG64  CacheGeneration;
+
+    //
+    // For a read-ahead, what to give OsrReadAheadDone
+    //
+    ULONG   ReadAheadCookie;
+
+    //
+    // For a chunk of a read we split, the read it's part of and where in
+    // that read's buffer the chunk goes
+    //
+    WDFREQUEST SplitRead;
+    size_t     BufferOffset;
+
+    //
+    // For a read waiting for the elevator, when it started waiting (in
+    // interrupt time)
+    //
+    ULONG64    ArrivalTime;
+
+} FILTER_REQUEST_CONTEXT, *PFILTER_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_REQUEST_CONTEXT,
+                                   CDFilterGetRequestContext)
+
+//
+// The extra context a read gets when we split it
+//
+typedef struct _FILTER_SPLIT_CONTEXT {
+
+    WDFSPINLOCK Lock;
+
+    //
+    // The read's buffer, which the chunks read straight into
+    //
+    WDFMEMORY   Memory;
+    ULONG64     DeviceOffset;
+    size_t      Length;
+
+    //
+    // Where in the buffer the next chunk starts, and how many chunks are
+    // on their way (plus one while we're still starting them)
+    //
+    size_t      NextOffset;
+    ULONG       Outstanding;
+
+    //
+    // How much of the start of the buffer has been read without a gap,
+    // as far as we know, and why it isn't all of it
+    //
+    size_t      GoodLength;
+    NTSTATUS    Status;
+
+} FILTER_SPLIT_CONTEXT, *PFILTER_SPLIT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_SPLIT_CONTEXT,
+                                   CDFilterGetSplitContext)
+
+//
+// The context of a read we send down in place of several small ones
+//
+typedef struct _FILTER_MERGE_CONTEXT {
+
+    ULONG64    DeviceOffset;
+    size_t     Length;
+    LONG64     CacheGeneration;
+
+    ULONG      Count;
+    WDFREQUEST Reads[CDFILTER_MAX_COALESCE];
+
+} FILTER_MERGE_CONTEXT, *PFILTER_MERGE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_MERGE_CONTEXT,
+                                   CDFilterGetMergeContext)
+
+//
+// Our trace ring, shared by all the devices we filter
+//
+extern OSR_TRACE CDFilterTrace;
+
 extern "C" {
     DRIVER_INITIALIZE DriverEntry;
 }
 
-EVT_WDF_DRIVER_DEVICE_ADD CDFilterEvtDeviceAdd;
+EVT_WDF_DRIVER_DEVICE_ADD          CDFilterEvtDeviceAdd;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP     CDFilterEvtDeviceCleanup;
+EVT_WDF_IO_QUEUE_IO_READ           CDFilterEvtRead;
+EVT_WDF_IO_QUEUE_IO_WRITE          CDFilterEvtWrite;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CDFilterEvtDeviceControl;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE CDFilterEvtReadComplete;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE CDFilterEvtWriteComplete;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE CDFilterEvtReadAheadComplete;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE CDFilterEvtSplitComplete;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE CDFilterEvtMergedReadComplete;
+EVT_WDF_TIMER                      CDFilterEvtCoalesceTimer;
+
+VOID
+CDFilterSendAndForget(PFILTER_DEVICE_CONTEXT FilterContext,
+                      WDFREQUEST             Request);
+
+BOOLEAN
+CDFilterSendRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                 WDFREQUEST             Request);
+
+BOOLEAN
+CDFilterSendCountedRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                        WDFREQUEST             Request);
+
+VOID
+CDFilterReadDone(PFILTER_DEVICE_CONTEXT FilterContext);
+
+VOID
+CDFilterSetupCache(PFILTER_DEVICE_CONTEXT FilterContext);
+
+VOID
+CDFilterCacheStats(PFILTER_DEVICE_CONTEXT FilterContext,
+                   WDFREQUEST             Request);
+
+VOID
+CDFilterReadAheadStats(PFILTER_DEVICE_CONTEXT FilterContext,
+                       WDFREQUEST             Request);
+
+VOID
+CDFilterReadAhead(PFILTER_DEVICE_CONTEXT FilterContext,
+                  ULONG64                Offset,
+                  size_t                 Length,
+                  BOOLEAN                Hit);
+
+VOID
+CDFilterFlushCache(PFILTER_DEVICE_CONTEXT FilterContext,
+                   ULONG64                Reason);
+
+VOID
+CDFilterCheckMedia(PFILTER_DEVICE_CONTEXT FilterContext,
+                   NTSTATUS               Status);
+
+VOID
+CDFilterSetupSplit(PFILTER_DEVICE_CONTEXT FilterContext);
+
+BOOLEAN
+CDFilterSplitRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                  WDFREQUEST             Request,
+                  ULONG64                Offset,
+                  size_t                 Length);
+
+BOOLEAN
+CDFilterSplitSendChunk(PFILTER_DEVICE_CONTEXT FilterContext,
+                       WDFREQUEST             Request,
+                       WDFREQUEST             Chunk);
+
+VOID
+CDFilterSplitRelease(WDFREQUEST Request);
+
+VOID
+CDFilterSetupCoalesce(PFILTER_DEVICE_CONTEXT FilterContext);
+
+BOOLEAN
+CDFilterCoalesceRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                     WDFREQUEST             Request);
+
+VOID
+CDFilterCoalesceFlush(PFILTER_DEVICE_CONTEXT FilterContext);
+
+VOID
+CDFilterSetupElevator(PFILTER_DEVICE_CONTEXT FilterContext);
+
+BOOLEAN
+CDFilterElevatorRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                     WDFREQUEST             Request);
+
+VOID
+CDFilterElevatorDispatch(PFILTER_DEVICE_CONTEXT FilterContext);
+
+VOID
+CDFilterElevatorStats(PFILTER_DEVICE_CONTEXT FilterContext,
+                      WDFREQUEST             Request);
+
+VOID
+CDFilterSendMergedRead(PFILTER_DEVICE_CONTEXT FilterContext,
+                       WDFREQUEST            *Reads,
+                       ULONG                  Count,
+                       ULONG64                Offset,
+                       size_t                 Length);
@@ -0,0 +1,520 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+//
+// OSR LZ4 block codec
+//
+// A small, self-contained implementation of the LZ4 block format: a
+// sequence of (literals, match) pairs, each introduced by a token byte.
+// Compressed blocks can be decoded by any LZ4 implementation's
+// LZ4_decompress_safe, and vice versa.
+//
+// The compressor is the simple greedy one: hash the next 4 bytes, look
+// up the last place we saw them, and take the match if it's really there.
+// It skips ahead faster and faster through data that isn't matching, so
+// incompressible data costs very little.  It's not the best ratio LZ4 can
+// do, but it's quick and it doesn't need any memory beyond the caller's
+// hash table.
+//
+// The decompressor checks everything against both buffers, so a corrupt
+// block can't make it read or write anywhere it shouldn't.
+//
+// This file builds in user mode too.
+//
+
+//
+// Inputs to OsrLz4Compress can't be bigger than this, which lets the hash
+// table hold 16 bit positions
+//
+#define OSR_LZ4_MAX_INPUT     (64 * 1024)
+
+#define OSR_LZ4_HASH_LOG      12
+#define OSR_LZ4_HASH_ENTRIES  (1 << OSR_LZ4_HASH_LOG)
+
+//
+// What the caller has to provide for the compressor's hash table
+//
+#define OSR_LZ4_HASH_TABLE_SIZE (OSR_LZ4_HASH_ENTRIES * sizeof(USHORT))
+
+//
+// OsrLz4Decompress returns this for a corrupt block
+//
+#define OSR_LZ4_ERROR         ((size_t)-1)
+
+//
+// Rules of the format: matches are at least 4 bytes, the last 5 bytes of
+// a block are always literals, and the last match has to start at least
+// 12 bytes before the end
+//
+#define OSR_LZ4_MIN_MATCH     4
+#define OSR_LZ4_LAST_LITERALS 5
+#define OSR_LZ4_MF_LIMIT      12
+
+#define OSR_LZ4_RUN_MASK      15
+#define OSR_LZ4_MAX_OFFSET    65535
+
+//
+// How quickly we skip through data that isn't matching.  We move ahead
+// one more byte for every 2^OSR_LZ4_SKIP_TRIGGER misses in a row.
+//
+#define OSR_LZ4_SKIP_TRIGGER  6
+
+FORCEINLINE ULONG
+OsrLz4Read32(const UCHAR* Source)
+{
+    return *(UNALIGNED const ULONG *)Source;
+}
+
+FORCEINLINE ULONG
+OsrLz4Hash(ULONG Sequence)
+{
+    return (Sequence * 2654435761U) >> (32 - OSR_LZ4_HASH_LOG);
+}
+
+//
+// Worst case number of bytes needed for a length field of Length, beyond
+// the 4 bits in the token
+//
+FORCEINLINE size_t
+OsrLz4LengthBytes(size_t Length)
+{
+    return (Length >= OSR_LZ4_RUN_MASK) ?
+                    ((Length - OSR_LZ4_RUN_MASK) / 255) + 1 : 0;
+}
+
+FORCEINLINE PUCHAR
+OsrLz4PutLength(PUCHAR Output,
+                size_t Length)
+{
+    Length -= OSR_LZ4_RUN_MASK;
+
+    while (Length >= 255) {
+        *Output++ = 255;
+        Length   -= 255;
+    }
+
+    *Output++ = (UCHAR)Length;
+
+    return Output;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrLz4PutSequence
+//
+//    This routine writes one sequence: a run of literals, optionally
+//    followed by a match
+//
+//  INPUTS:
+//
+//      Output         - Where the sequence goes
+//
+//      OutputEnd      - The end of the output buffer
+//
+//      Literals       - The literals
+//
+//      LiteralLength  - The number of literals
+//
+//      Offset         - How far back the match is
+//
+//      MatchLength    - The length of the match, or zero for the last
+//                       sequence in the block, which has no match
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      Where the next sequence goes, or nullptr if there wasn't room.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline PUCHAR
+OsrLz4PutSequence(PUCHAR       Output,
+                  PUCHAR       OutputEnd,
+                  const UCHAR* Literals,
+                  size_t       LiteralLength,
+                  size_t       Offset,
+                  size_t       MatchLength)
+{
+    PUCHAR token;
+    size_t needed;
+
+    needed = 1 + OsrLz4LengthBytes(LiteralLength) + LiteralLength;
+
+    if (MatchLength != 0) {
+        needed += 2 + OsrLz4LengthBytes(MatchLength - OSR_LZ4_MIN_MATCH);
+    }
+
+    if (needed > (size_t)(OutputEnd - Output)) {
+        return nullptr;
+    }
+
+    token = Output++;
+
+    if (LiteralLength >= OSR_LZ4_RUN_MASK) {
+
+        *token = OSR_LZ4_RUN_MASK << 4;
+        Output = OsrLz4PutLength(Output,
+                                 LiteralLength);
+    } else {
+
+        *token = (UCHAR)(LiteralLength << 4);
+    }
+
+    RtlCopyMemory(Output,
+                  Literals,
+                  LiteralLength);
+
+    Output += LiteralLength;
+
+    if (MatchLength == 0) {
+        return Output;
+    }
+
+    *Output++ = (UCHAR)Offset;
+    *Output++ = (UCHAR)(Offset >> 8);
+
+    MatchLength -= OSR_LZ4_MIN_MATCH;
+
+    if (MatchLength >= OSR_LZ4_RUN_MASK) {
+
+        *token |= OSR_LZ4_RUN_MASK;
+        Output = OsrLz4PutLength(Output,
+                                 MatchLength);
+    } else {
+
+        *token |= (UCHAR)MatchLength;
+    }
+
+    return Output;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrLz4Compress
+//
+//    This routine compresses a buffer into one LZ4 block
+//
+//  INPUTS:
+//
+//      Source              - The data to compress
+//
+//      SourceLength        - Its length, at most OSR_LZ4_MAX_INPUT
+//
+//      Destination         - Where the compressed block goes
+//
+//      DestinationCapacity - How big the compressed block is allowed to be
+//
+//      HashTable           - OSR_LZ4_HASH_TABLE_SIZE bytes of scratch
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The size of the compressed block, or zero if it wouldn't fit in
+//      DestinationCapacity.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      Callers that only want to keep the block if it's smaller than the
+//      original should pass a DestinationCapacity of SourceLength - 1.
+//      The compressor gives up as soon as it runs out of room, so that
+//      costs very little for data that doesn't compress.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline size_t
+OsrLz4Compress(const UCHAR* Source,
+               size_t       SourceLength,
+               PUCHAR       Destination,
+               size_t       DestinationCapacity,
+               PUSHORT      HashTable)
+{
+    const UCHAR* input      = Source;
+    const UCHAR* inputEnd   = Source + SourceLength;
+    const UCHAR* anchor     = Source;
+    const UCHAR* matchLimit = inputEnd - OSR_LZ4_LAST_LITERALS;
+    const UCHAR* lastStart  = inputEnd - OSR_LZ4_MF_LIMIT;
+    const UCHAR* match;
+    PUCHAR       output     = Destination;
+    PUCHAR       outputEnd  = Destination + DestinationCapacity;
+    size_t       matchLength;
+    ULONG        hash;
+    ULONG        misses     = 0;
+
+    if (SourceLength > OSR_LZ4_MAX_INPUT) {
+        return 0;
+    }
+
+    //
+    // Too short to hold a match, it's all literals
+    //
+    if (SourceLength <= OSR_LZ4_MF_LIMIT) {
+        goto LastLiterals;
+    }
+
+    RtlZeroMemory(HashTable,
+                  OSR_LZ4_HASH_TABLE_SIZE);
+
+    input++;
+
+    while (input <= lastStart) {
+
+        hash  = OsrLz4Hash(OsrLz4Read32(input));
+        match = Source + HashTable[hash];
+
+        HashTable[hash] = (USHORT)(input - Source);
+
+        if (match >= input ||
+            (size_t)(input - match) > OSR_LZ4_MAX_OFFSET ||
+            OsrLz4Read32(match) != OsrLz4Read32(input)) {
+
+            input += 1 + (misses++ >> OSR_LZ4_SKIP_TRIGGER);
+            continue;
+        }
+
+        misses = 0;
+
+        //
+        // Extend the match backwards over any literals that match too...
+        //
+        while (input > anchor && match > Source && input[-1] == match[-1]) {
+            input--;
+            match--;
+        }
+
+        //
+        // ...and then forwards as far as the format lets us
+        //
+        matchLength = OSR_LZ4_MIN_MATCH;
+
+        while (input + matchLength < matchLimit &&
+               input[matchLength] == match[matchLength]) {
+            matchLength++;
+        }
+
+        output = OsrLz4PutSequence(output,
+                                   outputEnd,
+                                   anchor,
+                                   input - anchor,
+                                   input - match,
+                                   matchLength);
+
+        if (output == nullptr) {
+            return 0;
+        }
+
+        input += matchLength;
+        anchor = input;
+
+        //
+        // Remember a position inside the match we just took, which helps
+        // with data that repeats with a short period
+        //
+        if (input <= lastStart) {
+
+            HashTable[OsrLz4Hash(OsrLz4Read32(input - 2))] =
+                                            (USHORT)(input - 2 - Source);
+        }
+    }
+
+LastLiterals:
+
+    output = OsrLz4PutSequence(output,
+                               outputEnd,
+                               anchor,
+                               inputEnd - anchor,
+                               0,
+                               0);
+
+    if (output == nullptr) {
+        return 0;
+    }
+
+    return output - Destination;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrLz4Decompress
+//
+//    This routine decompresses one LZ4 block
+//
+//  INPUTS:
+//
+//      Source              - The compressed block
+//
+//      SourceLength        - Its length
+//
+//      Destination         - Where the decompressed data goes
+//
+//      DestinationCapacity - The size of the Destination buffer
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The number of bytes decompressed, or OSR_LZ4_ERROR if the block is
+//      corrupt or doesn't fit.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline size_t
+OsrLz4Decompress(const UCHAR* Source,
+                 size_t       SourceLength,
+                 PUCHAR       Destination,
+                 size_t       DestinationCapacity)
+{
+    const UCHAR* input     = Source;
+    const UCHAR* inputEnd  = Source + SourceLength;
+    PUCHAR       output    = Destination;
+    PUCHAR       outputEnd = Destination + DestinationCapacity;
+    const UCHAR* match;
+    size_t       length;
+    size_t       offset;
+    UCHAR        token;
+    UCHAR        extra;
+
+    while (input < inputEnd) {
+
+        token  = *input++;
+        length = token >> 4;
+
+        if (length == OSR_LZ4_RUN_MASK) {
+
+            do {
+                if (input >= inputEnd) {
+                    return OSR_LZ4_ERROR;
+                }
+
+                extra   = *input++;
+                length += extra;
+
+            } while (extra == 255);
+        }
+
+        if (length > (size_t)(inputEnd - input) ||
+            length > (size_t)(outputEnd - output)) {
+            return OSR_LZ4_ERROR;
+        }
+
+        RtlCopyMemory(output,
+                      input,
+                      length);
+
+        input  += length;
+        output += length;
+
+        //
+        // The last sequence has no match
+        //
+        if (input == inputEnd) {
+            break;
+        }
+
+        if (inputEnd - input < 2) {
+            return OSR_LZ4_ERROR;
+        }
+
+        offset = input[0] | ((size_t)input[1] << 8);
+        input += 2;
+
+        if (offset == 0 || offset > (size_t)(output - Destination)) {
+            return OSR_LZ4_ERROR;
+        }
+
+        length = token & OSR_LZ4_RUN_MASK;
+
+        if (length == OSR_LZ4_RUN_MASK) {
+
+            do {
+                if (input >= inputEnd) {
+                    return OSR_LZ4_ERROR;
+                }
+
+                extra   = *input++;
+                length += extra;
+
+            } while (extra == 255);
+        }
+
+        length += OSR_LZ4_MIN_MATCH;
+
+        if (length > (size_t)(outputEnd - output)) {
+            return OSR_LZ4_ERROR;
+        }
+
+        match = output - offset;
+
+        if (offset >= length) {
+
+            RtlCopyMemory(output,
+                          match,
+                          length);
+
+            output += length;
+
+        } else {
+
+            //
+            // The match overlaps what it's producing (a repeating
+            // pattern), so it has to go a byte at a time
+            //
+            while (length-- != 0) {
+                *output++ = *match++;
+            }
+        }
+    }
+
+    return output - Destination;
+}
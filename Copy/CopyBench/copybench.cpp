@@ -0,0 +1,359 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// COPYBENCH.CPP
+//
+// Microbenchmark for osrcopy.h: compares memcpy with the streaming copies
+// across a range of sizes, both for raw throughput and for how much each
+// one disturbs a working set that's sitting in the cache.
+//
+// This code is purely functional, and is definitely not designed to be any
+// sort of example.
+//
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Windows.h>
+#include <osrcopy.h>
+
+//
+// Smallest and largest copy we try, going up by 4x each time
+//
+#define BENCH_MIN_SIZE         (4 * 1024)
+#define BENCH_MAX_SIZE         (64 * 1024 * 1024)
+
+//
+// Each size copies (at least) this much in total for the throughput
+// numbers, and does this many copies for the working set numbers
+//
+#define BENCH_BYTES_PER_SIZE   (1024ULL * 1024 * 1024)
+#define BENCH_MIN_ITERATIONS   4
+#define BENCH_REREAD_ROUNDS    32
+
+//
+// Default size of the working set that we try to keep in the cache
+//
+#define BENCH_WORKING_SET_KB   1024
+
+//
+// The copies we compare
+//
+typedef struct _BENCH_COPY {
+
+    const char   *Name;
+    BOOL          UseMemcpy;
+    OSR_COPY_KIND Kind;
+
+} BENCH_COPY, *PBENCH_COPY;
+
+static const BENCH_COPY Copies[] = {
+    { "memcpy",  TRUE,  OsrCopyPlain },
+    { "SSE2 NT", FALSE, OsrCopySse2  },
+    { "AVX NT",  FALSE, OsrCopyAvx   },
+};
+
+static LONGLONG Frequency;
+
+//
+// Keeps the compiler from throwing away our working set walks
+//
+static volatile ULONG64 Sink;
+
+static LONGLONG
+Now()
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+static void
+DoCopy(const BENCH_COPY *Copy,
+       PUCHAR            Destination,
+       const UCHAR      *Source,
+       size_t            Length)
+{
+    OSR_COPY copy;
+
+    if (Copy->UseMemcpy) {
+
+        memcpy(Destination,
+               Source,
+               Length);
+        return;
+    }
+
+    //
+    // Force the streaming copy we're measuring, whatever the size
+    //
+    copy.Kind      = Copy->Kind;
+    copy.Threshold = 0;
+
+    OsrCopyMemory(&copy,
+                  Destination,
+                  Source,
+                  Length);
+}
+
+//
+// Read every cache line of the working set
+//
+static void
+WalkWorkingSet(const UCHAR *WorkingSet,
+               size_t       Length)
+{
+    ULONG64 sum = 0;
+
+    for (size_t offset = 0; offset < Length; offset += 64) {
+        sum += *(const volatile ULONG64 *)(WorkingSet + offset);
+    }
+
+    Sink += sum;
+}
+
+//
+// MB per second for one copy and size
+//
+static double
+MeasureThroughput(const BENCH_COPY *Copy,
+                  PUCHAR            Destination,
+                  const UCHAR      *Source,
+                  size_t            Length)
+{
+    ULONG64  iterations;
+    LONGLONG start;
+    LONGLONG elapsed;
+
+    iterations = max(BENCH_BYTES_PER_SIZE / Length,
+                     BENCH_MIN_ITERATIONS);
+
+    //
+    // One to fault everything in
+    //
+    DoCopy(Copy,
+           Destination,
+           Source,
+           Length);
+
+    start = Now();
+
+    for (ULONG64 index = 0; index < iterations; index++) {
+
+        DoCopy(Copy,
+               Destination,
+               Source,
+               Length);
+    }
+
+    elapsed = max(Now() - start,
+                  1);
+
+    return ((double)Length * iterations / (1024.0 * 1024.0)) /
+           ((double)elapsed / Frequency);
+}
+
+//
+// Average microseconds to walk a warm working set after one copy.  With
+// a null Copy, that's with no copy in between at all.
+//
+static double
+MeasureReread(const BENCH_COPY *Copy,
+              PUCHAR            Destination,
+              const UCHAR      *Source,
+              size_t            Length,
+              const UCHAR      *WorkingSet,
+              size_t            WorkingSetLength)
+{
+    LONGLONG total = 0;
+    LONGLONG start;
+
+    for (ULONG round = 0; round < BENCH_REREAD_ROUNDS; round++) {
+
+        WalkWorkingSet(WorkingSet,
+                       WorkingSetLength);
+
+        if (Copy != nullptr) {
+
+            DoCopy(Copy,
+                   Destination,
+                   Source,
+                   Length);
+        }
+
+        start = Now();
+
+        WalkWorkingSet(WorkingSet,
+                       WorkingSetLength);
+
+        total += Now() - start;
+    }
+
+    return ((double)total * 1000000.0 / Frequency) / BENCH_REREAD_ROUNDS;
+}
+
+int
+__cdecl
+main(int    argc,
+     char** argv)
+{
+    OSR_COPY      detected;
+    LARGE_INTEGER frequency;
+    PUCHAR        source;
+    PUCHAR        destination;
+    PUCHAR        workingSet;
+    size_t        workingSetLength = BENCH_WORKING_SET_KB * 1024;
+    ULONG         copyCount;
+    size_t        crossover = 0;
+    double        throughput[ARRAYSIZE(Copies)];
+    double        reread[ARRAYSIZE(Copies)];
+    double        baseline;
+
+    if (argc > 2 || (argc == 2 && strtoul(argv[1], nullptr, 0) == 0)) {
+
+        printf("Usage: copybench [<working set KB>]\n");
+        return 1;
+    }
+
+    if (argc == 2) {
+        workingSetLength = (size_t)strtoul(argv[1], nullptr, 0) * 1024;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    Frequency = frequency.QuadPart;
+
+    OsrCopyInitialize(&detected);
+
+    if (detected.Kind == OsrCopyPlain) {
+
+        printf("This machine can't do streaming copies, nothing to compare\n");
+        return 1;
+    }
+
+    //
+    // Only try AVX if the processor has it
+    //
+    copyCount = (detected.Kind == OsrCopyAvx) ? 3 : 2;
+
+    source      = (PUCHAR)VirtualAlloc(nullptr,
+                                       BENCH_MAX_SIZE,
+                                       MEM_COMMIT | MEM_RESERVE,
+                                       PAGE_READWRITE);
+    destination = (PUCHAR)VirtualAlloc(nullptr,
+                                       BENCH_MAX_SIZE,
+                                       MEM_COMMIT | MEM_RESERVE,
+                                       PAGE_READWRITE);
+    workingSet  = (PUCHAR)VirtualAlloc(nullptr,
+                                       workingSetLength,
+                                       MEM_COMMIT | MEM_RESERVE,
+                                       PAGE_READWRITE);
+
+    if (source == nullptr || destination == nullptr || workingSet == nullptr) {
+
+        printf("VirtualAlloc failed with error 0x%lx\n",
+               GetLastError());
+        return 1;
+    }
+
+    memset(source,
+           0x5A,
+           BENCH_MAX_SIZE);
+
+    memset(destination,
+           0,
+           BENCH_MAX_SIZE);
+
+    memset(workingSet,
+           0xA5,
+           workingSetLength);
+
+    baseline = MeasureReread(nullptr,
+                             destination,
+                             source,
+                             0,
+                             workingSet,
+                             workingSetLength);
+
+    printf("Default threshold %llu bytes, best copy on this machine is %s\n",
+           (ULONG64)detected.Threshold,
+           Copies[copyCount - 1].Name);
+
+    printf("Walking a %llu KB working set takes %.1f us when nothing "
+           "disturbs it\n\n",
+           (ULONG64)workingSetLength / 1024,
+           baseline);
+
+    printf("%10s", "Size");
+
+    for (ULONG index = 0; index < copyCount; index++) {
+        printf("  %9s MB/s", Copies[index].Name);
+    }
+
+    printf("   |  working set walk after copy (us)\n");
+
+    for (size_t size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 4) {
+
+        for (ULONG index = 0; index < copyCount; index++) {
+
+            throughput[index] = MeasureThroughput(&Copies[index],
+                                                  destination,
+                                                  source,
+                                                  size);
+
+            reread[index] = MeasureReread(&Copies[index],
+                                          destination,
+                                          source,
+                                          size,
+                                          workingSet,
+                                          workingSetLength);
+        }
+
+        printf("%10llu", (ULONG64)size);
+
+        for (ULONG index = 0; index < copyCount; index++) {
+            printf("  %14.0f", throughput[index]);
+        }
+
+        printf("   |");
+
+        for (ULONG index = 0; index < copyCount; index++) {
+            printf("  %9.1f", reread[index]);
+        }
+
+        printf("\n");
+
+        //
+        // Remember the first size at which the best streaming copy is at
+        // least as fast as memcpy
+        //
+        if (crossover == 0 &&
+            throughput[copyCount - 1] >= throughput[0]) {
+
+            crossover = size;
+        }
+    }
+
+    if (crossover != 0) {
+        printf("\nStreaming keeps up with memcpy from %llu bytes\n",
+               (ULONG64)crossover);
+    } else {
+        printf("\nStreaming never kept up with memcpy\n");
+    }
+
+    VirtualFree(source,
+                0,
+                MEM_RELEASE);
+    VirtualFree(destination,
+                0,
+                MEM_RELEASE);
+    VirtualFree(workingSet,
+                0,
+                MEM_RELEASE);
+
+    return 0;
+}
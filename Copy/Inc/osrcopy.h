@@ -0,0 +1,803 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+//
+// OSR bulk copy
+//
+// RtlCopyMemory is the right way to move a few KB around.  It's not the
+// right way to move megabytes that the driver is never going to look at
+// again: every byte of the destination gets pulled into the cache on the
+// way through, pushing out whatever the rest of the system was using, only
+// to be written back to memory later anyway.
+//
+// OsrCopyMemory uses non-temporal ("streaming") stores for copies of at
+// least Threshold bytes.  These write combine straight to memory without
+// reading the destination or leaving it in the cache.  Smaller copies, and
+// any copy on a processor where we can't do this, go to RtlCopyMemory.
+//
+// The caller keeps one OSR_COPY (e.g. in its device context) and calls
+// OsrCopyInitialize once, which picks the widest stores the processor and
+// OS support.  This file builds in user mode too, which is how the
+// CopyBench utility compares the kinds of copy against memcpy.
+//
+// OsrCopyMemoryCrc32c does the same copy and computes the CRC32C of the
+// data on the way through, so a checksum doesn't cost a second pass over
+// memory.  It uses the SSE4.2 crc32 instruction when there is one.
+// OsrCrc32c computes the same checksum without copying anything.
+//
+
+#include <intrin.h>
+
+//
+// Define this before including this file to change the default threshold.
+// CopyBench will tell you where streaming starts to win on a given machine.
+//
+#ifndef OSR_COPY_NON_TEMPORAL_THRESHOLD
+#define OSR_COPY_NON_TEMPORAL_THRESHOLD (64 * 1024)
+#endif
+
+//
+// Streaming copies need the destination aligned to the store size, and
+// there's no point going through the setup for just a few stores
+//
+#define OSR_COPY_ALIGNMENT    32
+#define OSR_COPY_BLOCK_SIZE   128
+#define OSR_COPY_MIN_STREAM   (4 * OSR_COPY_BLOCK_SIZE)
+
+//
+// We only do streaming copies on x64, where SSE2 is always there and the
+// kernel lets us use the XMM registers without saving anything
+//
+#if defined(_M_AMD64)
+#define OSR_COPY_STREAMING 1
+#else
+#define OSR_COPY_STREAMING 0
+#endif
+
+typedef enum _OSR_COPY_KIND {
+
+    OsrCopyPlain = 0,       // RtlCopyMemory, always
+    OsrCopySse2,            // 16 byte streaming stores
+    OsrCopyAvx              // 32 byte streaming stores
+
+} OSR_COPY_KIND;
+
+typedef struct _OSR_COPY {
+
+    OSR_COPY_KIND Kind;
+    size_t        Threshold;
+    BOOLEAN       HardwareCrc;
+
+} OSR_COPY, *POSR_COPY;
+
+//
+// CRC32C (Castagnoli), bit reflected, as computed by the crc32 instruction
+//
+#define OSR_CRC32C_POLYNOMIAL 0x82F63B78
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyInitialize
+//
+//    This routine picks the copy we'll use on this machine
+//
+//  INPUTS:
+//
+//      Copy - The copy state to initialize
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      A 32 byte store only needs AVX, not AVX2, so that's what we check
+//      for.  In kernel mode we also need the OS to have enabled the AVX
+//      state, or we won't be able to save it.
+//
+//      The crc32 instruction works on general purpose registers, so
+//      there's no state to save for it.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrCopyInitialize(POSR_COPY Copy)
+{
+    Copy->Kind        = OsrCopyPlain;
+    Copy->Threshold   = OSR_COPY_NON_TEMPORAL_THRESHOLD;
+    Copy->HardwareCrc = FALSE;
+
+#if OSR_COPY_STREAMING
+
+    Copy->Kind = OsrCopySse2;
+
+#ifdef _KERNEL_MODE
+    if (ExIsProcessorFeaturePresent(PF_AVX_INSTRUCTIONS_AVAILABLE) &&
+        (RtlGetEnabledExtendedFeatures(XSTATE_MASK_AVX) & XSTATE_MASK_AVX)) {
+
+        Copy->Kind = OsrCopyAvx;
+    }
+
+    Copy->HardwareCrc = ExIsProcessorFeaturePresent(
+                                    PF_SSE4_2_INSTRUCTIONS_AVAILABLE);
+#else
+    if (IsProcessorFeaturePresent(PF_AVX_INSTRUCTIONS_AVAILABLE)) {
+
+        Copy->Kind = OsrCopyAvx;
+    }
+
+    Copy->HardwareCrc = IsProcessorFeaturePresent(
+                                PF_SSE4_2_INSTRUCTIONS_AVAILABLE) != FALSE;
+#endif
+
+#endif
+}
+
+#if OSR_COPY_STREAMING
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyStreamSse2
+//
+//    This routine copies whole blocks with 16 byte streaming stores
+//
+//  INPUTS:
+//
+//      Destination - Where to copy to, aligned to OSR_COPY_ALIGNMENT
+//
+//      Source      - Where to copy from, any alignment
+//
+//      Length      - A multiple of OSR_COPY_BLOCK_SIZE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      The caller must _mm_sfence before anyone else looks at the data.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrCopyStreamSse2(PUCHAR       Destination,
+                  const UCHAR* Source,
+                  size_t       Length)
+{
+    __m128i* destination = (__m128i *)Destination;
+    __m128i  data[OSR_COPY_BLOCK_SIZE / sizeof(__m128i)];
+    ULONG    index;
+
+    for (size_t offset = 0; offset < Length; offset += OSR_COPY_BLOCK_SIZE) {
+
+        //
+        // Load the whole block before storing any of it, so that the
+        // stores go out back to back and fill write combining buffers
+        //
+        for (index = 0; index < ARRAYSIZE(data); index++) {
+
+            data[index] = _mm_loadu_si128(
+                        (const __m128i *)(Source + offset) + index);
+        }
+
+        for (index = 0; index < ARRAYSIZE(data); index++) {
+
+            _mm_stream_si128(destination++,
+                             data[index]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyStreamAvx
+//
+//    This routine copies whole blocks with 32 byte streaming stores
+//
+//  INPUTS:
+//
+//      Destination - Where to copy to, aligned to OSR_COPY_ALIGNMENT
+//
+//      Source      - Where to copy from, any alignment
+//
+//      Length      - A multiple of OSR_COPY_BLOCK_SIZE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      In kernel mode the caller must have saved the AVX state.  The
+//      caller must _mm_sfence before anyone else looks at the data.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrCopyStreamAvx(PUCHAR       Destination,
+                 const UCHAR* Source,
+                 size_t       Length)
+{
+    __m256i* destination = (__m256i *)Destination;
+    __m256i  data[OSR_COPY_BLOCK_SIZE / sizeof(__m256i)];
+    ULONG    index;
+
+    for (size_t offset = 0; offset < Length; offset += OSR_COPY_BLOCK_SIZE) {
+
+        for (index = 0; index < ARRAYSIZE(data); index++) {
+
+            data[index] = _mm256_loadu_si256(
+                        (const __m256i *)(Source + offset) + index);
+        }
+
+        for (index = 0; index < ARRAYSIZE(data); index++) {
+
+            _mm256_stream_si256(destination++,
+                                data[index]);
+        }
+    }
+
+    //
+    // Avoid the penalty for going back to non-VEX SSE code with the upper
+    // halves of the YMM registers dirty
+    //
+    _mm256_zeroupper();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyNonTemporal
+//
+//    This routine does a streaming copy
+//
+//  INPUTS:
+//
+//      Kind        - Which stores to use
+//
+//      Destination - Where to copy to
+//
+//      Source      - Where to copy from
+//
+//      Length      - How much to copy, at least OSR_COPY_MIN_STREAM
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The unaligned head and the partial block at the end are copied with
+//      RtlCopyMemory.  If we can't save the AVX state we fall back to SSE2
+//      rather than fail the copy.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrCopyNonTemporal(OSR_COPY_KIND Kind,
+                   PVOID         Destination,
+                   const VOID*   Source,
+                   size_t        Length)
+{
+    PUCHAR       destination = (PUCHAR)Destination;
+    const UCHAR* source      = (const UCHAR *)Source;
+    size_t       head;
+    size_t       bulk;
+
+    head = (0 - (ULONG_PTR)destination) & (OSR_COPY_ALIGNMENT - 1);
+
+    RtlCopyMemory(destination,
+                  source,
+                  head);
+
+    destination += head;
+    source      += head;
+    Length      -= head;
+
+    bulk = Length & ~((size_t)OSR_COPY_BLOCK_SIZE - 1);
+
+    if (Kind == OsrCopyAvx) {
+
+#ifdef _KERNEL_MODE
+        XSTATE_SAVE saveState;
+
+        if (NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX,
+                                                    &saveState))) {
+
+            OsrCopyStreamAvx(destination,
+                             source,
+                             bulk);
+
+            KeRestoreExtendedProcessorState(&saveState);
+
+        } else {
+
+            OsrCopyStreamSse2(destination,
+                              source,
+                              bulk);
+        }
+#else
+        OsrCopyStreamAvx(destination,
+                         source,
+                         bulk);
+#endif
+
+    } else {
+
+        OsrCopyStreamSse2(destination,
+                          source,
+                          bulk);
+    }
+
+    //
+    // Streaming stores aren't ordered with ordinary ones.  Without this,
+    // whoever we hand the buffer to next (by releasing a lock, completing
+    // a request...) could see the old contents.
+    //
+    _mm_sfence();
+
+    RtlCopyMemory(destination + bulk,
+                  source + bulk,
+                  Length - bulk);
+}
+
+#endif // OSR_COPY_STREAMING
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyMemory
+//
+//    This routine copies a buffer, streaming it if it's big enough
+//
+//  INPUTS:
+//
+//      Copy        - The copy state from OsrCopyInitialize
+//
+//      Destination - Where to copy to
+//
+//      Source      - Where to copy from
+//
+//      Length      - How much to copy
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Same rules as RtlCopyMemory: the buffers must not overlap.
+//
+///////////////////////////////////////////////////////////////////////////////
+FORCEINLINE VOID
+OsrCopyMemory(const OSR_COPY* Copy,
+              PVOID           Destination,
+              const VOID*     Source,
+              size_t          Length)
+{
+#if OSR_COPY_STREAMING
+    if (Copy->Kind != OsrCopyPlain &&
+        Length >= Copy->Threshold &&
+        Length >= OSR_COPY_MIN_STREAM) {
+
+        OsrCopyNonTemporal(Copy->Kind,
+                           Destination,
+                           Source,
+                           Length);
+        return;
+    }
+#else
+    UNREFERENCED_PARAMETER(Copy);
+#endif
+
+    RtlCopyMemory(Destination,
+                  Source,
+                  Length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCrc32cSoftware
+//
+//    This routine adds bytes to a CRC32C, one bit at a time
+//
+//  INPUTS:
+//
+//      Crc    - The CRC so far, NOT inverted
+//
+//      Source - The data
+//
+//      Length - The length of the data
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The new CRC, NOT inverted.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      Slow, but small.  Only processors without SSE4.2 (which is to say
+//      not much of anything Windows still runs on) come this way.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline ULONG
+OsrCrc32cSoftware(ULONG        Crc,
+                  const UCHAR* Source,
+                  size_t       Length)
+{
+    while (Length-- != 0) {
+
+        Crc ^= *Source++;
+
+        for (ULONG bit = 0; bit < 8; bit++) {
+            Crc = (Crc >> 1) ^ (OSR_CRC32C_POLYNOMIAL & (0 - (Crc & 1)));
+        }
+    }
+
+    return Crc;
+}
+
+#if OSR_COPY_STREAMING
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyCrc32cHardware
+//
+//    This routine copies data and adds it to a CRC32C, 8 bytes at a time
+//
+//  INPUTS:
+//
+//      Destination - Where to copy to, or nullptr to just compute the CRC
+//
+//      Source      - Where to copy from
+//
+//      Length      - How much to copy
+//
+//      Crc         - The CRC so far, NOT inverted
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The new CRC, NOT inverted.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      Each 8 bytes is loaded once, and both checksummed and stored from
+//      the same register.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline ULONG64
+OsrCopyCrc32cHardware(PUCHAR       Destination,
+                      const UCHAR* Source,
+                      size_t       Length,
+                      ULONG64      Crc)
+{
+    ULONG64 data;
+
+    while (Length >= sizeof(ULONG64)) {
+
+        data = *(UNALIGNED const ULONG64 *)Source;
+
+        Crc = _mm_crc32_u64(Crc,
+                            data);
+
+        if (Destination != nullptr) {
+
+            *(UNALIGNED ULONG64 *)Destination = data;
+
+            Destination += sizeof(ULONG64);
+        }
+
+        Source += sizeof(ULONG64);
+        Length -= sizeof(ULONG64);
+    }
+
+    while (Length-- != 0) {
+
+        Crc = _mm_crc32_u8((ULONG)Crc,
+                           *Source);
+
+        if (Destination != nullptr) {
+            *Destination++ = *Source;
+        }
+
+        Source++;
+    }
+
+    return Crc;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyCrc32cNonTemporal
+//
+//    This routine does a streaming copy and adds the data to a CRC32C
+//
+//  INPUTS:
+//
+//      Destination - Where to copy to
+//
+//      Source      - Where to copy from
+//
+//      Length      - How much to copy, at least OSR_COPY_MIN_STREAM
+//
+//      Crc         - The CRC so far, NOT inverted
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The new CRC, NOT inverted.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      Always 16 byte stores.  We can only checksum 8 bytes per
+//      instruction, so wider stores wouldn't buy us anything, and this way
+//      there's no AVX state to save.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline ULONG64
+OsrCopyCrc32cNonTemporal(PUCHAR       Destination,
+                         const UCHAR* Source,
+                         size_t       Length,
+                         ULONG64      Crc)
+{
+    __m128i data;
+    size_t  head;
+    size_t  bulk;
+
+    head = (0 - (ULONG_PTR)Destination) & (sizeof(__m128i) - 1);
+
+    Crc = OsrCopyCrc32cHardware(Destination,
+                                Source,
+                                head,
+                                Crc);
+
+    Destination += head;
+    Source      += head;
+    Length      -= head;
+
+    bulk = Length & ~(sizeof(__m128i) - 1);
+
+    for (size_t offset = 0; offset < bulk; offset += sizeof(__m128i)) {
+
+        data = _mm_loadu_si128((const __m128i *)(Source + offset));
+
+        Crc = _mm_crc32_u64(Crc,
+                            (ULONG64)_mm_cvtsi128_si64(data));
+        Crc = _mm_crc32_u64(Crc,
+                            (ULONG64)_mm_cvtsi128_si64(
+                                        _mm_unpackhi_epi64(data, data)));
+
+        _mm_stream_si128((__m128i *)(Destination + offset),
+                         data);
+    }
+
+    _mm_sfence();
+
+    return OsrCopyCrc32cHardware(Destination + bulk,
+                                 Source + bulk,
+                                 Length - bulk,
+                                 Crc);
+}
+
+#endif // OSR_COPY_STREAMING
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCopyMemoryCrc32c
+//
+//    This routine copies a buffer and computes its CRC32C in the same pass
+//
+//  INPUTS:
+//
+//      Copy        - The copy state from OsrCopyInitialize
+//
+//      Destination - Where to copy to
+//
+//      Source      - Where to copy from
+//
+//      Length      - How much to copy
+//
+//      Crc         - The CRC32C of any data that came before this, or zero
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The CRC32C of everything so far.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      CRCs chain: the CRC of A followed by B is
+//      OsrCopyMemoryCrc32c(..., B, OsrCopyMemoryCrc32c(..., A, 0)).  So a
+//      message that's copied in pieces gets the same CRC as if it had been
+//      copied all at once.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline ULONG
+OsrCopyMemoryCrc32c(const OSR_COPY* Copy,
+                    PVOID           Destination,
+                    const VOID*     Source,
+                    size_t          Length,
+                    ULONG           Crc)
+{
+#if OSR_COPY_STREAMING
+    if (Copy->HardwareCrc) {
+
+        if (Copy->Kind != OsrCopyPlain &&
+            Length >= Copy->Threshold &&
+            Length >= OSR_COPY_MIN_STREAM) {
+
+            return ~(ULONG)OsrCopyCrc32cNonTemporal((PUCHAR)Destination,
+                                                    (const UCHAR *)Source,
+                                                    Length,
+                                                    (ULONG)~Crc);
+        }
+
+        return ~(ULONG)OsrCopyCrc32cHardware((PUCHAR)Destination,
+                                             (const UCHAR *)Source,
+                                             Length,
+                                             (ULONG)~Crc);
+    }
+#endif
+
+    //
+    // No crc32 instruction, so no way to avoid two passes
+    //
+    Crc = ~OsrCrc32cSoftware(~Crc,
+                             (const UCHAR *)Source,
+                             Length);
+
+    OsrCopyMemory(Copy,
+                  Destination,
+                  Source,
+                  Length);
+
+    return Crc;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrCrc32c
+//
+//    This routine computes the CRC32C of a buffer
+//
+//  INPUTS:
+//
+//      Copy   - The copy state from OsrCopyInitialize
+//
+//      Source - The data
+//
+//      Length - The length of the data
+//
+//      Crc    - The CRC32C of any data that came before this, or zero
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The CRC32C of everything so far.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      Gives the same answer as OsrCopyMemoryCrc32c.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline ULONG
+OsrCrc32c(const OSR_COPY* Copy,
+          const VOID*     Source,
+          size_t          Length,
+          ULONG           Crc)
+{
+#if OSR_COPY_STREAMING
+    if (Copy->HardwareCrc) {
+
+        return ~(ULONG)OsrCopyCrc32cHardware(nullptr,
+                                             (const UCHAR *)Source,
+                                             Length,
+                                             (ULONG)~Crc);
+    }
+#else
+    UNREFERENCED_PARAMETER(Copy);
+#endif
+
+    return ~OsrCrc32cSoftware(~Crc,
+                              (const UCHAR *)Source,
+                              Length);
+}
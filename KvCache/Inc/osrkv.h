@@ -0,0 +1,1078 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+//
+// OSR key/value table
+//
+// A hash table of variable length records (a key of up to
+// OSR_KV_MAX_KEY_LENGTH bytes and a value of up to OSR_KV_MAX_VALUE_LENGTH
+// bytes) that lives in nonpaged pool, with a cap on both the number of
+// records and the memory they use.  When either cap is reached, records
+// are evicted to make room, least recently used first (roughly).
+//
+// The table is split into segments, picked by the key's hash, each with
+// its own lock.  Operations on different segments never touch the same
+// lock or the same cache lines.  Each segment is an open addressing table
+// with linear probing, and is never allowed to get more than 3/4 full, so
+// a lookup never has to go very far.  Removals shift the records after
+// them back into place instead of leaving tombstones.
+//
+// GETs only take their segment's lock shared, so any number of them can
+// look at a segment at once.  PUTs and DELETEs take it exclusive.  Record
+// memory is allocated and freed outside the lock.
+//
+// Eviction is CLOCK: a GET sets the record's Referenced flag, and the
+// segment's clock hand sweeps around the slots clearing the flags until it
+// finds a record that hasn't been used since the last time around.
+//
+// The table keeps count of every operation and how long they took, in
+// performance counter ticks.
+//
+// This file builds in user mode too, which is how KvBench measures the
+// table without a driver in the way.
+//
+
+#define OSR_KV_MAX_KEY_LENGTH   256
+#define OSR_KV_MAX_VALUE_LENGTH (64 * 1024)
+
+#define OSR_KV_POOL_TAG         'vKrO'
+
+//
+// Allocations smaller than a page aren't cache aligned in the kernel, so
+// we never ask for less than this for the segments
+//
+#define OSR_KV_ALIGNED_ALLOCATION 4096
+
+#ifdef _KERNEL_MODE
+
+typedef EX_SPIN_LOCK OSR_KV_LOCK;
+typedef KIRQL        OSR_KV_LOCK_STATE;
+
+#define OsrKvLockInitialize(Lock)          (*(Lock) = 0)
+#define OsrKvAcquireShared(Lock)           ExAcquireSpinLockShared(Lock)
+#define OsrKvReleaseShared(Lock, State)    ExReleaseSpinLockShared(Lock, State)
+#define OsrKvAcquireExclusive(Lock)        ExAcquireSpinLockExclusive(Lock)
+#define OsrKvReleaseExclusive(Lock, State) ExReleaseSpinLockExclusive(Lock, State)
+
+#define OsrKvAllocate(Size)                ExAllocatePoolWithTag(NonPagedPoolNx, \
+                                                                 (Size),         \
+                                                                 OSR_KV_POOL_TAG)
+#define OsrKvFree(Pointer)                 ExFreePoolWithTag((Pointer),          \
+                                                             OSR_KV_POOL_TAG)
+
+FORCEINLINE LONGLONG
+OsrKvNow()
+{
+    return KeQueryPerformanceCounter(nullptr).QuadPart;
+}
+
+#else
+
+typedef SRWLOCK OSR_KV_LOCK;
+typedef UCHAR   OSR_KV_LOCK_STATE;
+
+#define OsrKvLockInitialize(Lock)          InitializeSRWLock(Lock)
+#define OsrKvAcquireShared(Lock)           (AcquireSRWLockShared(Lock), (UCHAR)0)
+#define OsrKvReleaseShared(Lock, State)    ((void)(State), ReleaseSRWLockShared(Lock))
+#define OsrKvAcquireExclusive(Lock)        (AcquireSRWLockExclusive(Lock), (UCHAR)0)
+#define OsrKvReleaseExclusive(Lock, State) ((void)(State), ReleaseSRWLockExclusive(Lock))
+
+#define OsrKvAllocate(Size)                _aligned_malloc((Size),              \
+                                                           SYSTEM_CACHE_ALIGNMENT_SIZE)
+#define OsrKvFree(Pointer)                 _aligned_free(Pointer)
+
+FORCEINLINE LONGLONG
+OsrKvNow()
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+#endif
+
+typedef enum _OSR_KV_STATUS {
+
+    OsrKvSuccess = 0,
+    OsrKvNotFound,          // No record with that key
+    OsrKvBufferTooSmall,    // GET found the record, but the value didn't fit
+    OsrKvInvalidKey,        // Key (or value) is too long, or empty
+    OsrKvTooBig,            // Record is bigger than a whole segment's cap
+    OsrKvNoMemory
+
+} OSR_KV_STATUS;
+
+//
+// One record.  The key comes first in Data, then the value.  Size is what
+// we allocated, which is what counts against the memory cap.
+//
+typedef struct _OSR_KV_RECORD {
+
+    struct _OSR_KV_RECORD *Next;        // Only used while we free it
+    volatile LONG          Referenced;
+    ULONG                  KeyLength;
+    ULONG                  ValueLength;
+    ULONG                  Size;
+    UCHAR                  Data[1];
+
+} OSR_KV_RECORD, *POSR_KV_RECORD;
+
+//
+// One slot of a segment.  We keep the whole hash here, so that a lookup
+// only has to look at a record if its hash matches.
+//
+typedef struct _OSR_KV_SLOT {
+
+    ULONG64        Hash;
+    POSR_KV_RECORD Record;              // nullptr if the slot is empty
+
+} OSR_KV_SLOT, *POSR_KV_SLOT;
+
+//
+// What we count for each kind of operation
+//
+typedef struct _OSR_KV_OP_COUNTERS {
+
+    volatile LONG64 Count;
+    volatile LONG64 Ticks;
+    volatile LONG64 MaxTicks;
+
+} OSR_KV_OP_COUNTERS, *POSR_KV_OP_COUNTERS;
+
+typedef struct DECLSPEC_CACHEALIGN _OSR_KV_SEGMENT {
+
+    OSR_KV_LOCK  Lock;
+
+    POSR_KV_SLOT Slots;
+    ULONG        SlotMask;
+    ULONG        MaxEntries;
+    ULONG        Entries;
+    ULONG        ClockHand;
+    size_t       BytesUsed;
+    size_t       ByteLimit;
+
+    //
+    // GETs only hold the lock shared, so these are updated with
+    // interlocked operations
+    //
+    volatile LONG64    Hits;
+    volatile LONG64    Evictions;
+    OSR_KV_OP_COUNTERS Gets;
+    OSR_KV_OP_COUNTERS Puts;
+    OSR_KV_OP_COUNTERS Deletes;
+
+} OSR_KV_SEGMENT, *POSR_KV_SEGMENT;
+
+typedef struct _OSR_KV_TABLE {
+
+    POSR_KV_SEGMENT Segments;
+    ULONG           SegmentCount;
+
+} OSR_KV_TABLE, *POSR_KV_TABLE;
+
+//
+// Totals for the whole table (see OsrKvQueryStats).  Ticks are performance
+// counter ticks.
+//
+typedef struct _OSR_KV_STATS {
+
+    ULONG64 Entries;
+    ULONG64 MaxEntries;
+    ULONG64 BytesUsed;
+    ULONG64 ByteLimit;
+
+    ULONG64 Gets;
+    ULONG64 Hits;
+    ULONG64 Puts;
+    ULONG64 Deletes;
+    ULONG64 Evictions;
+
+    ULONG64 GetTicks;
+    ULONG64 GetMaxTicks;
+    ULONG64 PutTicks;
+    ULONG64 PutMaxTicks;
+    ULONG64 DeleteTicks;
+    ULONG64 DeleteMaxTicks;
+
+} OSR_KV_STATS, *POSR_KV_STATS;
+
+//
+// FNV-1a, with a final mix so that both the low bits (which pick the slot)
+// and the high bits (which pick the segment) are good
+//
+FORCEINLINE ULONG64
+OsrKvHash(const UCHAR* Key,
+          ULONG        KeyLength)
+{
+    ULONG64 hash = 0xCBF29CE484222325ULL;
+
+    for (ULONG index = 0; index < KeyLength; index++) {
+
+        hash ^= Key[index];
+        hash *= 0x100000001B3ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+FORCEINLINE POSR_KV_SEGMENT
+OsrKvSegment(POSR_KV_TABLE Table,
+             ULONG64       Hash)
+{
+    return &Table->Segments[(Hash >> 32) % Table->SegmentCount];
+}
+
+FORCEINLINE VOID
+OsrKvRecordLatency(POSR_KV_OP_COUNTERS Counters,
+                   LONGLONG            Ticks)
+{
+    LONG64 max;
+
+    InterlockedIncrementNoFence64(&Counters->Count);
+    InterlockedAddNoFence64(&Counters->Ticks,
+                            Ticks);
+
+    max = ReadNoFence64(&Counters->MaxTicks);
+
+    while (Ticks > max) {
+
+        LONG64 previous = InterlockedCompareExchange64(&Counters->MaxTicks,
+                                                       Ticks,
+                                                       max);
+        if (previous == max) {
+            break;
+        }
+
+        max = previous;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvFind
+//
+//    This routine looks for a key in a segment
+//
+//  INPUTS:
+//
+//      Segment   - The segment
+//
+//      Hash      - The key's hash
+//
+//      Key       - The key
+//
+//      KeyLength - Its length
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The key's slot, or nullptr if it's not there.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the segment's lock, shared or exclusive.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline POSR_KV_SLOT
+OsrKvFind(POSR_KV_SEGMENT Segment,
+          ULONG64         Hash,
+          const UCHAR*    Key,
+          ULONG           KeyLength)
+{
+    POSR_KV_SLOT slot;
+
+    //
+    // There's always at least one empty slot, so this always stops
+    //
+    for (ULONG index = (ULONG)Hash & Segment->SlotMask;
+         ;
+         index = (index + 1) & Segment->SlotMask) {
+
+        slot = &Segment->Slots[index];
+
+        if (slot->Record == nullptr) {
+            return nullptr;
+        }
+
+        if (slot->Hash == Hash &&
+            slot->Record->KeyLength == KeyLength &&
+            RtlEqualMemory(slot->Record->Data,
+                           Key,
+                           KeyLength)) {
+
+            return slot;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvRemoveSlot
+//
+//    This routine takes a record out of a segment
+//
+//  INPUTS:
+//
+//      Segment - The segment
+//
+//      Index   - The record's slot
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The record, which the caller has to free.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the segment's lock exclusive.
+//
+//      With linear probing we can't just empty the slot, or we'd cut off
+//      any records after it that had to probe past it.  So we move each of
+//      those back into the hole, if that's not before its home slot, and
+//      that leaves a new hole where it was.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline POSR_KV_RECORD
+OsrKvRemoveSlot(POSR_KV_SEGMENT Segment,
+                ULONG           Index)
+{
+    POSR_KV_RECORD record = Segment->Slots[Index].Record;
+    ULONG          hole   = Index;
+    ULONG          next   = Index;
+    ULONG          home;
+
+    while (TRUE) {
+
+        Segment->Slots[hole].Record = nullptr;
+
+        while (TRUE) {
+
+            next = (next + 1) & Segment->SlotMask;
+
+            if (Segment->Slots[next].Record == nullptr) {
+                goto Done;
+            }
+
+            home = (ULONG)Segment->Slots[next].Hash & Segment->SlotMask;
+
+            //
+            // Can this record move back to the hole?  Not if its home is
+            // (cyclically) after the hole, up to where it is now.
+            //
+            if (hole <= next) {
+
+                if (home > hole && home <= next) {
+                    continue;
+                }
+
+            } else if (home > hole || home <= next) {
+                continue;
+            }
+
+            break;
+        }
+
+        Segment->Slots[hole] = Segment->Slots[next];
+
+        hole = next;
+    }
+
+Done:
+
+    Segment->Entries--;
+    Segment->BytesUsed -= record->Size;
+
+    return record;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvEvict
+//
+//    This routine picks a record to evict from a segment and takes it out
+//
+//  INPUTS:
+//
+//      Segment - The segment, which mustn't be empty
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The record, which the caller has to free.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the segment's lock exclusive.
+//
+//      We clear Referenced on every record we pass over, so we'll find one
+//      by the time we get back to where we started.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline POSR_KV_RECORD
+OsrKvEvict(POSR_KV_SEGMENT Segment)
+{
+    POSR_KV_SLOT slot;
+    ULONG        index;
+
+    while (TRUE) {
+
+        index = Segment->ClockHand;
+        slot  = &Segment->Slots[index];
+
+        Segment->ClockHand = (index + 1) & Segment->SlotMask;
+
+        if (slot->Record == nullptr) {
+            continue;
+        }
+
+        if (slot->Record->Referenced != 0) {
+
+            slot->Record->Referenced = 0;
+            continue;
+        }
+
+        InterlockedIncrementNoFence64(&Segment->Evictions);
+
+        return OsrKvRemoveSlot(Segment,
+                               index);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvInitialize
+//
+//    This routine sets up an empty table
+//
+//  INPUTS:
+//
+//      Table        - The table
+//
+//      SegmentCount - How many segments to split it into
+//
+//      MaxEntries   - The most records the table can hold
+//
+//      MaxBytes     - The most memory the records can use
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      OsrKvSuccess or OsrKvNoMemory
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      The caps are split evenly between the segments.  The slots are
+//      all allocated up front, four for every three records.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline OSR_KV_STATUS
+OsrKvInitialize(POSR_KV_TABLE Table,
+                ULONG         SegmentCount,
+                size_t        MaxEntries,
+                size_t        MaxBytes)
+{
+    POSR_KV_SEGMENT segment;
+    size_t          segmentBytes;
+    ULONG           entries;
+    ULONG           slots;
+
+    SegmentCount = max(SegmentCount,
+                       1);
+
+    entries = (ULONG)max(MaxEntries / SegmentCount,
+                         1);
+
+    //
+    // Round up to a power of two, with a quarter of them spare
+    //
+    slots = 4;
+
+    while (slots < entries + (entries / 3) + 1) {
+        slots *= 2;
+    }
+
+    segmentBytes = max(SegmentCount * sizeof(OSR_KV_SEGMENT),
+                       OSR_KV_ALIGNED_ALLOCATION);
+
+    Table->SegmentCount = 0;
+    Table->Segments     = (POSR_KV_SEGMENT)OsrKvAllocate(segmentBytes);
+
+    if (Table->Segments == nullptr) {
+        return OsrKvNoMemory;
+    }
+
+    RtlZeroMemory(Table->Segments,
+                  segmentBytes);
+
+    for (ULONG index = 0; index < SegmentCount; index++) {
+
+        segment = &Table->Segments[index];
+
+        OsrKvLockInitialize(&segment->Lock);
+
+        segment->Slots = (POSR_KV_SLOT)OsrKvAllocate(slots * sizeof(OSR_KV_SLOT));
+
+        if (segment->Slots == nullptr) {
+
+            //
+            // Free the ones we did get
+            //
+            while (index-- > 0) {
+                OsrKvFree(Table->Segments[index].Slots);
+            }
+
+            OsrKvFree(Table->Segments);
+
+            Table->Segments = nullptr;
+
+            return OsrKvNoMemory;
+        }
+
+        RtlZeroMemory(segment->Slots,
+                      slots * sizeof(OSR_KV_SLOT));
+
+        segment->SlotMask   = slots - 1;
+        segment->MaxEntries = min(entries,
+                                  slots - (slots / 4));
+        segment->ByteLimit  = MaxBytes / SegmentCount;
+    }
+
+    Table->SegmentCount = SegmentCount;
+
+    return OsrKvSuccess;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvDestroy
+//
+//    This routine frees a table and everything in it
+//
+//  INPUTS:
+//
+//      Table - The table
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Nobody can be using the table.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrKvDestroy(POSR_KV_TABLE Table)
+{
+    POSR_KV_SEGMENT segment;
+
+    if (Table->Segments == nullptr) {
+        return;
+    }
+
+    for (ULONG index = 0; index < Table->SegmentCount; index++) {
+
+        segment = &Table->Segments[index];
+
+        for (ULONG slot = 0; slot <= segment->SlotMask; slot++) {
+
+            if (segment->Slots[slot].Record != nullptr) {
+                OsrKvFree(segment->Slots[slot].Record);
+            }
+        }
+
+        OsrKvFree(segment->Slots);
+    }
+
+    OsrKvFree(Table->Segments);
+
+    Table->Segments     = nullptr;
+    Table->SegmentCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvGet
+//
+//    This routine looks up a key and copies out its value
+//
+//  INPUTS:
+//
+//      Table         - The table
+//
+//      Key           - The key
+//
+//      KeyLength     - Its length
+//
+//      Value         - The buffer to receive the value
+//
+//      ValueCapacity - The size of the Value buffer
+//
+//  OUTPUTS:
+//
+//      ValueLength   - The length of the value, if the key was found
+//                      (even if it didn't fit)
+//
+//  RETURNS:
+//
+//      OsrKvSuccess, OsrKvNotFound, OsrKvBufferTooSmall or OsrKvInvalidKey
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline OSR_KV_STATUS
+OsrKvGet(POSR_KV_TABLE Table,
+         const UCHAR*  Key,
+         ULONG         KeyLength,
+         PUCHAR        Value,
+         ULONG         ValueCapacity,
+         PULONG        ValueLength)
+{
+    POSR_KV_SEGMENT   segment;
+    POSR_KV_SLOT      slot;
+    POSR_KV_RECORD    record;
+    OSR_KV_STATUS     status = OsrKvNotFound;
+    OSR_KV_LOCK_STATE lockState;
+    ULONG64           hash;
+    LONGLONG          start;
+
+    if (KeyLength == 0 || KeyLength > OSR_KV_MAX_KEY_LENGTH) {
+        return OsrKvInvalidKey;
+    }
+
+    start = OsrKvNow();
+
+    hash    = OsrKvHash(Key,
+                        KeyLength);
+    segment = OsrKvSegment(Table,
+                           hash);
+
+    lockState = OsrKvAcquireShared(&segment->Lock);
+
+    slot = OsrKvFind(segment,
+                     hash,
+                     Key,
+                     KeyLength);
+
+    if (slot != nullptr) {
+
+        record = slot->Record;
+
+        *ValueLength = record->ValueLength;
+
+        if (record->ValueLength <= ValueCapacity) {
+
+            RtlCopyMemory(Value,
+                          record->Data + record->KeyLength,
+                          record->ValueLength);
+
+            status = OsrKvSuccess;
+
+        } else {
+
+            status = OsrKvBufferTooSmall;
+        }
+
+        //
+        // Only write the flag if we have to, so that GETs of a popular
+        // record don't keep pulling its cache line away from each other
+        //
+        if (ReadNoFence(&record->Referenced) == 0) {
+
+            WriteNoFence(&record->Referenced,
+                         1);
+        }
+    }
+
+    OsrKvReleaseShared(&segment->Lock,
+                       lockState);
+
+    if (slot != nullptr) {
+        InterlockedIncrementNoFence64(&segment->Hits);
+    }
+
+    OsrKvRecordLatency(&segment->Gets,
+                       OsrKvNow() - start);
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvPut
+//
+//    This routine adds a record, or replaces the value of one that's
+//    already there
+//
+//  INPUTS:
+//
+//      Table       - The table
+//
+//      Key         - The key
+//
+//      KeyLength   - Its length
+//
+//      Value       - The value
+//
+//      ValueLength - Its length
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      OsrKvSuccess, OsrKvInvalidKey, OsrKvTooBig or OsrKvNoMemory
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We evict as many records as it takes to get the segment under both
+//      of its caps.  The evicted records (and the old record, if we
+//      replaced one) are freed after we drop the lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline OSR_KV_STATUS
+OsrKvPut(POSR_KV_TABLE Table,
+         const UCHAR*  Key,
+         ULONG         KeyLength,
+         const UCHAR*  Value,
+         ULONG         ValueLength)
+{
+    POSR_KV_SEGMENT   segment;
+    POSR_KV_SLOT      slot;
+    POSR_KV_RECORD    record;
+    POSR_KV_RECORD    freeList = nullptr;
+    POSR_KV_RECORD    evicted;
+    OSR_KV_LOCK_STATE lockState;
+    ULONG64           hash;
+    ULONG             size;
+    ULONG             index;
+    LONGLONG          start;
+
+    if (KeyLength == 0 ||
+        KeyLength > OSR_KV_MAX_KEY_LENGTH ||
+        ValueLength > OSR_KV_MAX_VALUE_LENGTH) {
+
+        return OsrKvInvalidKey;
+    }
+
+    start = OsrKvNow();
+
+    hash    = OsrKvHash(Key,
+                        KeyLength);
+    segment = OsrKvSegment(Table,
+                           hash);
+
+    size = FIELD_OFFSET(OSR_KV_RECORD, Data) + KeyLength + ValueLength;
+
+    if (size > segment->ByteLimit) {
+        return OsrKvTooBig;
+    }
+
+    //
+    // Build the new record before we take the lock
+    //
+    record = (POSR_KV_RECORD)OsrKvAllocate(size);
+
+    if (record == nullptr) {
+        return OsrKvNoMemory;
+    }
+
+    record->Next        = nullptr;
+    record->Referenced  = 0;
+    record->KeyLength   = KeyLength;
+    record->ValueLength = ValueLength;
+    record->Size        = size;
+
+    RtlCopyMemory(record->Data,
+                  Key,
+                  KeyLength);
+
+    RtlCopyMemory(record->Data + KeyLength,
+                  Value,
+                  ValueLength);
+
+    lockState = OsrKvAcquireExclusive(&segment->Lock);
+
+    slot = OsrKvFind(segment,
+                     hash,
+                     Key,
+                     KeyLength);
+
+    if (slot != nullptr) {
+
+        //
+        // Replacing a value counts as using the record.  Take the old one
+        // out, and put the new one in just like any other.
+        //
+        record->Referenced = 1;
+
+        freeList = OsrKvRemoveSlot(segment,
+                                   (ULONG)(slot - segment->Slots));
+    }
+
+    //
+    // Make room, under both caps.  The record fits in an empty segment,
+    // so there's always something to evict while we're over.
+    //
+    while (segment->Entries >= segment->MaxEntries ||
+           segment->BytesUsed + size > segment->ByteLimit) {
+
+        evicted = OsrKvEvict(segment);
+
+        evicted->Next = freeList;
+        freeList      = evicted;
+    }
+
+    for (index = (ULONG)hash & segment->SlotMask;
+         segment->Slots[index].Record != nullptr;
+         index = (index + 1) & segment->SlotMask) {
+    }
+
+    segment->Slots[index].Hash   = hash;
+    segment->Slots[index].Record = record;
+
+    segment->Entries++;
+    segment->BytesUsed += size;
+
+    OsrKvReleaseExclusive(&segment->Lock,
+                          lockState);
+
+    while (freeList != nullptr) {
+
+        evicted  = freeList;
+        freeList = freeList->Next;
+
+        OsrKvFree(evicted);
+    }
+
+    OsrKvRecordLatency(&segment->Puts,
+                       OsrKvNow() - start);
+
+    return OsrKvSuccess;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvDelete
+//
+//    This routine removes a record
+//
+//  INPUTS:
+//
+//      Table     - The table
+//
+//      Key       - The key
+//
+//      KeyLength - Its length
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      OsrKvSuccess, OsrKvNotFound or OsrKvInvalidKey
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline OSR_KV_STATUS
+OsrKvDelete(POSR_KV_TABLE Table,
+            const UCHAR*  Key,
+            ULONG         KeyLength)
+{
+    POSR_KV_SEGMENT   segment;
+    POSR_KV_SLOT      slot;
+    POSR_KV_RECORD    record = nullptr;
+    OSR_KV_LOCK_STATE lockState;
+    ULONG64           hash;
+    LONGLONG          start;
+
+    if (KeyLength == 0 || KeyLength > OSR_KV_MAX_KEY_LENGTH) {
+        return OsrKvInvalidKey;
+    }
+
+    start = OsrKvNow();
+
+    hash    = OsrKvHash(Key,
+                        KeyLength);
+    segment = OsrKvSegment(Table,
+                           hash);
+
+    lockState = OsrKvAcquireExclusive(&segment->Lock);
+
+    slot = OsrKvFind(segment,
+                     hash,
+                     Key,
+                     KeyLength);
+
+    if (slot != nullptr) {
+
+        record = OsrKvRemoveSlot(segment,
+                                 (ULONG)(slot - segment->Slots));
+    }
+
+    OsrKvReleaseExclusive(&segment->Lock,
+                          lockState);
+
+    if (record != nullptr) {
+        OsrKvFree(record);
+    }
+
+    OsrKvRecordLatency(&segment->Deletes,
+                       OsrKvNow() - start);
+
+    return (record != nullptr) ? OsrKvSuccess : OsrKvNotFound;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrKvQueryStats
+//
+//    This routine adds up the counters of all the segments
+//
+//  INPUTS:
+//
+//      Table - The table
+//
+//  OUTPUTS:
+//
+//      Stats - The totals
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We don't take any locks, so this is a snapshot that may be a little
+//      out of date by the time the caller looks at it.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrKvQueryStats(POSR_KV_TABLE Table,
+                POSR_KV_STATS Stats)
+{
+    POSR_KV_SEGMENT segment;
+
+    RtlZeroMemory(Stats,
+                  sizeof(OSR_KV_STATS));
+
+    for (ULONG index = 0; index < Table->SegmentCount; index++) {
+
+        segment = &Table->Segments[index];
+
+        Stats->Entries    += segment->Entries;
+        Stats->MaxEntries += segment->MaxEntries;
+        Stats->BytesUsed  += segment->BytesUsed;
+        Stats->ByteLimit  += segment->ByteLimit;
+
+        Stats->Hits      += ReadNoFence64(&segment->Hits);
+        Stats->Evictions += ReadNoFence64(&segment->Evictions);
+
+        Stats->Gets        += ReadNoFence64(&segment->Gets.Count);
+        Stats->GetTicks    += ReadNoFence64(&segment->Gets.Ticks);
+        Stats->GetMaxTicks  = max(Stats->GetMaxTicks,
+                                  (ULONG64)ReadNoFence64(&segment->Gets.MaxTicks));
+
+        Stats->Puts        += ReadNoFence64(&segment->Puts.Count);
+        Stats->PutTicks    += ReadNoFence64(&segment->Puts.Ticks);
+        Stats->PutMaxTicks  = max(Stats->PutMaxTicks,
+                                  (ULONG64)ReadNoFence64(&segment->Puts.MaxTicks));
+
+        Stats->Deletes        += ReadNoFence64(&segment->Deletes.Count);
+        Stats->DeleteTicks    += ReadNoFence64(&segment->Deletes.Ticks);
+        Stats->DeleteMaxTicks  = max(Stats->DeleteMaxTicks,
+                                     (ULONG64)ReadNoFence64(&segment->Deletes.MaxTicks));
+    }
+}
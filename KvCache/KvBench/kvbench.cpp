@@ -0,0 +1,608 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// KVBENCH.CPP
+//
+// Multi-threaded benchmark for osrkv.h.  Runs a mix of GETs, PUTs and
+// DELETEs against either a table right here in user mode or the Nothing
+// driver's key/value cache, with more and more threads, and reports the
+// throughput, hit rate and how long each kind of operation took.
+//
+// This code is purely functional, and is definitely not designed to be any
+// sort of example.
+//
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Windows.h>
+#include <nothing_ioctl.h>
+#include <osrkv.h>
+
+//
+// Defaults for the workload.  Keys are picked uniformly from the key space,
+// and a GET that misses is followed by a PUT of the same key, like an app
+// using the cache would do.  Of the operations that aren't GETs, one in
+// BENCH_DELETE_ONE_IN is a DELETE and the rest are PUTs.
+//
+#define BENCH_DEFAULT_KEYS        (256 * 1024)
+#define BENCH_DEFAULT_VALUE_SIZE  256
+#define BENCH_DEFAULT_READ_PCT    90
+#define BENCH_DEFAULT_SECONDS     3
+#define BENCH_DEFAULT_CACHE_MB    16
+#define BENCH_DEFAULT_ENTRIES     (64 * 1024)
+#define BENCH_DELETE_ONE_IN       10
+#define BENCH_MAX_THREADS         64
+
+//
+// The user mode table gets this many segments per processor, the same as
+// the driver's NOTHING_KV_SEGMENTS_PER_SHARD
+//
+#define BENCH_SEGMENTS_PER_CPU    4
+
+typedef struct _BENCH_THREAD {
+
+    HANDLE   Thread;
+    ULONG    Seed;
+    ULONG64  Operations;
+
+    //
+    // Request and reply buffers for the device
+    //
+    PUCHAR   Request;
+    PUCHAR   Reply;
+
+} BENCH_THREAD, *PBENCH_THREAD;
+
+static OSR_KV_TABLE  Table;
+static HANDLE        Device = INVALID_HANDLE_VALUE;
+static ULONG         Keys        = BENCH_DEFAULT_KEYS;
+static ULONG         ValueSize   = BENCH_DEFAULT_VALUE_SIZE;
+static ULONG         ReadPercent = BENCH_DEFAULT_READ_PCT;
+static ULONG         Seconds     = BENCH_DEFAULT_SECONDS;
+static volatile LONG Stop;
+static HANDLE        StartEvent;
+
+static ULONG
+Random(PULONG Seed)
+{
+    //
+    // xorshift32, plenty for picking keys
+    //
+    *Seed ^= *Seed << 13;
+    *Seed ^= *Seed >> 17;
+    *Seed ^= *Seed << 5;
+
+    return *Seed;
+}
+
+static ULONG
+MakeKey(ULONG  Number,
+        PUCHAR Key)
+{
+    return (ULONG)sprintf((char *)Key,
+                          "key:%08lx",
+                          Number);
+}
+
+//
+// The three operations, against whichever cache we're measuring.  Each
+// returns TRUE if it found the key.
+//
+static BOOL
+DoGet(PBENCH_THREAD Thread,
+      PUCHAR        Key,
+      ULONG         KeyLength)
+{
+    PNOTHING_KV_RECORD record = (PNOTHING_KV_RECORD)Thread->Request;
+    DWORD              bytes;
+    ULONG              valueLength;
+
+    if (Device == INVALID_HANDLE_VALUE) {
+
+        return OsrKvGet(&Table,
+                        Key,
+                        KeyLength,
+                        Thread->Reply,
+                        NOTHING_KV_MAX_VALUE_LENGTH,
+                        &valueLength) == OsrKvSuccess;
+    }
+
+    record->KeyLength   = KeyLength;
+    record->ValueLength = 0;
+
+    memcpy(record + 1,
+           Key,
+           KeyLength);
+
+    return DeviceIoControl(Device,
+                           IOCTL_OSR_NOTHING_KV_GET,
+                           record,
+                           sizeof(NOTHING_KV_RECORD) + KeyLength,
+                           Thread->Reply,
+                           FIELD_OFFSET(NOTHING_KV_VALUE, Value) +
+                                               NOTHING_KV_MAX_VALUE_LENGTH,
+                           &bytes,
+                           nullptr);
+}
+
+static void
+DoPut(PBENCH_THREAD Thread,
+      PUCHAR        Key,
+      ULONG         KeyLength)
+{
+    PNOTHING_KV_RECORD record = (PNOTHING_KV_RECORD)Thread->Request;
+    PUCHAR             value  = (PUCHAR)(record + 1) + KeyLength;
+    DWORD              bytes;
+
+    if (Device == INVALID_HANDLE_VALUE) {
+
+        //
+        // The value's contents don't matter, so it comes from whatever
+        // the last GET left in the reply buffer
+        //
+        OsrKvPut(&Table,
+                 Key,
+                 KeyLength,
+                 Thread->Reply,
+                 ValueSize);
+        return;
+    }
+
+    record->KeyLength   = KeyLength;
+    record->ValueLength = ValueSize;
+
+    memcpy(record + 1,
+           Key,
+           KeyLength);
+
+    memset(value,
+           Key[KeyLength - 1],
+           ValueSize);
+
+    DeviceIoControl(Device,
+                    IOCTL_OSR_NOTHING_KV_PUT,
+                    record,
+                    sizeof(NOTHING_KV_RECORD) + KeyLength + ValueSize,
+                    nullptr,
+                    0,
+                    &bytes,
+                    nullptr);
+}
+
+static void
+DoDelete(PBENCH_THREAD Thread,
+         PUCHAR        Key,
+         ULONG         KeyLength)
+{
+    PNOTHING_KV_RECORD record = (PNOTHING_KV_RECORD)Thread->Request;
+    DWORD              bytes;
+
+    if (Device == INVALID_HANDLE_VALUE) {
+
+        OsrKvDelete(&Table,
+                    Key,
+                    KeyLength);
+        return;
+    }
+
+    record->KeyLength   = KeyLength;
+    record->ValueLength = 0;
+
+    memcpy(record + 1,
+           Key,
+           KeyLength);
+
+    DeviceIoControl(Device,
+                    IOCTL_OSR_NOTHING_KV_DELETE,
+                    record,
+                    sizeof(NOTHING_KV_RECORD) + KeyLength,
+                    nullptr,
+                    0,
+                    &bytes,
+                    nullptr);
+}
+
+//
+// The cache's own counters.  The driver's come back in a NOTHING_KV_STATS,
+// which has the same fields.
+//
+static BOOL
+QueryStats(POSR_KV_STATS Stats)
+{
+    NOTHING_KV_STATS stats;
+    DWORD            bytes;
+
+    if (Device == INVALID_HANDLE_VALUE) {
+
+        OsrKvQueryStats(&Table,
+                        Stats);
+        return TRUE;
+    }
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_OSR_NOTHING_KV_STATS,
+                         nullptr,
+                         0,
+                         &stats,
+                         sizeof(stats),
+                         &bytes,
+                         nullptr)) {
+
+        printf("IOCTL_OSR_NOTHING_KV_STATS failed with error 0x%lx\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    Stats->Entries        = stats.Entries;
+    Stats->MaxEntries     = stats.MaxEntries;
+    Stats->BytesUsed      = stats.BytesUsed;
+    Stats->ByteLimit      = stats.ByteLimit;
+    Stats->Gets           = stats.Gets;
+    Stats->Hits           = stats.Hits;
+    Stats->Puts           = stats.Puts;
+    Stats->Deletes        = stats.Deletes;
+    Stats->Evictions      = stats.Evictions;
+    Stats->GetTicks       = stats.GetTicks;
+    Stats->GetMaxTicks    = stats.GetMaxTicks;
+    Stats->PutTicks       = stats.PutTicks;
+    Stats->PutMaxTicks    = stats.PutMaxTicks;
+    Stats->DeleteTicks    = stats.DeleteTicks;
+    Stats->DeleteMaxTicks = stats.DeleteMaxTicks;
+
+    return TRUE;
+}
+
+static DWORD WINAPI
+BenchThread(PVOID Context)
+{
+    PBENCH_THREAD thread = (PBENCH_THREAD)Context;
+    UCHAR         key[32];
+    ULONG         keyLength;
+    ULONG         choice;
+
+    WaitForSingleObject(StartEvent,
+                        INFINITE);
+
+    while (!ReadNoFence(&Stop)) {
+
+        keyLength = MakeKey(Random(&thread->Seed) % Keys,
+                            key);
+
+        choice = Random(&thread->Seed) % 100;
+
+        if (choice < ReadPercent) {
+
+            if (!DoGet(thread,
+                       key,
+                       keyLength)) {
+
+                DoPut(thread,
+                      key,
+                      keyLength);
+            }
+
+        } else if (choice % BENCH_DELETE_ONE_IN == 0) {
+
+            DoDelete(thread,
+                     key,
+                     keyLength);
+        } else {
+
+            DoPut(thread,
+                  key,
+                  keyLength);
+        }
+
+        thread->Operations++;
+    }
+
+    return 0;
+}
+
+//
+// Average and worst microseconds for one kind of operation
+//
+static void
+PrintLatency(ULONG64  Count,
+             ULONG64  Ticks,
+             ULONG64  MaxTicks,
+             LONGLONG Frequency)
+{
+    if (Count == 0) {
+        printf("  %8s %8s", "-", "-");
+        return;
+    }
+
+    printf("  %8.2f %8.1f",
+           ((double)Ticks * 1000000.0 / Frequency) / Count,
+           (double)MaxTicks * 1000000.0 / Frequency);
+}
+
+int
+__cdecl
+main(int    argc,
+     char** argv)
+{
+    BENCH_THREAD  threads[BENCH_MAX_THREADS];
+    OSR_KV_STATS  before;
+    OSR_KV_STATS  after;
+    LARGE_INTEGER frequency;
+    const char   *devicePath = "\\\\.\\Nothing0";
+    ULONG         cacheMB    = BENCH_DEFAULT_CACHE_MB;
+    ULONG         entries    = BENCH_DEFAULT_ENTRIES;
+    ULONG         processors;
+    ULONG         maxThreads;
+    ULONG64       operations;
+    ULONG64       gets;
+    ULONG64       puts;
+    ULONG64       deletes;
+    LONGLONG      start;
+    LONGLONG      elapsed;
+    LARGE_INTEGER now;
+
+    for (int index = 1; index < argc; index++) {
+
+        if (strcmp(argv[index], "-device") == 0) {
+
+            if (index + 1 < argc && argv[index + 1][0] != '-') {
+                devicePath = argv[++index];
+            }
+
+            Device = CreateFileA(devicePath,
+                                 GENERIC_READ | GENERIC_WRITE,
+                                 0,
+                                 nullptr,
+                                 OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL,
+                                 nullptr);
+
+            if (Device == INVALID_HANDLE_VALUE) {
+
+                printf("CreateFile of %s failed with error 0x%lx\n",
+                       devicePath,
+                       GetLastError());
+                return 1;
+            }
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-keys") == 0) {
+
+            Keys = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-value") == 0) {
+
+            ValueSize = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-reads") == 0) {
+
+            ReadPercent = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-seconds") == 0) {
+
+            Seconds = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-cache") == 0) {
+
+            cacheMB = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-entries") == 0) {
+
+            entries = strtoul(argv[++index], nullptr, 0);
+
+        } else {
+
+            Keys = 0;
+            break;
+        }
+    }
+
+    if (Keys == 0 ||
+        ValueSize > NOTHING_KV_MAX_VALUE_LENGTH ||
+        ReadPercent > 100 ||
+        Seconds == 0 ||
+        cacheMB == 0 ||
+        entries == 0) {
+
+        printf("Usage: kvbench [-device [<path>]] [-keys <n>] [-value <bytes>]\n"
+               "               [-reads <percent>] [-seconds <n>]\n"
+               "               [-cache <MB>] [-entries <n>]\n");
+        return 1;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    processors = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    maxThreads = min(processors,
+                     BENCH_MAX_THREADS);
+
+    StartEvent = CreateEvent(nullptr,
+                             TRUE,
+                             FALSE,
+                             nullptr);
+
+    for (ULONG index = 0; index < maxThreads; index++) {
+
+        threads[index].Request = (PUCHAR)malloc(sizeof(NOTHING_KV_RECORD) +
+                                                NOTHING_KV_MAX_KEY_LENGTH +
+                                                NOTHING_KV_MAX_VALUE_LENGTH);
+        threads[index].Reply   = (PUCHAR)malloc(sizeof(NOTHING_KV_VALUE) +
+                                                NOTHING_KV_MAX_VALUE_LENGTH);
+
+        if (threads[index].Request == nullptr ||
+            threads[index].Reply == nullptr) {
+
+            printf("Out of memory\n");
+            return 1;
+        }
+
+        memset(threads[index].Reply,
+               0x5A,
+               sizeof(NOTHING_KV_VALUE) + NOTHING_KV_MAX_VALUE_LENGTH);
+    }
+
+    if (Device != INVALID_HANDLE_VALUE) {
+
+        printf("Measuring the key/value cache in %s\n",
+               devicePath);
+
+    } else {
+
+        printf("Measuring a user mode table: %lu MB, %lu entries, "
+               "%lu segments\n",
+               cacheMB,
+               entries,
+               processors * BENCH_SEGMENTS_PER_CPU);
+    }
+
+    printf("%lu keys, %lu byte values, %lu%% GETs, %lu seconds per run\n\n",
+           Keys,
+           ValueSize,
+           ReadPercent,
+           Seconds);
+
+    printf("%7s %12s %6s %9s  %17s  %17s  %17s\n",
+           "",
+           "",
+           "",
+           "",
+           "GET us",
+           "PUT us",
+           "DELETE us");
+    printf("%7s %12s %6s %9s  %8s %8s  %8s %8s  %8s %8s\n",
+           "Threads",
+           "Ops/sec",
+           "Hit %",
+           "Evictions",
+           "avg", "max",
+           "avg", "max",
+           "avg", "max");
+
+    //
+    // 1, 2, 4... threads, finishing with one per processor
+    //
+    for (ULONG threadCount = 1;
+         ;
+         threadCount = min(threadCount * 2,
+                           maxThreads)) {
+
+        //
+        // A fresh table for every run in user mode.  The driver's cache
+        // just keeps going, so we look at how its counters change.
+        //
+        if (Device == INVALID_HANDLE_VALUE) {
+
+            if (OsrKvInitialize(&Table,
+                                processors * BENCH_SEGMENTS_PER_CPU,
+                                entries,
+                                (size_t)cacheMB * 1024 * 1024) != OsrKvSuccess) {
+
+                printf("OsrKvInitialize failed\n");
+                return 1;
+            }
+        }
+
+        if (!QueryStats(&before)) {
+            return 1;
+        }
+
+        WriteNoFence(&Stop,
+                     0);
+        ResetEvent(StartEvent);
+
+        for (ULONG index = 0; index < threadCount; index++) {
+
+            threads[index].Seed       = 0x9E3779B9 * (index + 1);
+            threads[index].Operations = 0;
+            threads[index].Thread     = CreateThread(nullptr,
+                                                     0,
+                                                     BenchThread,
+                                                     &threads[index],
+                                                     0,
+                                                     nullptr);
+            if (threads[index].Thread == nullptr) {
+
+                printf("CreateThread failed with error 0x%lx\n",
+                       GetLastError());
+                return 1;
+            }
+        }
+
+        QueryPerformanceCounter(&now);
+        start = now.QuadPart;
+
+        SetEvent(StartEvent);
+
+        Sleep(Seconds * 1000);
+
+        WriteNoFence(&Stop,
+                     1);
+
+        operations = 0;
+
+        for (ULONG index = 0; index < threadCount; index++) {
+
+            WaitForSingleObject(threads[index].Thread,
+                                INFINITE);
+            CloseHandle(threads[index].Thread);
+
+            operations += threads[index].Operations;
+        }
+
+        QueryPerformanceCounter(&now);
+        elapsed = now.QuadPart - start;
+
+        if (!QueryStats(&after)) {
+            return 1;
+        }
+
+        gets    = after.Gets - before.Gets;
+        puts    = after.Puts - before.Puts;
+        deletes = after.Deletes - before.Deletes;
+
+        printf("%7lu %12.0f %6.1f %9llu",
+               threadCount,
+               (double)operations * frequency.QuadPart / elapsed,
+               gets ? 100.0 * (after.Hits - before.Hits) / gets : 0.0,
+               after.Evictions - before.Evictions);
+
+        //
+        // The worst case is over the whole life of the driver's cache,
+        // not just this run
+        //
+        PrintLatency(gets,
+                     after.GetTicks - before.GetTicks,
+                     after.GetMaxTicks,
+                     frequency.QuadPart);
+        PrintLatency(puts,
+                     after.PutTicks - before.PutTicks,
+                     after.PutMaxTicks,
+                     frequency.QuadPart);
+        PrintLatency(deletes,
+                     after.DeleteTicks - before.DeleteTicks,
+                     after.DeleteMaxTicks,
+                     frequency.QuadPart);
+        printf("\n");
+
+        if (Device == INVALID_HANDLE_VALUE) {
+            OsrKvDestroy(&Table);
+        }
+
+        if (threadCount == maxThreads) {
+            break;
+        }
+    }
+
+    printf("\nCache holds %llu of at most %llu entries, %llu of %llu bytes\n",
+           after.Entries,
+           after.MaxEntries,
+           after.BytesUsed,
+           after.ByteLimit);
+
+    if (Device != INVALID_HANDLE_VALUE) {
+        CloseHandle(Device);
+    }
+
+    return 0;
+}
@@ -50,3 +50,497 @@ DEFINE_GUID(GUID_DEVINTERFACE_NOTHING,
 //
 #define IOCTL_OSR_NOTHING CTL_CODE(FILE_DEVICE_NOTHING, 2049, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+//
+// Batched writes and reads
+//
+// These let an app move a whole batch of messages with one DeviceIoControl
+// instead of one WriteFile or ReadFile per message.
+//
+// The input buffer describes the batch: a NOTHING_BATCH header followed by
+// RecordCount NOTHING_BATCH_RECORDs, each giving the offset and length of
+// one message in the output buffer.
+//
+// The output buffer (locked down by the I/O Manager, since these are
+// METHOD_OUT_DIRECT) starts with RecordCount NOTHING_BATCH_RESULTs, which the
+// driver fills in, followed by the message data.  For a batch write the driver
+// takes each message's data from the output buffer, for a batch read it
+// fills each message's area in with data.
+//
+// The IOCTL itself fails only if the batch is malformed.  Otherwise the
+// Information field is the number of records processed and each record's
+// outcome is in its NOTHING_BATCH_RESULT.
+//
+#define IOCTL_OSR_NOTHING_BATCH_WRITE CTL_CODE(FILE_DEVICE_NOTHING, 2050, METHOD_OUT_DIRECT, FILE_WRITE_ACCESS)
+#define IOCTL_OSR_NOTHING_BATCH_READ  CTL_CODE(FILE_DEVICE_NOTHING, 2051, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+typedef struct _NOTHING_BATCH_RECORD {
+
+    ULONG DataOffset;       // From the start of the output buffer
+    ULONG DataLength;
+
+} NOTHING_BATCH_RECORD, *PNOTHING_BATCH_RECORD;
+
+typedef struct _NOTHING_BATCH {
+
+    ULONG                RecordCount;
+    NOTHING_BATCH_RECORD Records[1];
+
+} NOTHING_BATCH, *PNOTHING_BATCH;
+
+typedef struct _NOTHING_BATCH_RESULT {
+
+    LONG  Status;           // NTSTATUS for this record
+    ULONG BytesTransferred;
+
+} NOTHING_BATCH_RESULT, *PNOTHING_BATCH_RESULT;
+
+//
+// Shared submission/completion rings
+//
+// For the highest message rates an app can skip per-message system calls
+// altogether.  It allocates a page aligned region of memory, lays out a
+// NOTHING_RING_HEADER, a submission ring, a completion ring, and a data
+// area in it, and hands the region to the driver with
+// IOCTL_OSR_NOTHING_RING_SETUP.  That IOCTL must be sent OVERLAPPED: the
+// driver keeps it pending (which keeps the region locked down) until the
+// handle is closed or the IOCTL is cancelled.
+//
+// The app then queues NOTHING_RING_SUBMISSIONs, advances SubmissionTail,
+// and rings the doorbell by sending IOCTL_OSR_NOTHING_RING_ENTER.  The
+// driver processes everything from SubmissionHead up to SubmissionTail
+// (for as long as there's room in the completion ring), posts a
+// NOTHING_RING_COMPLETION for each, and advances SubmissionHead and
+// CompletionTail.  The app consumes completions and advances CompletionHead.
+// If another thread's doorbell is already being processed, the new one
+// leaves its submissions to that one and completes with nothing processed.
+// Reads and writes are limited to the driver's MaxMessageSize.
+//
+// Both ring sizes must be powers of two.  Head and tail values are free
+// running counters, the slot for a counter is (counter & (entries - 1)).
+// All offsets are from the start of the region.
+//
+#define IOCTL_OSR_NOTHING_RING_SETUP CTL_CODE(FILE_DEVICE_NOTHING, 2052, METHOD_OUT_DIRECT, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_OSR_NOTHING_RING_ENTER CTL_CODE(FILE_DEVICE_NOTHING, 2053, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NOTHING_RING_VERSION 1
+
+#define NOTHING_RING_OP_NOP   0
+#define NOTHING_RING_OP_WRITE 1     // Same as a WriteFile of the data
+#define NOTHING_RING_OP_READ  2     // Same as a ReadFile into the data
+
+typedef struct _NOTHING_RING_SUBMISSION {
+
+    ULONG     Opcode;
+    ULONG     DataOffset;
+    ULONG     DataLength;
+    ULONG     Reserved;
+    ULONGLONG UserData;             // Handed back in the completion
+
+} NOTHING_RING_SUBMISSION, *PNOTHING_RING_SUBMISSION;
+
+typedef struct _NOTHING_RING_COMPLETION {
+
+    ULONGLONG UserData;
+    LONG      Status;               // NTSTATUS
+    ULONG     BytesTransferred;
+
+} NOTHING_RING_COMPLETION, *PNOTHING_RING_COMPLETION;
+
+typedef struct _NOTHING_RING_HEADER {
+
+    //
+    // Filled in by the app before IOCTL_OSR_NOTHING_RING_SETUP, and
+    // never changed after that.
+    //
+    ULONG Version;
+    ULONG SubmissionEntries;
+    ULONG CompletionEntries;
+    ULONG SubmissionOffset;
+    ULONG CompletionOffset;
+    ULONG DataOffset;
+    ULONG DataLength;
+    ULONG Reserved;
+
+    //
+    // The ring indices.  Each one is only ever written by one side,
+    // and each pair lives on its own cache line.
+    //
+    DECLSPEC_ALIGN(64) volatile ULONG SubmissionHead;   // Driver
+    volatile ULONG                    SubmissionTail;   // App
+
+    DECLSPEC_ALIGN(64) volatile ULONG CompletionHead;   // App
+    volatile ULONG                    CompletionTail;   // Driver
+
+} NOTHING_RING_HEADER, *PNOTHING_RING_HEADER;
+
+//
+// Private channels
+//
+// Two handles that send IOCTL_OSR_NOTHING_CHANNEL_PAIR with the same Key
+// get paired into a private channel: from then on, data written on one of
+// them can only be read on the other.  The first handle's IOCTL stays
+// pending until its peer shows up (so send it OVERLAPPED, or from another
+// thread).  Once one end of a channel is closed, I/O on the other end
+// fails with STATUS_PIPE_BROKEN.
+//
+// Handles that aren't paired keep sharing the device the way they always
+// have.
+//
+#define IOCTL_OSR_NOTHING_CHANNEL_PAIR CTL_CODE(FILE_DEVICE_NOTHING, 2054, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _NOTHING_CHANNEL_PAIR {
+
+    ULONGLONG Key;
+
+} NOTHING_CHANNEL_PAIR, *PNOTHING_CHANNEL_PAIR;
+
+//
+// Performance counters
+//
+// IOCTL_OSR_NOTHING_GET_STATS returns a NOTHING_STATS block.  The counters
+// all start at zero when the device is started.  Counters that don't apply
+// to a particular version of the driver (there's no ReadQueue in a driver
+// that stores its data, for example) are always zero.
+//
+// The block is versioned: check Version, and use Size to find out how much
+// of the block the driver actually filled in.  New fields only ever get
+// added at the end.
+//
+#define IOCTL_OSR_NOTHING_GET_STATS CTL_CODE(FILE_DEVICE_NOTHING, 2055, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define NOTHING_STATS_VERSION 1
+
+typedef struct _NOTHING_STATS {
+
+    ULONG     Version;
+    ULONG     Size;
+
+    ULONGLONG Reads;
+    ULONGLONG Writes;
+    ULONGLONG BytesRead;
+    ULONGLONG BytesWritten;
+
+    //
+    // How many reads and writes had to wait on the ReadQueue or WriteQueue,
+    // how many are waiting right now, and the most that were ever waiting
+    // at once
+    //
+    ULONGLONG ReadsParked;
+    ULONGLONG WritesParked;
+    ULONGLONG ReadQueueDepth;
+    ULONGLONG WriteQueueDepth;
+    ULONGLONG ReadQueueMaxDepth;
+    ULONGLONG WriteQueueMaxDepth;
+
+    //
+    // Writes (and, in a driver with queue limits, reads) failed with
+    // STATUS_DEVICE_BUSY because there was no room
+    //
+    ULONGLONG DeviceBusyRejections;
+
+    //
+    // Compression (only in a driver that stores its data, and only with
+    // the Compression value set in its hardware key).  UncompressedBytes
+    // went into the compressor and CompressedBytes is what we stored for
+    // them, so their ratio is the compression ratio.  DecompressedBytes
+    // is what we've handed back out.  The Ticks are time spent compressing
+    // and decompressing, in performance counter ticks (see Frequency).
+    //
+    ULONGLONG UncompressedBytes;
+    ULONGLONG CompressedBytes;
+    ULONGLONG CompressTicks;
+    ULONGLONG DecompressedBytes;
+    ULONGLONG DecompressTicks;
+    ULONGLONG Frequency;        // Ticks per second
+
+} NOTHING_STATS, *PNOTHING_STATS;
+
+//
+// Latency histograms
+//
+// The driver stamps each read and write when it arrives and again when
+// it's completed, and keeps four histograms of the results:
+//
+//   Wait      - How long a request sat parked on the ReadQueue or
+//               WriteQueue, from when it was first parked until it was
+//               completed.  Requests that never had to wait aren't counted.
+//
+//   Service   - How long the request was in the driver altogether, from
+//               arrival to completion.
+//
+// Values are in performance counter ticks (see Frequency).  The buckets
+// are log scaled, HDR style: values below 16 each get their own bucket,
+// and after that every power of two is split into 8 equal buckets, which
+// keeps every bucket within 12.5% of the values in it.  Bucket b covers
+// values from NOTHING_LATENCY_BUCKET_START(b) up to the start of bucket
+// b + 1.  The last bucket also holds everything too big for the others.
+//
+// The input buffer is optional.  If it's there and has
+// NOTHING_LATENCY_FLAG_RESET set, the driver zeroes the histograms after
+// copying them out.
+//
+#define IOCTL_OSR_NOTHING_GET_LATENCY CTL_CODE(FILE_DEVICE_NOTHING, 2056, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define NOTHING_LATENCY_VERSION 1
+
+#define NOTHING_LATENCY_FLAG_RESET 0x00000001
+
+#define NOTHING_LATENCY_READ_WAIT     0
+#define NOTHING_LATENCY_WRITE_WAIT    1
+#define NOTHING_LATENCY_READ_SERVICE  2
+#define NOTHING_LATENCY_WRITE_SERVICE 3
+#define NOTHING_LATENCY_HISTOGRAMS    4
+
+#define NOTHING_LATENCY_BUCKETS 304
+
+#define NOTHING_LATENCY_BUCKET_START(b) \
+    ((b) < 16 ? (ULONGLONG)(b) : ((ULONGLONG)(8 + (b) % 8) << ((b) / 8 - 1)))
+
+typedef struct _NOTHING_LATENCY_REQUEST {
+
+    ULONG Flags;
+
+} NOTHING_LATENCY_REQUEST, *PNOTHING_LATENCY_REQUEST;
+
+typedef struct _NOTHING_LATENCY {
+
+    ULONG     Version;
+    ULONG     Size;
+    ULONGLONG Frequency;        // Ticks per second
+
+    ULONGLONG Counts[NOTHING_LATENCY_HISTOGRAMS][NOTHING_LATENCY_BUCKETS];
+
+} NOTHING_LATENCY, *PNOTHING_LATENCY;
+
+//
+// Integrity checking
+//
+// IOCTL_OSR_NOTHING_SET_INTEGRITY turns integrity mode on or off for the
+// handle it's sent on.  In integrity mode, the driver computes the CRC32C
+// of the data for every ReadFile and WriteFile on that handle while it
+// copies the data, so the app doesn't need to make a second pass over the
+// buffer to checksum it.
+//
+// IOCTL_OSR_NOTHING_GET_INTEGRITY returns the CRCs and lengths for the last
+// read and the last write on the handle that completed, along with how many
+// of each have been checksummed.  The CRC covers the bytes actually
+// transferred, which may be fewer than the app asked for.  If the app has
+// more than one read (or write) outstanding on the handle at once, "last"
+// is whichever one completed last.
+//
+// The CRC is CRC32C (Castagnoli), starting from and finally inverted with
+// 0xFFFFFFFF, which is what the SSE4.2 crc32 instruction, iSCSI, and
+// osrcopy.h's OsrCrc32c all compute.
+//
+#define IOCTL_OSR_NOTHING_SET_INTEGRITY CTL_CODE(FILE_DEVICE_NOTHING, 2057, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_OSR_NOTHING_GET_INTEGRITY CTL_CODE(FILE_DEVICE_NOTHING, 2058, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _NOTHING_INTEGRITY_MODE {
+
+    ULONG Enable;               // Nonzero to turn integrity mode on
+
+} NOTHING_INTEGRITY_MODE, *PNOTHING_INTEGRITY_MODE;
+
+typedef struct _NOTHING_INTEGRITY {
+
+    ULONG     ReadCrc32c;
+    ULONG     ReadLength;
+    ULONG     WriteCrc32c;
+    ULONG     WriteLength;
+    ULONGLONG Reads;
+    ULONGLONG Writes;
+
+} NOTHING_INTEGRITY, *PNOTHING_INTEGRITY;
+
+//
+// Key/value cache
+//
+// Drivers with a key/value cache (the 3A solution, with a nonzero
+// KvCacheSize in its hardware key) keep records in nonpaged pool that apps
+// can store, look up and remove by key.  It's a cache, not a store: once
+// it's full, storing a new record evicts the ones that have been used
+// least recently.  Without a cache, these fail with
+// STATUS_INVALID_DEVICE_REQUEST.
+//
+// Keys are 1 to NOTHING_KV_MAX_KEY_LENGTH bytes and values are 0 to
+// NOTHING_KV_MAX_VALUE_LENGTH bytes, both binary.
+//
+// IOCTL_OSR_NOTHING_KV_PUT's input buffer is a NOTHING_KV_RECORD followed
+// by the key and then the value.  It replaces the value if the key is
+// already there.
+//
+// IOCTL_OSR_NOTHING_KV_GET's input buffer is a NOTHING_KV_RECORD (whose
+// ValueLength is ignored) followed by the key.  The output buffer gets a
+// NOTHING_KV_VALUE.  If the key isn't there, the request fails with
+// STATUS_NOT_FOUND.  If the value doesn't fit, it completes with
+// STATUS_BUFFER_OVERFLOW and returns just ValueLength, so the app knows
+// how big a buffer to try again with.
+//
+// IOCTL_OSR_NOTHING_KV_DELETE's input buffer is the same as for a GET.  It
+// fails with STATUS_NOT_FOUND if the key isn't there.
+//
+// IOCTL_OSR_NOTHING_KV_STATS returns a NOTHING_KV_STATS, versioned the same
+// way as NOTHING_STATS.  The Ticks are how long the cache took to do each
+// kind of operation, in performance counter ticks (see Frequency), not
+// counting the trip through the I/O manager.
+//
+#define IOCTL_OSR_NOTHING_KV_PUT    CTL_CODE(FILE_DEVICE_NOTHING, 2059, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_OSR_NOTHING_KV_GET    CTL_CODE(FILE_DEVICE_NOTHING, 2060, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_OSR_NOTHING_KV_DELETE CTL_CODE(FILE_DEVICE_NOTHING, 2061, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_OSR_NOTHING_KV_STATS  CTL_CODE(FILE_DEVICE_NOTHING, 2062, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define NOTHING_KV_MAX_KEY_LENGTH   256
+#define NOTHING_KV_MAX_VALUE_LENGTH (64 * 1024)
+
+#define NOTHING_KV_STATS_VERSION    1
+
+typedef struct _NOTHING_KV_RECORD {
+
+    ULONG KeyLength;
+    ULONG ValueLength;
+
+    //
+    // Followed by the key, then (for a PUT) the value
+    //
+
+} NOTHING_KV_RECORD, *PNOTHING_KV_RECORD;
+
+typedef struct _NOTHING_KV_VALUE {
+
+    ULONG ValueLength;
+    UCHAR Value[1];
+
+} NOTHING_KV_VALUE, *PNOTHING_KV_VALUE;
+
+typedef struct _NOTHING_KV_STATS {
+
+    ULONG     Version;
+    ULONG     Size;
+
+    //
+    // What's in the cache now, and the most it can hold
+    //
+    ULONGLONG Entries;
+    ULONGLONG MaxEntries;
+    ULONGLONG BytesUsed;
+    ULONGLONG ByteLimit;
+
+    ULONGLONG Gets;
+    ULONGLONG Hits;
+    ULONGLONG Puts;
+    ULONGLONG Deletes;
+    ULONGLONG Evictions;
+
+    //
+    // Total and longest time for each kind of operation
+    //
+    ULONGLONG GetTicks;
+    ULONGLONG GetMaxTicks;
+    ULONGLONG PutTicks;
+    ULONGLONG PutMaxTicks;
+    ULONGLONG DeleteTicks;
+    ULONGLONG DeleteMaxTicks;
+    ULONGLONG Frequency;        // Ticks per second
+
+} NOTHING_KV_STATS, *PNOTHING_KV_STATS;
+
+//
+// Flow control
+//
+// In a driver with queue limits (the 6a solution), each Queue that reads
+// and writes wait on has a limit on how many Requests can wait there, and
+// on how many bytes of buffer they can have between them.  A read or write
+// that would have to wait when its Queue is at either limit fails straight
+// away with STATUS_DEVICE_BUSY instead.  One Request can always wait on an
+// empty Queue, however big it is.  A streaming write that already handed
+// some of its data to readers completes as a short write instead.
+//
+// IOCTL_OSR_NOTHING_GET_CREDITS tells the app how much room is left on the
+// Queues that the handle it's sent on uses: the device's own, or the
+// handle's channel's (see IOCTL_OSR_NOTHING_CHANNEL_PAIR).  A producer can
+// use this to pace itself instead of finding out it's too far ahead by
+// having writes fail.  The credits are a snapshot, and other handles can
+// use them up too.  A write that finds a read waiting never waits, so it
+// doesn't need a credit at all.
+//
+// A limit of zero means there isn't one, and the credits that go with it
+// are all ones.
+//
+#define IOCTL_OSR_NOTHING_GET_CREDITS CTL_CODE(FILE_DEVICE_NOTHING, 2063, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _NOTHING_CREDITS {
+
+    ULONG     MaxQueueDepth;
+    ULONG     Reserved;
+    ULONGLONG MaxQueueBytes;
+
+    //
+    // How many more writes (reads) can wait, and how many more bytes
+    //
+    ULONG     WriteCredits;
+    ULONG     ReadCredits;
+    ULONGLONG WriteByteCredits;
+    ULONGLONG ReadByteCredits;
+
+} NOTHING_CREDITS, *PNOTHING_CREDITS;
+
+//
+// Readiness polling
+//
+// In a driver with polling (the 6a solution), IOCTL_OSR_NOTHING_POLL lets
+// one thread wait until any of several Nothing handles is ready, without
+// parking a read or write on any of them.  A handle is readable when a
+// ReadFile on it would find a write waiting, and writable when a WriteFile
+// on it would find a read waiting.  A paired handle whose peer has closed
+// its end is always reported as NOTHING_POLL_HANGUP.
+//
+// The buffer (in and out, since this is METHOD_BUFFERED) is a NOTHING_POLL
+// header followed by EntryCount NOTHING_POLL_ENTRYs.  Each entry gives a
+// handle, in the calling process, to a Nothing device instance (any
+// instance, not just the one the IOCTL is sent to) and the events it's
+// interested in.  A Handle of zero means the handle the IOCTL is sent on.
+// The IOCTL completes as soon as at least one entry is ready, with every
+// entry's ReadyEvents filled in, or straight away if the caller set
+// NOTHING_POLL_FLAG_NO_WAIT.  To stop waiting, cancel the IOCTL.
+//
+// Readiness is a hint.  Another handle can get to the waiting Request
+// first, so a ReadFile on a handle that polled readable can still wait.
+// The one-writer rule for unpaired handles isn't taken into account.
+//
+#define IOCTL_OSR_NOTHING_POLL CTL_CODE(FILE_DEVICE_NOTHING, 2064, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NOTHING_POLL_READABLE     0x00000001
+#define NOTHING_POLL_WRITABLE     0x00000002
+#define NOTHING_POLL_HANGUP       0x00000004
+
+#define NOTHING_POLL_FLAG_NO_WAIT 0x00000001
+
+#define NOTHING_POLL_MAX_ENTRIES  64
+
+typedef struct _NOTHING_POLL_ENTRY {
+
+    ULONGLONG Handle;       // A HANDLE, widened so 32-bit apps match
+    ULONG     Events;       // NOTHING_POLL_READABLE and/or _WRITABLE
+    ULONG     ReadyEvents;  // Filled in by the driver
+
+} NOTHING_POLL_ENTRY, *PNOTHING_POLL_ENTRY;
+
+typedef struct _NOTHING_POLL {
+
+    ULONG              EntryCount;
+    ULONG              Flags;
+    NOTHING_POLL_ENTRY Entries[1];
+
+} NOTHING_POLL, *PNOTHING_POLL;
+
+#define NOTHING_POLL_SIZE(EntryCount) \
+    (FIELD_OFFSET(NOTHING_POLL, Entries) + (EntryCount) * sizeof(NOTHING_POLL_ENTRY))
+
+//
+// Trace control
+//
+// Drivers that keep an OSR trace ring (see osrtrace_format.h) let apps set
+// the trace level and dump the ring with these.
+//
+#define IOCTL_OSR_NOTHING_TRACE_LEVEL OSR_TRACE_IOCTL_LEVEL(FILE_DEVICE_NOTHING)
+#define IOCTL_OSR_NOTHING_TRACE_DUMP  OSR_TRACE_IOCTL_DUMP(FILE_DEVICE_NOTHING)
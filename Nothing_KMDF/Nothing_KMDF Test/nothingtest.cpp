@@ -9,13 +9,147 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <cstdio>
+#include <cstdlib>
 #include <Windows.h>
 #include <cfgmgr32.h>
 #include <nothing_ioctl.h>
+#include <osrcopy.h>
 
 HANDLE
 OpenNothingDeviceViaInterface(
-    VOID);
+    ULONG Instance,
+    DWORD FlagsAndAttributes);
+
+HANDLE
+OpenNothingDeviceInstance(
+    BOOL  ViaInterface,
+    ULONG Instance,
+    DWORD FlagsAndAttributes = 0);
+
+HANDLE
+OpenNothingDevice(
+    BOOL  ViaInterface,
+    DWORD FlagsAndAttributes = 0);
+
+ULONG
+CountNothingDevices(
+    BOOL ViaInterface);
+
+VOID
+RunThroughputBenchmark(
+    BOOL ViaInterface);
+
+VOID
+RunMessageSizeBenchmark(
+    HANDLE WriterHandle,
+    BOOL   ViaInterface);
+
+VOID
+SendBatch(
+    HANDLE DeviceHandle,
+    BOOL   IsWrite);
+
+VOID
+RunRingBenchmark(
+    BOOL ViaInterface);
+
+VOID
+RunChannelBenchmark(
+    BOOL ViaInterface);
+
+VOID
+RunOpenCloseBenchmark(
+    BOOL ViaInterface);
+
+HANDLE
+RunWriterHandoffBenchmark(
+    HANDLE DeviceHandle,
+    BOOL   ViaInterface);
+
+VOID
+PrintStats(
+    HANDLE DeviceHandle);
+
+VOID
+PrintLatency(
+    HANDLE DeviceHandle,
+    BOOL   Reset);
+
+VOID
+PrintCredits(
+    HANDLE DeviceHandle);
+
+VOID
+PollDevices(
+    BOOL ViaInterface);
+
+BOOL
+SetIntegrity(
+    HANDLE DeviceHandle,
+    BOOL   Enable);
+
+VOID
+CheckIntegrity(
+    HANDLE       DeviceHandle,
+    const UCHAR *Buffer,
+    DWORD        Length,
+    BOOL         IsWrite);
+
+VOID
+RunCompressionBenchmark(
+    HANDLE DeviceHandle);
+
+//
+// How many messages we send in a batch, and how big each one is
+//
+#define BATCH_RECORD_COUNT 16
+#define BATCH_MESSAGE_SIZE 256
+
+//
+// How long each pass of the throughput benchmark runs, and how big
+// the transfers are
+//
+#define BENCHMARK_SECONDS       5
+#define BENCHMARK_TRANSFER_SIZE 512
+
+//
+// How much data the message size benchmark moves for each message size
+//
+#define BENCHMARK_BYTES_PER_SIZE (256 * 1024 * 1024)
+
+//
+// How long we wait for a poll before giving up on it
+//
+#define POLL_WAIT_SECONDS 10
+
+//
+// Shape of the shared ring we set up for the ring benchmark.  Each
+// submission we post is a write or a read of BENCHMARK_TRANSFER_SIZE bytes
+// with its own slot in the data area.
+//
+#define RING_ENTRIES 256
+#define RING_BATCH   64
+
+//
+// How many threads hammer writes in the writer handoff benchmark, and how
+// many writes each one tries before closing and reopening its handle
+//
+#define HANDOFF_THREADS         16
+#define HANDOFF_WRITES_PER_OPEN 256
+
+//
+// Size of the WRITEs we send from the menu, unless "-s <bytes>" says
+// otherwise.  The driver's limit comes from MaxMessageSize in its INF.
+//
+#define DEFAULT_WRITE_SIZE      4096
+
+#define COMPRESS_MESSAGE_SIZE   (64 * 1024)
+#define COMPRESS_ROUNDS         4
+
+//
+// Which Nothing device we use, if there's more than one (see -d)
+//
+static ULONG DeviceInstance = 0;
 
 //
 // Simple test application to demonstrate the Nothing driver
@@ -28,54 +162,101 @@ main(ULONG  argc,
 {
     HANDLE deviceHandle;
     DWORD  code;
-    UCHAR  writeBuffer[4096];
-    UCHAR  readBuffer[9096];
+    PUCHAR writeBuffer;
+    PUCHAR readBuffer;
+    DWORD  writeSize = DEFAULT_WRITE_SIZE;
+    DWORD  readSize;
     DWORD  bytesRead;
     DWORD  index;
     DWORD  function;
-
-    UNREFERENCED_PARAMETER(argv);
+    BOOL   viaInterface = TRUE;
+    BOOL   integrity    = FALSE;
 
     //
-    // Init the write and read buffers with known data
+    // "-s <bytes>" sets the size of our WRITEs.  "-d <n>" picks which
+    // device to use when there's more than one.  "-n" means the user wants
+    // to open the device via its name (\\.\NothingN) instead of via the
+    // interface.  We're lazy, anything else is ignored.
     //
-    memset(readBuffer,
-           0xAA,
-           sizeof(readBuffer));
+    for (index = 1; index < argc; index++) {
 
-    memset(writeBuffer,
-           0xEE,
-           sizeof(writeBuffer));
+        if (_stricmp(argv[index], "-s") == 0 && index + 1 < argc) {
+
+            writeSize = strtoul(argv[++index],
+                                nullptr,
+                                0);
+            continue;
+        }
+
+        if (_stricmp(argv[index], "-d") == 0 && index + 1 < argc) {
+
+            DeviceInstance = strtoul(argv[++index],
+                                     nullptr,
+                                     0);
+            continue;
+        }
+
+        if (_stricmp(argv[index], "-n") == 0) {
+
+            viaInterface = FALSE;
+        }
+    }
+
+    if (writeSize < 32) {
+
+        printf("Write size must be at least 32 bytes\n");
+
+        return (ERROR_INVALID_PARAMETER);
+    }
+
+    if (viaInterface) {
+
+        printf("Opening Nothing device %lu of %lu via its Device Interface. "
+               "Specify -n to open via name\n\n",
+               DeviceInstance,
+               CountNothingDevices(TRUE));
+    } else {
+
+        printf("Opening Nothing device via its name, \\\\.\\Nothing%lu\n\n",
+               DeviceInstance);
+    }
 
     //
-    // Check to see if the user wants to open the device via the
-    // interface
+    // Reads get a buffer twice as big, so one read can pick up more than
+    // one write's worth of data
     //
-    if (argc == 2) {
+    readSize = (writeSize <= MAXDWORD / 2) ? writeSize * 2 : MAXDWORD;
 
-        //
-        // An argument specified (we're lazy, we don't care what it is)
-        // try to open via the interface
-        //
-        deviceHandle = OpenNothingDeviceViaInterface();
+    writeBuffer = (PUCHAR)malloc(writeSize);
+    readBuffer  = (PUCHAR)malloc(readSize);
 
-    } else {
+    if (writeBuffer == nullptr || readBuffer == nullptr) {
 
-        printf("Opening Nothing device via its name. Specify -i to open via "
-               "Device Interface\n\n");
+        printf("Couldn't allocate %lu byte write and %lu byte read "
+               "buffers\n",
+               writeSize,
+               readSize);
 
-        //
-        // Open the nothing device by name
-        //
-        deviceHandle = CreateFile(L"\\\\.\\NOTHING",
-                                  GENERIC_READ | GENERIC_WRITE,
-                                  0,
-                                  nullptr,
-                                  OPEN_EXISTING,
-                                  0,
-                                  nullptr);
+        return (ERROR_NOT_ENOUGH_MEMORY);
     }
 
+    printf("Using %lu byte WRITEs and %lu byte READs\n",
+           writeSize,
+           readSize);
+
+    //
+    // Init the write and read buffers with known data
+    //
+    memset(readBuffer,
+           0xAA,
+           readSize);
+
+    memset(writeBuffer,
+           0xEE,
+           writeSize);
+
+    deviceHandle = OpenNothingDevice(viaInterface);
+
     //
     // If this call fails, check to figure out what the error is and report it.
     //
@@ -101,11 +282,27 @@ main(ULONG  argc,
         printf("\t3. Print READ buffer\n");
         printf("\t4. Print WRITE buffer\n");
         printf("\t5. Send NOTHING IOCTL\n");
+        printf("\t6. Run throughput benchmark\n");
+        printf("\t7. Run message size benchmark\n");
+        printf("\t8. Send a batch of WRITEs\n");
+        printf("\t9. Send a batch of READs\n");
+        printf("\t10. Run shared ring benchmark\n");
+        printf("\t11. Run channel benchmark\n");
+        printf("\t12. Run open/close benchmark\n");
+        printf("\t13. Run writer handoff benchmark\n");
+        printf("\t14. Print device statistics\n");
+        printf("\t15. Print latency percentiles\n");
+        printf("\t16. Print and reset latency percentiles\n");
+        printf("\t17. Turn integrity checking %s\n",
+               integrity ? "OFF" : "ON");
+        printf("\t18. Run compression benchmark\n");
+        printf("\t19. Print flow control credits\n");
+        printf("\t20. Poll every Nothing device for readiness\n");
         printf("\n\t0. Exit\n");
         printf("\n\tSelection: ");
 
 #pragma warning(suppress: 6031)
-        scanf("%lx",
+        scanf("%lu",
               &function);   // NOLINT(cert-err34-c)
 
         switch (function) {
@@ -116,7 +313,7 @@ main(ULONG  argc,
                 //
                 if (!ReadFile(deviceHandle,
                               readBuffer,
-                              sizeof(readBuffer),
+                              readSize,
                               &bytesRead,
                               nullptr)) {
 
@@ -131,6 +328,14 @@ main(ULONG  argc,
                 printf("Read Success! Bytes Read = %lu.\n",
                        bytesRead);
 
+                if (integrity) {
+
+                    CheckIntegrity(deviceHandle,
+                                   readBuffer,
+                                   bytesRead,
+                                   FALSE);
+                }
+
                 break;
 
             case 2:
@@ -139,7 +344,7 @@ main(ULONG  argc,
                 //
                 if (!WriteFile(deviceHandle,
                                writeBuffer,
-                               sizeof(writeBuffer),
+                               writeSize,
                                &bytesRead,
                                nullptr)) {
 
@@ -154,6 +359,14 @@ main(ULONG  argc,
                 printf("Write Success! Bytes Written = %lu.\n",
                        bytesRead);
 
+                if (integrity) {
+
+                    CheckIntegrity(deviceHandle,
+                                   writeBuffer,
+                                   bytesRead,
+                                   TRUE);
+                }
+
                 break;
 
             case 3:
@@ -210,11 +423,148 @@ main(ULONG  argc,
 
                 break;
 
+            case 6:
+                //
+                // Measure how throughput scales with the number of threads
+                //
+                RunThroughputBenchmark(viaInterface);
+
+                break;
+
+            case 7:
+                //
+                // Measure read/write pairing throughput across message
+                // sizes. We're the writer, a second handle is the reader.
+                //
+                RunMessageSizeBenchmark(deviceHandle,
+                                        viaInterface);
+
+                break;
+
+            case 8:
+            case 9:
+                //
+                // Test the batch IOCTLs
+                //
+                SendBatch(deviceHandle,
+                          function == 8);
+
+                break;
+
+            case 10:
+                //
+                // Compare the shared ring against ReadFile/WriteFile
+                //
+                RunRingBenchmark(viaInterface);
+
+                break;
+
+            case 11:
+                //
+                // Measure how throughput scales with private channels
+                //
+                RunChannelBenchmark(viaInterface);
+
+                break;
+
+            case 12:
+                //
+                // Measure open and close rates with lots of handles open
+                //
+                RunOpenCloseBenchmark(viaInterface);
+
+                break;
+
+            case 13:
+                //
+                // Hammer writes while the writer keeps changing.  This
+                // needs our handle closed, so we get a new one back.
+                //
+                deviceHandle = RunWriterHandoffBenchmark(deviceHandle,
+                                                         viaInterface);
+
+                if (deviceHandle == INVALID_HANDLE_VALUE) {
+
+                    code = GetLastError();
+
+                    printf("CreateFile failed with error 0x%lx\n",
+                           code);
+
+                    return (code);
+                }
+
+                break;
+
+            case 14:
+                //
+                // Get the driver's performance counters
+                //
+                PrintStats(deviceHandle);
+
+                break;
+
+            case 15:
+            case 16:
+                //
+                // Get the driver's latency histograms, and optionally
+                // start them over
+                //
+                PrintLatency(deviceHandle,
+                             function == 16);
+
+                break;
+
+            case 17:
+                //
+                // Have the driver checksum our READs and WRITEs, and check
+                // its answers against our own
+                //
+                if (SetIntegrity(deviceHandle,
+                                 !integrity)) {
+
+                    integrity = !integrity;
+
+                    printf("Integrity checking is %s\n",
+                           integrity ? "ON" : "OFF");
+                }
+
+                break;
+
+            case 18:
+                //
+                // See how well the driver's compression does, and what it
+                // costs, on data that compresses and data that doesn't
+                //
+                RunCompressionBenchmark(deviceHandle);
+
+                break;
+
+            case 19:
+                //
+                // See how many more READs and WRITEs can wait in the
+                // driver before it starts failing them
+                //
+                PrintCredits(deviceHandle);
+
+                break;
+
+            case 20:
+                //
+                // Wait for any of the devices to have a READ or WRITE
+                // waiting, with one thread and one IOCTL
+                //
+                PollDevices(viaInterface);
+
+                break;
+
             case 0:
 
                 //
                 // zero is get out!
                 //
+                free(readBuffer);
+                free(writeBuffer);
+
                 return (0);
 
             default:
@@ -225,41 +575,122 @@ main(ULONG  argc,
 }
 
 
-HANDLE
-OpenNothingDeviceViaInterface()
+//
+// Get the list of Nothing device interfaces that are present, as a
+// MULTI_SZ.  Free it with free().
+//
+static PWSTR
+GetNothingInterfaceList()
 {
     CONFIGRET configReturn;
-    DWORD     lasterror;
-    WCHAR     deviceName[MAX_DEVICE_ID_LEN];
-    HANDLE    handleToReturn = INVALID_HANDLE_VALUE;
+    ULONG     listLength;
+    PWSTR     list = nullptr;
 
     //
-    // Get the device interface -- we only expose one
+    // Devices can come and go between getting the size and getting the
+    // list, in which case we just try again
     //
-    deviceName[0] = UNICODE_NULL;
+    do {
 
-    configReturn = CM_Get_Device_Interface_List((LPGUID)&GUID_DEVINTERFACE_NOTHING,
-                                                nullptr,
-                                                deviceName,
-                                                _countof(deviceName),
-                                                CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
-    if (configReturn != CR_SUCCESS) {
+        free(list);
+        list = nullptr;
 
-        lasterror = GetLastError();
+        configReturn = CM_Get_Device_Interface_List_Size(&listLength,
+                                                         (LPGUID)&GUID_DEVINTERFACE_NOTHING,
+                                                         nullptr,
+                                                         CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+        if (configReturn != CR_SUCCESS) {
+            break;
+        }
+
+        list = (PWSTR)malloc(listLength * sizeof(WCHAR));
+
+        if (list == nullptr) {
+            break;
+        }
+
+        configReturn = CM_Get_Device_Interface_List((LPGUID)&GUID_DEVINTERFACE_NOTHING,
+                                                    nullptr,
+                                                    list,
+                                                    listLength,
+                                                    CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+
+    } while (configReturn == CR_BUFFER_SMALL);
+
+    if (configReturn != CR_SUCCESS) {
 
         printf("CM_Get_Device_Interface_List fail: %lx\n",
-               lasterror);
+               configReturn);
+
+        free(list);
+        return nullptr;
+    }
+
+    return list;
+}
+
+//
+// How many Nothing devices we can spread work across.  By name we only
+// ever use the one we were told to.
+//
+ULONG
+CountNothingDevices(BOOL ViaInterface)
+{
+    PWSTR list;
+    ULONG count = 0;
 
+    if (!ViaInterface) {
+        return 1;
+    }
+
+    list = GetNothingInterfaceList();
+
+    if (list == nullptr) {
+        return 1;
+    }
+
+    for (PWSTR name = list; *name != UNICODE_NULL; name += wcslen(name) + 1) {
+        count++;
+    }
+
+    free(list);
+
+    return max(count, 1);
+}
+
+HANDLE
+OpenNothingDeviceViaInterface(ULONG Instance,
+                              DWORD FlagsAndAttributes)
+{
+    DWORD  lasterror;
+    PWSTR  list;
+    PWSTR  deviceName;
+    HANDLE handleToReturn = INVALID_HANDLE_VALUE;
+
+    //
+    // Get the device interfaces -- one per device -- and pick the one
+    // we were asked for
+    //
+    list = GetNothingInterfaceList();
+
+    if (list == nullptr) {
         goto Exit;
     }
 
+    deviceName = list;
+
+    while (*deviceName != UNICODE_NULL && Instance-- != 0) {
+        deviceName += wcslen(deviceName) + 1;
+    }
+
     //
     // Make sure there's an actual name there
     //
-    if (deviceName[0] == UNICODE_NULL) {
+    if (*deviceName == UNICODE_NULL) {
         lasterror = ERROR_NOT_FOUND;
         printf("CreateFile fail: %lx\n",
                lasterror);
+        SetLastError(lasterror);
         goto Exit;
     }
 
@@ -271,7 +702,7 @@ OpenNothingDeviceViaInterface()
                                 0,
                                 nullptr,
                                 OPEN_EXISTING,
-                                0,
+                                FlagsAndAttributes,
                                 nullptr);
 
     if (handleToReturn == INVALID_HANDLE_VALUE) {
@@ -282,8 +713,1879 @@ OpenNothingDeviceViaInterface()
 
 Exit:
 
+    free(list);
+
     //
     // Return a handle to the device
     //
     return handleToReturn;
 }
+
+HANDLE
+OpenNothingDeviceInstance(BOOL  ViaInterface,
+                          ULONG Instance,
+                          DWORD FlagsAndAttributes)
+{
+    WCHAR deviceName[32];
+
+    if (ViaInterface) {
+
+        return OpenNothingDeviceViaInterface(Instance,
+                                             FlagsAndAttributes);
+    }
+
+    //
+    // Open the nothing device by name.  Each instance has its own:
+    // \\.\Nothing0, \\.\Nothing1, and so on.
+    //
+    swprintf_s(deviceName,
+               _countof(deviceName),
+               L"\\\\.\\Nothing%lu",
+               Instance);
+
+    return CreateFile(deviceName,
+                      GENERIC_READ | GENERIC_WRITE,
+                      0,
+                      nullptr,
+                      OPEN_EXISTING,
+                      FlagsAndAttributes,
+                      nullptr);
+}
+
+HANDLE
+OpenNothingDevice(BOOL  ViaInterface,
+                  DWORD FlagsAndAttributes)
+{
+    return OpenNothingDeviceInstance(ViaInterface,
+                                     DeviceInstance,
+                                     FlagsAndAttributes);
+}
+
+//
+// Per-thread state for the throughput benchmark
+//
+typedef struct _BENCHMARK_THREAD {
+
+    HANDLE         DeviceHandle;
+    volatile LONG* Stop;
+    ULONGLONG      Operations;
+
+} BENCHMARK_THREAD, *PBENCHMARK_THREAD;
+
+DWORD
+WINAPI
+BenchmarkThread(LPVOID Context)
+{
+    PBENCHMARK_THREAD thread = (PBENCHMARK_THREAD)Context;
+    UCHAR             buffer[BENCHMARK_TRANSFER_SIZE];
+    DWORD             bytesTransferred;
+
+    memset(buffer,
+           0xEE,
+           sizeof(buffer));
+
+    //
+    // Write then read back, over and over, until we're told to stop. We
+    // only count the operations that worked (a write can fail with
+    // ERROR_BUSY if the device is full).
+    //
+    while (*thread->Stop == 0) {
+
+        if (WriteFile(thread->DeviceHandle,
+                      buffer,
+                      sizeof(buffer),
+                      &bytesTransferred,
+                      nullptr)) {
+
+            thread->Operations++;
+        }
+
+        if (ReadFile(thread->DeviceHandle,
+                     buffer,
+                     sizeof(buffer),
+                     &bytesTransferred,
+                     nullptr)) {
+
+            thread->Operations++;
+        }
+    }
+
+    return 0;
+}
+
+VOID
+RunThroughputBenchmark(BOOL ViaInterface)
+{
+    static const ULONG threadCounts[] = {1, 2, 4, 8, 16};
+    BENCHMARK_THREAD   threads[16];
+    HANDLE             threadHandles[16];
+    volatile LONG      stop;
+    ULONGLONG          totalOperations;
+    ULONG              count;
+    ULONG              index;
+    ULONG              devices;
+
+    //
+    // If there's more than one device, the threads are spread across them
+    // so that they don't all queue up behind one
+    //
+    devices = CountNothingDevices(ViaInterface);
+
+    printf("Throughput benchmark: %u byte write/read pairs, %u seconds per "
+           "pass, %lu device(s)\n",
+           BENCHMARK_TRANSFER_SIZE,
+           BENCHMARK_SECONDS,
+           devices);
+
+    for (ULONG pass = 0; pass < _countof(threadCounts); pass++) {
+
+        count = threadCounts[pass];
+        stop  = 0;
+
+        //
+        // Every thread gets its own handle. Our handles are opened for
+        // synchronous I/O, so the I/O Manager would serialize any
+        // threads that shared one.
+        //
+        for (index = 0; index < count; index++) {
+
+            threads[index].Stop         = &stop;
+            threads[index].Operations   = 0;
+            threads[index].DeviceHandle =
+                       OpenNothingDeviceInstance(ViaInterface,
+                                                 (DeviceInstance + index) %
+                                                                  devices);
+
+            if (threads[index].DeviceHandle == INVALID_HANDLE_VALUE) {
+
+                printf("CreateFile failed with error 0x%lx\n",
+                       GetLastError());
+
+                while (index-- > 0) {
+                    CloseHandle(threads[index].DeviceHandle);
+                }
+
+                return;
+            }
+        }
+
+        for (index = 0; index < count; index++) {
+
+            threadHandles[index] = CreateThread(nullptr,
+                                                0,
+                                                BenchmarkThread,
+                                                &threads[index],
+                                                0,
+                                                nullptr);
+        }
+
+        Sleep(BENCHMARK_SECONDS * 1000);
+
+        InterlockedExchange(&stop,
+                            1);
+
+        WaitForMultipleObjects(count,
+                               threadHandles,
+                               TRUE,
+                               INFINITE);
+
+        totalOperations = 0;
+
+        for (index = 0; index < count; index++) {
+
+            totalOperations += threads[index].Operations;
+
+            CloseHandle(threadHandles[index]);
+            CloseHandle(threads[index].DeviceHandle);
+        }
+
+        printf("\t%2lu thread(s): %10llu ops/sec\n",
+               count,
+               totalOperations / BENCHMARK_SECONDS);
+    }
+}
+
+//
+// State shared with the reader thread of the message size benchmark
+//
+typedef struct _MESSAGE_BENCHMARK {
+
+    HANDLE ReaderHandle;
+    PUCHAR Buffer;
+    DWORD  MessageSize;
+    ULONG  Messages;
+    BOOL   Failed;
+
+} MESSAGE_BENCHMARK, *PMESSAGE_BENCHMARK;
+
+DWORD
+WINAPI
+MessageBenchmarkReader(LPVOID Context)
+{
+    PMESSAGE_BENCHMARK benchmark = (PMESSAGE_BENCHMARK)Context;
+    DWORD              bytesRead;
+
+    for (ULONG index = 0; index < benchmark->Messages; index++) {
+
+        if (!ReadFile(benchmark->ReaderHandle,
+                      benchmark->Buffer,
+                      benchmark->MessageSize,
+                      &bytesRead,
+                      nullptr)) {
+
+            printf("ReadFile failed with error 0x%lx\n",
+                   GetLastError());
+
+            benchmark->Failed = TRUE;
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+VOID
+RunMessageSizeBenchmark(HANDLE WriterHandle,
+                        BOOL   ViaInterface)
+{
+    MESSAGE_BENCHMARK benchmark;
+    PUCHAR            writeBuffer;
+    HANDLE            readerThread;
+    DWORD             bytesWritten;
+    LARGE_INTEGER     frequency;
+    LARGE_INTEGER     start;
+    LARGE_INTEGER     end;
+    double            seconds;
+
+    //
+    // Our reader needs its own handle, so it's not the allowed writer.
+    //
+    benchmark.ReaderHandle = OpenNothingDevice(ViaInterface);
+
+    if (benchmark.ReaderHandle == INVALID_HANDLE_VALUE) {
+
+        printf("CreateFile failed with error 0x%lx\n",
+               GetLastError());
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    printf("Message size benchmark: %u MB per message size\n",
+           BENCHMARK_BYTES_PER_SIZE / (1024 * 1024));
+
+    for (DWORD size = 4 * 1024; size <= 16 * 1024 * 1024; size *= 4) {
+
+        writeBuffer      = (PUCHAR)malloc(size);
+        benchmark.Buffer = (PUCHAR)malloc(size);
+
+        if (writeBuffer == nullptr || benchmark.Buffer == nullptr) {
+
+            printf("Out of memory\n");
+
+            free(writeBuffer);
+            free(benchmark.Buffer);
+            break;
+        }
+
+        memset(writeBuffer,
+               0xEE,
+               size);
+
+        benchmark.MessageSize = size;
+        benchmark.Messages    = max(BENCHMARK_BYTES_PER_SIZE / size, 16);
+        benchmark.Failed      = FALSE;
+
+        QueryPerformanceCounter(&start);
+
+        readerThread = CreateThread(nullptr,
+                                    0,
+                                    MessageBenchmarkReader,
+                                    &benchmark,
+                                    0,
+                                    nullptr);
+
+        for (ULONG index = 0; index < benchmark.Messages; index++) {
+
+            if (!WriteFile(WriterHandle,
+                           writeBuffer,
+                           size,
+                           &bytesWritten,
+                           nullptr)) {
+
+                printf("WriteFile failed with error 0x%lx\n",
+                       GetLastError());
+
+                benchmark.Failed = TRUE;
+
+                break;
+            }
+        }
+
+        //
+        // If the writes failed the reader is stuck waiting for data that
+        // isn't coming, so cancel its read.
+        //
+        if (benchmark.Failed) {
+
+            CancelIoEx(benchmark.ReaderHandle,
+                       nullptr);
+        }
+
+        WaitForSingleObject(readerThread,
+                            INFINITE);
+
+        QueryPerformanceCounter(&end);
+
+        CloseHandle(readerThread);
+        free(writeBuffer);
+        free(benchmark.Buffer);
+
+        if (benchmark.Failed) {
+            break;
+        }
+
+        seconds = (double)(end.QuadPart - start.QuadPart) /
+                                                  (double)frequency.QuadPart;
+
+        printf("\t%8lu bytes: %10.1f MB/sec\n",
+               size,
+               ((double)size * benchmark.Messages) / (1024.0 * 1024.0) / seconds);
+    }
+
+    CloseHandle(benchmark.ReaderHandle);
+}
+
+VOID
+SendBatch(HANDLE DeviceHandle,
+          BOOL   IsWrite)
+{
+    PNOTHING_BATCH        batch;
+    PNOTHING_BATCH_RESULT results;
+    PUCHAR                outBuffer;
+    DWORD                 batchLength;
+    DWORD                 outLength;
+    DWORD                 dataOffset;
+    DWORD                 recordsProcessed;
+
+    batchLength = FIELD_OFFSET(NOTHING_BATCH, Records) +
+                       BATCH_RECORD_COUNT * sizeof(NOTHING_BATCH_RECORD);
+
+    //
+    // The output buffer has our results first, then the message data
+    //
+    dataOffset = BATCH_RECORD_COUNT * sizeof(NOTHING_BATCH_RESULT);
+    outLength  = dataOffset + BATCH_RECORD_COUNT * BATCH_MESSAGE_SIZE;
+
+    batch     = (PNOTHING_BATCH)malloc(batchLength);
+    outBuffer = (PUCHAR)malloc(outLength);
+
+    if (batch == nullptr || outBuffer == nullptr) {
+
+        printf("Out of memory\n");
+
+        free(batch);
+        free(outBuffer);
+        return;
+    }
+
+    batch->RecordCount = BATCH_RECORD_COUNT;
+
+    for (ULONG index = 0; index < BATCH_RECORD_COUNT; index++) {
+
+        batch->Records[index].DataOffset = dataOffset +
+                                               index * BATCH_MESSAGE_SIZE;
+        batch->Records[index].DataLength = BATCH_MESSAGE_SIZE;
+
+        //
+        // Give each message we write a different fill pattern
+        //
+        memset(outBuffer + batch->Records[index].DataOffset,
+               IsWrite ? (UCHAR)index : 0xAA,
+               BATCH_MESSAGE_SIZE);
+    }
+
+    if (!DeviceIoControl(DeviceHandle,
+                         IsWrite ? (DWORD)IOCTL_OSR_NOTHING_BATCH_WRITE :
+                                   (DWORD)IOCTL_OSR_NOTHING_BATCH_READ,
+                         batch,
+                         batchLength,
+                         outBuffer,
+                         outLength,
+                         &recordsProcessed,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+
+    } else {
+
+        results = (PNOTHING_BATCH_RESULT)outBuffer;
+
+        printf("Batch Success! Records processed = %lu.\n",
+               recordsProcessed);
+
+        for (ULONG index = 0; index < recordsProcessed; index++) {
+
+            printf("\tRecord %2lu: Status 0x%08lx, Bytes = %lu, First byte = 0x%x\n",
+                   index,
+                   results[index].Status,
+                   results[index].BytesTransferred,
+                   outBuffer[batch->Records[index].DataOffset]);
+        }
+    }
+
+    free(batch);
+    free(outBuffer);
+}
+
+//
+// Send a request on our overlapped ring handle and wait for it to finish
+//
+BOOL
+RingDeviceIoControl(HANDLE DeviceHandle,
+                    DWORD  IoControlCode,
+                    PVOID  OutBuffer,
+                    DWORD  OutLength,
+                    PDWORD BytesReturned)
+{
+    OVERLAPPED overlapped = {};
+    BOOL       result;
+
+    overlapped.hEvent = CreateEvent(nullptr,
+                                    TRUE,
+                                    FALSE,
+                                    nullptr);
+
+    result = DeviceIoControl(DeviceHandle,
+                             IoControlCode,
+                             nullptr,
+                             0,
+                             OutBuffer,
+                             OutLength,
+                             BytesReturned,
+                             &overlapped);
+
+    if (!result && GetLastError() == ERROR_IO_PENDING) {
+
+        result = GetOverlappedResult(DeviceHandle,
+                                     &overlapped,
+                                     BytesReturned,
+                                     TRUE);
+    }
+
+    CloseHandle(overlapped.hEvent);
+
+    return result;
+}
+
+VOID
+RunRingBenchmark(BOOL ViaInterface)
+{
+    HANDLE                   ringHandle;
+    HANDLE                   plainHandle;
+    OVERLAPPED               setupOverlapped = {};
+    PUCHAR                   region;
+    DWORD                    regionLength;
+    PNOTHING_RING_HEADER     header;
+    PNOTHING_RING_SUBMISSION submissions;
+    PNOTHING_RING_COMPLETION completions;
+    UCHAR                    buffer[BENCHMARK_TRANSFER_SIZE];
+    DWORD                    bytesTransferred;
+    ULONG                    submissionTail = 0;
+    ULONG                    completionHead = 0;
+    ULONG                    completionTail;
+    ULONGLONG                operations;
+    ULONGLONG                doorbells;
+    ULONGLONG                stopTime;
+
+    printf("Ring benchmark: %u byte write/read pairs, %u seconds per pass\n",
+           BENCHMARK_TRANSFER_SIZE,
+           BENCHMARK_SECONDS);
+
+    //
+    // First the plain old way, one system call per operation
+    //
+    plainHandle = OpenNothingDevice(ViaInterface);
+
+    if (plainHandle == INVALID_HANDLE_VALUE) {
+
+        printf("CreateFile failed with error 0x%lx\n",
+               GetLastError());
+        return;
+    }
+
+    memset(buffer,
+           0xEE,
+           sizeof(buffer));
+
+    operations = 0;
+    stopTime   = GetTickCount64() + BENCHMARK_SECONDS * 1000;
+
+    while (GetTickCount64() < stopTime) {
+
+        if (WriteFile(plainHandle,
+                      buffer,
+                      sizeof(buffer),
+                      &bytesTransferred,
+                      nullptr)) {
+            operations++;
+        }
+
+        if (ReadFile(plainHandle,
+                     buffer,
+                     sizeof(buffer),
+                     &bytesTransferred,
+                     nullptr)) {
+            operations++;
+        }
+    }
+
+    CloseHandle(plainHandle);
+
+    printf("\tReadFile/WriteFile: %10llu ops/sec, %10llu syscalls/sec\n",
+           operations / BENCHMARK_SECONDS,
+           operations / BENCHMARK_SECONDS);
+
+    //
+    // Now the shared ring.  The setup request stays pending for as long as
+    // the ring exists, so this handle has to be opened for overlapped I/O.
+    //
+    ringHandle = OpenNothingDevice(ViaInterface,
+                                   FILE_FLAG_OVERLAPPED);
+
+    if (ringHandle == INVALID_HANDLE_VALUE) {
+
+        printf("CreateFile failed with error 0x%lx\n",
+               GetLastError());
+        return;
+    }
+
+    regionLength = sizeof(NOTHING_RING_HEADER) +
+                   RING_ENTRIES * sizeof(NOTHING_RING_SUBMISSION) +
+                   RING_ENTRIES * sizeof(NOTHING_RING_COMPLETION) +
+                   RING_ENTRIES * BENCHMARK_TRANSFER_SIZE;
+
+    region = (PUCHAR)VirtualAlloc(nullptr,
+                                  regionLength,
+                                  MEM_COMMIT | MEM_RESERVE,
+                                  PAGE_READWRITE);
+
+    if (region == nullptr) {
+
+        printf("Out of memory\n");
+
+        CloseHandle(ringHandle);
+        return;
+    }
+
+    header = (PNOTHING_RING_HEADER)region;
+
+    header->Version           = NOTHING_RING_VERSION;
+    header->SubmissionEntries = RING_ENTRIES;
+    header->CompletionEntries = RING_ENTRIES;
+    header->SubmissionOffset  = sizeof(NOTHING_RING_HEADER);
+    header->CompletionOffset  = header->SubmissionOffset +
+                                   RING_ENTRIES * sizeof(NOTHING_RING_SUBMISSION);
+    header->DataOffset        = header->CompletionOffset +
+                                   RING_ENTRIES * sizeof(NOTHING_RING_COMPLETION);
+    header->DataLength        = RING_ENTRIES * BENCHMARK_TRANSFER_SIZE;
+
+    submissions = (PNOTHING_RING_SUBMISSION)(region + header->SubmissionOffset);
+    completions = (PNOTHING_RING_COMPLETION)(region + header->CompletionOffset);
+
+    memset(region + header->DataOffset,
+           0xEE,
+           header->DataLength);
+
+    setupOverlapped.hEvent = CreateEvent(nullptr,
+                                         TRUE,
+                                         FALSE,
+                                         nullptr);
+
+    if (DeviceIoControl(ringHandle,
+                        (DWORD)IOCTL_OSR_NOTHING_RING_SETUP,
+                        nullptr,
+                        0,
+                        region,
+                        regionLength,
+                        nullptr,
+                        &setupOverlapped) ||
+        GetLastError() != ERROR_IO_PENDING) {
+
+        printf("Ring setup failed with error 0x%lx\n",
+               GetLastError());
+        goto Exit;
+    }
+
+    operations = 0;
+    doorbells  = 0;
+    stopTime   = GetTickCount64() + BENCHMARK_SECONDS * 1000;
+
+    while (GetTickCount64() < stopTime) {
+
+        //
+        // Queue up a batch of write/read pairs.  We never have more than
+        // RING_BATCH entries outstanding, so neither ring can overflow.
+        //
+        for (ULONG index = 0; index < RING_BATCH; index++) {
+
+            PNOTHING_RING_SUBMISSION submission;
+            ULONG                    slot;
+
+            slot       = submissionTail & (RING_ENTRIES - 1);
+            submission = &submissions[slot];
+
+            submission->Opcode     = (index & 1) ? NOTHING_RING_OP_READ :
+                                                   NOTHING_RING_OP_WRITE;
+            submission->DataOffset = header->DataOffset +
+                                        slot * BENCHMARK_TRANSFER_SIZE;
+            submission->DataLength = BENCHMARK_TRANSFER_SIZE;
+            submission->Reserved   = 0;
+            submission->UserData   = submissionTail;
+
+            submissionTail++;
+        }
+
+        //
+        // Make sure the driver sees the entries before the new tail
+        //
+        MemoryBarrier();
+
+        header->SubmissionTail = submissionTail;
+
+        if (!RingDeviceIoControl(ringHandle,
+                                 (DWORD)IOCTL_OSR_NOTHING_RING_ENTER,
+                                 nullptr,
+                                 0,
+                                 &bytesTransferred)) {
+
+            printf("Ring enter failed with error 0x%lx\n",
+                   GetLastError());
+            break;
+        }
+
+        doorbells++;
+
+        //
+        // Reap whatever completed
+        //
+        completionTail = header->CompletionTail;
+
+        MemoryBarrier();
+
+        while (completionHead != completionTail) {
+
+            if (completions[completionHead & (RING_ENTRIES - 1)].Status >= 0) {
+                operations++;
+            }
+
+            completionHead++;
+        }
+
+        header->CompletionHead = completionHead;
+    }
+
+    printf("\tShared ring:        %10llu ops/sec, %10llu syscalls/sec\n",
+           operations / BENCHMARK_SECONDS,
+           doorbells / BENCHMARK_SECONDS);
+
+    //
+    // Tear the ring down by cancelling the setup request
+    //
+    CancelIoEx(ringHandle,
+               &setupOverlapped);
+
+    GetOverlappedResult(ringHandle,
+                        &setupOverlapped,
+                        &bytesTransferred,
+                        TRUE);
+
+Exit:
+
+    CloseHandle(setupOverlapped.hEvent);
+    CloseHandle(ringHandle);
+
+    VirtualFree(region,
+                0,
+                MEM_RELEASE);
+}
+
+//
+// Per-thread state for the channel benchmark.  Each channel has a writer
+// thread and a reader thread, each with its own end of the channel.
+//
+typedef struct _CHANNEL_THREAD {
+
+    HANDLE         DeviceHandle;
+    ULONGLONG      Key;
+    BOOL           IsWriter;
+    volatile LONG* Stop;
+    ULONGLONG      Bytes;
+
+} CHANNEL_THREAD, *PCHANNEL_THREAD;
+
+DWORD
+WINAPI
+ChannelBenchmarkThread(LPVOID Context)
+{
+    PCHANNEL_THREAD      thread = (PCHANNEL_THREAD)Context;
+    NOTHING_CHANNEL_PAIR pair;
+    UCHAR                buffer[BENCHMARK_TRANSFER_SIZE];
+    DWORD                bytesTransferred;
+
+    memset(buffer,
+           0xEE,
+           sizeof(buffer));
+
+    //
+    // This waits until the other end of the channel pairs too
+    //
+    pair.Key = thread->Key;
+
+    if (!DeviceIoControl(thread->DeviceHandle,
+                         (DWORD)IOCTL_OSR_NOTHING_CHANNEL_PAIR,
+                         &pair,
+                         sizeof(pair),
+                         nullptr,
+                         0,
+                         &bytesTransferred,
+                         nullptr)) {
+
+        printf("Channel pairing failed with error 0x%lx\n",
+               GetLastError());
+
+        return 1;
+    }
+
+    //
+    // Writers run until we tell them to stop.  Readers run until the
+    // writer's end of the channel gets closed and their reads fail.
+    //
+    while (!thread->IsWriter || *thread->Stop == 0) {
+
+        if (thread->IsWriter) {
+
+            if (!WriteFile(thread->DeviceHandle,
+                           buffer,
+                           sizeof(buffer),
+                           &bytesTransferred,
+                           nullptr)) {
+                break;
+            }
+
+        } else {
+
+            if (!ReadFile(thread->DeviceHandle,
+                          buffer,
+                          sizeof(buffer),
+                          &bytesTransferred,
+                          nullptr)) {
+                break;
+            }
+        }
+
+        thread->Bytes += bytesTransferred;
+    }
+
+    return 0;
+}
+
+VOID
+RunChannelBenchmark(BOOL ViaInterface)
+{
+    static const ULONG channelCounts[] = {1, 2, 4, 8};
+    CHANNEL_THREAD     threads[16];
+    HANDLE             threadHandles[16];
+    volatile LONG      stop;
+    ULONGLONG          totalBytes;
+    ULONG              count;
+    ULONG              index;
+
+    printf("Channel benchmark: %u byte writes, %u seconds per pass\n",
+           BENCHMARK_TRANSFER_SIZE,
+           BENCHMARK_SECONDS);
+
+    for (ULONG pass = 0; pass < _countof(channelCounts); pass++) {
+
+        //
+        // Writers are the even threads, readers the odd ones
+        //
+        count = channelCounts[pass] * 2;
+        stop  = 0;
+
+        for (index = 0; index < count; index++) {
+
+            threads[index].Stop         = &stop;
+            threads[index].Bytes        = 0;
+            threads[index].IsWriter     = (index % 2) == 0;
+            threads[index].Key          = ((ULONGLONG)GetCurrentProcessId() << 32) |
+                                              (pass << 16) | (index / 2);
+            threads[index].DeviceHandle = OpenNothingDevice(ViaInterface);
+
+            if (threads[index].DeviceHandle == INVALID_HANDLE_VALUE) {
+
+                printf("CreateFile failed with error 0x%lx\n",
+                       GetLastError());
+
+                while (index-- > 0) {
+                    CloseHandle(threads[index].DeviceHandle);
+                }
+
+                return;
+            }
+        }
+
+        for (index = 0; index < count; index++) {
+
+            threadHandles[index] = CreateThread(nullptr,
+                                                0,
+                                                ChannelBenchmarkThread,
+                                                &threads[index],
+                                                0,
+                                                nullptr);
+        }
+
+        Sleep(BENCHMARK_SECONDS * 1000);
+
+        InterlockedExchange(&stop,
+                            1);
+
+        //
+        // Once a writer's done, closing its end of the channel gets its
+        // reader out of any read it's waiting in.  If the writer never got
+        // paired, its reader is still waiting to be, so cancel that too.
+        //
+        for (index = 0; index < count; index += 2) {
+
+            WaitForSingleObject(threadHandles[index],
+                                INFINITE);
+
+            CloseHandle(threads[index].DeviceHandle);
+
+            CancelIoEx(threads[index + 1].DeviceHandle,
+                       nullptr);
+        }
+
+        totalBytes = 0;
+
+        for (index = 1; index < count; index += 2) {
+
+            WaitForSingleObject(threadHandles[index],
+                                INFINITE);
+
+            CloseHandle(threads[index].DeviceHandle);
+
+            totalBytes += threads[index].Bytes;
+        }
+
+        for (index = 0; index < count; index++) {
+
+            CloseHandle(threadHandles[index]);
+        }
+
+        printf("\t%2lu channel(s): %10.1f MB/sec\n",
+               count / 2,
+               (double)totalBytes / (1024.0 * 1024.0) / BENCHMARK_SECONDS);
+    }
+}
+
+VOID
+RunOpenCloseBenchmark(BOOL ViaInterface)
+{
+    static const ULONG handleCounts[] = {10000, 30000, 100000};
+    PHANDLE            handles;
+    ULONG              opened;
+    LARGE_INTEGER      frequency;
+    LARGE_INTEGER      start;
+    LARGE_INTEGER      middle;
+    LARGE_INTEGER      end;
+
+    QueryPerformanceFrequency(&frequency);
+
+    printf("Open/close benchmark: handles closed newest first\n");
+
+    for (ULONG pass = 0; pass < _countof(handleCounts); pass++) {
+
+        handles = (PHANDLE)malloc(handleCounts[pass] * sizeof(HANDLE));
+
+        if (handles == nullptr) {
+
+            printf("Out of memory\n");
+            return;
+        }
+
+        QueryPerformanceCounter(&start);
+
+        for (opened = 0; opened < handleCounts[pass]; opened++) {
+
+            handles[opened] = OpenNothingDevice(ViaInterface);
+
+            if (handles[opened] == INVALID_HANDLE_VALUE) {
+
+                printf("CreateFile failed with error 0x%lx\n",
+                       GetLastError());
+                break;
+            }
+        }
+
+        QueryPerformanceCounter(&middle);
+
+        //
+        // We're already the writer, so every one of these handles is
+        // waiting its turn.  Closing the newest first means each one is
+        // at the far end of the line.
+        //
+        for (ULONG index = opened; index-- > 0; ) {
+
+            CloseHandle(handles[index]);
+        }
+
+        QueryPerformanceCounter(&end);
+
+        free(handles);
+
+        if (opened == 0) {
+            break;
+        }
+
+        printf("\t%6lu handles: %10.0f opens/sec, %10.0f closes/sec\n",
+               opened,
+               opened / ((double)(middle.QuadPart - start.QuadPart) /
+                                                 (double)frequency.QuadPart),
+               opened / ((double)(end.QuadPart - middle.QuadPart) /
+                                                 (double)frequency.QuadPart));
+
+        if (opened != handleCounts[pass]) {
+            break;
+        }
+    }
+}
+
+//
+// State shared by the threads of the writer handoff benchmark
+//
+typedef struct _HANDOFF_BENCHMARK {
+
+    BOOL            ViaInterface;
+    volatile LONG   Stop;
+    volatile LONG   ReaderStop;
+    volatile LONG64 Written;
+    volatile LONG64 Rejected;
+    volatile LONG64 Unexpected;
+    volatile LONG64 Reopens;
+
+} HANDOFF_BENCHMARK, *PHANDOFF_BENCHMARK;
+
+DWORD
+WINAPI
+HandoffWriterThread(LPVOID Context)
+{
+    PHANDOFF_BENCHMARK benchmark = (PHANDOFF_BENCHMARK)Context;
+    HANDLE             deviceHandle;
+    UCHAR              buffer[BENCHMARK_TRANSFER_SIZE];
+    DWORD              bytesWritten;
+
+    memset(buffer,
+           0xEE,
+           sizeof(buffer));
+
+    while (benchmark->Stop == 0) {
+
+        deviceHandle = OpenNothingDevice(benchmark->ViaInterface);
+
+        if (deviceHandle == INVALID_HANDLE_VALUE) {
+
+            printf("CreateFile failed with error 0x%lx\n",
+                   GetLastError());
+            return 1;
+        }
+
+        //
+        // Only the writer's writes should work.  Everyone else's should
+        // fail with ERROR_WRITE_PROTECT, and nothing else.
+        //
+        for (ULONG index = 0;
+             index < HANDOFF_WRITES_PER_OPEN && benchmark->Stop == 0;
+             index++) {
+
+            if (WriteFile(deviceHandle,
+                          buffer,
+                          sizeof(buffer),
+                          &bytesWritten,
+                          nullptr)) {
+
+                InterlockedIncrement64(&benchmark->Written);
+
+            } else if (GetLastError() == ERROR_WRITE_PROTECT) {
+
+                InterlockedIncrement64(&benchmark->Rejected);
+
+            } else {
+
+                InterlockedIncrement64(&benchmark->Unexpected);
+            }
+        }
+
+        //
+        // If we're the writer, this hands ownership to the next in line
+        // while everybody else is still writing
+        //
+        CloseHandle(deviceHandle);
+
+        InterlockedIncrement64(&benchmark->Reopens);
+    }
+
+    return 0;
+}
+
+DWORD
+WINAPI
+HandoffReaderThread(LPVOID Context)
+{
+    PHANDOFF_BENCHMARK benchmark = (PHANDOFF_BENCHMARK)Context;
+    HANDLE             deviceHandle;
+    OVERLAPPED         overlapped = {};
+    UCHAR              buffer[BENCHMARK_TRANSFER_SIZE];
+    DWORD              bytesRead;
+
+    overlapped.hEvent = CreateEvent(nullptr,
+                                    TRUE,
+                                    FALSE,
+                                    nullptr);
+
+    //
+    // Drain the writes so the writer's writes complete.  If nothing shows
+    // up for a while then WE might have become the writer, so get back in
+    // line with a new handle.
+    //
+    while (benchmark->ReaderStop == 0) {
+
+        deviceHandle = OpenNothingDevice(benchmark->ViaInterface,
+                                         FILE_FLAG_OVERLAPPED);
+
+        if (deviceHandle == INVALID_HANDLE_VALUE) {
+
+            printf("CreateFile failed with error 0x%lx\n",
+                   GetLastError());
+            break;
+        }
+
+        while (benchmark->ReaderStop == 0) {
+
+            ResetEvent(overlapped.hEvent);
+
+            if (!ReadFile(deviceHandle,
+                          buffer,
+                          sizeof(buffer),
+                          nullptr,
+                          &overlapped) &&
+                GetLastError() != ERROR_IO_PENDING) {
+                break;
+            }
+
+            if (WaitForSingleObject(overlapped.hEvent,
+                                    50) != WAIT_OBJECT_0) {
+
+                CancelIoEx(deviceHandle,
+                           &overlapped);
+
+                GetOverlappedResult(deviceHandle,
+                                    &overlapped,
+                                    &bytesRead,
+                                    TRUE);
+                break;
+            }
+        }
+
+        CloseHandle(deviceHandle);
+    }
+
+    CloseHandle(overlapped.hEvent);
+
+    return 0;
+}
+
+HANDLE
+RunWriterHandoffBenchmark(HANDLE DeviceHandle,
+                          BOOL   ViaInterface)
+{
+    HANDOFF_BENCHMARK benchmark = {};
+    HANDLE            writerThreads[HANDOFF_THREADS];
+    HANDLE            readerThread;
+
+    printf("Writer handoff benchmark: %u threads, %u seconds\n",
+           HANDOFF_THREADS,
+           BENCHMARK_SECONDS);
+
+    //
+    // Get our handle out of the way, so ownership moves between the
+    // benchmark's handles
+    //
+    CloseHandle(DeviceHandle);
+
+    benchmark.ViaInterface = ViaInterface;
+
+    readerThread = CreateThread(nullptr,
+                                0,
+                                HandoffReaderThread,
+                                &benchmark,
+                                0,
+                                nullptr);
+
+    for (ULONG index = 0; index < HANDOFF_THREADS; index++) {
+
+        writerThreads[index] = CreateThread(nullptr,
+                                            0,
+                                            HandoffWriterThread,
+                                            &benchmark,
+                                            0,
+                                            nullptr);
+    }
+
+    Sleep(BENCHMARK_SECONDS * 1000);
+
+    InterlockedExchange(&benchmark.Stop,
+                        1);
+
+    //
+    // Keep reading until all the writers are done
+    //
+    WaitForMultipleObjects(HANDOFF_THREADS,
+                           writerThreads,
+                           TRUE,
+                           INFINITE);
+
+    InterlockedExchange(&benchmark.ReaderStop,
+                        1);
+
+    WaitForSingleObject(readerThread,
+                        INFINITE);
+
+    for (ULONG index = 0; index < HANDOFF_THREADS; index++) {
+
+        CloseHandle(writerThreads[index]);
+    }
+
+    CloseHandle(readerThread);
+
+    printf("\t%10lld writes/sec, %10lld rejected/sec, %lld handle reopens\n",
+           benchmark.Written / BENCHMARK_SECONDS,
+           benchmark.Rejected / BENCHMARK_SECONDS,
+           benchmark.Reopens);
+
+    printf("\t%lld writes failed with an unexpected error\n",
+           benchmark.Unexpected);
+
+    //
+    // Back in line we go
+    //
+    return OpenNothingDevice(ViaInterface);
+}
+
+VOID
+PrintStats(HANDLE DeviceHandle)
+{
+    NOTHING_STATS stats;
+    DWORD         bytesReturned;
+
+    if (!DeviceIoControl(DeviceHandle,
+                         (DWORD)IOCTL_OSR_NOTHING_GET_STATS,
+                         nullptr,
+                         0,
+                         &stats,
+                         sizeof(stats),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        return;
+    }
+
+    if (stats.Version != NOTHING_STATS_VERSION) {
+
+        printf("Unknown stats version %lu\n",
+               stats.Version);
+        return;
+    }
+
+    printf("\tReads:                   %llu\n", stats.Reads);
+    printf("\tWrites:                  %llu\n", stats.Writes);
+    printf("\tBytes read:              %llu\n", stats.BytesRead);
+    printf("\tBytes written:           %llu\n", stats.BytesWritten);
+    printf("\tReads parked:            %llu\n", stats.ReadsParked);
+    printf("\tWrites parked:           %llu\n", stats.WritesParked);
+    printf("\tRead queue depth:        %llu (max %llu)\n",
+           stats.ReadQueueDepth,
+           stats.ReadQueueMaxDepth);
+    printf("\tWrite queue depth:       %llu (max %llu)\n",
+           stats.WriteQueueDepth,
+           stats.WriteQueueMaxDepth);
+    printf("\tDevice busy rejections:  %llu\n", stats.DeviceBusyRejections);
+}
+
+//
+// Prints one credit count, or "unlimited"
+//
+static void
+PrintCredit(
+    const char *Name,
+    ULONGLONG   Credit,
+    ULONGLONG   Unlimited)
+{
+    if (Credit == Unlimited) {
+        printf("\t%-25s unlimited\n", Name);
+    } else {
+        printf("\t%-25s %llu\n", Name, Credit);
+    }
+}
+
+VOID
+PrintCredits(HANDLE DeviceHandle)
+{
+    NOTHING_CREDITS credits;
+    DWORD           bytesReturned;
+
+    if (!DeviceIoControl(DeviceHandle,
+                         (DWORD)IOCTL_OSR_NOTHING_GET_CREDITS,
+                         nullptr,
+                         0,
+                         &credits,
+                         sizeof(credits),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        return;
+    }
+
+    printf("\tMaximum queue depth:      %lu\n", credits.MaxQueueDepth);
+    printf("\tMaximum queue bytes:      %llu\n", credits.MaxQueueBytes);
+
+    PrintCredit("WRITE credits:",
+                credits.WriteCredits,
+                MAXULONG);
+    PrintCredit("WRITE byte credits:",
+                credits.WriteByteCredits,
+                MAXULONGLONG);
+    PrintCredit("READ credits:",
+                credits.ReadCredits,
+                MAXULONG);
+    PrintCredit("READ byte credits:",
+                credits.ReadByteCredits,
+                MAXULONGLONG);
+}
+
+VOID
+PollDevices(BOOL ViaInterface)
+{
+    HANDLE        handles[NOTHING_POLL_MAX_ENTRIES];
+    ULONG         handleCount = 0;
+    ULONG         deviceCount;
+    PNOTHING_POLL poll;
+    DWORD         pollSize;
+    DWORD         bytesReturned;
+    OVERLAPPED    overlapped = {};
+
+    deviceCount = ViaInterface ? CountNothingDevices(TRUE) :
+                                 NOTHING_POLL_MAX_ENTRIES;
+
+    //
+    // One handle on each device.  Opening by name, we don't know how many
+    // there are, so we keep going until one isn't there.
+    //
+    while (handleCount < min(deviceCount, NOTHING_POLL_MAX_ENTRIES)) {
+
+        handles[handleCount] = OpenNothingDeviceInstance(ViaInterface,
+                                                         handleCount,
+                                                         FILE_FLAG_OVERLAPPED);
+
+        if (handles[handleCount] == INVALID_HANDLE_VALUE) {
+            break;
+        }
+
+        handleCount++;
+    }
+
+    if (handleCount == 0) {
+
+        printf("Couldn't open any Nothing devices, error 0x%lx\n",
+               GetLastError());
+        return;
+    }
+
+    pollSize = NOTHING_POLL_SIZE(handleCount);
+
+    poll = (PNOTHING_POLL)calloc(1,
+                                 pollSize);
+
+    overlapped.hEvent = CreateEvent(nullptr,
+                                    TRUE,
+                                    FALSE,
+                                    nullptr);
+
+    if (poll == nullptr || overlapped.hEvent == nullptr) {
+
+        printf("Out of memory\n");
+        goto Exit;
+    }
+
+    poll->EntryCount = handleCount;
+
+    for (ULONG index = 0; index < handleCount; index++) {
+
+        poll->Entries[index].Handle = (ULONGLONG)(ULONG_PTR)handles[index];
+        poll->Entries[index].Events = NOTHING_POLL_READABLE |
+                                      NOTHING_POLL_WRITABLE;
+    }
+
+    printf("Waiting up to %u seconds for a READ or WRITE to be waiting on "
+           "any of %lu devices\n",
+           POLL_WAIT_SECONDS,
+           handleCount);
+
+    //
+    // The poll can go to any of the devices, they all see all of them
+    //
+    if (!DeviceIoControl(handles[0],
+                         (DWORD)IOCTL_OSR_NOTHING_POLL,
+                         poll,
+                         pollSize,
+                         poll,
+                         pollSize,
+                         nullptr,
+                         &overlapped)) {
+
+        if (GetLastError() != ERROR_IO_PENDING) {
+
+            printf("Poll failed with error 0x%lx\n",
+                   GetLastError());
+            goto Exit;
+        }
+
+        if (WaitForSingleObject(overlapped.hEvent,
+                                POLL_WAIT_SECONDS * 1000) == WAIT_TIMEOUT) {
+
+            CancelIoEx(handles[0],
+                       &overlapped);
+        }
+    }
+
+    if (!GetOverlappedResult(handles[0],
+                             &overlapped,
+                             &bytesReturned,
+                             TRUE)) {
+
+        if (GetLastError() == ERROR_OPERATION_ABORTED) {
+            printf("Nothing became ready\n");
+        } else {
+            printf("Poll failed with error 0x%lx\n",
+                   GetLastError());
+        }
+        goto Exit;
+    }
+
+    for (ULONG index = 0; index < handleCount; index++) {
+
+        printf("\tDevice %lu: %s%s%s\n",
+               index,
+               (poll->Entries[index].ReadyEvents & NOTHING_POLL_READABLE) ?
+                   "readable " : "",
+               (poll->Entries[index].ReadyEvents & NOTHING_POLL_WRITABLE) ?
+                   "writable " : "",
+               (poll->Entries[index].ReadyEvents & NOTHING_POLL_HANGUP) ?
+                   "hung up" : "");
+    }
+
+Exit:
+
+    if (overlapped.hEvent != nullptr) {
+        CloseHandle(overlapped.hEvent);
+    }
+
+    free(poll);
+
+    for (ULONG index = 0; index < handleCount; index++) {
+        CloseHandle(handles[index]);
+    }
+}
+
+//
+// Returns the value below which the given fraction of a histogram's
+// samples fall, in microseconds
+//
+static double
+LatencyPercentile(
+    const ULONGLONG *Counts,
+    ULONGLONG        Total,
+    ULONGLONG        Frequency,
+    double           Fraction)
+{
+    ULONGLONG target;
+    ULONGLONG seen = 0;
+    ULONG     bucket;
+
+    target = (ULONGLONG)(Fraction * (double)Total);
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (bucket = 0; bucket < NOTHING_LATENCY_BUCKETS - 1; bucket++) {
+
+        seen += Counts[bucket];
+
+        if (seen >= target) {
+            break;
+        }
+    }
+
+    //
+    // Report the top of the bucket, so we never understate
+    //
+    return ((double)NOTHING_LATENCY_BUCKET_START(bucket + 1) * 1000000.0) /
+           (double)Frequency;
+}
+
+VOID
+PrintLatency(HANDLE DeviceHandle,
+             BOOL   Reset)
+{
+    NOTHING_LATENCY_REQUEST latencyRequest;
+    PNOTHING_LATENCY        latency;
+    DWORD                   bytesReturned;
+    ULONGLONG               total;
+    static const char      *names[NOTHING_LATENCY_HISTOGRAMS] = {
+        "Read wait",
+        "Write wait",
+        "Read service",
+        "Write service"
+    };
+
+    //
+    // Too big for the stack
+    //
+    latency = (PNOTHING_LATENCY)malloc(sizeof(NOTHING_LATENCY));
+
+    if (latency == nullptr) {
+
+        printf("Out of memory\n");
+        return;
+    }
+
+    latencyRequest.Flags = Reset ? NOTHING_LATENCY_FLAG_RESET : 0;
+
+    if (!DeviceIoControl(DeviceHandle,
+                         (DWORD)IOCTL_OSR_NOTHING_GET_LATENCY,
+                         &latencyRequest,
+                         sizeof(latencyRequest),
+                         latency,
+                         sizeof(NOTHING_LATENCY),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        free(latency);
+        return;
+    }
+
+    if (latency->Version != NOTHING_LATENCY_VERSION ||
+        latency->Frequency == 0) {
+
+        printf("Unknown latency version %lu\n",
+               latency->Version);
+        free(latency);
+        return;
+    }
+
+    printf("\t%-14s %12s %12s %12s %12s\n",
+           "",
+           "count",
+           "p50 (us)",
+           "p99 (us)",
+           "p99.9 (us)");
+
+    for (ULONG histogram = 0; histogram < NOTHING_LATENCY_HISTOGRAMS; histogram++) {
+
+        total = 0;
+
+        for (ULONG bucket = 0; bucket < NOTHING_LATENCY_BUCKETS; bucket++) {
+            total += latency->Counts[histogram][bucket];
+        }
+
+        if (total == 0) {
+
+            printf("\t%-14s %12llu\n",
+                   names[histogram],
+                   total);
+            continue;
+        }
+
+        printf("\t%-14s %12llu %12.1f %12.1f %12.1f\n",
+               names[histogram],
+               total,
+               LatencyPercentile(latency->Counts[histogram], total, latency->Frequency, 0.50),
+               LatencyPercentile(latency->Counts[histogram], total, latency->Frequency, 0.99),
+               LatencyPercentile(latency->Counts[histogram], total, latency->Frequency, 0.999));
+    }
+
+    if (Reset) {
+        printf("\tHistograms reset\n");
+    }
+
+    free(latency);
+}
+
+BOOL
+SetIntegrity(
+    HANDLE DeviceHandle,
+    BOOL   Enable)
+{
+    NOTHING_INTEGRITY_MODE mode;
+    DWORD                  bytesReturned;
+
+    mode.Enable = Enable ? 1 : 0;
+
+    if (!DeviceIoControl(DeviceHandle,
+                         (DWORD)IOCTL_OSR_NOTHING_SET_INTEGRITY,
+                         &mode,
+                         sizeof(mode),
+                         nullptr,
+                         0,
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Compare the CRC the driver computed for our last READ or WRITE with
+// the one we compute ourselves
+//
+VOID
+CheckIntegrity(
+    HANDLE       DeviceHandle,
+    const UCHAR *Buffer,
+    DWORD        Length,
+    BOOL         IsWrite)
+{
+    NOTHING_INTEGRITY integrity;
+    DWORD             bytesReturned;
+    OSR_COPY          copy;
+    ULONG             driverCrc;
+    ULONG             driverLength;
+    ULONG             crc;
+
+    if (!DeviceIoControl(DeviceHandle,
+                         (DWORD)IOCTL_OSR_NOTHING_GET_INTEGRITY,
+                         nullptr,
+                         0,
+                         &integrity,
+                         sizeof(integrity),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        return;
+    }
+
+    driverCrc    = IsWrite ? integrity.WriteCrc32c : integrity.ReadCrc32c;
+    driverLength = IsWrite ? integrity.WriteLength : integrity.ReadLength;
+
+    OsrCopyInitialize(&copy);
+
+    crc = OsrCrc32c(&copy,
+                    Buffer,
+                    Length,
+                    0);
+
+    printf("Driver CRC32C 0x%08lx over %lu bytes, ours 0x%08lx over %lu "
+           "bytes: %s\n",
+           driverCrc,
+           driverLength,
+           crc,
+           Length,
+           (crc == driverCrc && Length == driverLength) ? "MATCH" : "MISMATCH");
+}
+
+//
+// Fill a corpus buffer with something that looks like a log of sensor
+// readings, which compresses about as well as real telemetry does
+//
+static VOID
+FillTelemetryCorpus(
+    PUCHAR Buffer,
+    DWORD  Length)
+{
+    char  line[128];
+    DWORD offset = 0;
+    ULONG sample = 0;
+    int   lineLength;
+
+    while (offset < Length) {
+
+        lineLength = snprintf(line,
+                              sizeof(line),
+                              "ts=%lu.%03lu sensor=%02lu temp=%lu.%lu "
+                              "rpm=%lu status=OK\n",
+                              1700000000 + (sample / 16),
+                              (sample * 37) % 1000,
+                              sample % 16,
+                              20 + (sample % 7),
+                              (sample / 3) % 10,
+                              2900 + (sample * 13) % 200);
+
+        for (int index = 0; index < lineLength && offset < Length; index++) {
+            Buffer[offset++] = (UCHAR)line[index];
+        }
+
+        sample++;
+    }
+}
+
+//
+// Fill a corpus buffer with pseudo-random bytes, which don't compress at
+// all
+//
+static VOID
+FillRandomCorpus(
+    PUCHAR Buffer,
+    DWORD  Length)
+{
+    ULONG64 state = 0x9E3779B97F4A7C15ULL;
+
+    for (DWORD offset = 0; offset < Length; offset++) {
+
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        Buffer[offset] = (UCHAR)state;
+    }
+}
+
+static BOOL
+GetStats(
+    HANDLE         DeviceHandle,
+    PNOTHING_STATS Stats)
+{
+    DWORD bytesReturned;
+
+    if (!DeviceIoControl(DeviceHandle,
+                         (DWORD)IOCTL_OSR_NOTHING_GET_STATS,
+                         nullptr,
+                         0,
+                         Stats,
+                         sizeof(NOTHING_STATS),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Read until the device is empty, returning how much we got
+//
+static ULONGLONG
+DrainDevice(
+    HANDLE DeviceHandle,
+    PUCHAR Buffer,
+    DWORD  Length)
+{
+    ULONGLONG total = 0;
+    DWORD     bytesRead;
+
+    while (ReadFile(DeviceHandle,
+                    Buffer,
+                    Length,
+                    &bytesRead,
+                    nullptr) && bytesRead != 0) {
+
+        total += bytesRead;
+    }
+
+    return total;
+}
+
+VOID
+RunCompressionBenchmark(HANDLE DeviceHandle)
+{
+    static const char *corpusNames[] = {"telemetry", "random"};
+    PUCHAR             corpus;
+    PUCHAR             readBuffer;
+    NOTHING_STATS      before;
+    NOTHING_STATS      after;
+    LARGE_INTEGER      frequency;
+    LARGE_INTEGER      start;
+    LARGE_INTEGER      end;
+    LONGLONG           writeTicks;
+    LONGLONG           readTicks;
+    ULONGLONG          capacity;
+    ULONGLONG          written;
+    ULONGLONG          read;
+    ULONGLONG          uncompressed;
+    ULONGLONG          compressed;
+    DWORD              bytesWritten;
+    double             megabytes;
+
+    corpus     = (PUCHAR)malloc(COMPRESS_MESSAGE_SIZE);
+    readBuffer = (PUCHAR)malloc(COMPRESS_MESSAGE_SIZE);
+
+    if (corpus == nullptr || readBuffer == nullptr) {
+
+        printf("Out of memory\n");
+
+        free(corpus);
+        free(readBuffer);
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    //
+    // Start with an empty device
+    //
+    DrainDevice(DeviceHandle,
+                readBuffer,
+                COMPRESS_MESSAGE_SIZE);
+
+    printf("Compression benchmark: %u KB writes, %u fill/drain rounds "
+           "per corpus\n",
+           COMPRESS_MESSAGE_SIZE / 1024,
+           COMPRESS_ROUNDS);
+
+    printf("%12s %14s %12s %12s %8s %16s %18s\n",
+           "Corpus",
+           "Capacity (MB)",
+           "Write MB/s",
+           "Read MB/s",
+           "Ratio",
+           "Compress us/MB",
+           "Decompress us/MB");
+
+    for (ULONG corpusIndex = 0; corpusIndex < 2; corpusIndex++) {
+
+        if (corpusIndex == 0) {
+
+            FillTelemetryCorpus(corpus,
+                                COMPRESS_MESSAGE_SIZE);
+        } else {
+
+            FillRandomCorpus(corpus,
+                             COMPRESS_MESSAGE_SIZE);
+        }
+
+        if (!GetStats(DeviceHandle,
+                      &before)) {
+            break;
+        }
+
+        capacity   = 0;
+        written    = 0;
+        read       = 0;
+        writeTicks = 0;
+        readTicks  = 0;
+
+        for (ULONG round = 0; round < COMPRESS_ROUNDS; round++) {
+
+            ULONGLONG roundWritten = 0;
+
+            //
+            // Write until the device says it's full.  How much it took is
+            // its effective capacity for this kind of data.
+            //
+            QueryPerformanceCounter(&start);
+
+            while (WriteFile(DeviceHandle,
+                             corpus,
+                             COMPRESS_MESSAGE_SIZE,
+                             &bytesWritten,
+                             nullptr)) {
+
+                roundWritten += bytesWritten;
+            }
+
+            QueryPerformanceCounter(&end);
+
+            if (GetLastError() != ERROR_BUSY) {
+
+                printf("WriteFile failed with error 0x%lx\n",
+                       GetLastError());
+                break;
+            }
+
+            writeTicks += end.QuadPart - start.QuadPart;
+            written    += roundWritten;
+            capacity    = max(capacity, roundWritten);
+
+            QueryPerformanceCounter(&start);
+
+            read += DrainDevice(DeviceHandle,
+                                readBuffer,
+                                COMPRESS_MESSAGE_SIZE);
+
+            QueryPerformanceCounter(&end);
+
+            readTicks += end.QuadPart - start.QuadPart;
+        }
+
+        if (!GetStats(DeviceHandle,
+                      &after)) {
+            break;
+        }
+
+        if (read != written) {
+
+            printf("Wrote %llu bytes but read back %llu\n",
+                   written,
+                   read);
+        }
+
+        uncompressed = after.UncompressedBytes - before.UncompressedBytes;
+        compressed   = after.CompressedBytes - before.CompressedBytes;
+        megabytes    = (double)uncompressed / (1024.0 * 1024.0);
+
+        printf("%12s %14.1f %12.0f %12.0f",
+               corpusNames[corpusIndex],
+               (double)capacity / (1024.0 * 1024.0),
+               ((double)written / (1024.0 * 1024.0)) /
+                       ((double)max(writeTicks, 1) / frequency.QuadPart),
+               ((double)read / (1024.0 * 1024.0)) /
+                       ((double)max(readTicks, 1) / frequency.QuadPart));
+
+        if (compressed == 0 || after.Frequency == 0) {
+
+            printf(" %8s\n",
+                   "n/a");
+            continue;
+        }
+
+        printf(" %8.2f %16.1f %18.1f\n",
+               (double)uncompressed / (double)compressed,
+               ((double)(after.CompressTicks - before.CompressTicks) *
+                    1000000.0 / after.Frequency) / megabytes,
+               ((double)(after.DecompressTicks - before.DecompressTicks) *
+                    1000000.0 / after.Frequency) / megabytes);
+    }
+
+    printf("\nRatio and CPU cost come from the driver, and are n/a unless it "
+           "has Compression\nset in its hardware key\n");
+
+    free(corpus);
+    free(readBuffer);
+}
@@ -0,0 +1,1314 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// CACHEBENCH.CPP
+//
+// Benchmark for osrsector.h, osrreadahead.h and osrelevator.h.  Runs a
+// few read workloads against a simulated CD-ROM drive, once with no cache
+// and once with one, and reports the hit rate and how much faster the
+// reads got.  Then it does the same for read-ahead, with streams of
+// sequential reads, and for the elevator, with several clients reading at
+// once.  It can also run the workloads against a real drive with CDFilter
+// on it.
+//
+// This code is purely functional, and is definitely not designed to be any
+// sort of example.
+//
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Windows.h>
+#include <winioctl.h>
+#include <osrsector.h>
+#include <osrreadahead.h>
+#include <osrelevator.h>
+
+//
+// This has to match CDFilter.h
+//
+#define FILE_DEVICE_CDFILTER           0xCF54
+#define IOCTL_OSR_CDFILTER_CACHE_STATS OSR_SECTOR_CACHE_IOCTL_STATS(FILE_DEVICE_CDFILTER)
+#define IOCTL_OSR_CDFILTER_READAHEAD_STATS OSR_READAHEAD_IOCTL_STATS(FILE_DEVICE_CDFILTER)
+
+//
+// Defaults for the simulated drive.  Getting to a new place on the disc
+// takes BENCH_DEFAULT_ACCESS_MS, and then data comes off at
+// BENCH_DEFAULT_RATE_MB per second, which is roughly a 48x CD-ROM drive.
+// A read that starts where the last one ended doesn't pay the access time.
+//
+#define BENCH_DEFAULT_MEDIA_MB    650
+#define BENCH_DEFAULT_ACCESS_MS   80
+#define BENCH_DEFAULT_RATE_MB     8
+
+#define BENCH_DEFAULT_CACHE_MB    8
+#define BENCH_DEFAULT_PAGE_KB     2
+#define BENCH_DEFAULT_READS       20000
+
+//
+// A real drive really does take that long for every miss, so we do fewer
+// reads unless we're told otherwise
+//
+#define BENCH_DEFAULT_DEVICE_READS 1000
+
+//
+// Every read is from 1 to this many sectors
+//
+#define BENCH_MAX_READ_SECTORS    16
+
+//
+// The hot set workload sends BENCH_HOT_PERCENT of its reads to
+// BENCH_HOT_SET_MB at the start of the disc (where the file system's
+// metadata lives), and the rest anywhere.  The file workload reads a
+// BENCH_FILE_MB file from start to finish, over and over.  The stream
+// workloads read straight through the disc, one from the middle and two
+// taking turns from a quarter and three quarters of the way in, like
+// playing media files.
+//
+#define BENCH_HOT_SET_MB          4
+#define BENCH_HOT_PERCENT         90
+#define BENCH_FILE_MB             6
+
+//
+// Defaults for the read-ahead runs.  The app spends BENCH_DEFAULT_THINK_US
+// on each read before it asks for the next one.
+//
+#define BENCH_DEFAULT_THINK_US    4000
+#define BENCH_DEFAULT_RA_MIN_KB   64
+#define BENCH_DEFAULT_RA_MAX_KB   1024
+
+//
+// Defaults for the elevator runs.  Each client keeps
+// BENCH_ELEVATOR_OUTSTANDING reads waiting at once, like a player that
+// double buffers.  The drive has one read at a time, and seeking costs
+// from BENCH_SEEK_MIN_MS for a short hop to BENCH_SEEK_FULL_MS all the way
+// across the disc, growing with the square root of the distance.
+//
+#define BENCH_DEFAULT_CLIENTS     4
+#define BENCH_DEFAULT_DEADLINE_MS 1000
+#define BENCH_MAX_CLIENTS         32
+#define BENCH_ELEVATOR_OUTSTANDING 2
+#define BENCH_SEEK_MIN_MS         20
+#define BENCH_SEEK_FULL_MS        150
+
+typedef enum _BENCH_WORKLOAD {
+
+    BenchHotSet = 0,
+    BenchUniform,
+    BenchFile,
+    BenchStream,
+    BenchTwoStreams,
+    BenchWorkloadCount
+
+} BENCH_WORKLOAD;
+
+static const char *WorkloadNames[BenchWorkloadCount] = {
+    "hot set",
+    "uniform",
+    "file",
+    "stream",
+    "2 stream",
+};
+
+typedef enum _ELEVATOR_WORKLOAD {
+
+    ElevatorStreams = 0,
+    ElevatorMixed,
+    ElevatorUniform,
+    ElevatorWorkloadCount
+
+} ELEVATOR_WORKLOAD;
+
+//
+// Every client streams, every other one streams and the rest read
+// anywhere, or they all read anywhere
+//
+static const char *ElevatorWorkloadNames[ElevatorWorkloadCount] = {
+    "streams",
+    "mixed",
+    "uniform",
+};
+
+//
+// Where the next read goes
+//
+typedef struct _BENCH_STREAM {
+
+    BENCH_WORKLOAD Workload;
+    ULONG          Seed;
+    ULONG64        MediaSectors;
+    ULONG64        NextSector;      // For BenchFile and BenchStream
+    ULONG64        OtherSector;     // For BenchTwoStreams
+
+} BENCH_STREAM, *PBENCH_STREAM;
+
+//
+// The simulated drive does one read at a time, in the order it gets them.
+// FreeAt is when it'll be done with everything it's been given, and
+// BusyUs is how long it's spent on reads altogether.
+//
+typedef struct _SIM_DRIVE {
+
+    ULONG64 AccessUs;
+    ULONG64 BytesPerSecond;
+    ULONG64 HeadOffset;
+    ULONG64 Reads;
+    double  BusyUs;
+    double  FreeAt;
+
+} SIM_DRIVE, *PSIM_DRIVE;
+
+//
+// A simulated read-ahead that the drive hasn't finished yet.  There's at
+// most one per stream, plus any that belonged to streams that have since
+// been replaced.
+//
+#define SIM_MAX_READ_AHEADS       (2 * OSR_READAHEAD_MAX_STREAMS)
+
+typedef struct _SIM_READ_AHEAD {
+
+    BOOL    InUse;
+    ULONG64 Offset;
+    ULONG   Length;
+    ULONG   Cookie;
+    LONG64  Generation;
+    double  DoneAt;
+
+} SIM_READ_AHEAD, *PSIM_READ_AHEAD;
+
+//
+// How a simulated run is set up
+//
+typedef struct _SIM_CONFIG {
+
+    ULONG64   MediaSize;
+    ULONG64   CacheSize;
+    ULONG     PageSize;
+    ULONG     Reads;
+    ULONG     ThinkUs;
+    ULONG     MinWindow;        // No read-ahead if MaxWindow is zero
+    ULONG     MaxWindow;
+    SIM_DRIVE Drive;
+
+} SIM_CONFIG, *PSIM_CONFIG;
+
+//
+// A read that a client has waiting for the simulated drive, or will have
+// once it gets to Arrival
+//
+typedef struct _SIM_WAITING_READ {
+
+    ULONG   Client;
+    ULONG64 Offset;
+    ULONG   Length;
+    ULONG64 Arrival;
+
+} SIM_WAITING_READ, *PSIM_WAITING_READ;
+
+static LONGLONG Frequency;
+static HANDLE   Device = INVALID_HANDLE_VALUE;
+
+static LONGLONG
+Now()
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+static ULONG
+Random(PULONG Seed)
+{
+    //
+    // xorshift32, plenty for picking sectors
+    //
+    *Seed ^= *Seed << 13;
+    *Seed ^= *Seed >> 17;
+    *Seed ^= *Seed << 5;
+
+    return *Seed;
+}
+
+static ULONG64
+Random64(PULONG Seed)
+{
+    ULONG64 high = Random(Seed);
+
+    return (high << 32) | Random(Seed);
+}
+
+static void
+NextRead(PBENCH_STREAM Stream,
+         PULONG64      Offset,
+         PULONG        Length)
+{
+    ULONG64 sectors;
+    ULONG64 sector;
+    ULONG64 hotSectors  = (BENCH_HOT_SET_MB * 1024ULL * 1024) / OSR_SECTOR_SIZE;
+    ULONG64 fileSectors = (BENCH_FILE_MB * 1024ULL * 1024) / OSR_SECTOR_SIZE;
+    ULONG64 fileStart   = Stream->MediaSectors / 2;
+
+    sectors = 1 + (Random(&Stream->Seed) % BENCH_MAX_READ_SECTORS);
+
+    switch (Stream->Workload) {
+
+        case BenchHotSet:
+
+            if (Random(&Stream->Seed) % 100 < BENCH_HOT_PERCENT) {
+                sector = Random64(&Stream->Seed) % (hotSectors - sectors);
+            } else {
+                sector = Random64(&Stream->Seed) % (Stream->MediaSectors - sectors);
+            }
+            break;
+
+        case BenchUniform:
+
+            sector = Random64(&Stream->Seed) % (Stream->MediaSectors - sectors);
+            break;
+
+        case BenchFile:
+
+            if (Stream->NextSector + sectors > fileStart + fileSectors) {
+                Stream->NextSector = fileStart;
+            }
+
+            sector = Stream->NextSector;
+
+            Stream->NextSector += sectors;
+            break;
+
+        case BenchTwoStreams:
+
+            //
+            // Take turns
+            //
+            sector              = Stream->NextSector;
+            Stream->NextSector  = Stream->OtherSector;
+            Stream->OtherSector = sector + sectors;
+            break;
+
+        default:
+
+            sector = Stream->NextSector;
+
+            Stream->NextSector += sectors;
+            break;
+    }
+
+    if (sector + sectors > Stream->MediaSectors) {
+        sector = 0;
+    }
+
+    *Offset = sector * OSR_SECTOR_SIZE;
+    *Length = (ULONG)(sectors * OSR_SECTOR_SIZE);
+}
+
+//
+// What's on the simulated disc.  Every 8 bytes hold their own offset,
+// scrambled a little, so that we can tell if the cache hands back the
+// wrong data.
+//
+static void
+FillPattern(PUCHAR  Buffer,
+            ULONG64 Offset,
+            ULONG   Length)
+{
+    PULONG64 words = (PULONG64)Buffer;
+
+    for (ULONG index = 0; index < Length / sizeof(ULONG64); index++) {
+        words[index] = (Offset + (index * sizeof(ULONG64))) ^ 0xA5A55A5AC3C33C3CULL;
+    }
+}
+
+static BOOL
+CheckPattern(const UCHAR *Buffer,
+             ULONG64      Offset,
+             ULONG        Length)
+{
+    const ULONG64 *words = (const ULONG64 *)Buffer;
+
+    for (ULONG index = 0; index < Length / sizeof(ULONG64); index++) {
+
+        if (words[index] != ((Offset + (index * sizeof(ULONG64))) ^
+                             0xA5A55A5AC3C33C3CULL)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void
+StartStream(PBENCH_STREAM  Stream,
+            BENCH_WORKLOAD Workload,
+            ULONG64        MediaSize)
+{
+    Stream->Workload     = Workload;
+    Stream->Seed         = 0x2545F491;
+    Stream->MediaSectors = MediaSize / OSR_SECTOR_SIZE;
+    Stream->NextSector   = Stream->MediaSectors / 2;
+    Stream->OtherSector  = Stream->MediaSectors / 4;
+
+    if (Workload == BenchTwoStreams) {
+        Stream->NextSector = (Stream->MediaSectors / 4) * 3;
+    }
+}
+
+//
+// Queues a read on the simulated drive, at time Now, and returns when the
+// drive will be done with it
+//
+static double
+SimDriveRead(PSIM_DRIVE Drive,
+             double     Now,
+             ULONG64    Offset,
+             ULONG      Length)
+{
+    double cost = 0.0;
+
+    if (Offset != Drive->HeadOffset) {
+        cost += (double)Drive->AccessUs;
+    }
+
+    cost += (double)Length * 1000000.0 / Drive->BytesPerSecond;
+
+    Drive->FreeAt      = max(Drive->FreeAt, Now) + cost;
+    Drive->BusyUs     += cost;
+    Drive->HeadOffset  = Offset + Length;
+
+    Drive->Reads++;
+
+    return Drive->FreeAt;
+}
+
+//
+// Puts the read-aheads that the simulated drive has finished by Now into
+// the cache, the way CDFilterEvtReadAheadComplete would
+//
+static void
+SimCompleteReadAheads(POSR_SECTOR_CACHE Cache,
+                      POSR_READAHEAD    ReadAhead,
+                      PSIM_READ_AHEAD   Pending,
+                      double            Now,
+                      PUCHAR            Scratch)
+{
+    for (ULONG index = 0; index < SIM_MAX_READ_AHEADS; index++) {
+
+        if (!Pending[index].InUse || Pending[index].DoneAt > Now) {
+            continue;
+        }
+
+        FillPattern(Scratch,
+                    Pending[index].Offset,
+                    Pending[index].Length);
+
+        OsrSectorCacheInsert(Cache,
+                             Pending[index].Offset,
+                             Pending[index].Length,
+                             Scratch,
+                             Pending[index].Generation);
+
+        OsrReadAheadDone(ReadAhead,
+                         Pending[index].Cookie,
+                         TRUE);
+
+        Pending[index].InUse = FALSE;
+    }
+}
+
+//
+// One workload against the simulated drive, with a cache of CacheSize
+// bytes in front of it (or none, if CacheSize is zero) and read-ahead (if
+// MaxWindow isn't zero).  Returns the effective MB per second, counting
+// the drive's time, the app's think time and our time, and prints how that
+// compares to Baseline if there is one.
+//
+static double
+RunSimulated(BENCH_WORKLOAD    Workload,
+             const SIM_CONFIG *Config,
+             PUCHAR            Buffer,
+             PUCHAR            Scratch,
+             double            Baseline,
+             BOOL              ShowReadAhead)
+{
+    OSR_SECTOR_CACHE       cache;
+    OSR_SECTOR_CACHE_STATS stats;
+    OSR_READAHEAD          readAhead;
+    OSR_READAHEAD_STATS    readAheadStats;
+    SIM_READ_AHEAD         pending[SIM_MAX_READ_AHEADS];
+    BENCH_STREAM           stream;
+    SIM_DRIVE              drive = Config->Drive;
+    ULONG64                offset;
+    ULONG                  length;
+    ULONG64                aheadOffset;
+    ULONG                  aheadLength;
+    ULONG                  cookie;
+    ULONG                  slot;
+    ULONG64                bytes = 0;
+    ULONG64                bad   = 0;
+    LONG64                 generation;
+    BOOLEAN                hit;
+    LONGLONG               start;
+    double                 appUs = 0.0;
+    double                 cpuUs;
+    double                 totalUs;
+    double                 throughput;
+
+    RtlZeroMemory(&cache,
+                  sizeof(cache));
+
+    RtlZeroMemory(&readAhead,
+                  sizeof(readAhead));
+
+    RtlZeroMemory(pending,
+                  sizeof(pending));
+
+    if (Config->CacheSize != 0 &&
+        !OsrSectorCacheInitialize(&cache,
+                                  Config->CacheSize,
+                                  Config->PageSize)) {
+
+        printf("OsrSectorCacheInitialize failed\n");
+        OsrSectorCacheDestroy(&cache);
+        return 0.0;
+    }
+
+    if (Config->MaxWindow != 0 &&
+        !OsrReadAheadInitialize(&readAhead,
+                                Config->MinWindow,
+                                Config->MaxWindow)) {
+
+        printf("OsrReadAheadInitialize failed\n");
+        OsrSectorCacheDestroy(&cache);
+        return 0.0;
+    }
+
+    StartStream(&stream,
+                Workload,
+                Config->MediaSize);
+
+    start = Now();
+
+    for (ULONG index = 0; index < Config->Reads; index++) {
+
+        NextRead(&stream,
+                 &offset,
+                 &length);
+
+        bytes += length;
+
+        if (Config->MaxWindow != 0) {
+
+            SimCompleteReadAheads(&cache,
+                                  &readAhead,
+                                  pending,
+                                  appUs,
+                                  Scratch);
+        }
+
+        hit = (Config->CacheSize != 0 &&
+               OsrSectorCacheRead(&cache,
+                                  offset,
+                                  length,
+                                  Buffer));
+
+        if (hit) {
+
+            if (!CheckPattern(Buffer,
+                              offset,
+                              length)) {
+                bad++;
+            }
+
+        } else {
+
+            //
+            // The app waits for the drive, including for whatever was
+            // queued on it before this read
+            //
+            generation = OsrSectorCacheGeneration(&cache);
+
+            appUs = SimDriveRead(&drive,
+                                 appUs,
+                                 offset,
+                                 length);
+
+            FillPattern(Buffer,
+                        offset,
+                        length);
+
+            if (Config->CacheSize != 0) {
+
+                OsrSectorCacheInsert(&cache,
+                                     offset,
+                                     length,
+                                     Buffer,
+                                     generation);
+            }
+        }
+
+        if (Config->MaxWindow != 0 &&
+            OsrReadAheadObserve(&readAhead,
+                                offset,
+                                length,
+                                hit,
+                                &aheadOffset,
+                                &aheadLength,
+                                &cookie)) {
+
+            for (slot = 0; slot < SIM_MAX_READ_AHEADS; slot++) {
+
+                if (!pending[slot].InUse) {
+                    break;
+                }
+            }
+
+            if (slot == SIM_MAX_READ_AHEADS ||
+                aheadOffset + aheadLength > Config->MediaSize) {
+
+                //
+                // Same as a read-ahead that failed
+                //
+                OsrReadAheadDone(&readAhead,
+                                 cookie,
+                                 FALSE);
+
+            } else {
+
+                //
+                // The app doesn't wait for this one
+                //
+                pending[slot].InUse      = TRUE;
+                pending[slot].Offset     = aheadOffset;
+                pending[slot].Length     = aheadLength;
+                pending[slot].Cookie     = cookie;
+                pending[slot].Generation = OsrSectorCacheGeneration(&cache);
+                pending[slot].DoneAt     = SimDriveRead(&drive,
+                                                        appUs,
+                                                        aheadOffset,
+                                                        aheadLength);
+            }
+        }
+
+        appUs += Config->ThinkUs;
+    }
+
+    cpuUs   = (double)(Now() - start) * 1000000.0 / Frequency;
+    totalUs = appUs + cpuUs;
+
+    throughput = ((double)bytes / (1024.0 * 1024.0)) / (totalUs / 1000000.0);
+
+    OsrSectorCacheQueryStats(&cache,
+                             &stats);
+
+    OsrReadAheadQueryStats(&readAhead,
+                           &readAheadStats);
+
+    printf("%-8s %8llu %7.1f %9llu %10.1f %9.1f %9.2f",
+           WorkloadNames[Workload],
+           ShowReadAhead ? Config->MaxWindow / 1024ULL :
+                           Config->CacheSize / (1024 * 1024),
+           (Config->CacheSize != 0) ? 100.0 * stats.Hits / Config->Reads : 0.0,
+           drive.Reads,
+           appUs / 1000000.0,
+           cpuUs / 1000.0,
+           throughput);
+
+    if (Baseline > 0.0) {
+        printf("   %6.1fx",
+               throughput / Baseline);
+    } else if (ShowReadAhead) {
+        printf("   %7s", "");
+    }
+
+    if (ShowReadAhead && Config->MaxWindow != 0) {
+        printf("  %7llu %7.1f %7lu",
+               readAheadStats.BytesReadAhead / (1024 * 1024),
+               (readAheadStats.BytesReadAhead != 0) ?
+                   100.0 * readAheadStats.BytesUsed / readAheadStats.BytesReadAhead :
+                   0.0,
+               readAheadStats.AverageWindow / 1024);
+    }
+
+    printf("\n");
+
+    if (bad != 0) {
+        printf("*** %llu cache hits returned the wrong data\n",
+               bad);
+    }
+
+    OsrSectorCacheDestroy(&cache);
+
+    return throughput;
+}
+
+//
+// How long the simulated drive takes to get from one offset to another
+//
+static double
+SimSeekUs(ULONG64 MediaSize,
+          ULONG64 From,
+          ULONG64 To)
+{
+    double distance;
+
+    if (From == To) {
+        return 0.0;
+    }
+
+    distance = (double)((From > To) ? From - To : To - From) / MediaSize;
+
+    return (BENCH_SEEK_MIN_MS +
+            (BENCH_SEEK_FULL_MS - BENCH_SEEK_MIN_MS) * sqrt(distance)) * 1000.0;
+}
+
+static void
+StartClient(PBENCH_STREAM     Stream,
+            ELEVATOR_WORKLOAD Workload,
+            ULONG             Client,
+            ULONG             Clients,
+            ULONG64           MediaSize)
+{
+    BOOL sequential = (Workload == ElevatorStreams ||
+                       (Workload == ElevatorMixed && (Client % 2) == 0));
+
+    StartStream(Stream,
+                sequential ? BenchStream : BenchUniform,
+                MediaSize);
+
+    //
+    // Streams start spread out across the disc, and the others each get
+    // their own random reads
+    //
+    Stream->NextSector = (Stream->MediaSectors * (2 * Client + 1)) /
+                         (2 * Clients);
+
+    Stream->Seed += Client * 0x9E3779B9;
+}
+
+//
+// Runs a workload with Clients clients sharing the simulated drive.  The
+// drive takes whichever waiting read comes first, either in the order they
+// arrived or in C-SCAN order from osrelevator.h.  Returns MB/s.
+//
+static double
+RunElevator(ELEVATOR_WORKLOAD Workload,
+            const SIM_CONFIG *Config,
+            ULONG             Clients,
+            ULONG             DeadlineMs,
+            BOOL              Scan,
+            double            Baseline)
+{
+    SIM_WAITING_READ   waiting[BENCH_MAX_CLIENTS * BENCH_ELEVATOR_OUTSTANDING];
+    BENCH_STREAM       streams[BENCH_MAX_CLIENTS];
+    OSR_ELEVATOR       elevator;
+    OSR_ELEVATOR_STATS stats;
+    ULONG              count = Clients * BENCH_ELEVATOR_OUTSTANDING;
+    ULONG              best;
+    ULONG64            head  = 0;
+    ULONG64            seeks = 0;
+    ULONG64            bytes = 0;
+    ULONG64            nowUs = 0;
+    ULONG64            latencyUs;
+    ULONG64            maxLatencyUs = 0;
+    double             totalLatencyUs = 0.0;
+    double             doneUs;
+    double             throughput;
+
+    OsrElevatorInitialize(&elevator,
+                          (ULONG64)DeadlineMs * 1000);
+
+    for (ULONG client = 0; client < Clients; client++) {
+
+        StartClient(&streams[client],
+                    Workload,
+                    client,
+                    Clients,
+                    Config->MediaSize);
+    }
+
+    for (ULONG slot = 0; slot < count; slot++) {
+
+        waiting[slot].Client  = slot % Clients;
+        waiting[slot].Arrival = 0;
+
+        NextRead(&streams[waiting[slot].Client],
+                 &waiting[slot].Offset,
+                 &waiting[slot].Length);
+    }
+
+    for (ULONG index = 0; index < Config->Reads; index++) {
+
+        //
+        // If nothing has arrived yet, the drive sits idle until the first
+        // one does
+        //
+        best = count;
+
+        for (ULONG slot = 0; slot < count; slot++) {
+
+            if (best == count ||
+                waiting[slot].Arrival < waiting[best].Arrival) {
+                best = slot;
+            }
+        }
+
+        nowUs = max(nowUs, waiting[best].Arrival);
+
+        for (ULONG slot = 0; slot < count; slot++) {
+
+            if (waiting[slot].Arrival > nowUs) {
+                continue;
+            }
+
+            if (Scan &&
+                OsrElevatorBetter(&elevator,
+                                  nowUs,
+                                  waiting[slot].Offset,
+                                  waiting[slot].Arrival,
+                                  waiting[best].Offset,
+                                  waiting[best].Arrival)) {
+                best = slot;
+            }
+        }
+
+        OsrElevatorDispatched(&elevator,
+                              nowUs,
+                              waiting[best].Offset,
+                              waiting[best].Length,
+                              waiting[best].Arrival);
+
+        if (waiting[best].Offset != head) {
+            seeks++;
+        }
+
+        doneUs = (double)nowUs +
+                 SimSeekUs(Config->MediaSize,
+                           head,
+                           waiting[best].Offset) +
+                 (double)waiting[best].Length * 1000000.0 /
+                     Config->Drive.BytesPerSecond;
+
+        head   = waiting[best].Offset + waiting[best].Length;
+        bytes += waiting[best].Length;
+        nowUs  = (ULONG64)doneUs;
+
+        latencyUs       = nowUs - waiting[best].Arrival;
+        totalLatencyUs += (double)latencyUs;
+        maxLatencyUs    = max(maxLatencyUs, latencyUs);
+
+        //
+        // The client looks at what it got, and then asks for its next read
+        //
+        waiting[best].Arrival = nowUs + Config->ThinkUs;
+
+        NextRead(&streams[waiting[best].Client],
+                 &waiting[best].Offset,
+                 &waiting[best].Length);
+    }
+
+    throughput = ((double)bytes / (1024.0 * 1024.0)) / (nowUs / 1000000.0);
+
+    OsrElevatorQueryStats(&elevator,
+                          &stats);
+
+    printf("%-8s %8s %9lu %9llu %10.1f %9.2f",
+           ElevatorWorkloadNames[Workload],
+           Scan ? "C-SCAN" : "FIFO",
+           Config->Reads,
+           seeks,
+           nowUs / 1000000.0,
+           throughput);
+
+    if (Baseline > 0.0) {
+        printf("   %6.1fx",
+               throughput / Baseline);
+    } else {
+        printf("   %7s", "");
+    }
+
+    printf("  %7.1f %7.1f",
+           totalLatencyUs / Config->Reads / 1000.0,
+           maxLatencyUs / 1000.0);
+
+    if (Scan) {
+        printf(" %7llu",
+               stats.Expired);
+    }
+
+    printf("\n");
+
+    return throughput;
+}
+
+static BOOL
+QueryDeviceStats(POSR_SECTOR_CACHE_STATS Stats)
+{
+    DWORD bytes;
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_OSR_CDFILTER_CACHE_STATS,
+                         nullptr,
+                         0,
+                         Stats,
+                         sizeof(OSR_SECTOR_CACHE_STATS),
+                         &bytes,
+                         nullptr)) {
+
+        printf("IOCTL_OSR_CDFILTER_CACHE_STATS failed with error 0x%lx\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Quietly fails if CDFilter isn't reading ahead
+//
+static BOOL
+QueryDeviceReadAheadStats(POSR_READAHEAD_STATS Stats)
+{
+    DWORD bytes;
+
+    return DeviceIoControl(Device,
+                           IOCTL_OSR_CDFILTER_READAHEAD_STATS,
+                           nullptr,
+                           0,
+                           Stats,
+                           sizeof(OSR_READAHEAD_STATS),
+                           &bytes,
+                           nullptr);
+}
+
+//
+// One workload against a real drive, through whatever cache and read-ahead
+// CDFilter has.  The app thinks for ThinkUs (give or take the resolution
+// of Sleep) after each read.
+//
+static void
+RunDevice(BENCH_WORKLOAD Workload,
+          ULONG64        MediaSize,
+          ULONG          Reads,
+          ULONG          ThinkUs,
+          PUCHAR         Buffer)
+{
+    OSR_SECTOR_CACHE_STATS before;
+    OSR_SECTOR_CACHE_STATS after;
+    OSR_READAHEAD_STATS    readAheadBefore;
+    OSR_READAHEAD_STATS    readAheadAfter;
+    BOOL                   readAhead;
+    BENCH_STREAM           stream;
+    OVERLAPPED             overlapped;
+    ULONG64                offset;
+    ULONG                  length;
+    ULONG64                bytes = 0;
+    DWORD                  transferred;
+    LONGLONG               start;
+    double                 seconds;
+
+    if (!QueryDeviceStats(&before)) {
+        return;
+    }
+
+    readAhead = QueryDeviceReadAheadStats(&readAheadBefore);
+
+    StartStream(&stream,
+                Workload,
+                MediaSize);
+
+    start = Now();
+
+    for (ULONG index = 0; index < Reads; index++) {
+
+        NextRead(&stream,
+                 &offset,
+                 &length);
+
+        RtlZeroMemory(&overlapped,
+                      sizeof(overlapped));
+
+        overlapped.Offset     = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+        if (!ReadFile(Device,
+                      Buffer,
+                      length,
+                      &transferred,
+                      &overlapped)) {
+
+            printf("ReadFile of %lu bytes at 0x%llx failed with error 0x%lx\n",
+                   length,
+                   offset,
+                   GetLastError());
+            return;
+        }
+
+        bytes += transferred;
+
+        if (ThinkUs >= 1000) {
+            Sleep(ThinkUs / 1000);
+        }
+    }
+
+    seconds = (double)(Now() - start) / Frequency;
+
+    if (!QueryDeviceStats(&after)) {
+        return;
+    }
+
+    printf("%-8s %8llu %7.1f %9llu %10.1f %9s %9.2f",
+           WorkloadNames[Workload],
+           ((ULONG64)after.PageCount * after.PageSize) / (1024 * 1024),
+           100.0 * (after.Hits - before.Hits) / Reads,
+           after.Misses - before.Misses,
+           seconds,
+           "-",
+           ((double)bytes / (1024.0 * 1024.0)) / seconds);
+
+    if (readAhead &&
+        QueryDeviceReadAheadStats(&readAheadAfter)) {
+
+        ULONG64 fetched = readAheadAfter.BytesReadAhead -
+                          readAheadBefore.BytesReadAhead;
+
+        printf("   %7llu %7.1f",
+               fetched / (1024 * 1024),
+               (fetched != 0) ?
+                   100.0 * (readAheadAfter.BytesUsed - readAheadBefore.BytesUsed) / fetched :
+                   0.0);
+    }
+
+    printf("\n");
+}
+
+int
+__cdecl
+main(int    argc,
+     char** argv)
+{
+    SIM_CONFIG    config;
+    LARGE_INTEGER frequency;
+    GET_LENGTH_INFORMATION lengthInfo;
+    const char   *devicePath = "\\\\.\\CdRom0";
+    ULONG64       mediaSize  = BENCH_DEFAULT_MEDIA_MB * 1024ULL * 1024;
+    ULONG64       cacheSize  = BENCH_DEFAULT_CACHE_MB * 1024ULL * 1024;
+    ULONG         pageSize   = BENCH_DEFAULT_PAGE_KB * 1024;
+    ULONG         accessMs   = BENCH_DEFAULT_ACCESS_MS;
+    ULONG         rateMB     = BENCH_DEFAULT_RATE_MB;
+    ULONG         reads      = 0;
+    ULONG         thinkUs    = BENCH_DEFAULT_THINK_US;
+    ULONG         minWindow  = BENCH_DEFAULT_RA_MIN_KB * 1024;
+    ULONG         maxWindow  = BENCH_DEFAULT_RA_MAX_KB * 1024;
+    ULONG         clients    = BENCH_DEFAULT_CLIENTS;
+    ULONG         deadlineMs = BENCH_DEFAULT_DEADLINE_MS;
+    PUCHAR        buffer;
+    PUCHAR        scratch;
+    DWORD         bytes;
+    double        baseline;
+    BOOL          usage = FALSE;
+
+    for (int index = 1; index < argc; index++) {
+
+        if (strcmp(argv[index], "-device") == 0) {
+
+            if (index + 1 < argc && argv[index + 1][0] != '-') {
+                devicePath = argv[++index];
+            }
+
+            Device = CreateFileA(devicePath,
+                                 GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 nullptr,
+                                 OPEN_EXISTING,
+                                 FILE_FLAG_NO_BUFFERING,
+                                 nullptr);
+
+            if (Device == INVALID_HANDLE_VALUE) {
+
+                printf("CreateFile of %s failed with error 0x%lx\n",
+                       devicePath,
+                       GetLastError());
+                return 1;
+            }
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-media") == 0) {
+
+            mediaSize = strtoull(argv[++index], nullptr, 0) * 1024 * 1024;
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-cache") == 0) {
+
+            cacheSize = strtoull(argv[++index], nullptr, 0) * 1024 * 1024;
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-page") == 0) {
+
+            pageSize = strtoul(argv[++index], nullptr, 0) * 1024;
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-reads") == 0) {
+
+            reads = strtoul(argv[++index], nullptr, 0);
+
+            usage = (reads == 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-access") == 0) {
+
+            accessMs = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-rate") == 0) {
+
+            rateMB = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-think") == 0) {
+
+            thinkUs = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-ramin") == 0) {
+
+            minWindow = strtoul(argv[++index], nullptr, 0) * 1024;
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-ramax") == 0) {
+
+            maxWindow = strtoul(argv[++index], nullptr, 0) * 1024;
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-clients") == 0) {
+
+            clients = strtoul(argv[++index], nullptr, 0);
+
+        } else if (index + 1 < argc && strcmp(argv[index], "-deadline") == 0) {
+
+            deadlineMs = strtoul(argv[++index], nullptr, 0);
+
+        } else {
+
+            usage = TRUE;
+            break;
+        }
+    }
+
+    if (!usage && Device != INVALID_HANDLE_VALUE) {
+
+        //
+        // The disc is as big as it is
+        //
+        if (!DeviceIoControl(Device,
+                             IOCTL_DISK_GET_LENGTH_INFO,
+                             nullptr,
+                             0,
+                             &lengthInfo,
+                             sizeof(lengthInfo),
+                             &bytes,
+                             nullptr)) {
+
+            printf("IOCTL_DISK_GET_LENGTH_INFO failed with error 0x%lx\n",
+                   GetLastError());
+            return 1;
+        }
+
+        mediaSize = (ULONG64)lengthInfo.Length.QuadPart;
+    }
+
+    if (usage ||
+        mediaSize < 2 * (BENCH_HOT_SET_MB + BENCH_FILE_MB) * 1024ULL * 1024 ||
+        rateMB == 0 ||
+        minWindow < OSR_SECTOR_SIZE ||
+        minWindow > maxWindow ||
+        maxWindow > OSR_READAHEAD_MAX_WINDOW ||
+        clients == 0 ||
+        clients > BENCH_MAX_CLIENTS) {
+
+        printf("Usage: cachebench [-device [<path>]] [-reads <n>] [-media <MB>]\n"
+               "                  [-cache <MB>] [-page <KB>] [-access <ms>]\n"
+               "                  [-rate <MB/s>] [-think <us>] [-ramin <KB>]\n"
+               "                  [-ramax <KB>] [-clients <n>] [-deadline <ms>]\n");
+        return 1;
+    }
+
+    if (reads == 0) {
+        reads = (Device != INVALID_HANDLE_VALUE) ? BENCH_DEFAULT_DEVICE_READS :
+                                                   BENCH_DEFAULT_READS;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    Frequency = frequency.QuadPart;
+
+    //
+    // Page aligned, which is good enough for unbuffered reads
+    //
+    buffer = (PUCHAR)VirtualAlloc(nullptr,
+                                  BENCH_MAX_READ_SECTORS * OSR_SECTOR_SIZE,
+                                  MEM_COMMIT | MEM_RESERVE,
+                                  PAGE_READWRITE);
+
+    //
+    // Where simulated read-aheads land before they go in the cache
+    //
+    scratch = (PUCHAR)VirtualAlloc(nullptr,
+                                   OSR_READAHEAD_MAX_WINDOW,
+                                   MEM_COMMIT | MEM_RESERVE,
+                                   PAGE_READWRITE);
+
+    if (buffer == nullptr || scratch == nullptr) {
+
+        printf("VirtualAlloc failed with error 0x%lx\n",
+               GetLastError());
+        return 1;
+    }
+
+    if (Device != INVALID_HANDLE_VALUE) {
+
+        printf("Measuring %s, %llu MB of media, %lu reads per workload\n\n",
+               devicePath,
+               mediaSize / (1024 * 1024),
+               reads);
+
+        printf("%-8s %8s %7s %9s %10s %9s %9s   %7s %7s\n",
+               "Workload", "Cache MB", "Hit %", "Misses", "Seconds", "", "MB/s",
+               "RA MB", "Used %");
+
+        for (int workload = 0; workload < BenchWorkloadCount; workload++) {
+
+            RunDevice((BENCH_WORKLOAD)workload,
+                      mediaSize,
+                      reads,
+                      thinkUs,
+                      buffer);
+        }
+
+        CloseHandle(Device);
+
+    } else {
+
+        RtlZeroMemory(&config,
+                      sizeof(config));
+
+        config.MediaSize            = mediaSize;
+        config.CacheSize            = cacheSize;
+        config.PageSize             = pageSize;
+        config.Reads                = reads;
+        config.Drive.AccessUs       = (ULONG64)accessMs * 1000;
+        config.Drive.BytesPerSecond = (ULONG64)rateMB * 1024 * 1024;
+
+        printf("Simulated drive: %llu MB of media, %lu ms access, %lu MB/s, "
+               "%lu reads per workload\n"
+               "Cache pages are %lu KB\n\n",
+               mediaSize / (1024 * 1024),
+               accessMs,
+               rateMB,
+               reads,
+               pageSize / 1024);
+
+        printf("%-8s %8s %7s %9s %10s %9s %9s   %7s\n",
+               "Workload", "Cache MB", "Hit %", "Drive I/O", "Seconds",
+               "CPU ms", "MB/s", "Speedup");
+
+        for (int workload = 0; workload < BenchWorkloadCount; workload++) {
+
+            config.CacheSize = 0;
+
+            baseline = RunSimulated((BENCH_WORKLOAD)workload,
+                                    &config,
+                                    buffer,
+                                    scratch,
+                                    0.0,
+                                    FALSE);
+
+            config.CacheSize = cacheSize;
+
+            (VOID)RunSimulated((BENCH_WORKLOAD)workload,
+                               &config,
+                               buffer,
+                               scratch,
+                               baseline,
+                               FALSE);
+        }
+
+        //
+        // Now read-ahead, with the cache on both times.  The app has to
+        // spend some time on what it reads, or there's nothing for the
+        // read-ahead to overlap with.
+        //
+        printf("\nRead-ahead, %lu KB to %lu KB windows, app thinks for %lu us "
+               "per read\n\n",
+               minWindow / 1024,
+               maxWindow / 1024,
+               thinkUs);
+
+        printf("%-8s %8s %7s %9s %10s %9s %9s   %7s  %7s %7s %7s\n",
+               "Workload", "RA KB", "Hit %", "Drive I/O", "Seconds",
+               "CPU ms", "MB/s", "Speedup", "RA MB", "Used %", "Avg KB");
+
+        config.ThinkUs = thinkUs;
+
+        for (int workload = 0; workload < BenchWorkloadCount; workload++) {
+
+            config.MinWindow = 0;
+            config.MaxWindow = 0;
+
+            baseline = RunSimulated((BENCH_WORKLOAD)workload,
+                                    &config,
+                                    buffer,
+                                    scratch,
+                                    0.0,
+                                    TRUE);
+
+            config.MinWindow = minWindow;
+            config.MaxWindow = maxWindow;
+
+            (VOID)RunSimulated((BENCH_WORKLOAD)workload,
+                               &config,
+                               buffer,
+                               scratch,
+                               baseline,
+                               TRUE);
+        }
+
+        //
+        // Now the elevator, with no cache so that every read goes to the
+        // drive
+        //
+        printf("\nElevator, %lu clients with %u reads each waiting, %lu ms "
+               "deadline, %u to %u ms seeks\n\n",
+               clients,
+               BENCH_ELEVATOR_OUTSTANDING,
+               deadlineMs,
+               BENCH_SEEK_MIN_MS,
+               BENCH_SEEK_FULL_MS);
+
+        printf("%-8s %8s %9s %9s %10s %9s   %7s  %7s %7s %7s\n",
+               "Workload", "Order", "Drive I/O", "Seeks", "Seconds", "MB/s",
+               "Speedup", "Avg ms", "Max ms", "Expired");
+
+        for (int workload = 0; workload < ElevatorWorkloadCount; workload++) {
+
+            baseline = RunElevator((ELEVATOR_WORKLOAD)workload,
+                                   &config,
+                                   clients,
+                                   deadlineMs,
+                                   FALSE,
+                                   0.0);
+
+            (VOID)RunElevator((ELEVATOR_WORKLOAD)workload,
+                              &config,
+                              clients,
+                              deadlineMs,
+                              TRUE,
+                              baseline);
+        }
+    }
+
+    VirtualFree(scratch,
+                0,
+                MEM_RELEASE);
+
+    VirtualFree(buffer,
+                0,
+                MEM_RELEASE);
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+#include <osrsector.h>
+
+//
+// OSR elevator
+//
+// Picks which of the reads that are waiting for a device to send it next,
+// so that the head sweeps across the media instead of thrashing back and
+// forth between interleaved streams.  It doesn't keep the reads itself.
+// The caller walks whatever it keeps them in, asking OsrElevatorBetter
+// whether each one beats the best so far, and then tells us which one it
+// sent with OsrElevatorDispatched.
+//
+// The order is C-SCAN: the read with the lowest offset at or past where
+// the last read we sent ended, and when there aren't any of those, the
+// lowest offset of all, which starts a new sweep from the bottom.  Only
+// ever sweeping one way means that reads near the start of the media
+// don't wait twice as long as those in the middle.
+//
+// A read that's waited Deadline or more has expired.  Expired reads go
+// first, oldest first, so that a read far from a busy stream can't wait
+// forever.
+//
+// There's no lock in here.  The caller has to hold its own across looking
+// for the best read and dispatching it.  Times are in whatever units the
+// caller likes, as long as Deadline is in the same ones.
+//
+// This file builds in user mode too, which is how CacheBench simulates
+// the elevator without a driver in the way.
+//
+
+//
+// A device control code to get a copy of the OSR_ELEVATOR_STATS, which
+// takes the device type of the driver that's doing the scheduling
+//
+#define OSR_ELEVATOR_IOCTL_STATS(DeviceType) \
+    CTL_CODE(DeviceType, 4036, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _OSR_ELEVATOR {
+
+    ULONG64 Head;           // Where the last read we dispatched ended
+    ULONG64 Deadline;
+
+    ULONG64 Dispatched;
+    ULONG64 Sweeps;         // Times we went back to the bottom
+    ULONG64 Expired;        // Reads dispatched because they'd waited too long
+    ULONG64 SeekBytes;      // How far the head moved between reads
+
+} OSR_ELEVATOR, *POSR_ELEVATOR;
+
+//
+// What OsrElevatorQueryStats (and the stats IOCTL) returns
+//
+typedef struct _OSR_ELEVATOR_STATS {
+
+    ULONG64 Deadline;
+    ULONG64 Dispatched;
+    ULONG64 Sweeps;
+    ULONG64 Expired;
+    ULONG64 SeekBytes;
+
+} OSR_ELEVATOR_STATS, *POSR_ELEVATOR_STATS;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrElevatorInitialize
+//
+//    This routine sets up an elevator with its head at the start of the
+//    media
+//
+//  INPUTS:
+//
+//      Elevator - The elevator
+//
+//      Deadline - How long a read can wait before it goes ahead of the
+//                 sweep
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrElevatorInitialize(POSR_ELEVATOR Elevator,
+                      ULONG64       Deadline)
+{
+    RtlZeroMemory(Elevator,
+                  sizeof(OSR_ELEVATOR));
+
+    Elevator->Deadline = Deadline;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrElevatorBetter
+//
+//    This routine says whether one waiting read should be sent before
+//    another
+//
+//  INPUTS:
+//
+//      Elevator    - The elevator
+//
+//      Now         - The time
+//
+//      Offset      - The device offset of the read we're looking at
+//
+//      Arrival     - When it started waiting
+//
+//      BestOffset  - The device offset of the best read so far
+//
+//      BestArrival - When it started waiting
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the read we're looking at should go first
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Reads at the same offset go in the order they arrived.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline BOOLEAN
+OsrElevatorBetter(POSR_ELEVATOR Elevator,
+                  ULONG64       Now,
+                  ULONG64       Offset,
+                  ULONG64       Arrival,
+                  ULONG64       BestOffset,
+                  ULONG64       BestArrival)
+{
+    BOOLEAN expired     = (Now - Arrival >= Elevator->Deadline);
+    BOOLEAN bestExpired = (Now - BestArrival >= Elevator->Deadline);
+    BOOLEAN ahead       = (Offset >= Elevator->Head);
+    BOOLEAN bestAhead   = (BestOffset >= Elevator->Head);
+
+    if (expired || bestExpired) {
+
+        if (expired != bestExpired) {
+            return expired;
+        }
+
+        return (Arrival < BestArrival);
+    }
+
+    if (ahead != bestAhead) {
+        return ahead;
+    }
+
+    if (Offset != BestOffset) {
+        return (Offset < BestOffset);
+    }
+
+    return (Arrival < BestArrival);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrElevatorDispatched
+//
+//    This routine is told about each read the caller sends, and moves the
+//    head to where it ends
+//
+//  INPUTS:
+//
+//      Elevator - The elevator
+//
+//      Now      - The time
+//
+//      Offset   - The device offset of the read
+//
+//      Length   - The length of the read
+//
+//      Arrival  - When it started waiting
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrElevatorDispatched(POSR_ELEVATOR Elevator,
+                      ULONG64       Now,
+                      ULONG64       Offset,
+                      size_t        Length,
+                      ULONG64       Arrival)
+{
+    if (Now - Arrival >= Elevator->Deadline) {
+
+        Elevator->Expired++;
+
+    } else if (Offset < Elevator->Head) {
+
+        Elevator->Sweeps++;
+    }
+
+    Elevator->SeekBytes += (Offset > Elevator->Head) ? Offset - Elevator->Head :
+                                                       Elevator->Head - Offset;
+
+    Elevator->Dispatched++;
+    Elevator->Head = Offset + Length;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrElevatorQueryStats
+//
+//    This routine returns a copy of the elevator's counters
+//
+//  INPUTS:
+//
+//      Elevator - The elevator
+//
+//  OUTPUTS:
+//
+//      Stats    - The counters
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller holds its lock, as usual.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrElevatorQueryStats(POSR_ELEVATOR       Elevator,
+                      POSR_ELEVATOR_STATS Stats)
+{
+    Stats->Deadline   = Elevator->Deadline;
+    Stats->Dispatched = Elevator->Dispatched;
+    Stats->Sweeps     = Elevator->Sweeps;
+    Stats->Expired    = Elevator->Expired;
+    Stats->SeekBytes  = Elevator->SeekBytes;
+}
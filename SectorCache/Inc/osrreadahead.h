@@ -0,0 +1,633 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+#include <osrsector.h>
+
+//
+// OSR read-ahead
+//
+// Spots sequential streams of reads and says when, where and how much to
+// read ahead of them.  It doesn't do any I/O itself.  The caller sends
+// the read-ahead to the device and puts what comes back in its sector
+// cache, so that the stream's next reads are hits.
+//
+// Streams are told apart by where they are on the device.  We keep track
+// of up to OSR_READAHEAD_MAX_STREAMS of them at once, each with the offset
+// we expect its next read at.  A read within OSR_READAHEAD_SLACK of that
+// belongs to the stream.  A read that doesn't belong to any stream starts
+// a new one, replacing the one that's gone longest without a read.  Once
+// a stream has had OSR_READAHEAD_DETECT reads in a row that each start
+// exactly where the last one ended, it's sequential, and we start reading
+// ahead of it.
+//
+// Each stream has a window, which is how far ahead of its next read we
+// try to keep.  We start another read-ahead once less than half of the
+// window is left, and only ever have one in flight per stream.  Every
+// OSR_READAHEAD_EPOCH reads, we look at how the stream's been doing:
+//
+//  - If any of its reads missed the cache, the read-ahead didn't keep up,
+//    so the window doubles (up to MaxWindow).
+//
+//  - Otherwise, if less than half of what we read ahead was used, we're
+//    reading more than the stream wants, so the window halves (down to
+//    MinWindow).
+//
+// This file builds in user mode too, which is how CacheBench simulates
+// read-ahead without a driver in the way.
+//
+
+#define OSR_READAHEAD_MAX_STREAMS 8
+#define OSR_READAHEAD_DETECT      2
+#define OSR_READAHEAD_SLACK       (64 * 1024)
+#define OSR_READAHEAD_EPOCH       16
+
+//
+// The largest window we can be set up with
+//
+#define OSR_READAHEAD_MAX_WINDOW  (4 * 1024 * 1024)
+
+//
+// A device control code to get a copy of the OSR_READAHEAD_STATS, which
+// takes the device type of the driver that's reading ahead
+//
+#define OSR_READAHEAD_IOCTL_STATS(DeviceType) \
+    CTL_CODE(DeviceType, 4035, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _OSR_READAHEAD_STREAM {
+
+    BOOLEAN InUse;
+    BOOLEAN InFlight;       // There's a read-ahead on its way
+    ULONG   Id;             // Goes up every time the slot gets a new stream
+    ULONG   Sequential;     // Sequential reads in a row
+    ULONG   Window;
+    ULONG64 NextOffset;     // Where we expect the next read
+    ULONG64 AheadEnd;       // The end of what we've read ahead
+    ULONG64 LastUsed;
+
+    //
+    // How the stream's done since we last looked at its window
+    //
+    ULONG   EpochReads;
+    ULONG   EpochMisses;
+    ULONG64 EpochFetched;
+    ULONG64 EpochUsed;
+
+} OSR_READAHEAD_STREAM, *POSR_READAHEAD_STREAM;
+
+typedef struct _OSR_READAHEAD {
+
+    OSR_SECTOR_LOCK      Lock;
+
+    ULONG                MinWindow;
+    ULONG                MaxWindow;
+    ULONG64              Clock;
+
+    OSR_READAHEAD_STREAM Streams[OSR_READAHEAD_MAX_STREAMS];
+
+    //
+    // Only changed with the lock held
+    //
+    ULONG64              StreamsDetected;
+    ULONG64              ReadAheads;
+    ULONG64              BytesReadAhead;
+    ULONG64              BytesUsed;
+    ULONG64              Misses;
+    ULONG64              WindowGrows;
+    ULONG64              WindowShrinks;
+
+} OSR_READAHEAD, *POSR_READAHEAD;
+
+//
+// What OsrReadAheadQueryStats (and the stats IOCTL) returns
+//
+typedef struct _OSR_READAHEAD_STATS {
+
+    ULONG   MinWindow;
+    ULONG   MaxWindow;
+    ULONG   SequentialStreams;  // Streams we're reading ahead of right now
+    ULONG   AverageWindow;      // Of those streams
+
+    ULONG64 StreamsDetected;
+    ULONG64 ReadAheads;
+    ULONG64 BytesReadAhead;
+    ULONG64 BytesUsed;          // Read-ahead data that a stream then read
+    ULONG64 Misses;             // Sequential reads that missed anyway
+    ULONG64 WindowGrows;
+    ULONG64 WindowShrinks;
+
+} OSR_READAHEAD_STATS, *POSR_READAHEAD_STATS;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrReadAheadInitialize
+//
+//    This routine sets up read-ahead with no streams
+//
+//  INPUTS:
+//
+//      ReadAhead - The read-ahead state
+//
+//      MinWindow - The smallest window, and the one a stream starts with
+//
+//      MaxWindow - The largest window
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE, or FALSE if the windows are no good
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The windows are rounded down to whole sectors.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline BOOLEAN
+OsrReadAheadInitialize(POSR_READAHEAD ReadAhead,
+                       ULONG          MinWindow,
+                       ULONG          MaxWindow)
+{
+    RtlZeroMemory(ReadAhead,
+                  sizeof(OSR_READAHEAD));
+
+    OsrSectorLockInitialize(&ReadAhead->Lock);
+
+    MinWindow -= MinWindow % OSR_SECTOR_SIZE;
+    MaxWindow -= MaxWindow % OSR_SECTOR_SIZE;
+
+    if (MinWindow == 0 ||
+        MinWindow > MaxWindow ||
+        MaxWindow > OSR_READAHEAD_MAX_WINDOW) {
+
+        return FALSE;
+    }
+
+    ReadAhead->MinWindow = MinWindow;
+    ReadAhead->MaxWindow = MaxWindow;
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrReadAheadReset
+//
+//    This routine forgets about every stream, for when the media might
+//    have changed
+//
+//  INPUTS:
+//
+//      ReadAhead - The read-ahead state
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Read-aheads that are on their way no longer belong to any stream,
+//      so OsrReadAheadDone ignores them.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrReadAheadReset(POSR_READAHEAD ReadAhead)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+
+    OsrSectorAcquire(&ReadAhead->Lock,
+                     &lockState);
+
+    for (ULONG index = 0; index < OSR_READAHEAD_MAX_STREAMS; index++) {
+
+        ReadAhead->Streams[index].InUse    = FALSE;
+        ReadAhead->Streams[index].InFlight = FALSE;
+        ReadAhead->Streams[index].Id++;
+    }
+
+    OsrSectorRelease(&ReadAhead->Lock,
+                     lockState);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrReadAheadAdjustWindow
+//
+//    This routine grows or shrinks a stream's window at the end of an
+//    epoch
+//
+//  INPUTS:
+//
+//      ReadAhead - The read-ahead state
+//
+//      Stream    - The stream
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrReadAheadAdjustWindow(POSR_READAHEAD        ReadAhead,
+                         POSR_READAHEAD_STREAM Stream)
+{
+    if (Stream->EpochMisses != 0) {
+
+        if (Stream->Window < ReadAhead->MaxWindow) {
+
+            Stream->Window = min(Stream->Window * 2,
+                                 ReadAhead->MaxWindow);
+
+            ReadAhead->WindowGrows++;
+        }
+
+    } else if (Stream->EpochUsed < Stream->EpochFetched / 2) {
+
+        if (Stream->Window > ReadAhead->MinWindow) {
+
+            Stream->Window = max(Stream->Window / 2,
+                                 ReadAhead->MinWindow);
+
+            Stream->Window -= Stream->Window % OSR_SECTOR_SIZE;
+
+            ReadAhead->WindowShrinks++;
+        }
+    }
+
+    Stream->EpochReads   = 0;
+    Stream->EpochMisses  = 0;
+    Stream->EpochFetched = 0;
+    Stream->EpochUsed    = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrReadAheadObserve
+//
+//    This routine is told about every read, and says whether to read
+//    ahead of it
+//
+//  INPUTS:
+//
+//      ReadAhead - The read-ahead state
+//
+//      Offset    - The device offset of the read, in bytes
+//
+//      Length    - The length of the read
+//
+//      Hit       - TRUE if the read was satisfied from the cache
+//
+//  OUTPUTS:
+//
+//      AheadOffset - Where to read ahead from
+//
+//      AheadLength - How much to read ahead
+//
+//      Cookie      - What to pass to OsrReadAheadDone when the read-ahead
+//                    is done
+//
+//  RETURNS:
+//
+//      TRUE if the caller should read ahead, in which case it must call
+//      OsrReadAheadDone whether the read-ahead works or not
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline BOOLEAN
+OsrReadAheadObserve(POSR_READAHEAD ReadAhead,
+                    ULONG64        Offset,
+                    size_t         Length,
+                    BOOLEAN        Hit,
+                    PULONG64       AheadOffset,
+                    PULONG         AheadLength,
+                    PULONG         Cookie)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+    POSR_READAHEAD_STREAM stream = nullptr;
+    POSR_READAHEAD_STREAM victim = nullptr;
+    POSR_READAHEAD_STREAM candidate;
+    ULONG64               end    = Offset + Length;
+    ULONG64               start;
+    ULONG                 index;
+    BOOLEAN               sequential;
+
+    if (ReadAhead->MaxWindow == 0 || Length == 0) {
+        return FALSE;
+    }
+
+    OsrSectorAcquire(&ReadAhead->Lock,
+                     &lockState);
+
+    ReadAhead->Clock++;
+
+    for (index = 0; index < OSR_READAHEAD_MAX_STREAMS; index++) {
+
+        candidate = &ReadAhead->Streams[index];
+
+        if (!candidate->InUse) {
+
+            if (victim == nullptr || victim->InUse) {
+                victim = candidate;
+            }
+            continue;
+        }
+
+        if (Offset + OSR_READAHEAD_SLACK >= candidate->NextOffset &&
+            Offset <= candidate->NextOffset + OSR_READAHEAD_SLACK) {
+
+            stream = candidate;
+            break;
+        }
+
+        if (victim == nullptr ||
+            (victim->InUse && candidate->LastUsed < victim->LastUsed)) {
+            victim = candidate;
+        }
+    }
+
+    if (stream == nullptr) {
+
+        //
+        // A new stream.  Nothing to read ahead of yet.
+        //
+        victim->Id++;
+
+        victim->InUse        = TRUE;
+        victim->InFlight     = FALSE;
+        victim->Sequential   = 0;
+        victim->Window       = ReadAhead->MinWindow;
+        victim->NextOffset   = end;
+        victim->AheadEnd     = end;
+        victim->LastUsed     = ReadAhead->Clock;
+        victim->EpochReads   = 0;
+        victim->EpochMisses  = 0;
+        victim->EpochFetched = 0;
+        victim->EpochUsed    = 0;
+
+        OsrSectorRelease(&ReadAhead->Lock,
+                         lockState);
+        return FALSE;
+    }
+
+    sequential = (Offset == stream->NextOffset);
+
+    stream->LastUsed   = ReadAhead->Clock;
+    stream->NextOffset = end;
+    stream->Sequential = sequential ? stream->Sequential + 1 : 0;
+
+    if (stream->Sequential < OSR_READAHEAD_DETECT) {
+
+        //
+        // Not (or no longer) sequential, so whatever we read ahead is
+        // probably wasted
+        //
+        stream->AheadEnd = max(stream->AheadEnd,
+                               end);
+
+        OsrSectorRelease(&ReadAhead->Lock,
+                         lockState);
+        return FALSE;
+    }
+
+    if (stream->Sequential == OSR_READAHEAD_DETECT) {
+        ReadAhead->StreamsDetected++;
+    }
+
+    if (Hit) {
+
+        if (Offset < stream->AheadEnd) {
+
+            stream->EpochUsed    += min(end, stream->AheadEnd) - Offset;
+            ReadAhead->BytesUsed += min(end, stream->AheadEnd) - Offset;
+        }
+
+    } else {
+
+        stream->EpochMisses++;
+        ReadAhead->Misses++;
+    }
+
+    if (++stream->EpochReads >= OSR_READAHEAD_EPOCH) {
+
+        OsrReadAheadAdjustWindow(ReadAhead,
+                                 stream);
+    }
+
+    //
+    // Time for more?
+    //
+    if (stream->InFlight ||
+        stream->AheadEnd >= stream->NextOffset + (stream->Window / 2)) {
+
+        OsrSectorRelease(&ReadAhead->Lock,
+                         lockState);
+        return FALSE;
+    }
+
+    start = max(stream->AheadEnd,
+                stream->NextOffset);
+
+    *AheadOffset = start;
+    *AheadLength = (ULONG)(stream->NextOffset + stream->Window - start);
+    *Cookie      = (stream->Id << 8) | (ULONG)(stream - ReadAhead->Streams);
+
+    stream->AheadEnd      = start + *AheadLength;
+    stream->InFlight      = TRUE;
+    stream->EpochFetched += *AheadLength;
+
+    ReadAhead->ReadAheads++;
+    ReadAhead->BytesReadAhead += *AheadLength;
+
+    OsrSectorRelease(&ReadAhead->Lock,
+                     lockState);
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrReadAheadDone
+//
+//    This routine is called when a read-ahead is finished
+//
+//  INPUTS:
+//
+//      ReadAhead - The read-ahead state
+//
+//      Cookie    - What OsrReadAheadObserve returned
+//
+//      Success   - TRUE if the read-ahead worked
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      If the read-ahead failed (off the end of the media, most likely)
+//      the stream has to be spotted all over again before we try again.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrReadAheadDone(POSR_READAHEAD ReadAhead,
+                 ULONG          Cookie,
+                 BOOLEAN        Success)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+    POSR_READAHEAD_STREAM stream;
+
+    stream = &ReadAhead->Streams[(Cookie & 0xFF) % OSR_READAHEAD_MAX_STREAMS];
+
+    OsrSectorAcquire(&ReadAhead->Lock,
+                     &lockState);
+
+    if (stream->InUse && (stream->Id & 0xFFFFFF) == (Cookie >> 8)) {
+
+        stream->InFlight = FALSE;
+
+        if (!Success) {
+
+            stream->Sequential = 0;
+            stream->Window     = ReadAhead->MinWindow;
+        }
+    }
+
+    OsrSectorRelease(&ReadAhead->Lock,
+                     lockState);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrReadAheadQueryStats
+//
+//    This routine returns a copy of the read-ahead counters
+//
+//  INPUTS:
+//
+//      ReadAhead - The read-ahead state
+//
+//  OUTPUTS:
+//
+//      Stats     - The counters
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrReadAheadQueryStats(POSR_READAHEAD       ReadAhead,
+                       POSR_READAHEAD_STATS Stats)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+    ULONG64               windows = 0;
+
+    RtlZeroMemory(Stats,
+                  sizeof(OSR_READAHEAD_STATS));
+
+    OsrSectorAcquire(&ReadAhead->Lock,
+                     &lockState);
+
+    Stats->MinWindow = ReadAhead->MinWindow;
+    Stats->MaxWindow = ReadAhead->MaxWindow;
+
+    for (ULONG index = 0; index < OSR_READAHEAD_MAX_STREAMS; index++) {
+
+        if (ReadAhead->Streams[index].InUse &&
+            ReadAhead->Streams[index].Sequential >= OSR_READAHEAD_DETECT) {
+
+            Stats->SequentialStreams++;
+            windows += ReadAhead->Streams[index].Window;
+        }
+    }
+
+    if (Stats->SequentialStreams != 0) {
+        Stats->AverageWindow = (ULONG)(windows / Stats->SequentialStreams);
+    }
+
+    Stats->StreamsDetected = ReadAhead->StreamsDetected;
+    Stats->ReadAheads      = ReadAhead->ReadAheads;
+    Stats->BytesReadAhead  = ReadAhead->BytesReadAhead;
+    Stats->BytesUsed       = ReadAhead->BytesUsed;
+    Stats->Misses          = ReadAhead->Misses;
+    Stats->WindowGrows     = ReadAhead->WindowGrows;
+    Stats->WindowShrinks   = ReadAhead->WindowShrinks;
+
+    OsrSectorRelease(&ReadAhead->Lock,
+                     lockState);
+}
@@ -0,0 +1,941 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+//
+// OSR sector cache
+//
+// A read cache of fixed size, sector aligned pages of a block device, kept
+// in nonpaged pool and keyed by the page's byte offset on the device.  All
+// of the memory for the pages is allocated up front, so once the cache is
+// set up it never allocates anything.  When it's full, the least recently
+// used page is thrown out to make room.
+//
+// A page is PageSize bytes, which is a power of two multiple of
+// OSR_SECTOR_SIZE (a CD-ROM sector).  Lookups hash the page number into a
+// table of chains, with a bucket for every page.  Every page is also on a
+// doubly linked LRU list, most recently used first.  Pages that don't hold
+// anything sit at the end of the list, so they're always used up before
+// anything is evicted.
+//
+// A read is all or nothing: either every page it touches is in the cache,
+// and the data is copied out, or it's a miss and the caller goes to the
+// device.  When the device read completes, the caller inserts what it got
+// back.  Only pages that the read covered completely are inserted.
+//
+// The cache has a generation number that goes up every time anything is
+// invalidated.  The caller takes a snapshot of it before sending a read
+// down, and passes that to the insert.  If anything was invalidated in the
+// meantime the insert does nothing, because the data the read returned
+// might be from before whatever the invalidation was for.
+//
+// There's one lock for the whole cache, and data is copied in and out
+// while holding it.  A CD-ROM isn't going to send enough reads our way for
+// that to matter.
+//
+// This file builds in user mode too, which is how CacheBench measures the
+// cache without a driver in the way.
+//
+
+#define OSR_SECTOR_SIZE              2048
+
+#define OSR_SECTOR_CACHE_POOL_TAG    'cSrO'
+
+//
+// Limits on what the cache can be set up with
+//
+#define OSR_SECTOR_CACHE_MAX_PAGE    (256 * 1024)
+#define OSR_SECTOR_CACHE_MAX_SIZE    (1024ULL * 1024 * 1024)
+
+//
+// A device control code to get a copy of the cache's OSR_SECTOR_CACHE_STATS.
+// Like the trace IOCTLs, this takes the device type of the driver that has
+// the cache.
+//
+#define OSR_SECTOR_CACHE_IOCTL_STATS(DeviceType) \
+    CTL_CODE(DeviceType, 4034, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#ifdef _KERNEL_MODE
+
+typedef KSPIN_LOCK OSR_SECTOR_LOCK;
+typedef KIRQL      OSR_SECTOR_LOCK_STATE;
+
+#define OsrSectorLockInitialize(Lock)  KeInitializeSpinLock(Lock)
+#define OsrSectorAcquire(Lock, State)  KeAcquireSpinLock((Lock), (State))
+#define OsrSectorRelease(Lock, State)  KeReleaseSpinLock((Lock), (State))
+
+#define OsrSectorAllocate(Size)        ExAllocatePoolWithTag(NonPagedPoolNx,  \
+                                                             (Size),          \
+                                                             OSR_SECTOR_CACHE_POOL_TAG)
+#define OsrSectorFree(Pointer)         ExFreePoolWithTag((Pointer),           \
+                                                         OSR_SECTOR_CACHE_POOL_TAG)
+
+#else
+
+typedef SRWLOCK OSR_SECTOR_LOCK;
+typedef UCHAR   OSR_SECTOR_LOCK_STATE;
+
+#define OsrSectorLockInitialize(Lock)  InitializeSRWLock(Lock)
+#define OsrSectorAcquire(Lock, State)  (*(State) = 0, AcquireSRWLockExclusive(Lock))
+#define OsrSectorRelease(Lock, State)  ((void)(State), ReleaseSRWLockExclusive(Lock))
+
+#define OsrSectorAllocate(Size)        _aligned_malloc((Size),                \
+                                                       SYSTEM_CACHE_ALIGNMENT_SIZE)
+#define OsrSectorFree(Pointer)         _aligned_free(Pointer)
+
+#endif
+
+//
+// One page of the cache.  Data always points at the same PageSize bytes of
+// the cache's buffer, whatever page of the device they hold.
+//
+typedef struct _OSR_SECTOR_PAGE {
+
+    struct _OSR_SECTOR_PAGE *HashNext;
+    struct _OSR_SECTOR_PAGE *LruNext;   // Towards the least recently used
+    struct _OSR_SECTOR_PAGE *LruPrev;   // Towards the most recently used
+    ULONG64                  PageNumber;
+    BOOLEAN                  Valid;
+    PUCHAR                   Data;
+
+} OSR_SECTOR_PAGE, *POSR_SECTOR_PAGE;
+
+typedef struct _OSR_SECTOR_CACHE {
+
+    OSR_SECTOR_LOCK   Lock;
+
+    ULONG             PageSize;
+    ULONG             PageShift;
+    ULONG             PageCount;
+    ULONG             BucketMask;
+
+    POSR_SECTOR_PAGE *Buckets;
+    POSR_SECTOR_PAGE  Pages;
+    PUCHAR            Data;
+
+    //
+    // The head of the LRU list.  Lru.LruNext is the most recently used
+    // page and Lru.LruPrev is the next one we'll reuse.
+    //
+    OSR_SECTOR_PAGE   Lru;
+    ULONG             ValidPages;
+
+    volatile LONG64   Generation;
+
+    //
+    // Everything below is only changed with the lock held
+    //
+    ULONG64           Hits;
+    ULONG64           Misses;
+    ULONG64           BytesHit;
+    ULONG64           PagesInserted;
+    ULONG64           Evictions;
+    ULONG64           Invalidations;
+
+} OSR_SECTOR_CACHE, *POSR_SECTOR_CACHE;
+
+//
+// What OsrSectorCacheQueryStats (and the stats IOCTL) returns
+//
+typedef struct _OSR_SECTOR_CACHE_STATS {
+
+    ULONG   PageSize;
+    ULONG   PageCount;
+    ULONG   ValidPages;
+    ULONG   Reserved;
+
+    ULONG64 Hits;           // Reads satisfied entirely from the cache
+    ULONG64 Misses;         // Reads that had to go to the device
+    ULONG64 BytesHit;
+    ULONG64 PagesInserted;
+    ULONG64 Evictions;
+    ULONG64 Invalidations;  // Times some or all of the cache was thrown away
+
+} OSR_SECTOR_CACHE_STATS, *POSR_SECTOR_CACHE_STATS;
+
+//
+// Fibonacci hashing.  Sequential page numbers end up spread all over the
+// table instead of in neighbouring buckets.
+//
+FORCEINLINE POSR_SECTOR_PAGE *
+OsrSectorBucket(POSR_SECTOR_CACHE Cache,
+                ULONG64           PageNumber)
+{
+    return &Cache->Buckets[(ULONG)((PageNumber * 0x9E3779B97F4A7C15ULL) >> 32) &
+                           Cache->BucketMask];
+}
+
+FORCEINLINE VOID
+OsrSectorLruRemove(POSR_SECTOR_PAGE Page)
+{
+    Page->LruPrev->LruNext = Page->LruNext;
+    Page->LruNext->LruPrev = Page->LruPrev;
+}
+
+FORCEINLINE VOID
+OsrSectorLruInsertHead(POSR_SECTOR_CACHE Cache,
+                       POSR_SECTOR_PAGE  Page)
+{
+    Page->LruPrev = &Cache->Lru;
+    Page->LruNext = Cache->Lru.LruNext;
+
+    Cache->Lru.LruNext->LruPrev = Page;
+    Cache->Lru.LruNext          = Page;
+}
+
+FORCEINLINE VOID
+OsrSectorLruInsertTail(POSR_SECTOR_CACHE Cache,
+                       POSR_SECTOR_PAGE  Page)
+{
+    Page->LruNext = &Cache->Lru;
+    Page->LruPrev = Cache->Lru.LruPrev;
+
+    Cache->Lru.LruPrev->LruNext = Page;
+    Cache->Lru.LruPrev          = Page;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorFind
+//
+//    This routine looks up a page of the device in the cache
+//
+//  INPUTS:
+//
+//      Cache      - The cache
+//
+//      PageNumber - The device offset of the page, divided by the page size
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The page, or nullptr if it isn't in the cache
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the cache's lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline POSR_SECTOR_PAGE
+OsrSectorFind(POSR_SECTOR_CACHE Cache,
+              ULONG64           PageNumber)
+{
+    POSR_SECTOR_PAGE page;
+
+    for (page = *OsrSectorBucket(Cache, PageNumber);
+         page != nullptr;
+         page = page->HashNext) {
+
+        if (page->PageNumber == PageNumber) {
+            return page;
+        }
+    }
+
+    return nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorDiscard
+//
+//    This routine throws away the contents of a page and makes it the next
+//    one to be reused
+//
+//  INPUTS:
+//
+//      Cache - The cache
+//
+//      Page  - A valid page
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the cache's lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrSectorDiscard(POSR_SECTOR_CACHE Cache,
+                 POSR_SECTOR_PAGE  Page)
+{
+    POSR_SECTOR_PAGE *link;
+
+    link = OsrSectorBucket(Cache,
+                           Page->PageNumber);
+
+    while (*link != Page) {
+        link = &(*link)->HashNext;
+    }
+
+    *link = Page->HashNext;
+
+    Page->HashNext = nullptr;
+    Page->Valid    = FALSE;
+
+    Cache->ValidPages--;
+
+    OsrSectorLruRemove(Page);
+
+    OsrSectorLruInsertTail(Cache,
+                           Page);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheInitialize
+//
+//    This routine sets up an empty cache
+//
+//  INPUTS:
+//
+//      Cache     - The cache
+//
+//      CacheSize - How much data the cache can hold, in bytes
+//
+//      PageSize  - The size of each page, in bytes.  Zero means one
+//                  sector.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the cache is ready, FALSE if the sizes are no good or we
+//      couldn't get the memory
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      PageSize must be a power of two multiple of OSR_SECTOR_SIZE, and
+//      CacheSize is rounded down to a multiple of it.  The cache is always
+//      safe to pass to OsrSectorCacheDestroy, even if this fails.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline BOOLEAN
+OsrSectorCacheInitialize(POSR_SECTOR_CACHE Cache,
+                         ULONG64           CacheSize,
+                         ULONG             PageSize)
+{
+    ULONG buckets;
+
+    RtlZeroMemory(Cache,
+                  sizeof(OSR_SECTOR_CACHE));
+
+    OsrSectorLockInitialize(&Cache->Lock);
+
+    Cache->Lru.LruNext = &Cache->Lru;
+    Cache->Lru.LruPrev = &Cache->Lru;
+
+    if (PageSize == 0) {
+        PageSize = OSR_SECTOR_SIZE;
+    }
+
+    if (PageSize < OSR_SECTOR_SIZE ||
+        PageSize > OSR_SECTOR_CACHE_MAX_PAGE ||
+        (PageSize & (PageSize - 1)) != 0 ||
+        CacheSize < PageSize ||
+        CacheSize > OSR_SECTOR_CACHE_MAX_SIZE) {
+
+        return FALSE;
+    }
+
+    Cache->PageSize  = PageSize;
+    Cache->PageCount = (ULONG)(CacheSize / PageSize);
+
+    while ((1UL << Cache->PageShift) != PageSize) {
+        Cache->PageShift++;
+    }
+
+    //
+    // A bucket for every page, rounded up to a power of two
+    //
+    buckets = 1;
+
+    while (buckets < Cache->PageCount) {
+        buckets *= 2;
+    }
+
+    Cache->BucketMask = buckets - 1;
+
+    Cache->Buckets = (POSR_SECTOR_PAGE *)OsrSectorAllocate(buckets * sizeof(POSR_SECTOR_PAGE));
+    Cache->Pages   = (POSR_SECTOR_PAGE)OsrSectorAllocate(Cache->PageCount *
+                                                         sizeof(OSR_SECTOR_PAGE));
+    Cache->Data    = (PUCHAR)OsrSectorAllocate((size_t)Cache->PageCount * PageSize);
+
+    if (Cache->Buckets == nullptr ||
+        Cache->Pages == nullptr ||
+        Cache->Data == nullptr) {
+
+        return FALSE;
+    }
+
+    RtlZeroMemory(Cache->Buckets,
+                  buckets * sizeof(POSR_SECTOR_PAGE));
+
+    RtlZeroMemory(Cache->Pages,
+                  Cache->PageCount * sizeof(OSR_SECTOR_PAGE));
+
+    for (ULONG index = 0; index < Cache->PageCount; index++) {
+
+        Cache->Pages[index].Data = Cache->Data + ((size_t)index * PageSize);
+
+        OsrSectorLruInsertTail(Cache,
+                               &Cache->Pages[index]);
+    }
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheDestroy
+//
+//    This routine frees everything the cache allocated
+//
+//  INPUTS:
+//
+//      Cache - The cache
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Nobody can be using the cache.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrSectorCacheDestroy(POSR_SECTOR_CACHE Cache)
+{
+    if (Cache->Data != nullptr) {
+        OsrSectorFree(Cache->Data);
+    }
+
+    if (Cache->Pages != nullptr) {
+        OsrSectorFree(Cache->Pages);
+    }
+
+    if (Cache->Buckets != nullptr) {
+        OsrSectorFree(Cache->Buckets);
+    }
+
+    Cache->Data      = nullptr;
+    Cache->Pages     = nullptr;
+    Cache->Buckets   = nullptr;
+    Cache->PageCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheRead
+//
+//    This routine tries to satisfy a read from the cache
+//
+//  INPUTS:
+//
+//      Cache  - The cache
+//
+//      Offset - The device offset of the read, in bytes
+//
+//      Length - The length of the read
+//
+//  OUTPUTS:
+//
+//      Buffer - The data, if every page of it was in the cache
+//
+//  RETURNS:
+//
+//      TRUE if it was a hit and Buffer is filled in, FALSE if the read has
+//      to go to the device
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Offset and Length don't need to be page aligned, but a read that's
+//      only partly in the cache is a miss.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline BOOLEAN
+OsrSectorCacheRead(POSR_SECTOR_CACHE Cache,
+                   ULONG64           Offset,
+                   size_t            Length,
+                   PVOID             Buffer)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+    POSR_SECTOR_PAGE      page;
+    ULONG64               firstPage;
+    ULONG64               lastPage;
+    PUCHAR                destination = (PUCHAR)Buffer;
+    ULONG                 pageOffset;
+    size_t                chunk;
+
+    if (Cache->PageCount == 0 || Length == 0) {
+        return FALSE;
+    }
+
+    firstPage = Offset >> Cache->PageShift;
+    lastPage  = (Offset + Length - 1) >> Cache->PageShift;
+
+    OsrSectorAcquire(&Cache->Lock,
+                     &lockState);
+
+    //
+    // Make sure it's all here before we copy anything
+    //
+    for (ULONG64 pageNumber = firstPage; pageNumber <= lastPage; pageNumber++) {
+
+        if (OsrSectorFind(Cache, pageNumber) == nullptr) {
+
+            Cache->Misses++;
+
+            OsrSectorRelease(&Cache->Lock,
+                             lockState);
+            return FALSE;
+        }
+    }
+
+    pageOffset = (ULONG)(Offset & (Cache->PageSize - 1));
+
+    for (ULONG64 pageNumber = firstPage; pageNumber <= lastPage; pageNumber++) {
+
+        page = OsrSectorFind(Cache,
+                             pageNumber);
+
+        chunk = min(Length,
+                    (size_t)(Cache->PageSize - pageOffset));
+
+        RtlCopyMemory(destination,
+                      page->Data + pageOffset,
+                      chunk);
+
+        destination += chunk;
+        Length      -= chunk;
+        pageOffset   = 0;
+
+        OsrSectorLruRemove(page);
+
+        OsrSectorLruInsertHead(Cache,
+                               page);
+    }
+
+    Cache->Hits++;
+    Cache->BytesHit += destination - (PUCHAR)Buffer;
+
+    OsrSectorRelease(&Cache->Lock,
+                     lockState);
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheGeneration
+//
+//    This routine returns the cache's current generation, for a caller
+//    that's about to send a read to the device
+//
+//  INPUTS:
+//
+//      Cache - The cache
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The generation, to pass to OsrSectorCacheInsert when the read is
+//      done
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+FORCEINLINE LONG64
+OsrSectorCacheGeneration(POSR_SECTOR_CACHE Cache)
+{
+    return ReadAcquire64(&Cache->Generation);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheInsert
+//
+//    This routine adds the data from a completed device read to the cache
+//
+//  INPUTS:
+//
+//      Cache      - The cache
+//
+//      Offset     - The device offset the read started at, in bytes
+//
+//      Length     - How much data the read returned
+//
+//      Buffer     - The data
+//
+//      Generation - What OsrSectorCacheGeneration returned before the read
+//                   was sent
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Only pages that the read covered completely are inserted.  Pages
+//      that are already in the cache are just moved to the front of the
+//      LRU list.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrSectorCacheInsert(POSR_SECTOR_CACHE Cache,
+                     ULONG64           Offset,
+                     size_t            Length,
+                     const VOID       *Buffer,
+                     LONG64            Generation)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+    POSR_SECTOR_PAGE      page;
+    POSR_SECTOR_PAGE     *bucket;
+    ULONG64               firstPage;
+    ULONG64               endPage;
+
+    if (Cache->PageCount == 0) {
+        return;
+    }
+
+    firstPage = (Offset + Cache->PageSize - 1) >> Cache->PageShift;
+    endPage   = (Offset + Length) >> Cache->PageShift;
+
+    if (firstPage >= endPage) {
+        return;
+    }
+
+    //
+    // If the read was bigger than the whole cache, the end of it would
+    // just evict the start, so only bother with the end
+    //
+    if (endPage - firstPage > Cache->PageCount) {
+        firstPage = endPage - Cache->PageCount;
+    }
+
+    OsrSectorAcquire(&Cache->Lock,
+                     &lockState);
+
+    if (Cache->Generation != Generation) {
+
+        OsrSectorRelease(&Cache->Lock,
+                         lockState);
+        return;
+    }
+
+    for (ULONG64 pageNumber = firstPage; pageNumber < endPage; pageNumber++) {
+
+        page = OsrSectorFind(Cache,
+                             pageNumber);
+
+        if (page == nullptr) {
+
+            //
+            // Reuse whatever's at the end of the list.  That's an empty
+            // page if there are any.
+            //
+            page = Cache->Lru.LruPrev;
+
+            if (page->Valid) {
+
+                Cache->Evictions++;
+
+                OsrSectorDiscard(Cache,
+                                 page);
+            }
+
+            RtlCopyMemory(page->Data,
+                          (const UCHAR *)Buffer +
+                              ((pageNumber << Cache->PageShift) - Offset),
+                          Cache->PageSize);
+
+            bucket = OsrSectorBucket(Cache,
+                                     pageNumber);
+
+            page->PageNumber = pageNumber;
+            page->Valid      = TRUE;
+            page->HashNext   = *bucket;
+            *bucket          = page;
+
+            Cache->ValidPages++;
+            Cache->PagesInserted++;
+        }
+
+        OsrSectorLruRemove(page);
+
+        OsrSectorLruInsertHead(Cache,
+                               page);
+    }
+
+    OsrSectorRelease(&Cache->Lock,
+                     lockState);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheInvalidate
+//
+//    This routine throws away anything the cache has for part of the
+//    device
+//
+//  INPUTS:
+//
+//      Cache  - The cache
+//
+//      Offset - The device offset of the range, in bytes
+//
+//      Length - The length of the range.  MAXULONG64 means everything
+//               from Offset to the end of the device.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This always bumps the generation, even if nothing in the range was
+//      cached, so that reads that are on their way don't put anything back.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrSectorCacheInvalidate(POSR_SECTOR_CACHE Cache,
+                         ULONG64           Offset,
+                         ULONG64           Length)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+    POSR_SECTOR_PAGE      page;
+    ULONG64               firstPage;
+    ULONG64               lastPage;
+
+    if (Cache->PageCount == 0 || Length == 0) {
+        return;
+    }
+
+    firstPage = Offset >> Cache->PageShift;
+
+    if (Length > MAXULONG64 - Offset) {
+        lastPage = MAXULONG64 >> Cache->PageShift;
+    } else {
+        lastPage = (Offset + Length - 1) >> Cache->PageShift;
+    }
+
+    OsrSectorAcquire(&Cache->Lock,
+                     &lockState);
+
+    InterlockedIncrement64(&Cache->Generation);
+
+    Cache->Invalidations++;
+
+    if (lastPage - firstPage >= Cache->PageCount) {
+
+        //
+        // Quicker to look at every page than to look up every page number
+        //
+        for (ULONG index = 0; index < Cache->PageCount; index++) {
+
+            page = &Cache->Pages[index];
+
+            if (page->Valid &&
+                page->PageNumber >= firstPage &&
+                page->PageNumber <= lastPage) {
+
+                OsrSectorDiscard(Cache,
+                                 page);
+            }
+        }
+
+    } else {
+
+        for (ULONG64 pageNumber = firstPage; pageNumber <= lastPage; pageNumber++) {
+
+            page = OsrSectorFind(Cache,
+                                 pageNumber);
+
+            if (page != nullptr) {
+
+                OsrSectorDiscard(Cache,
+                                 page);
+            }
+        }
+    }
+
+    OsrSectorRelease(&Cache->Lock,
+                     lockState);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheInvalidateAll
+//
+//    This routine empties the cache, for when the media might have changed
+//
+//  INPUTS:
+//
+//      Cache - The cache
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+FORCEINLINE VOID
+OsrSectorCacheInvalidateAll(POSR_SECTOR_CACHE Cache)
+{
+    OsrSectorCacheInvalidate(Cache,
+                             0,
+                             MAXULONG64);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrSectorCacheQueryStats
+//
+//    This routine returns a copy of the cache's counters
+//
+//  INPUTS:
+//
+//      Cache - The cache
+//
+//  OUTPUTS:
+//
+//      Stats - The counters
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrSectorCacheQueryStats(POSR_SECTOR_CACHE       Cache,
+                         POSR_SECTOR_CACHE_STATS Stats)
+{
+    OSR_SECTOR_LOCK_STATE lockState;
+
+    RtlZeroMemory(Stats,
+                  sizeof(OSR_SECTOR_CACHE_STATS));
+
+    if (Cache->PageCount == 0) {
+        return;
+    }
+
+    OsrSectorAcquire(&Cache->Lock,
+                     &lockState);
+
+    Stats->PageSize      = Cache->PageSize;
+    Stats->PageCount     = Cache->PageCount;
+    Stats->ValidPages    = Cache->ValidPages;
+    Stats->Hits          = Cache->Hits;
+    Stats->Misses        = Cache->Misses;
+    Stats->BytesHit      = Cache->BytesHit;
+    Stats->PagesInserted = Cache->PagesInserted;
+    Stats->Evictions     = Cache->Evictions;
+    Stats->Invalidations = Cache->Invalidations;
+
+    OsrSectorRelease(&Cache->Lock,
+                     lockState);
+}
@@ -149,9 +149,10 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     WDFDEVICE             device;
     WDF_IO_QUEUE_CONFIG   queueConfig;
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
-
-    DECLARE_CONST_UNICODE_STRING(userDeviceName,
-                                 L"\\DosDevices\\Nothing");
+    PNOTHING_DEVICE_CONTEXT devContext;
+    WDF_FILEOBJECT_CONFIG fileObjectConfig;
+    PUCHAR                scratch = nullptr;
+    size_t                scratchSize;
 
     UNREFERENCED_PARAMETER(Driver);
 
@@ -202,6 +203,35 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, 
                                            &pnpPowerCallbacks);
 
+    //
+    // We want a context on each open instance of our device to keep
+    // track of its shared rings, and an EvtDeviceFileCreate callback to
+    // initialize it.
+    //
+    WDF_FILEOBJECT_CONFIG_INIT(&fileObjectConfig,
+                               NothingEvtFdoCreate,
+                               WDF_NO_EVENT_CALLBACK,
+                               WDF_NO_EVENT_CALLBACK);
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&objAttributes,
+                                            NOTHING_FILE_CONTEXT);
+
+    WdfDeviceInitSetFileObjectConfig(DeviceInit,
+                                     &fileObjectConfig,
+                                     &objAttributes);
+
+    //
+    // Back to our device context for the WDFDEVICE
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&objAttributes,
+                                            NOTHING_DEVICE_CONTEXT);
+
+    //
+    // Our key/value cache isn't a WDF object, so we need to free it
+    // ourselves when the device goes away
+    //
+    objAttributes.EvtCleanupCallback = NothingEvtDeviceCleanup;
+
     //
     // Create our device object
     //
@@ -219,11 +249,11 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
 
     //
     // Create a symbolic link to our Device Object.  This allows apps
-    // to open our device by name.  Note that we use a constant name,
-    // so this driver will support only a single instance of our device.
+    // to open our device by name.  Every instance gets a name of its own
+    // (see NothingCreateSymbolicLink), so we can have as many instances
+    // of our device as we like.
     //
-    status = WdfDeviceCreateSymbolicLink(device,
-                                         &userDeviceName);
+    status = NothingCreateSymbolicLink(device);
 
     if (!NT_SUCCESS(status)) {
 #if DBG
@@ -252,13 +282,20 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     //
     // Configure our Queue of incoming requests
     //
-    // We use only the default Queue, and we set it for sequential processing.
-    // This means that the driver will only receive one request at a time
-    // from the Queue, and will not get another request until it completes
-    // the previous one.
+    // We use only the default Queue.  Normally we set it for sequential
+    // processing, which means that the driver will only receive one request
+    // at a time from the Queue, and will not get another request until it
+    // completes the previous one.
+    //
+    // If NOTHING_PARALLEL_DISPATCH is set we use parallel processing instead,
+    // and the Queue will hand us requests as fast as they arrive, on
+    // whatever processors they arrive on.  Our storage is sharded (and
+    // locked) per-processor to handle this.
     //
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
-                                           WdfIoQueueDispatchSequential);
+                                           NOTHING_PARALLEL_DISPATCH ?
+                                               WdfIoQueueDispatchParallel :
+                                               WdfIoQueueDispatchSequential);
 
     //
     // Declare our I/O Event Processing callbacks
@@ -291,6 +328,242 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
         goto Done;
     }
 
+    devContext = NothingGetContextFromDevice(device);
+
+    //
+    // Create the manual Queue that holds the setup requests for shared
+    // rings.  Those requests stay pending until the app closes its handle
+    // (or cancels them), so we need to know when they're cancelled in
+    // order to stop using the ring.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+                             WdfIoQueueDispatchManual);
+
+    queueConfig.EvtIoCanceledOnQueue = NothingEvtRingCanceledOnQueue;
+    queueConfig.PowerManaged         = WdfFalse;
+
+    status = WdfIoQueueCreate(device,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &devContext->RingQueue);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfIoQueueCreate for ring queue failed 0x%0x\n",
+                 status);
+#endif
+        goto Done;
+    }
+
+    //
+    // In parallel mode we want one shard per processor, otherwise one
+    // shard is all we need.  We need to know this before we read our
+    // configuration, which sizes the storage so that it splits evenly
+    // between the shards.
+    //
+    if (NOTHING_PARALLEL_DISPATCH) {
+
+        devContext->ShardCount =
+                KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    } else {
+
+        devContext->ShardCount = 1;
+    }
+
+    //
+    // Find out how big our storage should be, and how big a message we
+    // should accept
+    //
+    NothingReadConfiguration(device,
+                             devContext);
+
+    //
+    // Pick the fastest way to copy big messages on this machine
+    //
+    OsrCopyInitialize(&devContext->Copy);
+
+    //
+    // Allocate the storage for our ring.  It's specific to this device
+    // instance, so we parent the memory object on the WDFDEVICE and it'll
+    // be freed for us when the device goes away.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
+
+    objAttributes.ParentObject = device;
+
+    status = WdfMemoryCreate(&objAttributes,
+                             NonPagedPoolNx,
+                             NOTHING_POOL_TAG,
+                             devContext->StorageSize,
+                             &devContext->StorageMemory,
+                             (PVOID *)&devContext->Storage);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for storage ring failed 0x%0x\n",
+                 status);
+#endif
+        goto Done;
+    }
+
+    //
+    // Allocate the shards.  Pool allocations of a page or more are always
+    // page aligned, so we round the size up to make sure that each shard
+    // really does start on its own cache line.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
+
+    objAttributes.ParentObject = device;
+
+    status = WdfMemoryCreate(&objAttributes,
+                             NonPagedPoolNx,
+                             NOTHING_POOL_TAG,
+                             ROUND_TO_PAGES(devContext->ShardCount *
+                                            sizeof(NOTHING_STORAGE_SHARD)),
+                             &devContext->ShardMemory,
+                             (PVOID *)&devContext->Shards);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for storage shards failed 0x%0x\n",
+                 status);
+#endif
+        goto Done;
+    }
+
+    //
+    // In compression mode each shard needs scratch space for the
+    // compressor and decompressor.  That's another big allocation, so we
+    // only make it if we need it.
+    //
+    scratchSize = (3 * NOTHING_COMPRESS_BLOCK_SIZE) + OSR_LZ4_HASH_TABLE_SIZE;
+
+    if (devContext->Compression) {
+
+        WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
+
+        objAttributes.ParentObject = device;
+
+        status = WdfMemoryCreate(&objAttributes,
+                                 NonPagedPoolNx,
+                                 NOTHING_POOL_TAG,
+                                 devContext->ShardCount * scratchSize,
+                                 &devContext->ScratchMemory,
+                                 (PVOID *)&scratch);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfMemoryCreate for compression scratch failed 0x%0x\n",
+                     status);
+#endif
+            goto Done;
+        }
+    }
+
+    //
+    // Give each shard its own lock and an equal slice of the storage
+    // (and of the scratch space, if there is any)
+    //
+    for (ULONG index = 0; index < devContext->ShardCount; index++) {
+
+        PNOTHING_STORAGE_SHARD shard = &devContext->Shards[index];
+
+        WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
+
+        objAttributes.ParentObject = device;
+
+        status = WdfSpinLockCreate(&objAttributes,
+                                   &shard->Lock);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                     status);
+#endif
+            goto Done;
+        }
+
+        shard->StorageSize   = devContext->StorageSize /
+                                                devContext->ShardCount;
+        shard->Storage       = devContext->Storage +
+                                        (index * shard->StorageSize);
+        shard->ReadOffset    = 0;
+        shard->WriteOffset   = 0;
+        shard->BytesStored   = 0;
+        shard->BytesReserved = 0;
+        shard->WriterBusy    = FALSE;
+        shard->ReaderBusy    = FALSE;
+        shard->Copy          = &devContext->Copy;
+        shard->StagedOffset  = 0;
+        shard->StagedBytes   = 0;
+
+        if (scratch != nullptr) {
+
+            shard->WriteScratch = scratch + (index * scratchSize);
+            shard->ReadScratch  = shard->WriteScratch +
+                                               NOTHING_COMPRESS_BLOCK_SIZE;
+            shard->Staging      = shard->ReadScratch +
+                                               NOTHING_COMPRESS_BLOCK_SIZE;
+            shard->HashTable    = (PUSHORT)(shard->Staging +
+                                               NOTHING_COMPRESS_BLOCK_SIZE);
+        } else {
+
+            shard->WriteScratch = nullptr;
+            shard->ReadScratch  = nullptr;
+            shard->Staging      = nullptr;
+            shard->HashTable    = nullptr;
+        }
+    }
+
+    //
+    // Allocate our per-processor counters, page aligned for the same
+    // reason as the shards
+    //
+    devContext->CounterCount =
+                KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
+
+    objAttributes.ParentObject = device;
+
+    status = WdfMemoryCreate(&objAttributes,
+                             NonPagedPoolNx,
+                             NOTHING_POOL_TAG,
+                             ROUND_TO_PAGES(devContext->CounterCount *
+                                            sizeof(NOTHING_CPU_COUNTERS)),
+                             &devContext->CounterMemory,
+                             (PVOID *)&devContext->Counters);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for counters failed 0x%0x\n",
+                 status);
+#endif
+        goto Done;
+    }
+
+    RtlZeroMemory(devContext->Counters,
+                  devContext->CounterCount * sizeof(NOTHING_CPU_COUNTERS));
+
+    //
+    // Set up our key/value cache, if we're supposed to have one
+    //
+    if (devContext->KvCacheSize != 0) {
+
+        if (OsrKvInitialize(&devContext->KvTable,
+                            devContext->ShardCount *
+                                        NOTHING_KV_SEGMENTS_PER_SHARD,
+                            devContext->KvCacheEntries,
+                            devContext->KvCacheSize) != OsrKvSuccess) {
+#if DBG
+            DbgPrint("OsrKvInitialize failed\n");
+#endif
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Done;
+        }
+    }
+
     status = STATUS_SUCCESS;
 
 Done:
@@ -298,6 +571,80 @@ Done:
     return (status);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingCreateSymbolicLink
+//
+//    This routine gives our device a name that apps can open
+//
+//  INPUTS:
+//
+//      Device     - Our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      The device context's InstanceNumber
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or the reason we couldn't create a link.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      Each instance of the device gets its own name: Nothing0, Nothing1,
+//      and so on.  We take the lowest number that isn't already in use, so
+//      when a device goes away the next one to arrive reuses its number.
+//      The object manager tells us if the name's taken, which makes this
+//      safe even if two devices are being added at once.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+NothingCreateSymbolicLink(WDFDEVICE Device)
+{
+    NTSTATUS       status = STATUS_OBJECT_NAME_COLLISION;
+    UNICODE_STRING linkName;
+    WCHAR          linkBuffer[NOTHING_LINK_NAME_LENGTH];
+
+    RtlInitEmptyUnicodeString(&linkName,
+                              linkBuffer,
+                              sizeof(linkBuffer));
+
+    for (ULONG instance = 0; instance < NOTHING_MAX_INSTANCES; instance++) {
+
+        status = RtlUnicodeStringPrintf(&linkName,
+                                        L"\\DosDevices\\Nothing%lu",
+                                        instance);
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        status = WdfDeviceCreateSymbolicLink(Device,
+                                             &linkName);
+
+        if (NT_SUCCESS(status)) {
+
+            NothingGetContextFromDevice(Device)->InstanceNumber = instance;
+
+#if DBG
+            DbgPrint("Device is %wZ\n",
+                     &linkName);
+#endif
+            break;
+        }
+
+        if (status != STATUS_OBJECT_NAME_COLLISION) {
+            break;
+        }
+    }
+
+    return status;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  NothingEvtDeviceD0Entry
@@ -392,6 +739,46 @@ NothingEvtDeviceD0Exit(WDFDEVICE              Device,
     return STATUS_SUCCESS;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtDeviceCleanup
+//
+//    This routine is called by the framework when one of our devices is
+//    being deleted
+//
+//  INPUTS:
+//
+//      Object - One of our WDFDEVICE objects
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Everything else we allocated is parented on the device, so the
+//      only thing we have to free is the key/value cache.  Our queues
+//      are long gone by now, so nobody can be using it.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtDeviceCleanup(WDFOBJECT Object)
+{
+    PNOTHING_DEVICE_CONTEXT devContext;
+
+    devContext = NothingGetContextFromDevice((WDFDEVICE)Object);
+
+    OsrKvDestroy(&devContext->KvTable);
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -430,9 +817,12 @@ NothingEvtRead(WDFQUEUE   Queue,
                size_t     Length)
 {
     PNOTHING_DEVICE_CONTEXT devContext;
+    PNOTHING_FILE_CONTEXT   fileContext;
     NTSTATUS                status;
     PVOID                   outBuffer;
     size_t                  outLength;
+    ULONG                   crc        = 0;
+    PULONG                  crcPointer = nullptr;
 
     UNREFERENCED_PARAMETER(Length);
 
@@ -447,23 +837,6 @@ NothingEvtRead(WDFQUEUE   Queue,
     devContext = NothingGetContextFromDevice(
                                 WdfIoQueueGetDevice(Queue) );
 
-    //
-    // Any data waiting?
-    //
-    if(devContext->BytesStored == 0) {
-
-#if DBG
-        DbgPrint("No data waiting. Completing with 0 bytes transferred\n");
-#endif
-        //
-        // Well, THAT was easy...
-        //
-        status = STATUS_SUCCESS;
-        outLength = 0;
-
-        goto done;
-    }
-
     status =  WdfRequestRetrieveOutputBuffer(Request,
                                              1,              // min size
                                              &outBuffer,
@@ -484,24 +857,37 @@ NothingEvtRead(WDFQUEUE   Queue,
     }
 
     //
-    // Limit number of bytes returned to the number of bytes in the data storage area
+    // In integrity mode we checksum the data while we copy it
     //
-    if(outLength > devContext->BytesStored) {
-        outLength = devContext->BytesStored;
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+
+    if (ReadNoFence(&fileContext->Integrity) != 0) {
+        crcPointer = &crc;
     }
 
     //
-    // Copy the data from our storage area to the user's data buffer
+    // Drain as much as we can from storage into the user's data buffer.
+    // This returns the number of bytes actually copied, which is limited
+    // to the number of bytes waiting.
     //
-    RtlCopyMemory(outBuffer,
-                  devContext->Storage,
-                  outLength);
+    outLength = NothingStorageGet(devContext,
+                                  outBuffer,
+                                  outLength,
+                                  crcPointer);
 
-    //
-    // Given that the data's been retrieved we set the
-    // count of bytes stored to zero
-    //
-    devContext->BytesStored = 0;
+    if (crcPointer != nullptr) {
+
+        InterlockedExchange64(&fileContext->LastRead,
+                              (LONG64)(((ULONG64)outLength << 32) | crc));
+
+        InterlockedIncrement64(&fileContext->IntegrityReads);
+    }
+
+#if DBG
+    if (outLength == 0) {
+        DbgPrint("No data waiting. Completing with 0 bytes transferred\n");
+    }
+#endif
 
     status = STATUS_SUCCESS;
 
@@ -558,9 +944,12 @@ NothingEvtWrite(WDFQUEUE   Queue,
                 size_t     Length)
 {
     PNOTHING_DEVICE_CONTEXT devContext;
+    PNOTHING_FILE_CONTEXT   fileContext;
     NTSTATUS                status;
     PVOID                   inBuffer;
     size_t                  inLength;
+    ULONG                   crc        = 0;
+    PULONG                  crcPointer = nullptr;
 
 #if DBG
     DbgPrint("NothingEvtWrite\n");
@@ -572,22 +961,6 @@ NothingEvtWrite(WDFQUEUE   Queue,
     devContext = NothingGetContextFromDevice(
                                 WdfIoQueueGetDevice(Queue) );
 
-    if(devContext->BytesStored != 0) {
-
-#if DBG
-        DbgPrint("Data already stored. Completing with 0 bytes transferred\n");
-#endif
-
-        //
-        // There are already data stored in the buffer, complete
-        // the write with an error.
-        //
-        status = STATUS_DEVICE_BUSY;    // Translates to Win32 ERROR_BUSY
-        inLength = 0;
-
-        goto done;
-    }
-
     status =  WdfRequestRetrieveInputBuffer(Request,
                                             1,              // minimum acceptable buffer size
                                             &inBuffer,
@@ -608,25 +981,56 @@ NothingEvtWrite(WDFQUEUE   Queue,
         goto done;
     }
 
-    //
-    // Limit number of bytes stored to length of data storage area
-    //
-    if(inLength > NOTHING_BUFFER_MAX_LENGTH) {
-        inLength = NOTHING_BUFFER_MAX_LENGTH;
+    if (inLength > devContext->MaxMessageSize) {
+
+#if DBG
+        DbgPrint("Write of 0x%Ix bytes is too big\n", inLength);
+#endif
+        status   = STATUS_INVALID_BUFFER_SIZE;
+        inLength = 0;
+
+        goto done;
     }
 
-    //
-    // Store the data from the write into our storage area
-    //
-    RtlCopyMemory(devContext->Storage,
-                  inBuffer,
-                  inLength);
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+
+    if (ReadNoFence(&fileContext->Integrity) != 0) {
+        crcPointer = &crc;
+    }
 
     //
-    // Remember how many bytes of data we have waiting for the next
-    // lucky reader
+    // Append the data from the write to our storage.  If there isn't
+    // room for all of it we store what fits and complete the write with
+    // the number of bytes we took, just like a pipe would.
     //
-    devContext->BytesStored = inLength;
+    inLength = NothingStoragePut(devContext,
+                                 inBuffer,
+                                 inLength,
+                                 crcPointer);
+
+    if (inLength == 0) {
+
+#if DBG
+        DbgPrint("Storage full. Completing with 0 bytes transferred\n");
+#endif
+
+        //
+        // There's no room left anywhere, complete the write with
+        // an error.  The caller can try again once a reader has drained
+        // some of the data.
+        //
+        status = STATUS_DEVICE_BUSY;    // Translates to Win32 ERROR_BUSY
+
+        goto done;
+    }
+
+    if (crcPointer != nullptr) {
+
+        InterlockedExchange64(&fileContext->LastWrite,
+                              (LONG64)(((ULONG64)inLength << 32) | crc));
+
+        InterlockedIncrement64(&fileContext->IntegrityWrites);
+    }
 
     status = STATUS_SUCCESS;
 
@@ -687,22 +1091,2844 @@ NothingEvtDeviceControl(WDFQUEUE   Queue,
                         size_t     InputBufferLength,
                         ULONG      IoControlCode)
 {
-    UNREFERENCED_PARAMETER(IoControlCode);
+    PNOTHING_DEVICE_CONTEXT devContext;
+
     UNREFERENCED_PARAMETER(InputBufferLength);
     UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(Queue);
 
 #if DBG
     DbgPrint("NothingEvtDeviceControl\n");
 #endif
 
-    //
-    // Nothing to do...
-    // In this case, we return an info field of zero
-    //
-    WdfRequestCompleteWithInformation(Request,
-                                      STATUS_SUCCESS,
-                                      0);
+    devContext = NothingGetContextFromDevice(
+                                WdfIoQueueGetDevice(Queue) );
+
+    switch (IoControlCode) {
+
+        case IOCTL_OSR_NOTHING:
+
+            //
+            // Nothing to do...
+            // In this case, we return an info field of zero
+            //
+            WdfRequestCompleteWithInformation(Request,
+                                              STATUS_SUCCESS,
+                                              0);
+            break;
+
+        case IOCTL_OSR_NOTHING_BATCH_WRITE:
+        case IOCTL_OSR_NOTHING_BATCH_READ:
+
+            //
+            // A whole batch of writes or reads in one go
+            //
+            NothingProcessBatch(devContext,
+                                Request,
+                                IoControlCode == IOCTL_OSR_NOTHING_BATCH_WRITE);
+            break;
+
+        case IOCTL_OSR_NOTHING_RING_SETUP:
+
+            //
+            // App is handing us its shared rings.  This one stays pending.
+            //
+            NothingSharedRingSetup(devContext,
+                                   Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_RING_ENTER:
+
+            //
+            // Doorbell. Go process whatever's been submitted.
+            //
+            NothingSharedRingEnter(devContext,
+                                   Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_GET_STATS:
+
+            NothingGetStats(devContext,
+                            Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_SET_INTEGRITY:
+
+            NothingSetIntegrity(Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_GET_INTEGRITY:
+
+            NothingGetIntegrity(Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_KV_PUT:
+
+            NothingKvPut(devContext,
+                         Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_KV_GET:
+
+            NothingKvGet(devContext,
+                         Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_KV_DELETE:
+
+            NothingKvDelete(devContext,
+                            Request);
+            break;
+
+        case IOCTL_OSR_NOTHING_KV_STATS:
+
+            NothingKvGetStats(devContext,
+                              Request);
+            break;
+
+        default:
+
+            WdfRequestCompleteWithInformation(Request,
+                                              STATUS_INVALID_DEVICE_REQUEST,
+                                              0);
+            break;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingProcessBatch
+//
+//    This routine processes a batched write or read IOCTL
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - An IOCTL_OSR_NOTHING_BATCH_WRITE or
+//                   IOCTL_OSR_NOTHING_BATCH_READ request
+//
+//      IsWrite    - TRUE for a batch write, FALSE for a batch read
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      See nothing_ioctl.h for the layout of the buffers.  Each record is
+//      handled exactly like a WriteFile or ReadFile of the same data
+//      would be.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingProcessBatch(PNOTHING_DEVICE_CONTEXT DevContext,
+                    WDFREQUEST              Request,
+                    BOOLEAN                 IsWrite)
+{
+    NTSTATUS              status;
+    PNOTHING_BATCH        batch;
+    size_t                batchLength;
+    PUCHAR                outBuffer;
+    size_t                outLength;
+    PNOTHING_BATCH_RESULT results;
+    size_t                resultsLength;
+    PNOTHING_BATCH_RECORD record;
+    size_t                bytesTransferred;
+    ULONG                 index = 0;
+
+    //
+    // Get the batch description...
+    //
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(NOTHING_BATCH),
+                                           (PVOID *)&batch,
+                                           &batchLength);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get batch input buffer - 0x%x\n", status);
+#endif
+        goto done;
+    }
+
+    //
+    // ...and make sure that it's as big as it says it is
+    //
+    if (batch->RecordCount == 0 ||
+        batch->RecordCount > (batchLength - FIELD_OFFSET(NOTHING_BATCH, Records)) /
+                                                   sizeof(NOTHING_BATCH_RECORD)) {
+
+        status = STATUS_INVALID_PARAMETER;
+        goto done;
+    }
+
+    //
+    // Get the output buffer, which has to at least hold the results.
+    // This is the locked down user buffer, mapped into kernel virtual
+    // address space for us by the framework.
+    //
+    resultsLength = (size_t)batch->RecordCount * sizeof(NOTHING_BATCH_RESULT);
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            resultsLength,
+                                            (PVOID *)&outBuffer,
+                                            &outLength);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get batch output buffer - 0x%x\n", status);
+#endif
+        goto done;
+    }
+
+    results = (PNOTHING_BATCH_RESULT)outBuffer;
+
+    for (index = 0; index < batch->RecordCount; index++) {
+
+        record = &batch->Records[index];
+
+        //
+        // The message has to be in the data area of the output buffer,
+        // after the results.  Be careful about overflow here, these values
+        // come straight from the app.
+        //
+        if (record->DataOffset < resultsLength ||
+            record->DataOffset > outLength ||
+            record->DataLength > outLength - record->DataOffset) {
+
+            results[index].Status           = STATUS_INVALID_PARAMETER;
+            results[index].BytesTransferred = 0;
+            continue;
+        }
+
+        if (IsWrite && record->DataLength > DevContext->MaxMessageSize) {
+
+            results[index].Status           = STATUS_INVALID_BUFFER_SIZE;
+            results[index].BytesTransferred = 0;
+            continue;
+        }
+
+        if (IsWrite) {
+
+            bytesTransferred = NothingStoragePut(DevContext,
+                                                 outBuffer + record->DataOffset,
+                                                 record->DataLength,
+                                                 nullptr);
+
+            //
+            // Just like a write, no room at all means busy
+            //
+            results[index].Status = (bytesTransferred == 0 &&
+                                     record->DataLength != 0) ?
+                                        STATUS_DEVICE_BUSY : STATUS_SUCCESS;
+
+        } else {
+
+            bytesTransferred = NothingStorageGet(DevContext,
+                                                 outBuffer + record->DataOffset,
+                                                 record->DataLength,
+                                                 nullptr);
+
+            results[index].Status = STATUS_SUCCESS;
+        }
+
+        results[index].BytesTransferred = (ULONG)bytesTransferred;
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+#if DBG
+    DbgPrint("Completing batch with 0x%x records processed\n", index);
+#endif
+
+    WdfRequestCompleteWithInformation(Request,
+                                      status,
+                                      index);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtFdoCreate
+//
+//    This routine is called by the framework when someone is
+//    trying to open a HANDLE to our device
+//
+//  INPUTS:
+//
+//      Device   - One of our devices
+//
+//      Request  - A create request
+//
+//      FileObject - The WDFFILEOBJECT representing the new
+//                   open instance
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      The framework zeroes our file context for us, so all we need to
+//      do is create the lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtFdoCreate(WDFDEVICE     Device,
+                    WDFREQUEST    Request,
+                    WDFFILEOBJECT FileObject)
+{
+    PNOTHING_FILE_CONTEXT fileContext;
+    WDF_OBJECT_ATTRIBUTES objAttributes;
+    NTSTATUS              status;
+
+    UNREFERENCED_PARAMETER(Device);
+
+    fileContext = NothingGetFileContext(FileObject);
+
+    //
+    // The lock goes away with the file object
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
+
+    objAttributes.ParentObject = FileObject;
+
+    status = WdfSpinLockCreate(&objAttributes,
+                               &fileContext->RingLock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                 status);
+#endif
+    }
+
+    WdfRequestComplete(Request,
+                       status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingSharedRingSetup
+//
+//    This routine processes an IOCTL_OSR_NOTHING_RING_SETUP request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The setup request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      If the layout's good we park the request on our RingQueue.  As long
+//      as the request is pending the I/O Manager keeps the app's region
+//      locked down, and the mapping the framework gave us stays valid.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingSharedRingSetup(PNOTHING_DEVICE_CONTEXT DevContext,
+                       WDFREQUEST              Request)
+{
+    NTSTATUS              status;
+    PNOTHING_FILE_CONTEXT fileContext;
+    PUCHAR                ringBase;
+    size_t                ringLength;
+    NOTHING_RING_HEADER   layout;
+
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NOTHING_RING_HEADER),
+                                            (PVOID *)&ringBase,
+                                            &ringLength);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get ring buffer - 0x%x\n", status);
+#endif
+        goto done;
+    }
+
+    //
+    // Take ONE copy of the layout the app gave us and check that copy
+    //
+    RtlCopyMemory(&layout,
+                  ringBase,
+                  sizeof(layout));
+
+    if (layout.Version != NOTHING_RING_VERSION ||
+        layout.SubmissionEntries == 0 ||
+        (layout.SubmissionEntries & (layout.SubmissionEntries - 1)) != 0 ||
+        layout.CompletionEntries == 0 ||
+        (layout.CompletionEntries & (layout.CompletionEntries - 1)) != 0 ||
+        layout.SubmissionOffset < sizeof(NOTHING_RING_HEADER) ||
+        layout.CompletionOffset < sizeof(NOTHING_RING_HEADER) ||
+        (layout.SubmissionOffset % sizeof(ULONGLONG)) != 0 ||
+        (layout.CompletionOffset % sizeof(ULONGLONG)) != 0 ||
+        (ULONGLONG)layout.SubmissionOffset +
+            (ULONGLONG)layout.SubmissionEntries * sizeof(NOTHING_RING_SUBMISSION) > ringLength ||
+        (ULONGLONG)layout.CompletionOffset +
+            (ULONGLONG)layout.CompletionEntries * sizeof(NOTHING_RING_COMPLETION) > ringLength ||
+        (ULONGLONG)layout.DataOffset + layout.DataLength > ringLength) {
+
+#if DBG
+        DbgPrint("Bad ring layout\n");
+#endif
+        status = STATUS_INVALID_PARAMETER;
+        goto done;
+    }
+
+    WdfSpinLockAcquire(fileContext->RingLock);
+
+    //
+    // One set of rings per open instance.  If the last ring was just torn
+    // down, a doorbell might still be finishing with it.
+    //
+    if (fileContext->RingBase != nullptr ||
+        fileContext->RingEntering) {
+
+        WdfSpinLockRelease(fileContext->RingLock);
+
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto done;
+    }
+
+    fileContext->RingBase          = ringBase;
+    fileContext->RingLength        = ringLength;
+    fileContext->Header            = (PNOTHING_RING_HEADER)ringBase;
+    fileContext->Submissions       = (PNOTHING_RING_SUBMISSION)(ringBase +
+                                                     layout.SubmissionOffset);
+    fileContext->Completions       = (PNOTHING_RING_COMPLETION)(ringBase +
+                                                     layout.CompletionOffset);
+    fileContext->SubmissionEntries = layout.SubmissionEntries;
+    fileContext->CompletionEntries = layout.CompletionEntries;
+    fileContext->DataOffset        = layout.DataOffset;
+    fileContext->DataLength        = layout.DataLength;
+    fileContext->SubmissionHead    = 0;
+    fileContext->CompletionTail    = 0;
+
+    WriteULongRelease((volatile ULONG *)&fileContext->Header->SubmissionHead,
+                      0);
+    WriteULongRelease((volatile ULONG *)&fileContext->Header->CompletionTail,
+                      0);
+
+    WdfSpinLockRelease(fileContext->RingLock);
+
+    //
+    // Park the request.  From here on it's cancellation (which is what
+    // happens when the app closes its handle) that ends the ring's life.
+    //
+    status = WdfRequestForwardToIoQueue(Request,
+                                        DevContext->RingQueue);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfRequestForwardToIoQueue failed with Status code 0x%x",
+                 status);
+#endif
+        NothingSharedRingTeardown(fileContext,
+                                  Request,
+                                  status);
+        return;
+    }
+
+    return;
+
+done:
+
+    WdfRequestComplete(Request,
+                       status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingSharedRingEnter
+//
+//    This routine processes an IOCTL_OSR_NOTHING_RING_ENTER request (the
+//    "doorbell")
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The doorbell request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We complete the request with the number of submissions that we
+//      processed.  We stop early if the completion ring fills up, and we
+//      never process more than one ring's worth of submissions per doorbell.
+//
+//      Everything in the region belongs to the app and can change under us
+//      at any time, so we read each submission exactly once and check it
+//      against our own copy of the layout.
+//
+//      A write or read can move up to MaxMessageSize bytes (and compress
+//      them), so we don't hold the RingLock while we do it.  We claim the
+//      submission and a completion slot with the lock held, drop it for the
+//      storage call, and take it back to publish the completion.  Only one
+//      doorbell per ring does this at a time.  One that finds another
+//      already running just tells it to look again, and completes with
+//      zero.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingSharedRingEnter(PNOTHING_DEVICE_CONTEXT DevContext,
+                       WDFREQUEST              Request)
+{
+    NTSTATUS                 status;
+    PNOTHING_FILE_CONTEXT    fileContext;
+    NOTHING_RING_SUBMISSION  submission;
+    PNOTHING_RING_COMPLETION completion;
+    PUCHAR                   ringBase;
+    WDFREQUEST               teardownRequest;
+    ULONG                    submissionTail;
+    ULONG                    completionHead;
+    ULONG                    completionSlot;
+    size_t                   bytesTransferred;
+    ULONG                    processed = 0;
+    ULONG                    limit;
+
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+
+    WdfSpinLockAcquire(fileContext->RingLock);
+
+    if (fileContext->RingBase == nullptr) {
+
+        WdfSpinLockRelease(fileContext->RingLock);
+
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto done;
+    }
+
+    if (fileContext->RingEntering) {
+
+        //
+        // The doorbell that's running will get to our submissions
+        //
+        fileContext->RingKicked = TRUE;
+
+        WdfSpinLockRelease(fileContext->RingLock);
+
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    fileContext->RingEntering = TRUE;
+
+    //
+    // The region stays locked down until we say we're done with it, even
+    // if the ring is torn down while we don't hold the lock
+    //
+    ringBase = fileContext->RingBase;
+    limit    = fileContext->SubmissionEntries;
+
+    for (;;) {
+
+        if (fileContext->RingBase == nullptr) {
+            break;
+        }
+
+        submissionTail = ReadULongAcquire(
+                   (volatile ULONG *)&fileContext->Header->SubmissionTail);
+
+        if (fileContext->SubmissionHead == submissionTail ||
+            processed >= limit) {
+
+            //
+            // Another doorbell rang while we were working, so it gets its
+            // own ring's worth
+            //
+            if (!fileContext->RingKicked) {
+                break;
+            }
+
+            fileContext->RingKicked = FALSE;
+
+            limit = processed + fileContext->SubmissionEntries;
+            continue;
+        }
+
+        //
+        // Room for another completion?
+        //
+        completionHead = ReadULongAcquire(
+                   (volatile ULONG *)&fileContext->Header->CompletionHead);
+
+        if (fileContext->CompletionTail - completionHead >=
+                                            fileContext->CompletionEntries) {
+            break;
+        }
+
+        RtlCopyMemory(&submission,
+                      &fileContext->Submissions[fileContext->SubmissionHead &
+                                       (fileContext->SubmissionEntries - 1)],
+                      sizeof(submission));
+
+        completionSlot = fileContext->CompletionTail;
+
+        fileContext->SubmissionHead++;
+        fileContext->CompletionTail++;
+
+        WdfSpinLockRelease(fileContext->RingLock);
+
+        bytesTransferred = 0;
+
+        //
+        // The data has to be inside the data area
+        //
+        if (submission.DataOffset < fileContext->DataOffset ||
+            submission.DataOffset - fileContext->DataOffset > fileContext->DataLength ||
+            submission.DataLength > fileContext->DataLength -
+                           (submission.DataOffset - fileContext->DataOffset)) {
+
+            status = STATUS_INVALID_PARAMETER;
+
+        } else {
+
+            switch (submission.Opcode) {
+
+                case NOTHING_RING_OP_NOP:
+
+                    status = STATUS_SUCCESS;
+                    break;
+
+                case NOTHING_RING_OP_WRITE:
+
+                    if (submission.DataLength > DevContext->MaxMessageSize) {
+
+                        status = STATUS_INVALID_BUFFER_SIZE;
+                        break;
+                    }
+
+                    bytesTransferred = NothingStoragePut(DevContext,
+                                         ringBase + submission.DataOffset,
+                                         submission.DataLength,
+                                         nullptr);
+
+                    status = (bytesTransferred == 0 &&
+                              submission.DataLength != 0) ?
+                                 STATUS_DEVICE_BUSY : STATUS_SUCCESS;
+                    break;
+
+                case NOTHING_RING_OP_READ:
+
+                    if (submission.DataLength > DevContext->MaxMessageSize) {
+
+                        status = STATUS_INVALID_BUFFER_SIZE;
+                        break;
+                    }
+
+                    bytesTransferred = NothingStorageGet(DevContext,
+                                         ringBase + submission.DataOffset,
+                                         submission.DataLength,
+                                         nullptr);
+
+                    status = STATUS_SUCCESS;
+                    break;
+
+                default:
+
+                    status = STATUS_INVALID_PARAMETER;
+                    break;
+            }
+        }
+
+        WdfSpinLockAcquire(fileContext->RingLock);
+
+        completion = &fileContext->Completions[completionSlot &
+                                       (fileContext->CompletionEntries - 1)];
+
+        completion->UserData         = submission.UserData;
+        completion->Status           = status;
+        completion->BytesTransferred = (ULONG)bytesTransferred;
+
+        processed++;
+
+        //
+        // Publish our progress.  The release semantics make sure the app
+        // sees the completion itself before it sees the new tail.
+        //
+        WriteULongRelease((volatile ULONG *)&fileContext->Header->CompletionTail,
+                          fileContext->CompletionTail);
+        WriteULongRelease((volatile ULONG *)&fileContext->Header->SubmissionHead,
+                          fileContext->SubmissionHead);
+    }
+
+    //
+    // If the ring was torn down while we were using it, it's up to us to
+    // let the region go
+    //
+    fileContext->RingEntering = FALSE;
+    fileContext->RingKicked   = FALSE;
+
+    teardownRequest            = fileContext->RingTeardown;
+    fileContext->RingTeardown  = nullptr;
+
+    WdfSpinLockRelease(fileContext->RingLock);
+
+    if (teardownRequest != nullptr) {
+
+        WdfRequestComplete(teardownRequest,
+                           fileContext->RingTeardownStatus);
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    WdfRequestCompleteWithInformation(Request,
+                                      status,
+                                      processed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingSharedRingTeardown
+//
+//    This routine stops us using an open instance's shared rings, and
+//    completes the setup request that described them
+//
+//  INPUTS:
+//
+//      FileContext  - The open instance's file context
+//
+//      SetupRequest - The IOCTL_OSR_NOTHING_RING_SETUP request
+//
+//      Status       - What to complete it with
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Completing the setup request unlocks the region.  If a doorbell is
+//      using it right now, we leave the request for the doorbell to
+//      complete when it's done.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingSharedRingTeardown(PNOTHING_FILE_CONTEXT FileContext,
+                          WDFREQUEST            SetupRequest,
+                          NTSTATUS              Status)
+{
+    WdfSpinLockAcquire(FileContext->RingLock);
+
+    FileContext->RingBase = nullptr;
+
+    if (FileContext->RingEntering) {
+
+        FileContext->RingTeardown       = SetupRequest;
+        FileContext->RingTeardownStatus = Status;
+
+        SetupRequest = nullptr;
+    }
+
+    WdfSpinLockRelease(FileContext->RingLock);
+
+    if (SetupRequest != nullptr) {
+
+        WdfRequestComplete(SetupRequest,
+                           Status);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtRingCanceledOnQueue
+//
+//    This routine is called by the framework when a pending
+//    IOCTL_OSR_NOTHING_RING_SETUP request on our RingQueue is cancelled
+//
+//  INPUTS:
+//
+//      Queue    - Our RingQueue
+//
+//      Request  - The setup request being cancelled
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is how a ring normally goes away: when the app closes its
+//      handle the framework cancels the requests it has waiting in our
+//      Queues.  The request isn't completed (and the region unlocked)
+//      until no doorbell is using the region.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtRingCanceledOnQueue(WDFQUEUE   Queue,
+                              WDFREQUEST Request)
+{
+    UNREFERENCED_PARAMETER(Queue);
+
+#if DBG
+    DbgPrint("Shared ring torn down\n");
+#endif
+
+    NothingSharedRingTeardown(
+              NothingGetFileContext(WdfRequestGetFileObject(Request)),
+              Request,
+              STATUS_CANCELLED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingGetCpuCounters
+//
+//    This routine returns the performance counters to update from the
+//    current processor
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The current processor's set of counters
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We might get moved to another processor right after this, in which
+//      case we update some other processor's counters.  That's fine, the
+//      totals come out the same.
+//
+///////////////////////////////////////////////////////////////////////////////
+PNOTHING_CPU_COUNTERS
+NothingGetCpuCounters(PNOTHING_DEVICE_CONTEXT DevContext)
+{
+    return &DevContext->Counters[KeGetCurrentProcessorNumberEx(nullptr) %
+                                                   DevContext->CounterCount];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingGetStats
+//
+//    This routine processes an IOCTL_OSR_NOTHING_GET_STATS request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The stats request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We add up the counters without any locks, so the totals are only a
+//      snapshot.  This driver has no ReadQueue or WriteQueue, so those
+//      counters stay zero.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingGetStats(PNOTHING_DEVICE_CONTEXT DevContext,
+                WDFREQUEST              Request)
+{
+    NTSTATUS              status;
+    PNOTHING_STATS        stats;
+    PNOTHING_CPU_COUNTERS counters;
+    LARGE_INTEGER         frequency;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NOTHING_STATS),
+                                            (PVOID *)&stats,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get stats buffer - 0x%x\n", status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    RtlZeroMemory(stats,
+                  sizeof(NOTHING_STATS));
+
+    stats->Version = NOTHING_STATS_VERSION;
+    stats->Size    = sizeof(NOTHING_STATS);
+
+    for (ULONG index = 0; index < DevContext->CounterCount; index++) {
+
+        counters = &DevContext->Counters[index];
+
+        stats->Reads                += ReadNoFence64(&counters->Reads);
+        stats->Writes               += ReadNoFence64(&counters->Writes);
+        stats->BytesRead            += ReadNoFence64(&counters->BytesRead);
+        stats->BytesWritten         += ReadNoFence64(&counters->BytesWritten);
+        stats->DeviceBusyRejections +=
+                           ReadNoFence64(&counters->DeviceBusyRejections);
+
+        stats->UncompressedBytes +=
+                           ReadNoFence64(&counters->CompressInputBytes);
+        stats->CompressedBytes   +=
+                           ReadNoFence64(&counters->CompressOutputBytes);
+        stats->CompressTicks     += ReadNoFence64(&counters->CompressTicks);
+        stats->DecompressedBytes +=
+                           ReadNoFence64(&counters->DecompressOutputBytes);
+        stats->DecompressTicks   += ReadNoFence64(&counters->DecompressTicks);
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+
+    stats->Frequency = frequency.QuadPart;
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(NOTHING_STATS));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingSetIntegrity
+//
+//    This routine processes an IOCTL_OSR_NOTHING_SET_INTEGRITY request
+//
+//  INPUTS:
+//
+//      Request    - The request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Integrity mode belongs to the handle, not the device.  Turning it
+//      on doesn't reset the last CRCs.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingSetIntegrity(WDFREQUEST Request)
+{
+    NTSTATUS                status;
+    PNOTHING_INTEGRITY_MODE mode;
+    PNOTHING_FILE_CONTEXT   fileContext;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(NOTHING_INTEGRITY_MODE),
+                                           (PVOID *)&mode,
+                                           nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get integrity mode buffer - 0x%x\n", status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+
+    WriteNoFence(&fileContext->Integrity,
+                 mode->Enable != 0 ? 1 : 0);
+
+    WdfRequestComplete(Request,
+                       STATUS_SUCCESS);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingGetIntegrity
+//
+//    This routine processes an IOCTL_OSR_NOTHING_GET_INTEGRITY request
+//
+//  INPUTS:
+//
+//      Request    - The request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingGetIntegrity(WDFREQUEST Request)
+{
+    NTSTATUS              status;
+    PNOTHING_INTEGRITY    integrity;
+    PNOTHING_FILE_CONTEXT fileContext;
+    ULONG64               lastRead;
+    ULONG64               lastWrite;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NOTHING_INTEGRITY),
+                                            (PVOID *)&integrity,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get integrity buffer - 0x%x\n", status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+
+    lastRead  = (ULONG64)ReadNoFence64(&fileContext->LastRead);
+    lastWrite = (ULONG64)ReadNoFence64(&fileContext->LastWrite);
+
+    integrity->ReadCrc32c  = (ULONG)lastRead;
+    integrity->ReadLength  = (ULONG)(lastRead >> 32);
+    integrity->WriteCrc32c = (ULONG)lastWrite;
+    integrity->WriteLength = (ULONG)(lastWrite >> 32);
+    integrity->Reads       = ReadNoFence64(&fileContext->IntegrityReads);
+    integrity->Writes      = ReadNoFence64(&fileContext->IntegrityWrites);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(NOTHING_INTEGRITY));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingKvRetrieveRecord
+//
+//    This routine gets the NOTHING_KV_RECORD at the start of a key/value
+//    request's input buffer, and checks that what follows it is all there
+//
+//  INPUTS:
+//
+//      Request   - An IOCTL_OSR_NOTHING_KV_xxx request
+//
+//      WithValue - TRUE if the value follows the key (a PUT)
+//
+//  OUTPUTS:
+//
+//      Record    - The record, followed by its key (and value)
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or the status to complete the request with
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We check the lengths against the limits before we add them up, so
+//      the sum can't wrap around.  The cache itself decides whether an
+//      empty key is OK.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+NothingKvRetrieveRecord(WDFREQUEST          Request,
+                        BOOLEAN             WithValue,
+                        PNOTHING_KV_RECORD* Record)
+{
+    NTSTATUS           status;
+    PNOTHING_KV_RECORD record;
+    size_t             inputLength;
+    size_t             needed;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(NOTHING_KV_RECORD),
+                                           (PVOID *)&record,
+                                           &inputLength);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get key/value record - 0x%x\n", status);
+#endif
+        return status;
+    }
+
+    if (record->KeyLength > NOTHING_KV_MAX_KEY_LENGTH ||
+        (WithValue && record->ValueLength > NOTHING_KV_MAX_VALUE_LENGTH)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    needed = sizeof(NOTHING_KV_RECORD) + record->KeyLength;
+
+    if (WithValue) {
+        needed += record->ValueLength;
+    }
+
+    if (needed > inputLength) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *Record = record;
+
+    return STATUS_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingKvStatus
+//
+//    This routine turns the result of a key/value cache operation into
+//    an NTSTATUS
+//
+//  INPUTS:
+//
+//      KvStatus - What the cache told us
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The status to complete the request with
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+NothingKvStatus(OSR_KV_STATUS KvStatus)
+{
+    switch (KvStatus) {
+
+        case OsrKvSuccess:
+            return STATUS_SUCCESS;
+
+        case OsrKvNotFound:
+            return STATUS_NOT_FOUND;
+
+        case OsrKvBufferTooSmall:
+            return STATUS_BUFFER_OVERFLOW;
+
+        case OsrKvTooBig:
+            return STATUS_INVALID_BUFFER_SIZE;
+
+        case OsrKvNoMemory:
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        case OsrKvInvalidKey:
+        default:
+            return STATUS_INVALID_PARAMETER;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingKvPut
+//
+//    This routine processes an IOCTL_OSR_NOTHING_KV_PUT request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingKvPut(PNOTHING_DEVICE_CONTEXT DevContext,
+             WDFREQUEST              Request)
+{
+    NTSTATUS           status;
+    PNOTHING_KV_RECORD record;
+    PUCHAR             key;
+
+    if (DevContext->KvCacheSize == 0) {
+
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = NothingKvRetrieveRecord(Request,
+                                     TRUE,
+                                     &record);
+
+    if (NT_SUCCESS(status)) {
+
+        key = (PUCHAR)(record + 1);
+
+        status = NothingKvStatus(OsrKvPut(&DevContext->KvTable,
+                                          key,
+                                          record->KeyLength,
+                                          key + record->KeyLength,
+                                          record->ValueLength));
+    }
+
+    WdfRequestComplete(Request,
+                       status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingKvGet
+//
+//    This routine processes an IOCTL_OSR_NOTHING_KV_GET request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is METHOD_BUFFERED, so the key and the value we return share
+//      the same buffer.  We copy the key out before we look it up, so we
+//      don't have to care what order the cache reads and writes them in.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingKvGet(PNOTHING_DEVICE_CONTEXT DevContext,
+             WDFREQUEST              Request)
+{
+    NTSTATUS           status;
+    PNOTHING_KV_RECORD record;
+    PNOTHING_KV_VALUE  value;
+    size_t             outputLength;
+    ULONG              keyLength;
+    ULONG              valueLength = 0;
+    ULONG_PTR          information = 0;
+    UCHAR              key[NOTHING_KV_MAX_KEY_LENGTH];
+
+    if (DevContext->KvCacheSize == 0) {
+
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = NothingKvRetrieveRecord(Request,
+                                     FALSE,
+                                     &record);
+
+    if (!NT_SUCCESS(status)) {
+        goto Done;
+    }
+
+    if (record->KeyLength == 0 ||
+        record->KeyLength > NOTHING_KV_MAX_KEY_LENGTH) {
+
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+
+    keyLength = record->KeyLength;
+
+    RtlCopyMemory(key,
+                  record + 1,
+                  keyLength);
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            FIELD_OFFSET(NOTHING_KV_VALUE,
+                                                         Value),
+                                            (PVOID *)&value,
+                                            &outputLength);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get key/value output buffer - 0x%x\n", status);
+#endif
+        goto Done;
+    }
+
+    status = NothingKvStatus(OsrKvGet(&DevContext->KvTable,
+                                      key,
+                                      keyLength,
+                                      value->Value,
+                                      (ULONG)min(outputLength -
+                                                    FIELD_OFFSET(NOTHING_KV_VALUE,
+                                                                 Value),
+                                                 NOTHING_KV_MAX_VALUE_LENGTH),
+                                      &valueLength));
+
+    if (status == STATUS_SUCCESS) {
+
+        value->ValueLength = valueLength;
+
+        information = FIELD_OFFSET(NOTHING_KV_VALUE, Value) + valueLength;
+
+    } else if (status == STATUS_BUFFER_OVERFLOW) {
+
+        //
+        // Tell the app how big a buffer it needs
+        //
+        value->ValueLength = valueLength;
+
+        information = FIELD_OFFSET(NOTHING_KV_VALUE, Value);
+    }
+
+Done:
+
+    WdfRequestCompleteWithInformation(Request,
+                                      status,
+                                      information);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingKvDelete
+//
+//    This routine processes an IOCTL_OSR_NOTHING_KV_DELETE request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingKvDelete(PNOTHING_DEVICE_CONTEXT DevContext,
+                WDFREQUEST              Request)
+{
+    NTSTATUS           status;
+    PNOTHING_KV_RECORD record;
+
+    if (DevContext->KvCacheSize == 0) {
+
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = NothingKvRetrieveRecord(Request,
+                                     FALSE,
+                                     &record);
+
+    if (NT_SUCCESS(status)) {
+
+        status = NothingKvStatus(OsrKvDelete(&DevContext->KvTable,
+                                             (PUCHAR)(record + 1),
+                                             record->KeyLength));
+    }
+
+    WdfRequestComplete(Request,
+                       status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingKvGetStats
+//
+//    This routine processes an IOCTL_OSR_NOTHING_KV_STATS request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Like NothingGetStats, this is only a snapshot.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingKvGetStats(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFREQUEST              Request)
+{
+    NTSTATUS          status;
+    PNOTHING_KV_STATS stats;
+    OSR_KV_STATS      kvStats;
+    LARGE_INTEGER     frequency;
+
+    if (DevContext->KvCacheSize == 0) {
+
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NOTHING_KV_STATS),
+                                            (PVOID *)&stats,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get key/value stats buffer - 0x%x\n", status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    OsrKvQueryStats(&DevContext->KvTable,
+                    &kvStats);
+
+    KeQueryPerformanceCounter(&frequency);
+
+    RtlZeroMemory(stats,
+                  sizeof(NOTHING_KV_STATS));
+
+    stats->Version        = NOTHING_KV_STATS_VERSION;
+    stats->Size           = sizeof(NOTHING_KV_STATS);
+    stats->Entries        = kvStats.Entries;
+    stats->MaxEntries     = kvStats.MaxEntries;
+    stats->BytesUsed      = kvStats.BytesUsed;
+    stats->ByteLimit      = kvStats.ByteLimit;
+    stats->Gets           = kvStats.Gets;
+    stats->Hits           = kvStats.Hits;
+    stats->Puts           = kvStats.Puts;
+    stats->Deletes        = kvStats.Deletes;
+    stats->Evictions      = kvStats.Evictions;
+    stats->GetTicks       = kvStats.GetTicks;
+    stats->GetMaxTicks    = kvStats.GetMaxTicks;
+    stats->PutTicks       = kvStats.PutTicks;
+    stats->PutMaxTicks    = kvStats.PutMaxTicks;
+    stats->DeleteTicks    = kvStats.DeleteTicks;
+    stats->DeleteMaxTicks = kvStats.DeleteMaxTicks;
+    stats->Frequency      = frequency.QuadPart;
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(NOTHING_KV_STATS));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingReadConfiguration
+//
+//    This routine reads our storage size and maximum message size from
+//    the device's hardware key
+//
+//  INPUTS:
+//
+//      Device     - Our WDFDEVICE
+//
+//      DevContext - Our device context
+//
+//  OUTPUTS:
+//
+//      DevContext->StorageSize, DevContext->MaxMessageSize,
+//      DevContext->Compression, DevContext->KvCacheSize and
+//      DevContext->KvCacheEntries
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      Anything that's missing gets our default, and anything out of range
+//      gets clamped.  The storage is split evenly between the shards, so
+//      we round it to a multiple of the page size times the shard count.
+//      With compression on, every shard has to be big enough to hold a
+//      whole compression block, which can mean more storage than we were
+//      asked for.  There's no key/value cache unless KvCacheSize is there.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingReadConfiguration(WDFDEVICE               Device,
+                         PNOTHING_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS status;
+    WDFKEY   key;
+    ULONG    value;
+    size_t   granularity;
+
+    DECLARE_CONST_UNICODE_STRING(storageSizeName,
+                                 L"StorageSize");
+    DECLARE_CONST_UNICODE_STRING(maxMessageSizeName,
+                                 L"MaxMessageSize");
+    DECLARE_CONST_UNICODE_STRING(compressionName,
+                                 L"Compression");
+    DECLARE_CONST_UNICODE_STRING(kvCacheSizeName,
+                                 L"KvCacheSize");
+    DECLARE_CONST_UNICODE_STRING(kvCacheEntriesName,
+                                 L"KvCacheEntries");
+
+    DevContext->StorageSize    = NOTHING_DEFAULT_STORAGE_SIZE;
+    DevContext->MaxMessageSize = NOTHING_DEFAULT_MAX_MESSAGE_SIZE;
+    DevContext->Compression    = FALSE;
+    DevContext->KvCacheSize    = 0;
+    DevContext->KvCacheEntries = NOTHING_DEFAULT_KV_CACHE_ENTRIES;
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (NT_SUCCESS(status)) {
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                             &storageSizeName,
+                                             &value))) {
+
+            DevContext->StorageSize = value;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                             &maxMessageSizeName,
+                                             &value))) {
+
+            DevContext->MaxMessageSize = value;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                             &compressionName,
+                                             &value))) {
+
+            DevContext->Compression = (value != 0);
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                             &kvCacheSizeName,
+                                             &value))) {
+
+            DevContext->KvCacheSize = value;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                             &kvCacheEntriesName,
+                                             &value))) {
+
+            DevContext->KvCacheEntries = value;
+        }
+
+        WdfRegistryClose(key);
+
+    } else {
+#if DBG
+        DbgPrint("WdfDeviceOpenRegistryKey failed 0x%0x, using defaults\n",
+                 status);
+#endif
+    }
+
+    DevContext->StorageSize = max(DevContext->StorageSize,
+                                  NOTHING_MIN_STORAGE_SIZE);
+    DevContext->StorageSize = min(DevContext->StorageSize,
+                                  NOTHING_MAX_STORAGE_SIZE);
+
+    if (DevContext->Compression) {
+
+        DevContext->StorageSize = max(DevContext->StorageSize,
+                                      (size_t)NOTHING_COMPRESS_MIN_SHARD_SIZE *
+                                                    DevContext->ShardCount);
+    }
+
+    granularity = (size_t)PAGE_SIZE * DevContext->ShardCount;
+
+    DevContext->StorageSize = max(DevContext->StorageSize -
+                                      (DevContext->StorageSize % granularity),
+                                  granularity);
+
+    DevContext->MaxMessageSize = max(DevContext->MaxMessageSize,
+                                     NOTHING_MIN_MESSAGE_SIZE);
+    DevContext->MaxMessageSize = min(DevContext->MaxMessageSize,
+                                     NOTHING_MAX_MESSAGE_SIZE);
+
+    DevContext->KvCacheSize    = min(DevContext->KvCacheSize,
+                                     NOTHING_MAX_KV_CACHE_SIZE);
+    DevContext->KvCacheEntries = max(DevContext->KvCacheEntries,
+                                     1);
+    DevContext->KvCacheEntries = min(DevContext->KvCacheEntries,
+                                     NOTHING_MAX_KV_CACHE_ENTRIES);
+
+#if DBG
+    DbgPrint("Storage size 0x%Ix, maximum message size 0x%Ix, "
+             "compression %s, key/value cache 0x%Ix bytes, %lu entries\n",
+             DevContext->StorageSize,
+             DevContext->MaxMessageSize,
+             DevContext->Compression ? "on" : "off",
+             DevContext->KvCacheSize,
+             DevContext->KvCacheEntries);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingStoragePut
+//
+//    This routine stores data from a write in the device's storage
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Buffer     - The data to store
+//
+//      Length     - The length of the data to store
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      The number of bytes actually stored. Zero means that there's no
+//      room left in storage at all.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We start with the shard for the current processor and move on to
+//      the next shard only if the current one is full. All the data from
+//      one write always goes into a single shard, so a reader will never see
+//      a write's data out of order.  Data from DIFFERENT writes that landed
+//      in different shards can be read back in any order, though.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingStoragePut(PNOTHING_DEVICE_CONTEXT DevContext,
+                  PVOID                   Buffer,
+                  size_t                  Length,
+                  PULONG                  Crc)
+{
+    PNOTHING_STORAGE_SHARD shard;
+    PNOTHING_CPU_COUNTERS  counters;
+    ULONG                  first;
+    size_t                 bytesStored = 0;
+
+    //
+    // Note that we might get moved to some other processor as soon as we
+    // have the number, but that's OK.  It's the shard locks that keep us
+    // safe, the processor number just keeps us from piling on to one shard.
+    //
+    first = KeGetCurrentProcessorNumberEx(nullptr) % DevContext->ShardCount;
+
+    for (ULONG index = 0; index < DevContext->ShardCount; index++) {
+
+        shard = &DevContext->Shards[(first + index) % DevContext->ShardCount];
+
+        if (DevContext->Compression) {
+
+            bytesStored = NothingRingPutCompressed(DevContext,
+                                                   shard,
+                                                   Buffer,
+                                                   Length,
+                                                   Crc);
+
+        } else if (Length > NOTHING_COPY_CHUNK_SIZE) {
+
+            bytesStored = NothingRingPutChunked(shard,
+                                                Buffer,
+                                                Length,
+                                                Crc);
+        } else {
+
+            WdfSpinLockAcquire(shard->Lock);
+
+            bytesStored = NothingRingPut(shard,
+                                         Buffer,
+                                         Length,
+                                         Crc);
+
+            WdfSpinLockRelease(shard->Lock);
+        }
+
+        if (bytesStored != 0) {
+            break;
+        }
+    }
+
+    counters = NothingGetCpuCounters(DevContext);
+
+    InterlockedIncrementNoFence64(&counters->Writes);
+
+    if (bytesStored != 0) {
+
+        InterlockedAddNoFence64(&counters->BytesWritten,
+                                bytesStored);
+
+    } else if (Length != 0) {
+
+        //
+        // Every shard was full.  Our callers fail this with
+        // STATUS_DEVICE_BUSY.
+        //
+        InterlockedIncrementNoFence64(&counters->DeviceBusyRejections);
+    }
+
+    return bytesStored;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingStorageGet
+//
+//    This routine retrieves data for a read from the device's storage
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Buffer     - The buffer to receive the data
+//
+//      Length     - The length of the buffer
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      The number of bytes actually copied to the buffer.  Zero means that
+//      there's no data waiting.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Like NothingStoragePut, we start with the current processor's shard.
+//      If that's empty we go looking in the other shards for data.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingStorageGet(PNOTHING_DEVICE_CONTEXT DevContext,
+                  PVOID                   Buffer,
+                  size_t                  Length,
+                  PULONG                  Crc)
+{
+    PNOTHING_STORAGE_SHARD shard;
+    PNOTHING_CPU_COUNTERS  counters;
+    ULONG                  first;
+    size_t                 bytesCopied = 0;
+
+    first = KeGetCurrentProcessorNumberEx(nullptr) % DevContext->ShardCount;
+
+    for (ULONG index = 0; index < DevContext->ShardCount; index++) {
+
+        shard = &DevContext->Shards[(first + index) % DevContext->ShardCount];
+
+        //
+        // Don't bother taking the lock on a shard that's empty.  If we
+        // race with a write here we'll just miss its data this time around.
+        //
+        if (*(volatile size_t *)&shard->BytesStored == 0 &&
+            *(volatile size_t *)&shard->StagedBytes == 0) {
+            continue;
+        }
+
+        if (DevContext->Compression) {
+
+            bytesCopied = NothingRingGetCompressed(DevContext,
+                                                   shard,
+                                                   Buffer,
+                                                   Length,
+                                                   Crc);
+
+        } else if (Length > NOTHING_COPY_CHUNK_SIZE) {
+
+            bytesCopied = NothingRingGetChunked(shard,
+                                                Buffer,
+                                                Length,
+                                                Crc);
+        } else {
+
+            WdfSpinLockAcquire(shard->Lock);
+
+            bytesCopied = NothingRingGet(shard,
+                                         Buffer,
+                                         Length,
+                                         Crc);
+
+            WdfSpinLockRelease(shard->Lock);
+        }
+
+        if (bytesCopied != 0) {
+            break;
+        }
+    }
+
+    counters = NothingGetCpuCounters(DevContext);
+
+    InterlockedIncrementNoFence64(&counters->Reads);
+    InterlockedAddNoFence64(&counters->BytesRead,
+                            bytesCopied);
+
+    return bytesCopied;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingPut
+//
+//    This routine appends data to one shard of the device's storage ring
+//
+//  INPUTS:
+//
+//      Shard      - The storage shard to store the data in
+//
+//      Buffer     - The data to store
+//
+//      Length     - The length of the data to store
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      The number of bytes actually stored, which is limited to the
+//      amount of free space in the ring.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the shard's lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingRingPut(PNOTHING_STORAGE_SHARD Shard,
+               PVOID                  Buffer,
+               size_t                 Length,
+               PULONG                 Crc)
+{
+    size_t bytesToCopy;
+
+    //
+    // If a big message is on its way in, ours has to wait its turn (or
+    // go to another shard)
+    //
+    if (Shard->WriterBusy) {
+        return 0;
+    }
+
+    //
+    // Limit number of bytes stored to the free space in the ring
+    //
+    bytesToCopy = min(Length,
+                      Shard->StorageSize - Shard->BytesStored -
+                                           Shard->BytesReserved);
+
+    NothingRingCopyIn(Shard,
+                      Shard->WriteOffset,
+                      Buffer,
+                      bytesToCopy,
+                      Crc);
+
+    Shard->WriteOffset = (Shard->WriteOffset + bytesToCopy) %
+                                                   Shard->StorageSize;
+
+    //
+    // Remember how many bytes of data we have waiting for the next
+    // lucky reader
+    //
+    Shard->BytesStored += bytesToCopy;
+
+    return bytesToCopy;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingGet
+//
+//    This routine removes data from one shard of the device's storage ring
+//
+//  INPUTS:
+//
+//      Shard      - The storage shard to take the data from
+//
+//      Buffer     - The buffer to receive the data
+//
+//      Length     - The length of the buffer
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      The number of bytes actually copied to the buffer, which is limited
+//      to the number of bytes stored in the ring.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must hold the shard's lock.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingRingGet(PNOTHING_STORAGE_SHARD Shard,
+               PVOID                  Buffer,
+               size_t                 Length,
+               PULONG                 Crc)
+{
+    size_t bytesToCopy;
+
+    //
+    // Someone's in the middle of reading a big message out of this shard,
+    // so the data at ReadOffset belongs to them
+    //
+    if (Shard->ReaderBusy) {
+        return 0;
+    }
+
+    //
+    // Limit number of bytes returned to the number of bytes in the ring
+    //
+    bytesToCopy = min(Length,
+                      Shard->BytesStored);
+
+    NothingRingCopyOut(Shard,
+                       Shard->ReadOffset,
+                       Buffer,
+                       bytesToCopy,
+                       Crc);
+
+    Shard->ReadOffset = (Shard->ReadOffset + bytesToCopy) %
+                                                   Shard->StorageSize;
+
+    Shard->BytesStored -= bytesToCopy;
+
+    return bytesToCopy;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingPutCompressed
+//
+//    This routine appends a message to one shard of the device's storage
+//    ring in compression mode
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Shard      - The storage shard to store the data in
+//
+//      Buffer     - The data to store
+//
+//      Length     - The length of the data to store
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we stored.
+//
+//  RETURNS:
+//
+//      The number of bytes actually stored.  We only ever store whole
+//      blocks, so if the ring fills up this is a multiple of
+//      NOTHING_COMPRESS_BLOCK_SIZE.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must NOT hold the shard's lock.
+//
+//      This works just like NothingRingPutChunked, with each chunk being
+//      a block.  We compress the block before we take the lock, so we
+//      know how much space to reserve for it.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingRingPutCompressed(PNOTHING_DEVICE_CONTEXT DevContext,
+                         PNOTHING_STORAGE_SHARD  Shard,
+                         PVOID                   Buffer,
+                         size_t                  Length,
+                         PULONG                  Crc)
+{
+    PNOTHING_CPU_COUNTERS counters;
+    NOTHING_BLOCK_HEADER  header;
+    PUCHAR                source;
+    PUCHAR                payload;
+    size_t                bytesStored = 0;
+    size_t                blockLength;
+    size_t                offset;
+    LARGE_INTEGER         start;
+    LARGE_INTEGER         end;
+
+    WdfSpinLockAcquire(Shard->Lock);
+
+    if (Shard->WriterBusy) {
+
+        WdfSpinLockRelease(Shard->Lock);
+        return 0;
+    }
+
+    Shard->WriterBusy = TRUE;
+
+    WdfSpinLockRelease(Shard->Lock);
+
+    counters = NothingGetCpuCounters(DevContext);
+
+    while (bytesStored < Length) {
+
+        source = (PUCHAR)Buffer + bytesStored;
+
+        header.RawLength = (ULONG)min(Length - bytesStored,
+                                      NOTHING_COMPRESS_BLOCK_SIZE);
+
+        //
+        // We only want the compressed block if it's smaller, so that's all
+        // the room we give the compressor.  If it doesn't fit, we store the
+        // block as is.
+        //
+        start = KeQueryPerformanceCounter(nullptr);
+
+        header.StoredLength = (ULONG)OsrLz4Compress(source,
+                                                    header.RawLength,
+                                                    Shard->WriteScratch,
+                                                    header.RawLength - 1,
+                                                    Shard->HashTable);
+
+        end = KeQueryPerformanceCounter(nullptr);
+
+        InterlockedAddNoFence64(&counters->CompressTicks,
+                                end.QuadPart - start.QuadPart);
+
+        if (header.StoredLength != 0) {
+
+            payload = Shard->WriteScratch;
+
+        } else {
+
+            header.StoredLength = header.RawLength;
+            payload             = source;
+        }
+
+        blockLength = sizeof(NOTHING_BLOCK_HEADER) + header.StoredLength;
+
+        WdfSpinLockAcquire(Shard->Lock);
+
+        if (blockLength > Shard->StorageSize - Shard->BytesStored -
+                                               Shard->BytesReserved) {
+
+            //
+            // The ring's full.  We keep the blocks we've stored so far.
+            //
+            WdfSpinLockRelease(Shard->Lock);
+            break;
+        }
+
+        offset = Shard->WriteOffset;
+
+        Shard->WriteOffset    = (offset + blockLength) % Shard->StorageSize;
+        Shard->BytesReserved += blockLength;
+
+        WdfSpinLockRelease(Shard->Lock);
+
+        NothingRingCopyIn(Shard,
+                          offset,
+                          &header,
+                          sizeof(NOTHING_BLOCK_HEADER),
+                          nullptr);
+
+        NothingRingCopyIn(Shard,
+                          (offset + sizeof(NOTHING_BLOCK_HEADER)) %
+                                                     Shard->StorageSize,
+                          payload,
+                          header.StoredLength,
+                          nullptr);
+
+        //
+        // The CRC is always of the data the caller gave us, not of what
+        // we stored
+        //
+        if (Crc != nullptr) {
+
+            *Crc = OsrCrc32c(Shard->Copy,
+                             source,
+                             header.RawLength,
+                             *Crc);
+        }
+
+        InterlockedAddNoFence64(&counters->CompressInputBytes,
+                                header.RawLength);
+        InterlockedAddNoFence64(&counters->CompressOutputBytes,
+                                blockLength);
+
+        WdfSpinLockAcquire(Shard->Lock);
+
+        Shard->BytesReserved -= blockLength;
+        Shard->BytesStored   += blockLength;
+
+        WdfSpinLockRelease(Shard->Lock);
+
+        bytesStored += header.RawLength;
+    }
+
+    WdfSpinLockAcquire(Shard->Lock);
+
+    Shard->WriterBusy = FALSE;
+
+    WdfSpinLockRelease(Shard->Lock);
+
+    return bytesStored;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingGetCompressed
+//
+//    This routine removes data for a read from one shard of the device's
+//    storage ring in compression mode
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Shard      - The storage shard to take the data from
+//
+//      Buffer     - The buffer to receive the data
+//
+//      Length     - The length of the buffer
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      The number of bytes actually copied to the buffer, which is limited
+//      to the amount of data in the shard.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must NOT hold the shard's lock.
+//
+//      We decompress each block straight into the caller's buffer if it
+//      fits.  If it doesn't, it goes into the shard's Staging buffer and
+//      we (or the next reader) hand it out from there.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingRingGetCompressed(PNOTHING_DEVICE_CONTEXT DevContext,
+                         PNOTHING_STORAGE_SHARD  Shard,
+                         PVOID                   Buffer,
+                         size_t                  Length,
+                         PULONG                  Crc)
+{
+    PNOTHING_CPU_COUNTERS counters;
+    NOTHING_BLOCK_HEADER  header;
+    PUCHAR                source;
+    PUCHAR                target;
+    size_t                bytesCopied = 0;
+    size_t                blockLength;
+    size_t                offset;
+    size_t                chunkLength;
+    size_t                decoded;
+    LARGE_INTEGER         start;
+    LARGE_INTEGER         end;
+
+    WdfSpinLockAcquire(Shard->Lock);
+
+    if (Shard->ReaderBusy) {
+
+        WdfSpinLockRelease(Shard->Lock);
+        return 0;
+    }
+
+    Shard->ReaderBusy = TRUE;
+
+    WdfSpinLockRelease(Shard->Lock);
+
+    counters = NothingGetCpuCounters(DevContext);
+
+    while (bytesCopied < Length) {
+
+        //
+        // Whatever's left of the last block we decompressed comes first
+        //
+        if (Shard->StagedBytes != 0) {
+
+            chunkLength = min(Length - bytesCopied,
+                              Shard->StagedBytes);
+
+            if (Crc != nullptr) {
+
+                *Crc = OsrCopyMemoryCrc32c(Shard->Copy,
+                                           (PUCHAR)Buffer + bytesCopied,
+                                           Shard->Staging +
+                                                    Shard->StagedOffset,
+                                           chunkLength,
+                                           *Crc);
+            } else {
+
+                OsrCopyMemory(Shard->Copy,
+                              (PUCHAR)Buffer + bytesCopied,
+                              Shard->Staging + Shard->StagedOffset,
+                              chunkLength);
+            }
+
+            Shard->StagedOffset += chunkLength;
+            Shard->StagedBytes  -= chunkLength;
+
+            bytesCopied += chunkLength;
+
+            continue;
+        }
+
+        //
+        // Writers only ever publish whole blocks, so if there's anything
+        // in the shard there's a whole block at ReadOffset
+        //
+        WdfSpinLockAcquire(Shard->Lock);
+
+        if (Shard->BytesStored == 0) {
+
+            WdfSpinLockRelease(Shard->Lock);
+            break;
+        }
+
+        NothingRingCopyOut(Shard,
+                           Shard->ReadOffset,
+                           &header,
+                           sizeof(NOTHING_BLOCK_HEADER),
+                           nullptr);
+
+        blockLength = sizeof(NOTHING_BLOCK_HEADER) + header.StoredLength;
+
+        offset = (Shard->ReadOffset + sizeof(NOTHING_BLOCK_HEADER)) %
+                                                     Shard->StorageSize;
+
+        Shard->ReadOffset     = (Shard->ReadOffset + blockLength) %
+                                                     Shard->StorageSize;
+        Shard->BytesStored   -= blockLength;
+        Shard->BytesReserved += blockLength;
+
+        WdfSpinLockRelease(Shard->Lock);
+
+        if (header.RawLength <= Length - bytesCopied) {
+
+            target = (PUCHAR)Buffer + bytesCopied;
+
+        } else {
+
+            target = Shard->Staging;
+        }
+
+        if (header.StoredLength == header.RawLength) {
+
+            NothingRingCopyOut(Shard,
+                               offset,
+                               target,
+                               header.RawLength,
+                               nullptr);
+
+            decoded = header.RawLength;
+
+        } else {
+
+            //
+            // The decompressor needs the block in one piece, so if it
+            // wraps around the end of the ring we put it back together
+            //
+            if (offset + header.StoredLength <= Shard->StorageSize) {
+
+                source = Shard->Storage + offset;
+
+            } else {
+
+                NothingRingCopyOut(Shard,
+                                   offset,
+                                   Shard->ReadScratch,
+                                   header.StoredLength,
+                                   nullptr);
+
+                source = Shard->ReadScratch;
+            }
+
+            start = KeQueryPerformanceCounter(nullptr);
+
+            decoded = OsrLz4Decompress(source,
+                                       header.StoredLength,
+                                       target,
+                                       header.RawLength);
+
+            end = KeQueryPerformanceCounter(nullptr);
+
+            InterlockedAddNoFence64(&counters->DecompressTicks,
+                                    end.QuadPart - start.QuadPart);
+        }
+
+        WdfSpinLockAcquire(Shard->Lock);
+
+        Shard->BytesReserved -= blockLength;
+
+        WdfSpinLockRelease(Shard->Lock);
+
+        if (decoded != header.RawLength) {
+
+            //
+            // We compressed this block ourselves, so this means someone
+            // scribbled on our storage.  Better to lose the block than to
+            // hand back garbage.
+            //
+#if DBG
+            DbgPrint("Corrupt block of 0x%x bytes dropped\n",
+                     header.RawLength);
+#endif
+            continue;
+        }
+
+        InterlockedAddNoFence64(&counters->DecompressOutputBytes,
+                                decoded);
+
+        if (target == Shard->Staging) {
+
+            Shard->StagedOffset = 0;
+            Shard->StagedBytes  = decoded;
+
+            continue;
+        }
+
+        if (Crc != nullptr) {
+
+            *Crc = OsrCrc32c(Shard->Copy,
+                             target,
+                             decoded,
+                             *Crc);
+        }
+
+        bytesCopied += decoded;
+    }
+
+    WdfSpinLockAcquire(Shard->Lock);
+
+    Shard->ReaderBusy = FALSE;
+
+    WdfSpinLockRelease(Shard->Lock);
+
+    return bytesCopied;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingPutChunked
+//
+//    This routine appends a big message to one shard of the device's
+//    storage ring, a chunk at a time
+//
+//  INPUTS:
+//
+//      Shard      - The storage shard to store the data in
+//
+//      Buffer     - The data to store
+//
+//      Length     - The length of the data to store
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      The number of bytes actually stored, which is limited to the
+//      amount of free space in the ring.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must NOT hold the shard's lock.
+//
+//      We only hold the lock long enough to reserve space for each chunk
+//      and then to hand the chunk over to readers, never while we copy.
+//      Readers can start on the message before we've finished storing it.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingRingPutChunked(PNOTHING_STORAGE_SHARD Shard,
+                      PVOID                  Buffer,
+                      size_t                 Length,
+                      PULONG                 Crc)
+{
+    size_t bytesStored = 0;
+    size_t chunkLength;
+    size_t offset;
+
+    WdfSpinLockAcquire(Shard->Lock);
+
+    if (Shard->WriterBusy) {
+
+        WdfSpinLockRelease(Shard->Lock);
+        return 0;
+    }
+
+    Shard->WriterBusy = TRUE;
+
+    while (bytesStored < Length) {
+
+        chunkLength = min(Length - bytesStored,
+                          NOTHING_COPY_CHUNK_SIZE);
+
+        chunkLength = min(chunkLength,
+                          Shard->StorageSize - Shard->BytesStored -
+                                               Shard->BytesReserved);
+
+        if (chunkLength == 0) {
+
+            //
+            // The ring's full.  Like any other write, we keep what we've
+            // stored so far.
+            //
+            break;
+        }
+
+        offset = Shard->WriteOffset;
+
+        Shard->WriteOffset    = (offset + chunkLength) % Shard->StorageSize;
+        Shard->BytesReserved += chunkLength;
+
+        WdfSpinLockRelease(Shard->Lock);
+
+        NothingRingCopyIn(Shard,
+                          offset,
+                          (PUCHAR)Buffer + bytesStored,
+                          chunkLength,
+                          Crc);
+
+        WdfSpinLockAcquire(Shard->Lock);
+
+        Shard->BytesReserved -= chunkLength;
+        Shard->BytesStored   += chunkLength;
+
+        bytesStored += chunkLength;
+    }
+
+    Shard->WriterBusy = FALSE;
+
+    WdfSpinLockRelease(Shard->Lock);
+
+    return bytesStored;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingGetChunked
+//
+//    This routine removes data for a big read from one shard of the
+//    device's storage ring, a chunk at a time
+//
+//  INPUTS:
+//
+//      Shard      - The storage shard to take the data from
+//
+//      Buffer     - The buffer to receive the data
+//
+//      Length     - The length of the buffer
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      The number of bytes actually copied to the buffer, which is limited
+//      to the number of bytes stored in the ring.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must NOT hold the shard's lock.
+//
+//      The mirror image of NothingRingPutChunked.  The space we're copying
+//      out of doesn't become free until we're done with it.
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingRingGetChunked(PNOTHING_STORAGE_SHARD Shard,
+                      PVOID                  Buffer,
+                      size_t                 Length,
+                      PULONG                 Crc)
+{
+    size_t bytesCopied = 0;
+    size_t chunkLength;
+    size_t offset;
+
+    WdfSpinLockAcquire(Shard->Lock);
+
+    if (Shard->ReaderBusy) {
+
+        WdfSpinLockRelease(Shard->Lock);
+        return 0;
+    }
+
+    Shard->ReaderBusy = TRUE;
+
+    while (bytesCopied < Length) {
+
+        chunkLength = min(Length - bytesCopied,
+                          NOTHING_COPY_CHUNK_SIZE);
+
+        chunkLength = min(chunkLength,
+                          Shard->BytesStored);
+
+        if (chunkLength == 0) {
+            break;
+        }
+
+        offset = Shard->ReadOffset;
+
+        Shard->ReadOffset     = (offset + chunkLength) % Shard->StorageSize;
+        Shard->BytesStored   -= chunkLength;
+        Shard->BytesReserved += chunkLength;
+
+        WdfSpinLockRelease(Shard->Lock);
+
+        NothingRingCopyOut(Shard,
+                           offset,
+                           (PUCHAR)Buffer + bytesCopied,
+                           chunkLength,
+                           Crc);
+
+        WdfSpinLockAcquire(Shard->Lock);
+
+        Shard->BytesReserved -= chunkLength;
+
+        bytesCopied += chunkLength;
+    }
+
+    Shard->ReaderBusy = FALSE;
+
+    WdfSpinLockRelease(Shard->Lock);
+
+    return bytesCopied;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingCopyIn
+//
+//    This routine copies data into a shard's storage, wrapping around
+//    the end of the ring if it has to
+//
+//  INPUTS:
+//
+//      Shard      - The storage shard
+//
+//      Offset     - Where in the shard's storage the data goes
+//
+//      Buffer     - The data
+//
+//      Length     - The length of the data
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must own the space it's copying into.
+//
+//      Big copies bypass the cache (see osrcopy.h), since nobody is going
+//      to look at the data until a reader comes along for it.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingRingCopyIn(PNOTHING_STORAGE_SHARD Shard,
+                  size_t                 Offset,
+                  PVOID                  Buffer,
+                  size_t                 Length,
+                  PULONG                 Crc)
+{
+    size_t firstPart;
+
+    firstPart = min(Length,
+                    Shard->StorageSize - Offset);
+
+    if (Crc != nullptr) {
+
+        *Crc = OsrCopyMemoryCrc32c(Shard->Copy,
+                                   Shard->Storage + Offset,
+                                   Buffer,
+                                   firstPart,
+                                   *Crc);
+
+        *Crc = OsrCopyMemoryCrc32c(Shard->Copy,
+                                   Shard->Storage,
+                                   (PUCHAR)Buffer + firstPart,
+                                   Length - firstPart,
+                                   *Crc);
+        return;
+    }
+
+    OsrCopyMemory(Shard->Copy,
+                  Shard->Storage + Offset,
+                  Buffer,
+                  firstPart);
+
+    OsrCopyMemory(Shard->Copy,
+                  Shard->Storage,
+                  (PUCHAR)Buffer + firstPart,
+                  Length - firstPart);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRingCopyOut
+//
+//    This routine copies data out of a shard's storage, wrapping around
+//    the end of the ring if it has to
+//
+//  INPUTS:
+//
+//      Shard      - The storage shard
+//
+//      Offset     - Where in the shard's storage the data is
+//
+//      Buffer     - The buffer to receive the data
+//
+//      Length     - The length of the data
+//
+//      Crc        - If not nullptr, the CRC32C to add the data to
+//
+//  OUTPUTS:
+//
+//      If Crc isn't nullptr, *Crc is updated to include the data
+//      we copied.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      The caller must own the space it's copying from.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingRingCopyOut(PNOTHING_STORAGE_SHARD Shard,
+                   size_t                 Offset,
+                   PVOID                  Buffer,
+                   size_t                 Length,
+                   PULONG                 Crc)
+{
+    size_t firstPart;
+
+    firstPart = min(Length,
+                    Shard->StorageSize - Offset);
+
+    if (Crc != nullptr) {
+
+        *Crc = OsrCopyMemoryCrc32c(Shard->Copy,
+                                   Buffer,
+                                   Shard->Storage + Offset,
+                                   firstPart,
+                                   *Crc);
+
+        *Crc = OsrCopyMemoryCrc32c(Shard->Copy,
+                                   (PUCHAR)Buffer + firstPart,
+                                   Shard->Storage,
+                                   Length - firstPart,
+                                   *Crc);
+        return;
+    }
+
+    OsrCopyMemory(Shard->Copy,
+                  Buffer,
+                  Shard->Storage + Offset,
+                  firstPart);
+
+    OsrCopyMemory(Shard->Copy,
+                  (PUCHAR)Buffer + firstPart,
+                  Shard->Storage,
+                  Length - firstPart);
 }
 
 CHAR const *
@@ -39,13 +39,177 @@
 
 #include <ntddk.h>
 #include <wdf.h>
+#include <ntstrsafe.h>
 
 #include "NOTHING_IOCTL.h"
+#include <osrcopy.h>
+#include <osrlz4.h>
+#include <osrkv.h>
 
 //
-// Choose an arbitrary maximum buffer length
+// Size of our storage ring.  Writes append to the ring until it's full and
+// reads drain whatever is there, so this is how much data can be waiting
+// for readers at any one time.
 //
-#define NOTHING_BUFFER_MAX_LENGTH 4096
+// We also limit the size of any one write.  Both can be set with the
+// StorageSize and MaxMessageSize values in the device's hardware key (see
+// Nothing_KMDF.inf), these are what we use if they aren't there.  Whatever
+// we're given is clamped to the limits below.
+//
+#define NOTHING_DEFAULT_STORAGE_SIZE     (4 * 1024 * 1024)
+#define NOTHING_DEFAULT_MAX_MESSAGE_SIZE (32 * 1024 * 1024)
+
+#define NOTHING_MIN_STORAGE_SIZE         (64 * 1024)
+#define NOTHING_MAX_STORAGE_SIZE         (1024 * 1024 * 1024)
+#define NOTHING_MIN_MESSAGE_SIZE         4096
+#define NOTHING_MAX_MESSAGE_SIZE         (64 * 1024 * 1024)
+
+//
+// Messages bigger than this are copied in and out of storage a chunk at a
+// time, without holding the shard's lock while we copy.  Otherwise one big
+// write would keep every other processor that wants the shard spinning
+// (and its own processor at DISPATCH_LEVEL) for the whole copy.
+//
+#define NOTHING_COPY_CHUNK_SIZE          (64 * 1024)
+
+//
+// With the Compression value in the hardware key set, writes are cut into
+// blocks of this size (no bigger than OSR_LZ4_MAX_INPUT) and each block
+// is LZ4 compressed (see osrlz4.h) on its way into storage.  A block that
+// doesn't get any smaller is stored as is.  Either way it's preceded by a
+// NOTHING_BLOCK_HEADER.
+//
+// Every shard has to be able to hold at least one whole block, so when
+// compression is on we don't let the shards get smaller than
+// NOTHING_COMPRESS_MIN_SHARD_SIZE.
+//
+#define NOTHING_COMPRESS_BLOCK_SIZE      (32 * 1024)
+#define NOTHING_COMPRESS_MIN_SHARD_SIZE  (128 * 1024)
+
+typedef struct _NOTHING_BLOCK_HEADER {
+
+    //
+    // How many bytes of storage follow the header, and how many bytes of
+    // data they hold.  If they're the same, the block isn't compressed.
+    //
+    ULONG StoredLength;
+    ULONG RawLength;
+
+} NOTHING_BLOCK_HEADER, *PNOTHING_BLOCK_HEADER;
+
+//
+// Set to TRUE to have our default Queue use parallel dispatching. In that
+// case the storage ring is split into one shard per processor, so that
+// callers on different processors don't serialize on a single lock.
+//
+// Set to FALSE to get the original sequential behavior (one shard, one
+// request in the driver at a time).  That's the default, because with
+// parallel dispatching a single writer whose writes run on different
+// processors no longer reads its data back in the order it wrote it.
+//
+#define NOTHING_PARALLEL_DISPATCH FALSE
+
+//
+// Our key/value cache (see the IOCTL_OSR_NOTHING_KV_xxx IOCTLs) is off
+// unless the KvCacheSize value in the device's hardware key says how much
+// memory it can use.  KvCacheEntries caps how many records it can hold.
+//
+// The cache is split into this many segments per shard, each with its own
+// lock, so that two processors rarely want the same one.
+//
+#define NOTHING_DEFAULT_KV_CACHE_ENTRIES  (64 * 1024)
+#define NOTHING_MAX_KV_CACHE_SIZE         (1024 * 1024 * 1024)
+#define NOTHING_MAX_KV_CACHE_ENTRIES      (16 * 1024 * 1024)
+#define NOTHING_KV_SEGMENTS_PER_SHARD     4
+
+//
+// Pool tag for our allocations ('NthR' in the debugger)
+//
+#define NOTHING_POOL_TAG 'RhtN'
+
+//
+// One shard of our storage ring
+//
+// Data waiting to be read starts at ReadOffset, new data gets stored at
+// WriteOffset, and BytesStored lets us tell a full ring from an empty one.
+// Each shard has its own lock, and each one sits on its own cache line so
+// that processors working on different shards don't fight over the memory.
+//
+// While a big message is being copied a chunk at a time, the space for
+// the chunk being copied is in BytesReserved: it isn't free, but it isn't
+// data anyone can read yet either (or any more).  WriterBusy and
+// ReaderBusy keep anyone else from writing or reading the shard until the
+// big message is done, so that its data stays in one piece.
+//
+// In compression mode the shard holds blocks instead of raw bytes, and it
+// has some scratch space of its own.  WriteScratch and HashTable belong to
+// whoever has WriterBusy set.  ReadScratch (where we gather a compressed
+// block that wraps around the end of the ring) and Staging belong to
+// whoever has ReaderBusy set.  Staging holds what's left of a block that
+// a reader decompressed but didn't have room for: the next StagedBytes
+// bytes of data from this shard are there, at StagedOffset, not in the
+// ring.
+//
+typedef struct DECLSPEC_CACHEALIGN _NOTHING_STORAGE_SHARD {
+
+    WDFSPINLOCK Lock;
+
+    PUCHAR      Storage;
+    size_t      StorageSize;
+    size_t      ReadOffset;
+    size_t      WriteOffset;
+    size_t      BytesStored;
+    size_t      BytesReserved;
+
+    POSR_COPY   Copy;
+
+    BOOLEAN     WriterBusy;
+    BOOLEAN     ReaderBusy;
+
+    PUCHAR      WriteScratch;
+    PUSHORT     HashTable;
+    PUCHAR      ReadScratch;
+    PUCHAR      Staging;
+    size_t      StagedOffset;
+    size_t      StagedBytes;
+
+} NOTHING_STORAGE_SHARD, *PNOTHING_STORAGE_SHARD;
+
+//
+// One processor's performance counters
+//
+// Each processor bumps only its own set (on its own cache line), and we
+// add them all up when someone asks for them.  We still use interlocked
+// operations, because a thread can get moved to another processor in the
+// middle of an update, but they're essentially never contended.
+//
+typedef struct DECLSPEC_CACHEALIGN _NOTHING_CPU_COUNTERS {
+
+    volatile LONG64 Reads;
+    volatile LONG64 Writes;
+    volatile LONG64 BytesRead;
+    volatile LONG64 BytesWritten;
+    volatile LONG64 DeviceBusyRejections;
+
+    //
+    // Compression mode only.  Ticks are performance counter ticks spent in
+    // the compressor and decompressor.
+    //
+    volatile LONG64 CompressInputBytes;
+    volatile LONG64 CompressOutputBytes;
+    volatile LONG64 CompressTicks;
+    volatile LONG64 DecompressOutputBytes;
+    volatile LONG64 DecompressTicks;
+
+} NOTHING_CPU_COUNTERS, *PNOTHING_CPU_COUNTERS;
+
+//
+// Instances of our device are named \DosDevices\Nothing0, Nothing1, and so
+// on, up to this many.  NOTHING_LINK_NAME_LENGTH has room for the longest
+// name.
+//
+#define NOTHING_MAX_INSTANCES    100
+#define NOTHING_LINK_NAME_LENGTH 32
 
 //
 // Nothing device context structure
@@ -57,8 +221,63 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
 
     ULONG Nothing;
 
-    ULONG   BytesStored;
-    UCHAR   Storage[NOTHING_BUFFER_MAX_LENGTH];
+    //
+    // Which instance of the device this is, the N in \DosDevices\NothingN
+    //
+    ULONG InstanceNumber;
+
+    //
+    // Our storage ring.  The data lives in a separate nonpaged allocation
+    // (way too big to be part of the context) that's carved up evenly
+    // between the shards.
+    //
+    WDFMEMORY StorageMemory;
+    PUCHAR    Storage;
+    size_t    StorageSize;
+
+    //
+    // The biggest write we'll accept
+    //
+    size_t    MaxMessageSize;
+
+    //
+    // Are we compressing what we store?  If so, the shards' scratch space
+    // is all in one allocation.
+    //
+    BOOLEAN   Compression;
+    WDFMEMORY ScratchMemory;
+
+    //
+    // How we copy data in and out of the storage (see osrcopy.h)
+    //
+    OSR_COPY  Copy;
+
+    //
+    // The shards themselves.  In sequential mode there's just one.
+    //
+    WDFMEMORY              ShardMemory;
+    PNOTHING_STORAGE_SHARD Shards;
+    ULONG                  ShardCount;
+
+    //
+    // Our performance counters, one set per processor
+    //
+    WDFMEMORY              CounterMemory;
+    PNOTHING_CPU_COUNTERS  Counters;
+    ULONG                  CounterCount;
+
+    //
+    // Manual queue holding the pending IOCTL_OSR_NOTHING_RING_SETUP
+    // requests for any shared rings that apps have set up.
+    //
+    WDFQUEUE RingQueue;
+
+    //
+    // Our key/value cache.  KvCacheSize is zero if we don't have one.
+    //
+    size_t       KvCacheSize;
+    ULONG        KvCacheEntries;
+    OSR_KV_TABLE KvTable;
 
 }  NOTHING_DEVICE_CONTEXT, *PNOTHING_DEVICE_CONTEXT;
 
@@ -71,6 +290,74 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_DEVICE_CONTEXT,
                                    NothingGetContextFromDevice)
 
+//
+// Nothing file context structure
+//
+// KMDF will associate this structure with each open instance of our
+// device.  It holds the state of the shared submission/completion rings, if
+// the app has set them up (see nothing_ioctl.h).
+//
+typedef struct _NOTHING_FILE_CONTEXT {
+
+    //
+    // Integrity mode (see IOCTL_OSR_NOTHING_SET_INTEGRITY).  LastRead and
+    // LastWrite each hold a transfer's length in the high 32 bits and its
+    // CRC32C in the low 32, so both can be updated at once without a lock.
+    //
+    volatile LONG   Integrity;
+    volatile LONG64 LastRead;
+    volatile LONG64 LastWrite;
+    volatile LONG64 IntegrityReads;
+    volatile LONG64 IntegrityWrites;
+
+    //
+    // Guards everything below
+    //
+    WDFSPINLOCK RingLock;
+
+    //
+    // TRUE while a doorbell is working through the submissions.  It drops
+    // the lock for each storage call, so only one doorbell at a time gets
+    // to do that.  One that comes in meanwhile sets RingKicked and leaves
+    // its submissions to the one that's running.
+    //
+    // If the ring is torn down while a doorbell is running, the setup
+    // request waits in RingTeardown for the doorbell to finish with the
+    // region, and the doorbell completes it with RingTeardownStatus.
+    //
+    BOOLEAN     RingEntering;
+    BOOLEAN     RingKicked;
+    WDFREQUEST  RingTeardown;
+    NTSTATUS    RingTeardownStatus;
+
+    //
+    // The region described by the pending setup request.  RingBase is
+    // nullptr if there's no ring set up.
+    //
+    PUCHAR      RingBase;
+    size_t      RingLength;
+
+    //
+    // Our own copy of the layout.  We never look at the layout in the
+    // shared header after setup, because the app can change it whenever
+    // it likes.  For the same reason we keep our own copies of the two
+    // indices that only WE are allowed to advance.
+    //
+    PNOTHING_RING_HEADER     Header;
+    PNOTHING_RING_SUBMISSION Submissions;
+    PNOTHING_RING_COMPLETION Completions;
+    ULONG                    SubmissionEntries;
+    ULONG                    CompletionEntries;
+    ULONG                    DataOffset;
+    ULONG                    DataLength;
+    ULONG                    SubmissionHead;
+    ULONG                    CompletionTail;
+
+} NOTHING_FILE_CONTEXT, *PNOTHING_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_FILE_CONTEXT,
+                                   NothingGetFileContext)
+
 //
 // Forward declarations
 //
@@ -84,6 +371,136 @@ EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL NothingEvtDeviceControl;
 
 EVT_WDF_DEVICE_D0_ENTRY            NothingEvtDeviceD0Entry;
 EVT_WDF_DEVICE_D0_EXIT             NothingEvtDeviceD0Exit;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP     NothingEvtDeviceCleanup;
+
+NTSTATUS
+NothingCreateSymbolicLink(WDFDEVICE Device);
+
+EVT_WDF_DEVICE_FILE_CREATE            NothingEvtFdoCreate;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE NothingEvtRingCanceledOnQueue;
+
+VOID
+NothingSharedRingSetup(PNOTHING_DEVICE_CONTEXT DevContext,
+                       WDFREQUEST              Request);
+
+VOID
+NothingSharedRingEnter(PNOTHING_DEVICE_CONTEXT DevContext,
+                       WDFREQUEST              Request);
+
+VOID
+NothingSharedRingTeardown(PNOTHING_FILE_CONTEXT FileContext,
+                          WDFREQUEST            SetupRequest,
+                          NTSTATUS              Status);
+
+VOID
+NothingProcessBatch(PNOTHING_DEVICE_CONTEXT DevContext,
+                    WDFREQUEST              Request,
+                    BOOLEAN                 IsWrite);
+
+PNOTHING_CPU_COUNTERS
+NothingGetCpuCounters(PNOTHING_DEVICE_CONTEXT DevContext);
+
+VOID
+NothingGetStats(PNOTHING_DEVICE_CONTEXT DevContext,
+                WDFREQUEST              Request);
+
+VOID
+NothingSetIntegrity(WDFREQUEST Request);
+
+VOID
+NothingGetIntegrity(WDFREQUEST Request);
+
+NTSTATUS
+NothingKvRetrieveRecord(WDFREQUEST          Request,
+                        BOOLEAN             WithValue,
+                        PNOTHING_KV_RECORD* Record);
+
+NTSTATUS
+NothingKvStatus(OSR_KV_STATUS KvStatus);
+
+VOID
+NothingKvPut(PNOTHING_DEVICE_CONTEXT DevContext,
+             WDFREQUEST              Request);
+
+VOID
+NothingKvGet(PNOTHING_DEVICE_CONTEXT DevContext,
+             WDFREQUEST              Request);
+
+VOID
+NothingKvDelete(PNOTHING_DEVICE_CONTEXT DevContext,
+                WDFREQUEST              Request);
+
+VOID
+NothingKvGetStats(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFREQUEST              Request);
+
+size_t
+NothingStoragePut(PNOTHING_DEVICE_CONTEXT DevContext,
+                  PVOID                   Buffer,
+                  size_t                  Length,
+                  PULONG                  Crc);
+
+size_t
+NothingStorageGet(PNOTHING_DEVICE_CONTEXT DevContext,
+                  PVOID                   Buffer,
+                  size_t                  Length,
+                  PULONG                  Crc);
+
+VOID
+NothingReadConfiguration(WDFDEVICE               Device,
+                         PNOTHING_DEVICE_CONTEXT DevContext);
+
+size_t
+NothingRingPut(PNOTHING_STORAGE_SHARD Shard,
+               PVOID                  Buffer,
+               size_t                 Length,
+               PULONG                 Crc);
+
+size_t
+NothingRingGet(PNOTHING_STORAGE_SHARD Shard,
+               PVOID                  Buffer,
+               size_t                 Length,
+               PULONG                 Crc);
+
+size_t
+NothingRingPutCompressed(PNOTHING_DEVICE_CONTEXT DevContext,
+                         PNOTHING_STORAGE_SHARD  Shard,
+                         PVOID                   Buffer,
+                         size_t                  Length,
+                         PULONG                  Crc);
+
+size_t
+NothingRingGetCompressed(PNOTHING_DEVICE_CONTEXT DevContext,
+                         PNOTHING_STORAGE_SHARD  Shard,
+                         PVOID                   Buffer,
+                         size_t                  Length,
+                         PULONG                  Crc);
+
+size_t
+NothingRingPutChunked(PNOTHING_STORAGE_SHARD Shard,
+                      PVOID                  Buffer,
+                      size_t                 Length,
+                      PULONG                 Crc);
+
+size_t
+NothingRingGetChunked(PNOTHING_STORAGE_SHARD Shard,
+                      PVOID                  Buffer,
+                      size_t                 Length,
+                      PULONG                 Crc);
+
+VOID
+NothingRingCopyIn(PNOTHING_STORAGE_SHARD Shard,
+                  size_t                 Offset,
+                  PVOID                  Buffer,
+                  size_t                 Length,
+                  PULONG                 Crc);
+
+VOID
+NothingRingCopyOut(PNOTHING_STORAGE_SHARD Shard,
+                   size_t                 Offset,
+                   PVOID                  Buffer,
+                   size_t                 Length,
+                   PULONG                 Crc);
 
 //
 CHAR const *
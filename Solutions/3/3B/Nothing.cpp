@@ -38,6 +38,8 @@
 
 #include "nothing.h"
 
+OSR_TRACE NothingTrace;
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  DriverEntry
@@ -76,6 +78,7 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
 {
     WDF_DRIVER_CONFIG driverConfig;
     NTSTATUS          status;
+    WDFDRIVER         driver;
 
 #if DBG
     DbgPrint("\nOSR Nothing Driver -- Compiled %s %s\n",
@@ -97,15 +100,25 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
                              RegistryPath,
                              WDF_NO_OBJECT_ATTRIBUTES,
                              &driverConfig,
-                             WDF_NO_HANDLE);
+                             &driver);
 
     if (!NT_SUCCESS(status)) {
 #if DBG
         DbgPrint("WdfDriverCreate failed 0x%0x\n",
                  status);
 #endif
+        goto Done;
     }
 
+    //
+    // Set up our trace ring.  We can live without it, so if this fails
+    // we just won't trace.
+    //
+    (VOID)OsrTraceInitialize(&NothingTrace,
+                             driver);
+
+Done:
+
     return (status);
 }
 
@@ -151,9 +164,6 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
     PNOTHING_DEVICE_CONTEXT devContext;
 
-    DECLARE_CONST_UNICODE_STRING(userDeviceName,
-                                 L"\\DosDevices\\Nothing");
-
     UNREFERENCED_PARAMETER(Driver);
 
     //
@@ -219,11 +229,11 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
 
     //
     // Create a symbolic link to our Device Object.  This allows apps
-    // to open our device by name.  Note that we use a constant name,
-    // so this driver will support only a single instance of our device.
+    // to open our device by name.  Every instance gets a name of its own
+    // (see NothingCreateSymbolicLink), so we can have as many instances
+    // of our device as we like.
     //
-    status = WdfDeviceCreateSymbolicLink(device,
-                                         &userDeviceName);
+    status = NothingCreateSymbolicLink(device);
 
     if (!NT_SUCCESS(status)) {
 #if DBG
@@ -308,6 +318,11 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     //
     devContext = NothingGetContextFromDevice(device);
 
+    //
+    // Pick the fastest way to copy big messages on this machine
+    //
+    OsrCopyInitialize(&devContext->Copy);
+
     //
     // First the read...
     //
@@ -360,6 +375,80 @@ Done:
     return (status);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingCreateSymbolicLink
+//
+//    This routine gives our device a name that apps can open
+//
+//  INPUTS:
+//
+//      Device     - Our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      The device context's InstanceNumber
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or the reason we couldn't create a link.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      Each instance of the device gets its own name: Nothing0, Nothing1,
+//      and so on.  We take the lowest number that isn't already in use, so
+//      when a device goes away the next one to arrive reuses its number.
+//      The object manager tells us if the name's taken, which makes this
+//      safe even if two devices are being added at once.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+NothingCreateSymbolicLink(WDFDEVICE Device)
+{
+    NTSTATUS       status = STATUS_OBJECT_NAME_COLLISION;
+    UNICODE_STRING linkName;
+    WCHAR          linkBuffer[NOTHING_LINK_NAME_LENGTH];
+
+    RtlInitEmptyUnicodeString(&linkName,
+                              linkBuffer,
+                              sizeof(linkBuffer));
+
+    for (ULONG instance = 0; instance < NOTHING_MAX_INSTANCES; instance++) {
+
+        status = RtlUnicodeStringPrintf(&linkName,
+                                        L"\\DosDevices\\Nothing%lu",
+                                        instance);
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        status = WdfDeviceCreateSymbolicLink(Device,
+                                             &linkName);
+
+        if (NT_SUCCESS(status)) {
+
+            NothingGetContextFromDevice(Device)->InstanceNumber = instance;
+
+#if DBG
+            DbgPrint("Device is %wZ\n",
+                     &linkName);
+#endif
+            break;
+        }
+
+        if (status != STATUS_OBJECT_NAME_COLLISION) {
+            break;
+        }
+    }
+
+    return status;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  NothingEvtDeviceD0Entry
@@ -500,11 +589,12 @@ NothingEvtRead(WDFQUEUE   Queue,
     size_t                  readBufferLen;
     size_t                  copyLen;
 
-    UNREFERENCED_PARAMETER(Length);
-
-#if DBG
-    DbgPrint("NothingEvtRead\n");
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&NothingTrace,
+                                      OSR_TRACE_NOTHING_READ,
+                                      Request,
+                                      Length,
+                                      0,
+                                      STATUS_SUCCESS);
 
     //
     // Get a pointer to our device context.
@@ -521,10 +611,12 @@ NothingEvtRead(WDFQUEUE   Queue,
 
     if (!NT_SUCCESS(status)) {
 
-#if DBG
-        DbgPrint("Failed to retrieve from the write queue (0x%x). "\
-                 "Queuing read\n", status);
-#endif
+        OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&NothingTrace,
+                                          OSR_TRACE_NOTHING_READ_PARKED,
+                                          Request,
+                                          0,
+                                          0,
+                                          status);
 
         //
         // There are no writes waiting.
@@ -542,10 +634,12 @@ NothingEvtRead(WDFQUEUE   Queue,
             // Wow... we were unable to put the read Request onto the manual read Queue.
             // Not sure how we could get an error here, but... 
             //
-#if DBG
-            DbgPrint("WdfRequestForwardToIoQueue failed with Status code 0x%x", 
-                     status);
-#endif
+            OsrTrace<OSR_TRACE_LEVEL_ERROR>(&NothingTrace,
+                                            OSR_TRACE_NOTHING_FORWARD_FAILED,
+                                            Request,
+                                            0,
+                                            0,
+                                            status);
             copyLen = 0;
 
             goto DoneCompleteRead;
@@ -558,9 +652,6 @@ NothingEvtRead(WDFQUEUE   Queue,
     // We DO have a write! Satisfy the read we just received using the
     // data from the write that we just removed from the Queue.
     //
-#if DBG
-    DbgPrint("Write request was pending!\n");
-#endif
 
     //
     // Get the write buffer...
@@ -570,10 +661,14 @@ NothingEvtRead(WDFQUEUE   Queue,
                                             &writeBuffer,
                                             &writeBufferLen);     
     if(!NT_SUCCESS(status)) {
-#if DBG
-        DbgPrint("WdfRequestRetrieveInputBuffer failed with Status code 0x%x", 
-                     status);
-#endif
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&NothingTrace,
+                                        OSR_TRACE_NOTHING_BUFFER_FAILED,
+                                        Request,
+                                        OsrTraceRequestCookie(&NothingTrace,
+                                                              writeRequest),
+                                        0,
+                                        status);
 
         //
         // Bad buffer... Fail both requests.
@@ -593,10 +688,13 @@ NothingEvtRead(WDFQUEUE   Queue,
                                              &readBufferLen);     
     if(!NT_SUCCESS(status)) {
 
-#if DBG
-        DbgPrint("WdfRequestRetrieveOutputBuffer failed with Status code 0x%x", 
-                     status);
-#endif
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&NothingTrace,
+                                        OSR_TRACE_NOTHING_BUFFER_FAILED,
+                                        Request,
+                                        OsrTraceRequestCookie(&NothingTrace,
+                                                              Request),
+                                        0,
+                                        status);
         //
         // Sigh... Fail both requests.
         //
@@ -615,15 +713,20 @@ NothingEvtRead(WDFQUEUE   Queue,
     //
     // Store the data from the write into the user's read buffer
     //
-    RtlCopyMemory(readBuffer,
+    OsrCopyMemory(&devContext->Copy,
+                  readBuffer,
                   writeBuffer,
                   copyLen);
 
 DoneCompleteBoth:
 
-#if DBG
-    DbgPrint("Completing requests with 0x%Ix bytes transferred\n", copyLen);
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&NothingTrace,
+                                      OSR_TRACE_NOTHING_PAIRED,
+                                      Request,
+                                      OsrTraceRequestCookie(&NothingTrace,
+                                                            writeRequest),
+                                      copyLen,
+                                      status);
 
     //
     // Done with the write
@@ -689,11 +792,12 @@ NothingEvtWrite(WDFQUEUE   Queue,
     size_t                  readBufferLen;
     size_t                  copyLen;
 
-    UNREFERENCED_PARAMETER(Length);
-
-#if DBG
-    DbgPrint("NothingEvtRead\n");
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&NothingTrace,
+                                      OSR_TRACE_NOTHING_WRITE,
+                                      Request,
+                                      Length,
+                                      0,
+                                      STATUS_SUCCESS);
 
     //
     // Get a pointer to our device context.
@@ -710,10 +814,12 @@ NothingEvtWrite(WDFQUEUE   Queue,
 
     if (!NT_SUCCESS(status)) {
 
-#if DBG
-        DbgPrint("Failed to retrieve from the read queue (0x%x). "\
-                 "Queuing read\n", status);
-#endif
+        OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&NothingTrace,
+                                          OSR_TRACE_NOTHING_WRITE_PARKED,
+                                          Request,
+                                          0,
+                                          0,
+                                          status);
 
         //
         // There are no reads waiting.
@@ -731,10 +837,12 @@ NothingEvtWrite(WDFQUEUE   Queue,
             // Wow... we were unable to put the write Request onto the manual write Queue.
             // Not sure how we could get an error here, but... 
             //
-#if DBG
-            DbgPrint("WdfRequestForwardToIoQueue failed with Status code 0x%x", 
-                     status);
-#endif
+            OsrTrace<OSR_TRACE_LEVEL_ERROR>(&NothingTrace,
+                                            OSR_TRACE_NOTHING_FORWARD_FAILED,
+                                            Request,
+                                            0,
+                                            0,
+                                            status);
             copyLen = 0;
 
             goto DoneCompleteWrite;
@@ -747,9 +855,6 @@ NothingEvtWrite(WDFQUEUE   Queue,
     // We DO have a read! Satisfy the write we just received using the
     // data from the read that we just removed from the Queue.
     //
-#if DBG
-    DbgPrint("read request was pending!\n");
-#endif
 
     //
     // Get the read buffer...
@@ -759,10 +864,14 @@ NothingEvtWrite(WDFQUEUE   Queue,
                                             &readBuffer,
                                             &readBufferLen);     
     if(!NT_SUCCESS(status)) {
-#if DBG
-        DbgPrint("WdfRequestRetrieveOutputBuffer failed with Status code 0x%x", 
-                     status);
-#endif
+
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&NothingTrace,
+                                        OSR_TRACE_NOTHING_BUFFER_FAILED,
+                                        Request,
+                                        OsrTraceRequestCookie(&NothingTrace,
+                                                              readRequest),
+                                        0,
+                                        status);
 
         //
         // Bad buffer... Fail both requests.
@@ -782,10 +891,13 @@ NothingEvtWrite(WDFQUEUE   Queue,
                                              &writeBufferLen);     
     if(!NT_SUCCESS(status)) {
 
-#if DBG
-        DbgPrint("WdfRequestRetrieveInputBuffer failed with Status code 0x%x", 
-                     status);
-#endif
+        OsrTrace<OSR_TRACE_LEVEL_ERROR>(&NothingTrace,
+                                        OSR_TRACE_NOTHING_BUFFER_FAILED,
+                                        Request,
+                                        OsrTraceRequestCookie(&NothingTrace,
+                                                              Request),
+                                        0,
+                                        status);
         //
         // Sigh... Fail both requests.
         //
@@ -804,15 +916,20 @@ NothingEvtWrite(WDFQUEUE   Queue,
     //
     // Store the data from the write into the user's read buffer
     //
-    RtlCopyMemory(readBuffer,
+    OsrCopyMemory(&devContext->Copy,
+                  readBuffer,
                   writeBuffer,
                   copyLen);
 
 DoneCompleteBoth:
 
-#if DBG
-    DbgPrint("Completing requests with 0x%Ix bytes transferred\n", copyLen);
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&NothingTrace,
+                                      OSR_TRACE_NOTHING_PAIRED,
+                                      Request,
+                                      OsrTraceRequestCookie(&NothingTrace,
+                                                            readRequest),
+                                      copyLen,
+                                      status);
 
     //
     // Done with the read
@@ -876,14 +993,34 @@ NothingEvtDeviceControl(WDFQUEUE   Queue,
                         size_t     InputBufferLength,
                         ULONG      IoControlCode)
 {
-    UNREFERENCED_PARAMETER(IoControlCode);
     UNREFERENCED_PARAMETER(InputBufferLength);
     UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(Queue);
 
-#if DBG
-    DbgPrint("NothingEvtDeviceControl\n");
-#endif
+    OsrTrace<OSR_TRACE_LEVEL_VERBOSE>(&NothingTrace,
+                                      OSR_TRACE_NOTHING_IOCTL,
+                                      Request,
+                                      IoControlCode,
+                                      0,
+                                      STATUS_SUCCESS);
+
+    switch (IoControlCode) {
+
+        case IOCTL_OSR_NOTHING_TRACE_LEVEL:
+
+            OsrTraceProcessLevel(&NothingTrace,
+                                 Request);
+            return;
+
+        case IOCTL_OSR_NOTHING_TRACE_DUMP:
+
+            OsrTraceProcessDump(&NothingTrace,
+                                Request);
+            return;
+
+        default:
+            break;
+    }
 
     //
     // Nothing to do...
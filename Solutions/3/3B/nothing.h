@@ -39,14 +39,25 @@
 
 #include <ntddk.h>
 #include <wdf.h>
+#include <ntstrsafe.h>
 
 #include "NOTHING_IOCTL.h"
+#include <osrcopy.h>
+#include <osrtrace.h>
 
 //
 // Choose an arbitrary maximum buffer length
 //
 #define NOTHING_BUFFER_MAX_LENGTH 4096
 
+//
+// Instances of our device are named \DosDevices\Nothing0, Nothing1, and so
+// on, up to this many.  NOTHING_LINK_NAME_LENGTH has room for the longest
+// name.
+//
+#define NOTHING_MAX_INSTANCES    100
+#define NOTHING_LINK_NAME_LENGTH 32
+
 //
 // Nothing device context structure
 //
@@ -57,6 +68,11 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
 
     ULONG Nothing;
 
+    //
+    // Which instance of the device this is, the N in \DosDevices\NothingN
+    //
+    ULONG InstanceNumber;
+
     //
     // Manual queues for holding incoming requests if no data
     // pending.
@@ -64,6 +80,11 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
     WDFQUEUE ReadQueue;
     WDFQUEUE WriteQueue;
 
+    //
+    // How we copy data from writes to reads (see osrcopy.h)
+    //
+    OSR_COPY Copy;
+
 }  NOTHING_DEVICE_CONTEXT, *PNOTHING_DEVICE_CONTEXT;
 
 //
@@ -75,6 +96,11 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_DEVICE_CONTEXT,
                                    NothingGetContextFromDevice)
 
+//
+// Our trace ring, shared by all our devices
+//
+extern OSR_TRACE NothingTrace;
+
 //
 // Forward declarations
 //
@@ -89,6 +115,9 @@ EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL NothingEvtDeviceControl;
 EVT_WDF_DEVICE_D0_ENTRY            NothingEvtDeviceD0Entry;
 EVT_WDF_DEVICE_D0_EXIT             NothingEvtDeviceD0Exit;
 
+NTSTATUS
+NothingCreateSymbolicLink(WDFDEVICE Device);
+
 //
 CHAR const *
 NothingPowerDeviceStateToString(WDF_POWER_DEVICE_STATE DeviceState);
@@ -74,8 +74,11 @@ NTSTATUS
 DriverEntry(PDRIVER_OBJECT  DriverObject,
             PUNICODE_STRING RegistryPath)
 {
-    WDF_DRIVER_CONFIG driverConfig;
-    NTSTATUS          status;
+    WDF_DRIVER_CONFIG       driverConfig;
+    WDF_OBJECT_ATTRIBUTES   driverAttributes;
+    WDFDRIVER               driver;
+    PNOTHING_DRIVER_CONTEXT driverContext;
+    NTSTATUS                status;
 
 #if DBG
     DbgPrint("\nOSR Nothing Driver -- Compiled %s %s\n",
@@ -90,19 +93,50 @@ DriverEntry(PDRIVER_OBJECT  DriverObject,
     WDF_DRIVER_CONFIG_INIT(&driverConfig,
                            NothingEvtDeviceAdd);
 
+    //
+    // Our WDFDRIVER gets a context of its own, which is where we keep the
+    // polls that are waiting (see IOCTL_OSR_NOTHING_POLL)
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&driverAttributes,
+                                            NOTHING_DRIVER_CONTEXT);
+
+    driverAttributes.EvtCleanupCallback = NothingEvtDriverCleanup;
+
     //
     // Create our WDFDriver instance
     //
     status = WdfDriverCreate(DriverObject,
                              RegistryPath,
-                             WDF_NO_OBJECT_ATTRIBUTES,
+                             &driverAttributes,
                              &driverConfig,
-                             WDF_NO_HANDLE);
+                             &driver);
 
     if (!NT_SUCCESS(status)) {
 #if DBG
         DbgPrint("WdfDriverCreate failed 0x%0x\n",
                  status);
+#endif
+        return (status);
+    }
+
+    driverContext = NothingGetDriverContext(driver);
+
+    InitializeListHead(&driverContext->PollWaiters);
+
+    KeInitializeDpc(&driverContext->PollDpc,
+                    NothingPollDpc,
+                    driverContext);
+
+    //
+    // With no attributes, the lock's parent is our WDFDRIVER
+    //
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES,
+                               &driverContext->PollLock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                 status);
 #endif
     }
 
@@ -151,10 +185,8 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
     PNOTHING_DEVICE_CONTEXT      devContext;
     WDF_FILEOBJECT_CONFIG        fileObjectConfig;
-
-
-    DECLARE_CONST_UNICODE_STRING(userDeviceName,
-                                 L"\\DosDevices\\Nothing");
+    WDF_OBJECT_ATTRIBUTES        fileAttributes;
+    WDF_OBJECT_ATTRIBUTES        requestAttributes;
 
     UNREFERENCED_PARAMETER(Driver);
 
@@ -215,12 +247,53 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
 
     //
     // Update the device init structure to specify our new
-    // callbacks.
+    // callbacks, along with the context we want on each open instance
+    // (which is where we keep track of channels).
     //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes,
+                                            NOTHING_FILE_CONTEXT);
+
     WdfDeviceInitSetFileObjectConfig(DeviceInit,
                                      &fileObjectConfig,
-                                     WDF_NO_OBJECT_ATTRIBUTES);
+                                     &fileAttributes);
+
+    //
+    // Tell the framework how we want to get the data buffers for read
+    // and write requests.  If we don't say anything, we get Buffered I/O.
+    //
+    // Note that our code for pairing reads and writes doesn't care which
+    // one we pick: WdfRequestRetrieveInputBuffer and WdfRequestRetrieveOutputBuffer
+    // hand us a kernel virtual address either way.  For Direct I/O that's
+    // a system address that maps the requestor's locked down pages.
+    //
+    if (NOTHING_DIRECT_IO) {
+
+        WdfDeviceInitSetIoType(DeviceInit,
+                               WdfDeviceIoDirect);
+    }
+
+    //
+    // Have the framework give each Request we receive a context of our
+    // own, in which we keep track of streaming progress.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes,
+                                            NOTHING_REQUEST_CONTEXT);
+
+    //
+    // The framework calls our cleanup callback when a Request is
+    // completed, which is when we stop its clock.
+    //
+    requestAttributes.EvtCleanupCallback = NothingEvtRequestCleanup;
 
+    WdfDeviceInitSetRequestAttributes(DeviceInit,
+                                      &requestAttributes);
+
+    //
+    // We need to see IOCTL_OSR_NOTHING_POLL requests in the context of the
+    // thread that sent them, because they're full of handles
+    //
+    WdfDeviceInitSetIoInCallerContextCallback(DeviceInit,
+                                              NothingEvtIoInCallerContext);
 
     //
     // Create our device object
@@ -239,11 +312,11 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
 
     //
     // Create a symbolic link to our Device Object.  This allows apps
-    // to open our device by name.  Note that we use a constant name,
-    // so this driver will support only a single instance of our device.
+    // to open our device by name.  Every instance gets a name of its own
+    // (see NothingCreateSymbolicLink), so we can have as many instances
+    // of our device as we like.
     //
-    status = WdfDeviceCreateSymbolicLink(device,
-                                         &userDeviceName);
+    status = NothingCreateSymbolicLink(device);
 
     if (!NT_SUCCESS(status)) {
 #if DBG
@@ -282,8 +355,14 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     // Request when an existing Request is forwarded to another Queue.  So, we
     // don't have to change the Dispatch Type to Parallel.
     //
+    // With channels we DO want Parallel, so that different channels can be
+    // in the driver at the same time.  Our QueueLock and each channel's lock
+    // take care of the synchronization that Sequential gave us for free.
+    //
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig,
-                                           WdfIoQueueDispatchSequential);
+                                           NOTHING_CHANNELS ?
+                                               WdfIoQueueDispatchParallel :
+                                               WdfIoQueueDispatchSequential);
 
     //
     // Declare our I/O Event Processing callbacks
@@ -330,14 +409,29 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     devContext = NothingGetContextFromDevice(device);
 
     //
-    // First the read...
+    // Pick the fastest way to copy big messages on this machine
+    //
+    OsrCopyInitialize(&devContext->Copy);
+
+    //
+    // Find out how many reads and writes we let wait
+    //
+    NothingReadConfiguration(device,
+                             devContext);
+
+    //
+    // First the read...  Both of these get a context to count what's
+    // parked on them (see NothingParkRequest).
     //
     WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
                              WdfIoQueueDispatchManual);
 
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&objAttributes,
+                                            NOTHING_QUEUE_CONTEXT);
+
     status = WdfIoQueueCreate(device,
                               &queueConfig,
-                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &objAttributes,
                               &devContext->ReadQueue);
 
     if (!NT_SUCCESS(status)) {
@@ -356,9 +450,12 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
                              WdfIoQueueDispatchManual);
 
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&objAttributes,
+                                            NOTHING_QUEUE_CONTEXT);
+
     status = WdfIoQueueCreate(device,
                               &queueConfig,
-                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &objAttributes,
                               &devContext->WriteQueue);
 
     if (!NT_SUCCESS(status)) {
@@ -372,45 +469,70 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
     }
 
     //
-    // The Collection we're about to create holds "stuff" that's specific
-    // to a device instance.  So, we want to parent the Collection on the
-    // WDFDEVICE Object. If we don't specify this, the Collection will be
-    // parented on the WDFDRIVER.  It will *eventually* go away, but we
-    // shouldn't have to wait for the driver to unload for device-specific
-    // stuff to be destructed.
+    // And one more, for channel pairing requests waiting for their peer
     //
-    WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
-
-    objAttributes.ParentObject = device;
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+                             WdfIoQueueDispatchManual);
 
-    //
-    // Create the collection we use for keeping track of
-    // WDFFILEOBJECTs.
-    //
-    status = WdfCollectionCreate(&objAttributes,
-                                 &devContext->FileObjectsCollection);
+    status = WdfIoQueueCreate(device,
+                              &queueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &devContext->PairQueue);
 
     if (!NT_SUCCESS(status)) {
 
 #if DBG
-        DbgPrint("WdfCollectionCreate failed 0x%0x\n",
+        DbgPrint("WdfIoQueueCreate for manual pair queue failed 0x%0x\n",
                  status);
 #endif
+
         goto Done;
     }
 
+    //
+    // The list we use for keeping track of WDFFILEOBJECTs waiting to
+    // write starts out empty
+    //
+    InitializeListHead(&devContext->WaitingWriters);
 
     //
-    // Like above, this Object is device specific, so we want
-    // it to be parented on the Device.
+    // The lock we're about to create is specific to a device instance.
+    // So, we want to parent the lock on the WDFDEVICE Object. If we don't
+    // specify this, the lock will be parented on the WDFDRIVER.  It will
+    // *eventually* go away, but we shouldn't have to wait for the driver to
+    // unload for device-specific stuff to be destructed.
     //
     WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
 
     objAttributes.ParentObject = device;
 
     status = WdfSpinLockCreate(&objAttributes,
-                               &devContext->FileObjectsCollectionLock);
+                               &devContext->WaitingWritersLock);
+
+
+    if (!NT_SUCCESS(status)) {
+
+#if DBG
+        DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                 status);
+#endif
+        goto Done;
+    }
+
+    status = WdfSpinLockCreate(&objAttributes,
+                               &devContext->QueueLock);
+
+    if (!NT_SUCCESS(status)) {
+
+#if DBG
+        DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                 status);
+#endif
+        goto Done;
+    }
 
+    status = WdfSpinLockCreate(&objAttributes,
+                               &devContext->PairLock);
 
     if (!NT_SUCCESS(status)) {
 
@@ -421,6 +543,43 @@ NothingEvtDeviceAdd(WDFDRIVER       Driver,
         goto Done;
     }
 
+    //
+    // Allocate our per-processor counters.  Pool allocations of a page or
+    // more are always page aligned, so we round the size up to make sure
+    // that each processor's counters really do start on their own cache
+    // line.
+    //
+    devContext->CounterCount =
+                KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    status = WdfMemoryCreate(&objAttributes,
+                             NonPagedPoolNx,
+                             NOTHING_POOL_TAG,
+                             ROUND_TO_PAGES(devContext->CounterCount *
+                                            sizeof(NOTHING_CPU_COUNTERS)),
+                             &devContext->CounterMemory,
+                             (PVOID *)&devContext->Counters);
+
+    if (!NT_SUCCESS(status)) {
+
+#if DBG
+        DbgPrint("WdfMemoryCreate for counters failed 0x%0x\n",
+                 status);
+#endif
+        goto Done;
+    }
+
+    RtlZeroMemory(devContext->Counters,
+                  devContext->CounterCount * sizeof(NOTHING_CPU_COUNTERS));
+
+    {
+        LARGE_INTEGER frequency;
+
+        KeQueryPerformanceCounter(&frequency);
+
+        devContext->PerformanceFrequency = frequency.QuadPart;
+    }
+
     status = STATUS_SUCCESS;
 
 Done:
@@ -428,6 +587,80 @@ Done:
     return (status);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingCreateSymbolicLink
+//
+//    This routine gives our device a name that apps can open
+//
+//  INPUTS:
+//
+//      Device     - Our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      The device context's InstanceNumber
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or the reason we couldn't create a link.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      Each instance of the device gets its own name: Nothing0, Nothing1,
+//      and so on.  We take the lowest number that isn't already in use, so
+//      when a device goes away the next one to arrive reuses its number.
+//      The object manager tells us if the name's taken, which makes this
+//      safe even if two devices are being added at once.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+NothingCreateSymbolicLink(WDFDEVICE Device)
+{
+    NTSTATUS       status = STATUS_OBJECT_NAME_COLLISION;
+    UNICODE_STRING linkName;
+    WCHAR          linkBuffer[NOTHING_LINK_NAME_LENGTH];
+
+    RtlInitEmptyUnicodeString(&linkName,
+                              linkBuffer,
+                              sizeof(linkBuffer));
+
+    for (ULONG instance = 0; instance < NOTHING_MAX_INSTANCES; instance++) {
+
+        status = RtlUnicodeStringPrintf(&linkName,
+                                        L"\\DosDevices\\Nothing%lu",
+                                        instance);
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        status = WdfDeviceCreateSymbolicLink(Device,
+                                             &linkName);
+
+        if (NT_SUCCESS(status)) {
+
+            NothingGetContextFromDevice(Device)->InstanceNumber = instance;
+
+#if DBG
+            DbgPrint("Device is %wZ\n",
+                     &linkName);
+#endif
+            break;
+        }
+
+        if (status != STATUS_OBJECT_NAME_COLLISION) {
+            break;
+        }
+    }
+
+    return status;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 //  NothingEvtDeviceD0Entry
@@ -578,6 +811,40 @@ NothingEvtRead(WDFQUEUE   Queue,
     devContext = NothingGetContextFromDevice(
                                              WdfIoQueueGetDevice(Queue));
 
+    InterlockedIncrementNoFence64(&NothingGetCpuCounters(devContext)->Reads);
+
+    NothingStampArrival(devContext,
+                        Request,
+                        FALSE);
+
+    //
+    // Reads on a paired handle only ever see their own channel
+    //
+    if (NOTHING_CHANNELS &&
+        NothingGetFileContext(WdfRequestGetFileObject(Request))->ChannelObject) {
+
+        NothingChannelIo(devContext,
+                         Request,
+                         FALSE);
+
+        goto DoneUnlocked;
+    }
+
+    WdfSpinLockAcquire(devContext->QueueLock);
+
+    //
+    // In streaming mode the read gets handled elsewhere
+    //
+    if (NOTHING_STREAMING) {
+
+        NothingStreamRead(devContext,
+                          devContext->ReadQueue,
+                          devContext->WriteQueue,
+                          Request);
+
+        goto DoneJustReturn;
+    }
+
     //
     // We have received a READ.  Are there any writes waiting?
     //
@@ -598,8 +865,10 @@ NothingEvtRead(WDFQUEUE   Queue,
         // Put the read Request we just received onto the read Queue and return
         // with that read Request pending.
         //
-        status = WdfRequestForwardToIoQueue(Request,
-                                            devContext->ReadQueue);
+        status = NothingParkRequest(devContext,
+                                    Request,
+                                    devContext->ReadQueue,
+                                    TRUE);
 
 
         if (!NT_SUCCESS(status)) {
@@ -680,12 +949,18 @@ NothingEvtRead(WDFQUEUE   Queue,
                   readBufferLen);
 
     //
-    // Store the data from the write into the user's read buffer
+    // Store the data from the write into the user's read buffer.  When
+    // we're using Direct I/O this is the ONLY copy of the data that's
+    // made between the writer and the reader.
     //
-    RtlCopyMemory(readBuffer,
+    OsrCopyMemory(&devContext->Copy,
+                  readBuffer,
                   writeBuffer,
                   copyLen);
 
+    NothingCountBytes(devContext,
+                      copyLen);
+
 DoneCompleteBoth:
 
 #if DBG
@@ -709,6 +984,10 @@ DoneCompleteRead:
                                       copyLen);
 DoneJustReturn:
 
+    WdfSpinLockRelease(devContext->QueueLock);
+
+DoneUnlocked:
+
     return;
 }
 
@@ -771,6 +1050,25 @@ NothingEvtWrite(WDFQUEUE   Queue,
     devContext = NothingGetContextFromDevice(
                                              WdfIoQueueGetDevice(Queue));
 
+    InterlockedIncrementNoFence64(&NothingGetCpuCounters(devContext)->Writes);
+
+    NothingStampArrival(devContext,
+                        Request,
+                        TRUE);
+
+    //
+    // Writes on a paired handle only ever go to their own channel.  The
+    // one-writer rule is for the shared Queues, so it doesn't apply.
+    //
+    if (NOTHING_CHANNELS &&
+        NothingGetFileContext(WdfRequestGetFileObject(Request))->ChannelObject) {
+
+        NothingChannelIo(devContext,
+                         Request,
+                         TRUE);
+
+        goto DoneUnlocked;
+    }
 
     //
     // Check to see if this caller is THE open instances that
@@ -783,7 +1081,13 @@ NothingEvtWrite(WDFQUEUE   Queue,
     //
     // Was this on the allowed open instance??
     //
-    if (devContext->AllowedWriter != fileObject) {
+    // We don't take any lock for this.  The current epoch matches the one
+    // in our file context only if we were the last open instance made the
+    // writer.  The acquire makes sure that if we see the new epoch we also
+    // see everything that was set up before it was published.
+    //
+    if (ReadAcquire64(&devContext->WriterEpoch) !=
+                        NothingGetFileContext(fileObject)->WriterEpoch) {
 
         //
         // Nope.  Block the write.  Return an error.
@@ -792,11 +1096,26 @@ NothingEvtWrite(WDFQUEUE   Queue,
         DbgPrint("File object 0x%p not allowed to write!\n",
                  fileObject);
 #endif
-        status = STATUS_MEDIA_WRITE_PROTECTED;
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_MEDIA_WRITE_PROTECTED,
+                                          0);
 
-        copyLen = 0;
+        goto DoneUnlocked;
+    }
+
+    WdfSpinLockAcquire(devContext->QueueLock);
+
+    //
+    // In streaming mode the write gets handled elsewhere
+    //
+    if (NOTHING_STREAMING) {
 
-        goto DoneCompleteWrite;
+        NothingStreamWrite(devContext,
+                           devContext->ReadQueue,
+                           devContext->WriteQueue,
+                           Request);
+
+        goto DoneJustReturn;
     }
 
     //
@@ -819,8 +1138,10 @@ NothingEvtWrite(WDFQUEUE   Queue,
         // Put the write Request we just received onto the write Queue and return
         // with that write Request pending.
         //
-        status = WdfRequestForwardToIoQueue(Request,
-                                            devContext->WriteQueue);
+        status = NothingParkRequest(devContext,
+                                    Request,
+                                    devContext->WriteQueue,
+                                    FALSE);
 
 
         if (!NT_SUCCESS(status)) {
@@ -901,12 +1222,18 @@ NothingEvtWrite(WDFQUEUE   Queue,
                   readBufferLen);
 
     //
-    // Store the data from the write into the user's read buffer
+    // Store the data from the write into the user's read buffer.  When
+    // we're using Direct I/O this is the ONLY copy of the data that's
+    // made between the writer and the reader.
     //
-    RtlCopyMemory(readBuffer,
+    OsrCopyMemory(&devContext->Copy,
+                  readBuffer,
                   writeBuffer,
                   copyLen);
 
+    NothingCountBytes(devContext,
+                      copyLen);
+
 DoneCompleteBoth:
 
 #if DBG
@@ -930,27 +1257,28 @@ DoneCompleteWrite:
                                       copyLen);
 DoneJustReturn:
 
+    WdfSpinLockRelease(devContext->QueueLock);
+
+DoneUnlocked:
+
     return;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//  NothingEvtDeviceControl
+//  NothingStreamRead
 //
-//    This routine is called by the framework when there is a
-//    device control request for us to process
+//    This routine processes a read request in streaming mode
 //
 //  INPUTS:
 //
-//      Queue    - Our default queue
-//
-//      Request  - A device control request
+//      DevContext - Our device context
 //
-//      OutputBufferLength - The length of the output buffer
+//      ReadQueue  - Where to park the read if there's no data
 //
-//      InputBufferLength  - The length of the input buffer
+//      WriteQueue - Where to look for writes with data
 //
-//      IoControlCode      - The operation being performed
+//      Request    - A read request
 //
 //  OUTPUTS:
 //
@@ -962,82 +1290,2655 @@ DoneJustReturn:
 //
 //  IRQL:
 //
-//      This routine is called at IRQL == PASSIVE_LEVEL, due to
-//      our PASSIVE_LEVEL execution level contraint
+//      This routine is called at IRQL <= DISPATCH_LEVEL, with the lock
+//      that guards the two Queues held
 //
 //  NOTES:
 //
+//      We fill the read with data from as many waiting writes as it takes.
+//      A write that we consume completely gets completed.  A write that we
+//      only consume part of goes back on the head of the WriteQueue so that
+//      the next read picks up where this one left off.
+//
+//      If there's no data waiting at all, the read waits on the ReadQueue.
+//      Otherwise, like a pipe, we complete it with whatever we found even
+//      if that's less than the read asked for.
 //
 ///////////////////////////////////////////////////////////////////////////////
 VOID
-NothingEvtDeviceControl(WDFQUEUE   Queue,
-                        WDFREQUEST Request,
-                        size_t     OutputBufferLength,
-                        size_t     InputBufferLength,
-                        ULONG      IoControlCode)
+NothingStreamRead(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFQUEUE                ReadQueue,
+                  WDFQUEUE                WriteQueue,
+                  WDFREQUEST              Request)
 {
-    UNREFERENCED_PARAMETER(IoControlCode);
-    UNREFERENCED_PARAMETER(InputBufferLength);
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(Queue);
+    NTSTATUS                 status;
+    WDFREQUEST               writeRequest;
+    PVOID                    writeBuffer;
+    size_t                   writeBufferLen;
+    PVOID                    readBuffer;
+    size_t                   readBufferLen;
+    PNOTHING_REQUEST_CONTEXT readContext;
+    PNOTHING_REQUEST_CONTEXT writeContext;
+    size_t                   copyLen;
+
+    readContext = NothingGetRequestContext(Request);
+
+    //
+    // Get the read buffer...
+    //
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            1,
+                                            &readBuffer,
+                                            &readBufferLen);
+    if (!NT_SUCCESS(status)) {
 
 #if DBG
-    DbgPrint("NothingEvtDeviceControl\n");
+        DbgPrint("WdfRequestRetrieveOutputBuffer failed with Status code 0x%x",
+                 status);
 #endif
+        WdfRequestCompleteWithInformation(Request,
+                                          status,
+                                          0);
+        return;
+    }
 
     //
-    // Nothing to do...
-    // In this case, we return an info field of zero
+    // Keep pulling writes off the WriteQueue until the read is full or
+    // we run out of writes.
     //
-    WdfRequestCompleteWithInformation(Request,
-                                      STATUS_SUCCESS,
-                                      0);
-}
+    while (readContext->BytesTransferred < readBufferLen) {
 
-///////////////////////////////////////////////////////////////////////////////
-//
-//  NothingEvtFdoCreate
-//
-//    This routine is called by the framework when someone is
-//    trying to open a HANDLE to our device
-//
-//  INPUTS:
-//
-//      Device   - One of our devices
-//
-//      Request  - A create request
-//
-//      FileObject - The WDFFILEOBJECT representing the new
-//                   open instance
-//
-//  OUTPUTS:
-//
-//      None.
-//
-//  RETURNS:
-//
-//      None.
-//
-//  IRQL:
-//
-//      This routine is called at IRQL == PASSIVE_LEVEL.
-//
-//  NOTES:
-//
-//
-///////////////////////////////////////////////////////////////////////////////
-VOID
-NothingEvtFdoCreate(
+        status = WdfIoQueueRetrieveNextRequest(WriteQueue,
+                                               &writeRequest);
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        writeContext = NothingGetRequestContext(writeRequest);
+
+        status = WdfRequestRetrieveInputBuffer(writeRequest,
+                                               1,
+                                               &writeBuffer,
+                                               &writeBufferLen);
+        if (!NT_SUCCESS(status)) {
+
+#if DBG
+            DbgPrint("WdfRequestRetrieveInputBuffer failed with Status code 0x%x",
+                     status);
+#endif
+            //
+            // Bad write buffer. Fail that write and move on to the next.
+            //
+            WdfRequestCompleteWithInformation(writeRequest,
+                                              status,
+                                              writeContext->BytesTransferred);
+            continue;
+        }
+
+        copyLen = NothingStreamCopy(DevContext,
+                                    readBuffer,
+                                    readBufferLen,
+                                    readContext,
+                                    writeBuffer,
+                                    writeBufferLen,
+                                    writeContext);
+
+        NothingCountBytes(DevContext,
+                          copyLen);
+
+        if (writeContext->BytesTransferred == writeBufferLen) {
+
+            //
+            // We used up all of this write's data, so it's done.
+            //
+            WdfRequestCompleteWithInformation(writeRequest,
+                                              STATUS_SUCCESS,
+                                              writeBufferLen);
+            continue;
+        }
+
+        //
+        // The read's full but there's data left in the write. Put the write
+        // back at the head of the WriteQueue for the next reader.
+        //
+        status = WdfRequestRequeue(writeRequest);
+
+        if (!NT_SUCCESS(status)) {
+
+#if DBG
+            DbgPrint("WdfRequestRequeue failed with Status code 0x%x",
+                     status);
+#endif
+            //
+            // Can't hang on to it, so complete it with as much as we
+            // took.  The writer sees this as a short write.
+            //
+            WdfRequestCompleteWithInformation(writeRequest,
+                                              STATUS_SUCCESS,
+                                              writeContext->BytesTransferred);
+        }
+    }
+
+    if (readContext->BytesTransferred != 0) {
+
+#if DBG
+        DbgPrint("Completing read with 0x%Ix bytes transferred\n",
+                 readContext->BytesTransferred);
+#endif
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_SUCCESS,
+                                          readContext->BytesTransferred);
+        return;
+    }
+
+    //
+    // No data at all.  Wait for a writer.
+    //
+    status = NothingParkRequest(DevContext,
+                                Request,
+                                ReadQueue,
+                                TRUE);
+
+    if (!NT_SUCCESS(status)) {
+
+#if DBG
+        DbgPrint("WdfRequestForwardToIoQueue failed with Status code 0x%x",
+                 status);
+#endif
+        WdfRequestCompleteWithInformation(Request,
+                                          status,
+                                          0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingStreamWrite
+//
+//    This routine processes a write request in streaming mode
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      ReadQueue  - Where to look for reads waiting for data
+//
+//      WriteQueue - Where to park the write if there's data left over
+//
+//      Request    - A write request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL, with the lock
+//      that guards the two Queues held
+//
+//  NOTES:
+//
+//      We hand the write's data out to as many waiting reads as it takes.
+//      Each read we give data to gets completed.  If we run out of reads
+//      before we run out of data, the write waits on the WriteQueue with
+//      the rest of its data for the next reader.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingStreamWrite(PNOTHING_DEVICE_CONTEXT DevContext,
+                   WDFQUEUE                ReadQueue,
+                   WDFQUEUE                WriteQueue,
+                   WDFREQUEST              Request)
+{
+    NTSTATUS                 status;
+    WDFREQUEST               readRequest;
+    PVOID                    writeBuffer;
+    size_t                   writeBufferLen;
+    PVOID                    readBuffer;
+    size_t                   readBufferLen;
+    PNOTHING_REQUEST_CONTEXT readContext;
+    PNOTHING_REQUEST_CONTEXT writeContext;
+    size_t                   copyLen;
+
+    writeContext = NothingGetRequestContext(Request);
+
+    //
+    // Get the write buffer...
+    //
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           1,
+                                           &writeBuffer,
+                                           &writeBufferLen);
+    if (!NT_SUCCESS(status)) {
+
+#if DBG
+        DbgPrint("WdfRequestRetrieveInputBuffer failed with Status code 0x%x",
+                 status);
+#endif
+        WdfRequestCompleteWithInformation(Request,
+                                          status,
+                                          0);
+        return;
+    }
+
+    //
+    // Keep pulling reads off the ReadQueue until we've handed out all
+    // of our data or we run out of reads.
+    //
+    while (writeContext->BytesTransferred < writeBufferLen) {
+
+        status = WdfIoQueueRetrieveNextRequest(ReadQueue,
+                                               &readRequest);
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        readContext = NothingGetRequestContext(readRequest);
+
+        status = WdfRequestRetrieveOutputBuffer(readRequest,
+                                                1,
+                                                &readBuffer,
+                                                &readBufferLen);
+        if (!NT_SUCCESS(status)) {
+
+#if DBG
+            DbgPrint("WdfRequestRetrieveOutputBuffer failed with Status code 0x%x",
+                     status);
+#endif
+            //
+            // Bad read buffer. Fail that read and move on to the next.
+            //
+            WdfRequestCompleteWithInformation(readRequest,
+                                              status,
+                                              0);
+            continue;
+        }
+
+        copyLen = NothingStreamCopy(DevContext,
+                                    readBuffer,
+                                    readBufferLen,
+                                    readContext,
+                                    writeBuffer,
+                                    writeBufferLen,
+                                    writeContext);
+
+        NothingCountBytes(DevContext,
+                          copyLen);
+
+        //
+        // Like a pipe, the read completes with whatever it got
+        //
+        WdfRequestCompleteWithInformation(readRequest,
+                                          STATUS_SUCCESS,
+                                          readContext->BytesTransferred);
+    }
+
+    if (writeContext->BytesTransferred == writeBufferLen) {
+
+#if DBG
+        DbgPrint("Completing write with 0x%Ix bytes transferred\n",
+                 writeBufferLen);
+#endif
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_SUCCESS,
+                                          writeBufferLen);
+        return;
+    }
+
+    //
+    // Data left over.  Wait for more readers, keeping track of how far
+    // we've gotten in the request context.
+    //
+    status = NothingParkRequest(DevContext,
+                                Request,
+                                WriteQueue,
+                                FALSE);
+
+    if (status == STATUS_DEVICE_BUSY && writeContext->BytesTransferred != 0) {
+
+        //
+        // No room to wait, but some of the data's already gone to
+        // readers.  Tell the writer how much, as a short write.
+        //
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_SUCCESS,
+                                          writeContext->BytesTransferred);
+
+    } else if (!NT_SUCCESS(status)) {
+
+#if DBG
+        DbgPrint("NothingParkRequest failed with Status code 0x%x",
+                 status);
+#endif
+        WdfRequestCompleteWithInformation(Request,
+                                          status,
+                                          writeContext->BytesTransferred);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingStreamCopy
+//
+//    This routine moves as much data as it can from a write to a read,
+//    picking up where we last left off in each of them
+//
+//  INPUTS:
+//
+//      DevContext     - Our device context
+//
+//      ReadBuffer     - The read's data buffer
+//
+//      ReadBufferLen  - The length of the read's data buffer
+//
+//      ReadContext    - The read's request context
+//
+//      WriteBuffer    - The write's data buffer
+//
+//      WriteBufferLen - The length of the write's data buffer
+//
+//      WriteContext   - The write's request context
+//
+//  OUTPUTS:
+//
+//      ReadContext and WriteContext are updated with the number of bytes
+//      copied.
+//
+//  RETURNS:
+//
+//      The number of bytes copied.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+size_t
+NothingStreamCopy(PNOTHING_DEVICE_CONTEXT  DevContext,
+                  PVOID                    ReadBuffer,
+                  size_t                   ReadBufferLen,
+                  PNOTHING_REQUEST_CONTEXT ReadContext,
+                  PVOID                    WriteBuffer,
+                  size_t                   WriteBufferLen,
+                  PNOTHING_REQUEST_CONTEXT WriteContext)
+{
+    size_t copyLen;
+
+    copyLen = min(ReadBufferLen - ReadContext->BytesTransferred,
+                  WriteBufferLen - WriteContext->BytesTransferred);
+
+    OsrCopyMemory(&DevContext->Copy,
+                  (PUCHAR)ReadBuffer + ReadContext->BytesTransferred,
+                  (PUCHAR)WriteBuffer + WriteContext->BytesTransferred,
+                  copyLen);
+
+    ReadContext->BytesTransferred  += copyLen;
+    WriteContext->BytesTransferred += copyLen;
+
+    return copyLen;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingSetAllowedWriter
+//
+//    This routine hands write ownership of the device to a new open
+//    instance
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      NewWriter  - The new allowed writer, or nullptr for none
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL, with the
+//      WaitingWritersLock held
+//
+//  NOTES:
+//
+//      The old writer's epoch stops matching the moment we publish the new
+//      one, and the new writer's starts matching at that same moment, so a
+//      write never sees two owners or a half made change.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingSetAllowedWriter(PNOTHING_DEVICE_CONTEXT DevContext,
+                        WDFFILEOBJECT           NewWriter)
+{
+    LONG64 epoch;
+
+    //
+    // We hold the lock, so nobody else changes the epoch under us
+    //
+    epoch = DevContext->WriterEpoch + 1;
+
+    if (NewWriter != nullptr) {
+
+        NothingGetFileContext(NewWriter)->WriterEpoch = epoch;
+    }
+
+    DevContext->AllowedWriter = NewWriter;
+
+    InterlockedExchange64(&DevContext->WriterEpoch,
+                          epoch);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingChannelPair
+//
+//    This routine processes an IOCTL_OSR_NOTHING_CHANNEL_PAIR request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The pairing request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      If another handle is already waiting on the PairQueue with the same
+//      key we pair the two up and complete both requests.  Otherwise this
+//      request waits on the PairQueue.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingChannelPair(PNOTHING_DEVICE_CONTEXT DevContext,
+                   WDFREQUEST              Request)
+{
+    NTSTATUS              status;
+    PNOTHING_CHANNEL_PAIR pair;
+    WDFFILEOBJECT         fileObject;
+    PNOTHING_FILE_CONTEXT fileContext;
+    PNOTHING_FILE_CONTEXT peerContext;
+    WDFREQUEST            peerRequest = nullptr;
+    WDFREQUEST            prevRequest = nullptr;
+    WDFREQUEST            foundRequest;
+    WDF_IO_QUEUE_CONFIG   queueConfig;
+    WDF_OBJECT_ATTRIBUTES objAttributes;
+    WDFOBJECT             channelObject;
+    PNOTHING_CHANNEL      channel;
+
+    fileObject  = WdfRequestGetFileObject(Request);
+    fileContext = NothingGetFileContext(fileObject);
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(NOTHING_CHANNEL_PAIR),
+                                           (PVOID *)&pair,
+                                           nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get pair buffer - 0x%x\n", status);
+#endif
+        goto done;
+    }
+
+    if (fileContext->ChannelObject != nullptr) {
+
+        //
+        // Already paired
+        //
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto done;
+    }
+
+    WdfSpinLockAcquire(DevContext->PairLock);
+
+    //
+    // Give this handle its private Queues, if it doesn't have them yet.
+    // They get deleted when the handle is closed.
+    //
+    if (fileContext->ReadQueue == nullptr) {
+
+        WDF_IO_QUEUE_CONFIG_INIT(&queueConfig,
+                                 WdfIoQueueDispatchManual);
+
+        queueConfig.PowerManaged = WdfFalse;
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&objAttributes,
+                                                NOTHING_QUEUE_CONTEXT);
+
+        status = WdfIoQueueCreate(WdfFileObjectGetDevice(fileObject),
+                                  &queueConfig,
+                                  &objAttributes,
+                                  &fileContext->ReadQueue);
+
+        if (NT_SUCCESS(status)) {
+
+            status = WdfIoQueueCreate(WdfFileObjectGetDevice(fileObject),
+                                      &queueConfig,
+                                      &objAttributes,
+                                      &fileContext->WriteQueue);
+        }
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfIoQueueCreate for channel queue failed 0x%0x\n",
+                     status);
+#endif
+            WdfSpinLockRelease(DevContext->PairLock);
+            goto done;
+        }
+    }
+
+    //
+    // Look for someone waiting with the same key.  The only way a request
+    // leaves the PairQueue without us holding the PairLock is by being
+    // cancelled, and if that happens to the one we're looking at we just
+    // start over.
+    //
+    while (TRUE) {
+
+        status = WdfIoQueueFindRequest(DevContext->PairQueue,
+                                       prevRequest,
+                                       nullptr,
+                                       nullptr,
+                                       &foundRequest);
+
+        if (prevRequest != nullptr) {
+            WdfObjectDereference(prevRequest);
+            prevRequest = nullptr;
+        }
+
+        if (status == STATUS_NOT_FOUND) {
+            continue;
+        }
+
+        if (!NT_SUCCESS(status)) {
+
+            //
+            // STATUS_NO_MORE_ENTRIES.  Nobody's waiting for us.
+            //
+            break;
+        }
+
+        if (WdfRequestGetFileObject(foundRequest) == fileObject) {
+
+            //
+            // This handle already has a pairing request waiting
+            //
+            WdfObjectDereference(foundRequest);
+
+            WdfSpinLockRelease(DevContext->PairLock);
+
+            status = STATUS_INVALID_DEVICE_STATE;
+            goto done;
+        }
+
+        if (NothingGetFileContext(WdfRequestGetFileObject(foundRequest))->
+                                                ChannelKey != pair->Key) {
+
+            prevRequest = foundRequest;
+            continue;
+        }
+
+        status = WdfIoQueueRetrieveFoundRequest(DevContext->PairQueue,
+                                                foundRequest,
+                                                &peerRequest);
+
+        WdfObjectDereference(foundRequest);
+
+        if (NT_SUCCESS(status)) {
+            break;
+        }
+
+        peerRequest = nullptr;
+    }
+
+    if (peerRequest == nullptr) {
+
+        //
+        // Wait for our peer
+        //
+        fileContext->ChannelKey = pair->Key;
+
+        status = WdfRequestForwardToIoQueue(Request,
+                                            DevContext->PairQueue);
+
+        WdfSpinLockRelease(DevContext->PairLock);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfRequestForwardToIoQueue failed with Status code 0x%x",
+                     status);
+#endif
+            goto done;
+        }
+
+        return;
+    }
+
+    WdfSpinLockRelease(DevContext->PairLock);
+
+    //
+    // Found our peer.  Nobody else can see either handle's channel until
+    // we fill it in, so we don't need any locks to set it up.
+    //
+    peerContext = NothingGetFileContext(WdfRequestGetFileObject(peerRequest));
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&objAttributes,
+                                            NOTHING_CHANNEL);
+
+    objAttributes.ParentObject = WdfFileObjectGetDevice(fileObject);
+
+    status = WdfObjectCreate(&objAttributes,
+                             &channelObject);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfObjectCreate failed 0x%0x\n",
+                 status);
+#endif
+        goto donePeer;
+    }
+
+    channel = NothingGetChannel(channelObject);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objAttributes);
+
+    objAttributes.ParentObject = channelObject;
+
+    status = WdfSpinLockCreate(&objAttributes,
+                               &channel->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate failed 0x%0x\n",
+                 status);
+#endif
+        WdfObjectDelete(channelObject);
+        goto donePeer;
+    }
+
+    channel->End[0] = peerContext;
+    channel->End[1] = fileContext;
+
+    peerContext->ChannelObject = channelObject;
+    peerContext->ChannelEnd    = 0;
+
+    fileContext->ChannelObject = channelObject;
+    fileContext->ChannelEnd    = 1;
+
+#if DBG
+    DbgPrint("Paired 0x%p and 0x%p\n",
+             WdfRequestGetFileObject(peerRequest),
+             fileObject);
+#endif
+
+donePeer:
+
+    WdfRequestComplete(peerRequest,
+                       status);
+done:
+
+    WdfRequestComplete(Request,
+                       status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingChannelIo
+//
+//    This routine processes a read or write request on a paired handle
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - A read or write request
+//
+//      IsWrite    - TRUE for a write, FALSE for a read
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      A read takes data from the writes waiting on our peer's WriteQueue,
+//      and waits on our own ReadQueue.  A write feeds the reads waiting on
+//      our peer's ReadQueue, and waits on our own WriteQueue.  The only
+//      lock involved is the channel's.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingChannelIo(PNOTHING_DEVICE_CONTEXT DevContext,
+                 WDFREQUEST              Request,
+                 BOOLEAN                 IsWrite)
+{
+    PNOTHING_FILE_CONTEXT fileContext;
+    PNOTHING_FILE_CONTEXT peerContext;
+    PNOTHING_CHANNEL      channel;
+
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+    channel     = NothingGetChannel(fileContext->ChannelObject);
+
+    WdfSpinLockAcquire(channel->Lock);
+
+    peerContext = channel->End[1 - fileContext->ChannelEnd];
+
+    if (peerContext == nullptr) {
+
+        //
+        // The other end's gone
+        //
+        WdfSpinLockRelease(channel->Lock);
+
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_PIPE_BROKEN,
+                                          0);
+        return;
+    }
+
+    if (IsWrite) {
+
+        NothingStreamWrite(DevContext,
+                           peerContext->ReadQueue,
+                           fileContext->WriteQueue,
+                           Request);
+    } else {
+
+        NothingStreamRead(DevContext,
+                          fileContext->ReadQueue,
+                          peerContext->WriteQueue,
+                          Request);
+    }
+
+    WdfSpinLockRelease(channel->Lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingChannelClose
+//
+//    This routine tears down a closing handle's end of its channel
+//
+//  INPUTS:
+//
+//      FileContext - The context of the closing handle
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      By the time a handle is closed all of its own requests are done, so
+//      its Queues are empty.  The peer's requests can't complete any more,
+//      so we fail them.  Whichever end closes last deletes the channel.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingChannelClose(PNOTHING_FILE_CONTEXT FileContext)
+{
+    PNOTHING_FILE_CONTEXT peerContext = nullptr;
+    PNOTHING_CHANNEL      channel;
+
+    if (FileContext->ChannelObject != nullptr) {
+
+        channel = NothingGetChannel(FileContext->ChannelObject);
+
+        WdfSpinLockAcquire(channel->Lock);
+
+        channel->End[FileContext->ChannelEnd] = nullptr;
+
+        peerContext = channel->End[1 - FileContext->ChannelEnd];
+
+        if (peerContext != nullptr) {
+
+            NothingChannelFlush(peerContext);
+        }
+
+        WdfSpinLockRelease(channel->Lock);
+
+        if (peerContext == nullptr) {
+
+            WdfObjectDelete(FileContext->ChannelObject);
+
+        } else {
+
+            //
+            // Our peer is hung up now
+            //
+            NothingPollKick();
+        }
+
+        FileContext->ChannelObject = nullptr;
+    }
+
+    if (FileContext->ReadQueue != nullptr) {
+
+        WdfObjectDelete(FileContext->ReadQueue);
+    }
+
+    if (FileContext->WriteQueue != nullptr) {
+
+        WdfObjectDelete(FileContext->WriteQueue);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingChannelFlush
+//
+//    This routine fails all the requests waiting on a handle's private
+//    Queues, because its peer has gone away
+//
+//  INPUTS:
+//
+//      FileContext - The context of the handle whose requests we fail
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL, with the channel
+//      lock held
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingChannelFlush(PNOTHING_FILE_CONTEXT FileContext)
+{
+    WDFREQUEST request;
+
+    while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(FileContext->ReadQueue,
+                                                    &request))) {
+
+        WdfRequestCompleteWithInformation(request,
+                                          STATUS_PIPE_BROKEN,
+                                          0);
+    }
+
+    //
+    // Writes might have handed out some of their data already, so let
+    // the writer know how much
+    //
+    while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(FileContext->WriteQueue,
+                                                    &request))) {
+
+        WdfRequestCompleteWithInformation(request,
+                                          STATUS_PIPE_BROKEN,
+                              NothingGetRequestContext(request)->BytesTransferred);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingParkRequest
+//
+//    This routine puts a read or write on one of our manual Queues to wait,
+//    and keeps the counters that go with that
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The read or write to park
+//
+//      Queue      - The Queue to park it on
+//
+//      IsRead     - TRUE if Request is a read, FALSE for a write
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_DEVICE_BUSY if the Queue is at one of its limits, otherwise
+//      the status of WdfRequestForwardToIoQueue.  If this fails, the caller
+//      still owns the request.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL, with the lock
+//      that guards Queue held
+//
+//  NOTES:
+//
+//      This is already our slow path, so it's where we look after the
+//      maximum depth.  The maximums are shared by everyone, but we only
+//      write them when a Queue gets deeper than it's ever been.
+//
+//      It's also where we enforce the Queue's limits, charging the Queue
+//      for the Request (see NOTHING_QUEUE_CONTEXT).  A Request that's
+//      already been charged (one we're putting back after a failed
+//      forward, say) isn't charged or checked again.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+NothingParkRequest(PNOTHING_DEVICE_CONTEXT DevContext,
+                   WDFREQUEST              Request,
+                   WDFQUEUE                Queue,
+                   BOOLEAN                 IsRead)
+{
+    NTSTATUS                 status;
+    PNOTHING_CPU_COUNTERS    counters;
+    PNOTHING_REQUEST_CONTEXT requestContext;
+    PNOTHING_QUEUE_CONTEXT   queueContext;
+    WDF_REQUEST_PARAMETERS   params;
+    size_t                   length;
+    volatile LONG64         *maxDepth;
+    LONG64                   oldMax;
+    LONG64                   previous;
+    ULONG                    depth;
+
+    requestContext = NothingGetRequestContext(Request);
+
+    if (requestContext->ChargedQueue == nullptr) {
+
+        queueContext = NothingGetQueueContext(Queue);
+
+        WDF_REQUEST_PARAMETERS_INIT(&params);
+
+        WdfRequestGetParameters(Request,
+                                &params);
+
+        length = IsRead ? params.Parameters.Read.Length :
+                          params.Parameters.Write.Length;
+
+        //
+        // Is there room?  There always is on an empty Queue, so that a
+        // Request bigger than MaxQueueBytes can still wait by itself.
+        //
+        if (queueContext->Depth != 0 &&
+            ((DevContext->MaxQueueDepth != 0 &&
+              (ULONG)queueContext->Depth >= DevContext->MaxQueueDepth) ||
+             (DevContext->MaxQueueBytes != 0 &&
+              (size_t)queueContext->Bytes + length > DevContext->MaxQueueBytes))) {
+
+            InterlockedIncrementNoFence64(
+                    &NothingGetCpuCounters(DevContext)->DeviceBusyRejections);
+
+            return STATUS_DEVICE_BUSY;
+        }
+
+        if (InterlockedIncrement(&queueContext->Depth) == 1) {
+
+            //
+            // The Queue was empty, so whoever's on the other side of it
+            // just became ready
+            //
+            NothingPollKick();
+        }
+
+        InterlockedAdd64(&queueContext->Bytes,
+                         length);
+
+        requestContext->ChargedQueue = queueContext;
+        requestContext->ChargedBytes = length;
+    }
+
+    //
+    // Start the wait clock the first time the Request gets parked.  It has
+    // to be now, because once it's on the Queue it isn't ours any more.
+    //
+
+    if (requestContext->ParkedTime == 0) {
+
+        requestContext->ParkedTime = KeQueryPerformanceCounter(nullptr).QuadPart;
+    }
+
+    status = WdfRequestForwardToIoQueue(Request,
+                                        Queue);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    counters = NothingGetCpuCounters(DevContext);
+
+    InterlockedIncrementNoFence64(IsRead ? &counters->ReadsParked :
+                                           &counters->WritesParked);
+
+    WdfIoQueueGetState(Queue,
+                       &depth,
+                       nullptr);
+
+    maxDepth = IsRead ? &DevContext->ReadQueueMaxDepth :
+                        &DevContext->WriteQueueMaxDepth;
+
+    oldMax = ReadNoFence64(maxDepth);
+
+    while ((LONG64)depth > oldMax) {
+
+        previous = InterlockedCompareExchange64(maxDepth,
+                                                depth,
+                                                oldMax);
+        if (previous == oldMax) {
+            break;
+        }
+
+        oldMax = previous;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingCountBytes
+//
+//    This routine counts data moved from a write to a read
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Length     - The number of bytes moved
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Every byte we move is both written and read, so both counters go up.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingCountBytes(PNOTHING_DEVICE_CONTEXT DevContext,
+                  size_t                  Length)
+{
+    PNOTHING_CPU_COUNTERS counters;
+
+    counters = NothingGetCpuCounters(DevContext);
+
+    InterlockedAddNoFence64(&counters->BytesRead,
+                            Length);
+    InterlockedAddNoFence64(&counters->BytesWritten,
+                            Length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingGetCpuCounters
+//
+//    This routine returns the performance counters to update from the
+//    current processor
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The current processor's set of counters
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We might get moved to another processor right after this, in which
+//      case we update some other processor's counters.  That's fine, the
+//      totals come out the same.
+//
+///////////////////////////////////////////////////////////////////////////////
+PNOTHING_CPU_COUNTERS
+NothingGetCpuCounters(PNOTHING_DEVICE_CONTEXT DevContext)
+{
+    return &DevContext->Counters[KeGetCurrentProcessorNumberEx(nullptr) %
+                                                   DevContext->CounterCount];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingGetStats
+//
+//    This routine processes an IOCTL_OSR_NOTHING_GET_STATS request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The stats request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We add up the counters without any locks, so the totals are only a
+//      snapshot.  The current depths are those of the device's shared
+//      ReadQueue and WriteQueue.  The parked counts and maximum depths
+//      include channel Queues too.  DeviceBusyRejections counts the
+//      requests that NothingParkRequest failed with STATUS_DEVICE_BUSY
+//      because a Queue was at one of its limits.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingGetStats(PNOTHING_DEVICE_CONTEXT DevContext,
+                WDFREQUEST              Request)
+{
+    NTSTATUS              status;
+    PNOTHING_STATS        stats;
+    PNOTHING_CPU_COUNTERS counters;
+    ULONG                 depth;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NOTHING_STATS),
+                                            (PVOID *)&stats,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get stats buffer - 0x%x\n", status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    RtlZeroMemory(stats,
+                  sizeof(NOTHING_STATS));
+
+    stats->Version = NOTHING_STATS_VERSION;
+    stats->Size    = sizeof(NOTHING_STATS);
+
+    for (ULONG index = 0; index < DevContext->CounterCount; index++) {
+
+        counters = &DevContext->Counters[index];
+
+        stats->Reads        += ReadNoFence64(&counters->Reads);
+        stats->Writes       += ReadNoFence64(&counters->Writes);
+        stats->BytesRead    += ReadNoFence64(&counters->BytesRead);
+        stats->BytesWritten += ReadNoFence64(&counters->BytesWritten);
+        stats->ReadsParked  += ReadNoFence64(&counters->ReadsParked);
+        stats->WritesParked += ReadNoFence64(&counters->WritesParked);
+        stats->DeviceBusyRejections +=
+                           ReadNoFence64(&counters->DeviceBusyRejections);
+    }
+
+    WdfIoQueueGetState(DevContext->ReadQueue,
+                       &depth,
+                       nullptr);
+
+    stats->ReadQueueDepth = depth;
+
+    WdfIoQueueGetState(DevContext->WriteQueue,
+                       &depth,
+                       nullptr);
+
+    stats->WriteQueueDepth = depth;
+
+    stats->ReadQueueMaxDepth  = ReadNoFence64(&DevContext->ReadQueueMaxDepth);
+    stats->WriteQueueMaxDepth = ReadNoFence64(&DevContext->WriteQueueMaxDepth);
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(NOTHING_STATS));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingStampArrival
+//
+//    This routine starts the clock on a read or write that just arrived
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The read or write
+//
+//      IsWrite    - TRUE for a write, FALSE for a read
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingStampArrival(PNOTHING_DEVICE_CONTEXT DevContext,
+                    WDFREQUEST              Request,
+                    BOOLEAN                 IsWrite)
+{
+    PNOTHING_REQUEST_CONTEXT requestContext;
+
+    requestContext = NothingGetRequestContext(Request);
+
+    requestContext->DevContext  = DevContext;
+    requestContext->IsWrite     = IsWrite;
+    requestContext->ArrivalTime = KeQueryPerformanceCounter(nullptr).QuadPart;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtRequestCleanup
+//
+//    This routine is called by the framework when a Request sent to our
+//    device has been completed
+//
+//  INPUTS:
+//
+//      Object   - The WDFREQUEST
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      This is the one place that sees every read and write complete, no
+//      matter who completed it or why (including the framework cancelling
+//      it), so it's where we stop the clock.  For the same reason, it's
+//      where a parked Request gives back what it was charged, and where a
+//      poll lets go of the handles it was watching.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtRequestCleanup(WDFOBJECT Object)
+{
+    PNOTHING_REQUEST_CONTEXT requestContext;
+    LONGLONG                 now;
+
+    requestContext = NothingGetRequestContext(Object);
+
+    if (requestContext->ChargedQueue != nullptr) {
+
+        InterlockedAdd64(&requestContext->ChargedQueue->Bytes,
+                         -(LONG64)requestContext->ChargedBytes);
+        InterlockedDecrement(&requestContext->ChargedQueue->Depth);
+    }
+
+    if (requestContext->PollWaiter != nullptr) {
+
+        for (ULONG index = 0;
+             index < requestContext->PollWaiter->EntryCount;
+             index++) {
+
+            ObDereferenceObject(requestContext->PollWaiter->Entries[index].FileObject);
+        }
+
+        ExFreePoolWithTag(requestContext->PollWaiter,
+                          NOTHING_POOL_TAG);
+    }
+
+    if (requestContext->ArrivalTime == 0) {
+
+        //
+        // Not a read or a write
+        //
+        return;
+    }
+
+    now = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+    NothingRecordLatency(requestContext->DevContext,
+                         requestContext->IsWrite ?
+                             NOTHING_LATENCY_WRITE_SERVICE :
+                             NOTHING_LATENCY_READ_SERVICE,
+                         now - requestContext->ArrivalTime);
+
+    if (requestContext->ParkedTime != 0) {
+
+        NothingRecordLatency(requestContext->DevContext,
+                             requestContext->IsWrite ?
+                                 NOTHING_LATENCY_WRITE_WAIT :
+                                 NOTHING_LATENCY_READ_WAIT,
+                             now - requestContext->ParkedTime);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingRecordLatency
+//
+//    This routine adds one value to one of our latency histograms
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Histogram  - Which histogram (NOTHING_LATENCY_XXX)
+//
+//      Ticks      - The value, in performance counter ticks
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      See nothing_ioctl.h for how the buckets are laid out.  Like our
+//      other counters, each processor has its own histograms.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingRecordLatency(PNOTHING_DEVICE_CONTEXT DevContext,
+                     ULONG                   Histogram,
+                     LONGLONG                Ticks)
+{
+    ULONG64 value;
+    ULONG   msb;
+    ULONG   bucket;
+
+    value = (Ticks < 0) ? 0 : (ULONG64)Ticks;
+
+    if (value < 16) {
+
+        bucket = (ULONG)value;
+
+    } else {
+
+        BitScanReverse64(&msb,
+                         value);
+
+        //
+        // Which power of two, then which eighth of it
+        //
+        bucket = (msb - 2) * 8 + (ULONG)(value >> (msb - 3)) - 8;
+
+        if (bucket >= NOTHING_LATENCY_BUCKETS) {
+
+            bucket = NOTHING_LATENCY_BUCKETS - 1;
+        }
+    }
+
+    InterlockedIncrementNoFence64(
+               &NothingGetCpuCounters(DevContext)->Latency[Histogram][bucket]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingGetLatency
+//
+//    This routine processes an IOCTL_OSR_NOTHING_GET_LATENCY request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The latency request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Like the stats, this is a snapshot taken without any locks.  A
+//      reset zeroes each bucket right after we've read it, so a value that's
+//      recorded in between is lost.  That's good enough for percentiles.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingGetLatency(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFREQUEST              Request)
+{
+    NTSTATUS                 status;
+    PNOTHING_LATENCY         latency;
+    PNOTHING_LATENCY_REQUEST latencyRequest;
+    PNOTHING_CPU_COUNTERS    counters;
+    BOOLEAN                  reset = FALSE;
+
+    //
+    // The input buffer is optional
+    //
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(NOTHING_LATENCY_REQUEST),
+                                           (PVOID *)&latencyRequest,
+                                           nullptr);
+    if (NT_SUCCESS(status)) {
+
+        reset = (latencyRequest->Flags & NOTHING_LATENCY_FLAG_RESET) != 0;
+    }
+
+    //
+    // With METHOD_BUFFERED the input and output share the same buffer, so
+    // we're done with the input now.
+    //
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NOTHING_LATENCY),
+                                            (PVOID *)&latency,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get latency buffer - 0x%x\n", status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    RtlZeroMemory(latency,
+                  sizeof(NOTHING_LATENCY));
+
+    latency->Version   = NOTHING_LATENCY_VERSION;
+    latency->Size      = sizeof(NOTHING_LATENCY);
+    latency->Frequency = DevContext->PerformanceFrequency;
+
+    for (ULONG index = 0; index < DevContext->CounterCount; index++) {
+
+        counters = &DevContext->Counters[index];
+
+        for (ULONG histogram = 0; histogram < NOTHING_LATENCY_HISTOGRAMS; histogram++) {
+
+            for (ULONG bucket = 0; bucket < NOTHING_LATENCY_BUCKETS; bucket++) {
+
+                latency->Counts[histogram][bucket] += reset ?
+                    InterlockedExchange64(&counters->Latency[histogram][bucket], 0) :
+                    ReadNoFence64(&counters->Latency[histogram][bucket]);
+            }
+        }
+    }
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(NOTHING_LATENCY));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingGetCredits
+//
+//    This routine processes an IOCTL_OSR_NOTHING_GET_CREDITS request
+//
+//  INPUTS:
+//
+//      DevContext - Our device context
+//
+//      Request    - The credits request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We don't take the Queue locks, so this is only a snapshot.  By the
+//      time the app looks at it, other Requests may have come and gone.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingGetCredits(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFREQUEST              Request)
+{
+    NTSTATUS               status;
+    PNOTHING_CREDITS       credits;
+    PNOTHING_FILE_CONTEXT  fileContext;
+    PNOTHING_QUEUE_CONTEXT readContext;
+    PNOTHING_QUEUE_CONTEXT writeContext;
+    ULONG                  depth;
+    size_t                 bytes;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(NOTHING_CREDITS),
+                                            (PVOID *)&credits,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("Failed to get credits buffer - 0x%x\n", status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    //
+    // A paired handle's reads and writes wait on its own Queues
+    //
+    fileContext = NothingGetFileContext(WdfRequestGetFileObject(Request));
+
+    if (NOTHING_CHANNELS && fileContext->ChannelObject != nullptr) {
+
+        readContext  = NothingGetQueueContext(fileContext->ReadQueue);
+        writeContext = NothingGetQueueContext(fileContext->WriteQueue);
+
+    } else {
+
+        readContext  = NothingGetQueueContext(DevContext->ReadQueue);
+        writeContext = NothingGetQueueContext(DevContext->WriteQueue);
+    }
+
+    RtlZeroMemory(credits,
+                  sizeof(NOTHING_CREDITS));
+
+    credits->MaxQueueDepth = DevContext->MaxQueueDepth;
+    credits->MaxQueueBytes = DevContext->MaxQueueBytes;
+
+    credits->WriteCredits     = MAXULONG;
+    credits->ReadCredits      = MAXULONG;
+    credits->WriteByteCredits = MAXULONGLONG;
+    credits->ReadByteCredits  = MAXULONGLONG;
+
+    if (DevContext->MaxQueueDepth != 0) {
+
+        depth = (ULONG)ReadNoFence(&writeContext->Depth);
+
+        credits->WriteCredits = (depth < DevContext->MaxQueueDepth) ?
+                                    DevContext->MaxQueueDepth - depth : 0;
+
+        depth = (ULONG)ReadNoFence(&readContext->Depth);
+
+        credits->ReadCredits = (depth < DevContext->MaxQueueDepth) ?
+                                    DevContext->MaxQueueDepth - depth : 0;
+    }
+
+    if (DevContext->MaxQueueBytes != 0) {
+
+        bytes = (size_t)ReadNoFence64(&writeContext->Bytes);
+
+        credits->WriteByteCredits = (bytes < DevContext->MaxQueueBytes) ?
+                                        DevContext->MaxQueueBytes - bytes : 0;
+
+        bytes = (size_t)ReadNoFence64(&readContext->Bytes);
+
+        credits->ReadByteCredits = (bytes < DevContext->MaxQueueBytes) ?
+                                        DevContext->MaxQueueBytes - bytes : 0;
+    }
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(NOTHING_CREDITS));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingReadConfiguration
+//
+//    This routine reads our queue limits from the device's hardware key
+//
+//  INPUTS:
+//
+//      Device     - Our WDFDEVICE
+//
+//      DevContext - Our device context
+//
+//  OUTPUTS:
+//
+//      DevContext->MaxQueueDepth and DevContext->MaxQueueBytes
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      Anything that's missing gets our default.  Zero turns a limit off.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingReadConfiguration(WDFDEVICE               Device,
+                         PNOTHING_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS status;
+    WDFKEY   key;
+    ULONG    value;
+
+    DECLARE_CONST_UNICODE_STRING(maxQueueDepthName,
+                                 L"MaxQueueDepth");
+    DECLARE_CONST_UNICODE_STRING(maxQueueBytesName,
+                                 L"MaxQueueBytes");
+
+    DevContext->MaxQueueDepth = NOTHING_DEFAULT_MAX_QUEUE_DEPTH;
+    DevContext->MaxQueueBytes = NOTHING_DEFAULT_MAX_QUEUE_BYTES;
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (NT_SUCCESS(status)) {
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                             &maxQueueDepthName,
+                                             &value))) {
+
+            DevContext->MaxQueueDepth = value;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                             &maxQueueBytesName,
+                                             &value))) {
+
+            DevContext->MaxQueueBytes = value;
+        }
+
+        WdfRegistryClose(key);
+
+    } else {
+#if DBG
+        DbgPrint("WdfDeviceOpenRegistryKey failed 0x%0x, using defaults\n",
+                 status);
+#endif
+    }
+
+#if DBG
+    DbgPrint("Maximum queue depth %lu, maximum queue bytes 0x%Ix\n",
+             DevContext->MaxQueueDepth,
+             DevContext->MaxQueueBytes);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtDeviceControl
+//
+//    This routine is called by the framework when there is a
+//    device control request for us to process
+//
+//  INPUTS:
+//
+//      Queue    - Our default queue
+//
+//      Request  - A device control request
+//
+//      OutputBufferLength - The length of the output buffer
+//
+//      InputBufferLength  - The length of the input buffer
+//
+//      IoControlCode      - The operation being performed
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL, due to
+//      our PASSIVE_LEVEL execution level contraint
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtDeviceControl(WDFQUEUE   Queue,
+                        WDFREQUEST Request,
+                        size_t     OutputBufferLength,
+                        size_t     InputBufferLength,
+                        ULONG      IoControlCode)
+{
+    PNOTHING_DEVICE_CONTEXT devContext;
+
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+
+#if DBG
+    DbgPrint("NothingEvtDeviceControl\n");
+#endif
+
+    devContext = NothingGetContextFromDevice(
+                                             WdfIoQueueGetDevice(Queue));
+
+    if (IoControlCode == IOCTL_OSR_NOTHING_CHANNEL_PAIR) {
+
+        //
+        // Pair this handle up with another one, if we do channels at all
+        //
+        if (NOTHING_CHANNELS) {
+
+            NothingChannelPair(devContext,
+                               Request);
+
+        } else {
+
+            WdfRequestComplete(Request,
+                               STATUS_INVALID_DEVICE_REQUEST);
+        }
+        return;
+    }
+
+    if (IoControlCode == IOCTL_OSR_NOTHING_GET_STATS) {
+
+        NothingGetStats(devContext,
+                        Request);
+        return;
+    }
+
+    if (IoControlCode == IOCTL_OSR_NOTHING_GET_LATENCY) {
+
+        NothingGetLatency(devContext,
+                          Request);
+        return;
+    }
+
+    if (IoControlCode == IOCTL_OSR_NOTHING_GET_CREDITS) {
+
+        NothingGetCredits(devContext,
+                          Request);
+        return;
+    }
+
+    if (IoControlCode == IOCTL_OSR_NOTHING_POLL) {
+
+        NothingPoll(Request);
+        return;
+    }
+
+    //
+    // Nothing to do...
+    // In this case, we return an info field of zero
+    //
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtIoInCallerContext
+//
+//    This routine is called by the framework for every Request sent to one
+//    of our devices, in the context of the thread that sent it, before the
+//    Request goes on our default Queue
+//
+//  INPUTS:
+//
+//      Device   - One of our devices
+//
+//      Request  - A Request of any type
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      The only thing we need the caller's context for is turning the
+//      handles in an IOCTL_OSR_NOTHING_POLL into file objects (see
+//      NothingPollPrepare).  Everything else goes straight on to our
+//      default Queue.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtIoInCallerContext(WDFDEVICE  Device,
+                            WDFREQUEST Request)
+{
+    NTSTATUS               status;
+    WDF_REQUEST_PARAMETERS params;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    if (params.Type == WdfRequestTypeDeviceControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_OSR_NOTHING_POLL) {
+
+        status = NothingPollPrepare(Request);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("NothingPollPrepare failed with Status code 0x%x\n",
+                     status);
+#endif
+            WdfRequestComplete(Request,
+                               status);
+            return;
+        }
+    }
+
+    status = WdfDeviceEnqueueRequest(Device,
+                                     Request);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfDeviceEnqueueRequest failed with Status code 0x%x\n",
+                 status);
+#endif
+        WdfRequestComplete(Request,
+                           status);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingPollPrepare
+//
+//    This routine builds the NOTHING_POLL_WAITER for an
+//    IOCTL_OSR_NOTHING_POLL request
+//
+//  INPUTS:
+//
+//      Request  - The poll request
+//
+//  OUTPUTS:
+//
+//      The Request context's PollWaiter
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or an error saying what's wrong with the request.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL, in the context of
+//      the thread that sent the Request
+//
+//  NOTES:
+//
+//      Every handle has to be one of ours.  We know that a file object is
+//      one of ours if the device at the top of its stack belongs to our
+//      driver.
+//
+//      Whatever we've referenced by the time something fails gets cleaned
+//      up with the Request, so we can just return.
+//
+///////////////////////////////////////////////////////////////////////////////
+NTSTATUS
+NothingPollPrepare(WDFREQUEST Request)
+{
+    NTSTATUS                   status;
+    PNOTHING_POLL              poll;
+    size_t                     length;
+    PNOTHING_POLL_WAITER       waiter;
+    PNOTHING_POLL_WAITER_ENTRY entry;
+    PFILE_OBJECT               fileObject;
+    PDEVICE_OBJECT             deviceObject;
+    PDRIVER_OBJECT             driverObject;
+    WDFDEVICE                  device;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           NOTHING_POLL_SIZE(1),
+                                           (PVOID *)&poll,
+                                           &length);
+    if (!NT_SUCCESS(status)) {
+
+        return status;
+    }
+
+    if (poll->EntryCount == 0 ||
+        poll->EntryCount > NOTHING_POLL_MAX_ENTRIES ||
+        length < NOTHING_POLL_SIZE(poll->EntryCount)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // We hand the entries back in the same buffer, so it has to be big
+    // enough both ways
+    //
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            NOTHING_POLL_SIZE(poll->EntryCount),
+                                            (PVOID *)&poll,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+
+        return status;
+    }
+
+    waiter = (PNOTHING_POLL_WAITER)ExAllocatePoolWithTag(NonPagedPoolNx,
+                    FIELD_OFFSET(NOTHING_POLL_WAITER, Entries) +
+                        poll->EntryCount * sizeof(NOTHING_POLL_WAITER_ENTRY),
+                    NOTHING_POOL_TAG);
+
+    if (waiter == nullptr) {
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(waiter,
+                  FIELD_OFFSET(NOTHING_POLL_WAITER, Entries));
+
+    InitializeListHead(&waiter->Link);
+
+    waiter->Request = Request;
+    waiter->Flags   = poll->Flags;
+
+    NothingGetRequestContext(Request)->PollWaiter = waiter;
+
+    driverObject = WdfDriverWdmGetDriverObject(WdfGetDriver());
+
+    for (ULONG index = 0; index < poll->EntryCount; index++) {
+
+        if (poll->Entries[index].Handle == 0) {
+
+            fileObject = WdfFileObjectWdmGetFileObject(
+                                        WdfRequestGetFileObject(Request));
+
+            ObReferenceObject(fileObject);
+
+        } else {
+
+            status = ObReferenceObjectByHandle(
+                            (HANDLE)(ULONG_PTR)poll->Entries[index].Handle,
+                            0,
+                            *IoFileObjectType,
+                            WdfRequestGetRequestorMode(Request),
+                            (PVOID *)&fileObject,
+                            nullptr);
+
+            if (!NT_SUCCESS(status)) {
+
+                return status;
+            }
+        }
+
+        //
+        // Count the entry now, so that the reference gets dropped
+        // whatever happens next
+        //
+        entry = &waiter->Entries[index];
+
+        RtlZeroMemory(entry,
+                      sizeof(NOTHING_POLL_WAITER_ENTRY));
+
+        entry->FileObject = fileObject;
+
+        waiter->EntryCount++;
+
+        deviceObject = IoGetRelatedDeviceObject(fileObject);
+
+        if (deviceObject->DriverObject != driverObject) {
+
+            return STATUS_INVALID_HANDLE;
+        }
+
+        device = WdfWdmDeviceGetWdfDeviceHandle(deviceObject);
+
+        entry->WdfFileObject = WdfDeviceGetFileObject(device,
+                                                      fileObject);
+
+        if (entry->WdfFileObject == nullptr) {
+
+            return STATUS_INVALID_HANDLE;
+        }
+
+        entry->Events = poll->Entries[index].Events &
+                            (NOTHING_POLL_READABLE | NOTHING_POLL_WRITABLE);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingPoll
+//
+//    This routine processes an IOCTL_OSR_NOTHING_POLL request
+//
+//  INPUTS:
+//
+//      Request  - The poll request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      If nothing's ready yet the Request waits on the driver's PollWaiters
+//      list, and gets looked at again by NothingPollDpc.  We go on the list
+//      BEFORE we check for the second time.  Anything that becomes ready
+//      after that sees PollWaiterCount isn't zero and kicks the DPC, and
+//      anything that became ready before it is caught by our check.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingPoll(WDFREQUEST Request)
+{
+    NTSTATUS                status;
+    PNOTHING_POLL_WAITER    waiter;
+    PNOTHING_DRIVER_CONTEXT driverContext;
+
+    waiter = NothingGetRequestContext(Request)->PollWaiter;
+
+    if (waiter == nullptr) {
+
+        //
+        // Can't happen, NothingEvtIoInCallerContext saw to that
+        //
+        WdfRequestComplete(Request,
+                           STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    if (NothingPollCheck(waiter) ||
+        (waiter->Flags & NOTHING_POLL_FLAG_NO_WAIT) != 0) {
+
+        NothingPollComplete(waiter,
+                            STATUS_SUCCESS);
+        return;
+    }
+
+    driverContext = NothingGetDriverContext(WdfGetDriver());
+
+    WdfSpinLockAcquire(driverContext->PollLock);
+
+    InsertTailList(&driverContext->PollWaiters,
+                   &waiter->Link);
+
+    InterlockedIncrement(&driverContext->PollWaiterCount);
+
+    if (NothingPollCheck(waiter)) {
+
+        status = STATUS_SUCCESS;
+
+    } else {
+
+        status = WdfRequestMarkCancelableEx(Request,
+                                            NothingEvtPollCancel);
+
+        if (NT_SUCCESS(status)) {
+
+            //
+            // Wait
+            //
+            WdfSpinLockRelease(driverContext->PollLock);
+            return;
+        }
+    }
+
+    RemoveEntryList(&waiter->Link);
+
+    InterlockedDecrement(&driverContext->PollWaiterCount);
+
+    WdfSpinLockRelease(driverContext->PollLock);
+
+    NothingPollComplete(waiter,
+                        status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingPollCheck
+//
+//    This routine works out which of a poll's handles are ready
+//
+//  INPUTS:
+//
+//      Waiter  - The poll
+//
+//  OUTPUTS:
+//
+//      The ReadyEvents of each of Waiter's entries
+//
+//  RETURNS:
+//
+//      TRUE if any of the entries is ready, FALSE otherwise.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL, possibly with the
+//      PollLock held
+//
+//  NOTES:
+//
+//      A Queue's Depth counts what's been parked on it and not completed
+//      yet, so a Request that's been taken off the Queue to be paired still
+//      counts for a moment.  That's fine for a hint.
+//
+//      A channel's lock is the only thing that keeps the peer's Queues
+//      around, so we have to hold it while we look at them.  That's why the
+//      PollLock always has to be taken before a channel's lock, and never
+//      the other way around.
+//
+///////////////////////////////////////////////////////////////////////////////
+BOOLEAN
+NothingPollCheck(PNOTHING_POLL_WAITER Waiter)
+{
+    PNOTHING_POLL_WAITER_ENTRY entry;
+    PNOTHING_FILE_CONTEXT      fileContext;
+    PNOTHING_FILE_CONTEXT      peerContext;
+    PNOTHING_DEVICE_CONTEXT    devContext;
+    PNOTHING_CHANNEL           channel;
+    WDFQUEUE                   readQueue;
+    WDFQUEUE                   writeQueue;
+    ULONG                      state;
+    BOOLEAN                    ready = FALSE;
+
+    for (ULONG index = 0; index < Waiter->EntryCount; index++) {
+
+        entry       = &Waiter->Entries[index];
+        fileContext = NothingGetFileContext(entry->WdfFileObject);
+        state       = 0;
+
+        if (NOTHING_CHANNELS && fileContext->ChannelObject != nullptr) {
+
+            channel = NothingGetChannel(fileContext->ChannelObject);
+
+            WdfSpinLockAcquire(channel->Lock);
+
+            peerContext = channel->End[1 - fileContext->ChannelEnd];
+
+            if (peerContext == nullptr) {
+
+                state = NOTHING_POLL_HANGUP;
+
+            } else {
+
+                //
+                // Our reads feed on the peer's writes, and our writes on
+                // the peer's reads
+                //
+                if (ReadNoFence(&NothingGetQueueContext(
+                                    peerContext->WriteQueue)->Depth) != 0) {
+
+                    state |= NOTHING_POLL_READABLE;
+                }
+
+                if (ReadNoFence(&NothingGetQueueContext(
+                                    peerContext->ReadQueue)->Depth) != 0) {
+
+                    state |= NOTHING_POLL_WRITABLE;
+                }
+            }
+
+            WdfSpinLockRelease(channel->Lock);
+
+        } else {
+
+            devContext = NothingGetContextFromDevice(
+                                WdfFileObjectGetDevice(entry->WdfFileObject));
+
+            readQueue  = devContext->ReadQueue;
+            writeQueue = devContext->WriteQueue;
+
+            if (ReadNoFence(&NothingGetQueueContext(writeQueue)->Depth) != 0) {
+
+                state |= NOTHING_POLL_READABLE;
+            }
+
+            if (ReadNoFence(&NothingGetQueueContext(readQueue)->Depth) != 0) {
+
+                state |= NOTHING_POLL_WRITABLE;
+            }
+        }
+
+        //
+        // Hangups get reported whether they were asked for or not
+        //
+        entry->ReadyEvents = state & (entry->Events | NOTHING_POLL_HANGUP);
+
+        if (entry->ReadyEvents != 0) {
+
+            ready = TRUE;
+        }
+    }
+
+    return ready;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingPollComplete
+//
+//    This routine completes an IOCTL_OSR_NOTHING_POLL request
+//
+//  INPUTS:
+//
+//      Waiter  - The poll
+//
+//      Status  - What to complete it with
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      Waiter goes away with the Request, so don't touch it after this.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingPollComplete(PNOTHING_POLL_WAITER Waiter,
+                    NTSTATUS             Status)
+{
+    NTSTATUS      status;
+    PNOTHING_POLL poll;
+    WDFREQUEST    request = Waiter->Request;
+
+    if (!NT_SUCCESS(Status)) {
+
+        WdfRequestComplete(request,
+                           Status);
+        return;
+    }
+
+    //
+    // NothingPollPrepare already checked that this is big enough
+    //
+    status = WdfRequestRetrieveOutputBuffer(request,
+                                            NOTHING_POLL_SIZE(Waiter->EntryCount),
+                                            (PVOID *)&poll,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+
+        WdfRequestComplete(request,
+                           status);
+        return;
+    }
+
+    for (ULONG index = 0; index < Waiter->EntryCount; index++) {
+
+        poll->Entries[index].ReadyEvents = Waiter->Entries[index].ReadyEvents;
+    }
+
+    WdfRequestCompleteWithInformation(request,
+                                      STATUS_SUCCESS,
+                                      NOTHING_POLL_SIZE(Waiter->EntryCount));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingPollKick
+//
+//    This routine gets the waiting polls looked at again, because something
+//    might have become ready
+//
+//  INPUTS:
+//
+//      None.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL, with any of our
+//      locks held or not
+//
+//  NOTES:
+//
+//      Our callers have just made something ready with an interlocked
+//      operation, which is a full barrier, so if a poll went on the list
+//      after we look at PollWaiterCount, it'll see what they did.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingPollKick()
+{
+    PNOTHING_DRIVER_CONTEXT driverContext;
+
+    driverContext = NothingGetDriverContext(WdfGetDriver());
+
+    if (ReadNoFence(&driverContext->PollWaiterCount) != 0) {
+
+        KeInsertQueueDpc(&driverContext->PollDpc,
+                         nullptr,
+                         nullptr);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingPollDpc
+//
+//    This routine completes any waiting polls that are now ready
+//
+//  INPUTS:
+//
+//      Dpc             - Our driver context's PollDpc
+//
+//      DeferredContext - Our driver context
+//
+//      SystemArgument1 - Unused
+//
+//      SystemArgument2 - Unused
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      A poll that's been cancelled out from under us belongs to
+//      NothingEvtPollCancel, which takes it off the list as soon as we
+//      drop the PollLock.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingPollDpc(PKDPC Dpc,
+               PVOID DeferredContext,
+               PVOID SystemArgument1,
+               PVOID SystemArgument2)
+{
+    PNOTHING_DRIVER_CONTEXT driverContext;
+    PNOTHING_POLL_WAITER    waiter;
+    PLIST_ENTRY             entry;
+    PLIST_ENTRY             next;
+    LIST_ENTRY              ready;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    driverContext = (PNOTHING_DRIVER_CONTEXT)DeferredContext;
+
+    InitializeListHead(&ready);
+
+    WdfSpinLockAcquire(driverContext->PollLock);
+
+    for (entry = driverContext->PollWaiters.Flink;
+         entry != &driverContext->PollWaiters;
+         entry = next) {
+
+        next   = entry->Flink;
+        waiter = CONTAINING_RECORD(entry,
+                                   NOTHING_POLL_WAITER,
+                                   Link);
+
+        if (!NothingPollCheck(waiter)) {
+            continue;
+        }
+
+        if (WdfRequestUnmarkCancelable(waiter->Request) == STATUS_CANCELLED) {
+            continue;
+        }
+
+        RemoveEntryList(&waiter->Link);
+
+        InterlockedDecrement(&driverContext->PollWaiterCount);
+
+        InsertTailList(&ready,
+                       &waiter->Link);
+    }
+
+    WdfSpinLockRelease(driverContext->PollLock);
+
+    while (!IsListEmpty(&ready)) {
+
+        waiter = CONTAINING_RECORD(RemoveHeadList(&ready),
+                                   NOTHING_POLL_WAITER,
+                                   Link);
+
+        NothingPollComplete(waiter,
+                            STATUS_SUCCESS);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtPollCancel
+//
+//    This routine is called by the framework when a waiting
+//    IOCTL_OSR_NOTHING_POLL is cancelled
+//
+//  INPUTS:
+//
+//      Request  - The poll request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtPollCancel(WDFREQUEST Request)
+{
+    PNOTHING_DRIVER_CONTEXT driverContext;
+    PNOTHING_POLL_WAITER    waiter;
+
+    driverContext = NothingGetDriverContext(WdfGetDriver());
+    waiter        = NothingGetRequestContext(Request)->PollWaiter;
+
+    WdfSpinLockAcquire(driverContext->PollLock);
+
+    RemoveEntryList(&waiter->Link);
+
+    InterlockedDecrement(&driverContext->PollWaiterCount);
+
+    WdfSpinLockRelease(driverContext->PollLock);
+
+    NothingPollComplete(waiter,
+                        STATUS_CANCELLED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtDriverCleanup
+//
+//    This routine is called by the framework when our WDFDRIVER is being
+//    deleted, just before we're unloaded
+//
+//  INPUTS:
+//
+//      Driver  - Our WDFDRIVER
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      All of our devices are gone, so nothing can kick the PollDpc any
+//      more, but it might still be queued or running.  Our code had better
+//      not be unloaded out from under it.
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtDriverCleanup(WDFOBJECT Driver)
+{
+    UNREFERENCED_PARAMETER(Driver);
+
+    KeFlushQueuedDpcs();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  NothingEvtFdoCreate
+//
+//    This routine is called by the framework when someone is
+//    trying to open a HANDLE to our device
+//
+//  INPUTS:
+//
+//      Device   - One of our devices
+//
+//      Request  - A create request
+//
+//      FileObject - The WDFFILEOBJECT representing the new
+//                   open instance
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+VOID
+NothingEvtFdoCreate(
     WDFDEVICE     Device,
     WDFREQUEST    Request,
     WDFFILEOBJECT FileObject)
 {
     PNOTHING_DEVICE_CONTEXT devContext;
-    NTSTATUS                status;
+    PNOTHING_FILE_CONTEXT   fileContext;
+
+    devContext  = NothingGetContextFromDevice(Device);
+    fileContext = NothingGetFileContext(FileObject);
 
-    devContext = NothingGetContextFromDevice(Device);
+    InitializeListHead(&fileContext->WaitingWritersLink);
 
-    WdfSpinLockAcquire(devContext->FileObjectsCollectionLock);
+    WdfSpinLockAcquire(devContext->WaitingWritersLock);
 
     //
     // Check to see if we don't already have an "allowed writer"
@@ -1051,37 +3952,31 @@ NothingEvtFdoCreate(
         //
         // Allow this caller to write to the device
         //
-        status                    = STATUS_SUCCESS;
-        devContext->AllowedWriter = FileObject;
+        NothingSetAllowedWriter(devContext,
+                                FileObject);
 
     } else {
 
 #if DBG
-        DbgPrint("Adding 0x%p to collection\n",
+        DbgPrint("Adding 0x%p to the waiting writers\n",
                  FileObject);
 #endif
         //
-        // Put this caller on the "waiting to be allowed to write" list
+        // Put this caller on the end of the "waiting to be allowed to
+        // write" list.  The link is in the file context, so there's nothing
+        // to allocate and nothing that can fail.
         //
-        status = WdfCollectionAdd(devContext->FileObjectsCollection,
-                                  FileObject);
-
-        if (!NT_SUCCESS(status)) {
-#if DBG
-            DbgPrint("WdfCollectionAdd failed 0x%0x\n",
-                     status);
-#endif
-        }
-
+        InsertTailList(&devContext->WaitingWriters,
+                       &fileContext->WaitingWritersLink);
     }
 
-    WdfSpinLockRelease(devContext->FileObjectsCollectionLock);
+    WdfSpinLockRelease(devContext->WaitingWritersLock);
 
     //
     // Done with this request
     //
     WdfRequestCompleteWithInformation(Request,
-                                      status,
+                                      STATUS_SUCCESS,
                                       0);
 }
 
@@ -1119,13 +4014,16 @@ VOID
 NothingEvtFdoClose(WDFFILEOBJECT FileObject)
 {
     PNOTHING_DEVICE_CONTEXT devContext;
+    PNOTHING_FILE_CONTEXT   fileContext;
+    PLIST_ENTRY             entry;
     WDFFILEOBJECT           newWriter;
 
     devContext =
             NothingGetContextFromDevice(WdfFileObjectGetDevice(FileObject));
 
+    fileContext = NothingGetFileContext(FileObject);
 
-    WdfSpinLockAcquire(devContext->FileObjectsCollectionLock);
+    WdfSpinLockAcquire(devContext->WaitingWritersLock);
 
     //
     // Was this open the allowed writer?
@@ -1140,27 +4038,33 @@ NothingEvtFdoClose(WDFFILEOBJECT FileObject)
         // The allowed writer is going away. Try to promote the next
         // person in line to being the writer.
         //
-        newWriter = (WDFFILEOBJECT)WdfCollectionGetFirstItem(devContext->FileObjectsCollection);
+        if (!IsListEmpty(&devContext->WaitingWriters)) {
+
+            //
+            // Take him off the head of the list.
+            //
+            entry = RemoveHeadList(&devContext->WaitingWriters);
 
-        if (newWriter) {
+            InitializeListHead(entry);
 
+            newWriter = (WDFFILEOBJECT)WdfObjectContextGetObject(
+                                    CONTAINING_RECORD(entry,
+                                                      NOTHING_FILE_CONTEXT,
+                                                      WaitingWritersLink));
 #if DBG
             DbgPrint("0x%p is now allowed to write\n",
                      newWriter);
 #endif
-            //
-            // Remove him from the collection.
-            //
-            WdfCollectionRemove(devContext->FileObjectsCollection,
-                                newWriter);
 
         } else {
 #if DBG
             DbgPrint("No one else waiting to be a writer\n");
 #endif
+            newWriter = nullptr;
         }
 
-        devContext->AllowedWriter = newWriter;
+        NothingSetAllowedWriter(devContext,
+                                newWriter);
 
     } else {
 
@@ -1169,14 +4073,23 @@ NothingEvtFdoClose(WDFFILEOBJECT FileObject)
         // them out of the list.
         //
 #if DBG
-        DbgPrint("Removing non-writer 0x%p from the collection\n",
+        DbgPrint("Removing non-writer 0x%p from the waiting writers\n",
                  FileObject);
 #endif
-        WdfCollectionRemove(devContext->FileObjectsCollection,
-                            FileObject);
+        RemoveEntryList(&fileContext->WaitingWritersLink);
+
+        InitializeListHead(&fileContext->WaitingWritersLink);
     }
 
-    WdfSpinLockRelease(devContext->FileObjectsCollectionLock);
+    WdfSpinLockRelease(devContext->WaitingWritersLock);
+
+    //
+    // Tear down our end of any channel
+    //
+    if (NOTHING_CHANNELS) {
+
+        NothingChannelClose(NothingGetFileContext(FileObject));
+    }
 }
 
 
@@ -39,14 +39,100 @@
 
 #include <ntddk.h>
 #include <wdf.h>
+#include <ntstrsafe.h>
 
 #include "NOTHING_IOCTL.h"
+#include <osrcopy.h>
 
 //
 // Choose an arbitrary maximum buffer length
 //
 #define NOTHING_BUFFER_MAX_LENGTH 4096
 
+//
+// Set to TRUE to have our device use Direct I/O for reads and writes
+// instead of Buffered I/O.
+//
+// With Buffered I/O the I/O Manager copies the writer's data into a system
+// buffer, we copy that into the reader's system buffer, and the I/O Manager
+// then copies THAT back out to the reader.  With Direct I/O the writer's and
+// reader's buffers are locked down and described by MDLs, so when we pair a
+// read with a write we copy straight from the writer's pages into the
+// reader's pages.  One copy instead of three, which matters for big
+// transfers.
+//
+#define NOTHING_DIRECT_IO FALSE
+
+//
+// Set to TRUE to pair reads and writes as a byte stream, the way a pipe
+// would, instead of one read per write.
+//
+// Without streaming, a read and a write that get paired are both completed
+// with the smaller of the two lengths, and whatever's left of the write is
+// simply lost.  With streaming, a write that's bigger than the read stays
+// on the WriteQueue (remembering how much of it has been consumed) and
+// feeds the following reads, and a read that's bigger than the write
+// gathers data from as many of the waiting writes as it can hold.
+//
+#define NOTHING_STREAMING FALSE
+
+//
+// Set to TRUE to let pairs of handles set up private channels (see
+// IOCTL_OSR_NOTHING_CHANNEL_PAIR).  Each paired handle gets its own
+// ReadQueue and WriteQueue, and each pair has its own lock, so independent
+// producer/consumer pairs don't get in each other's way.  Handles that
+// aren't paired share the device's ReadQueue and WriteQueue as before.
+//
+// Channels always pair reads and writes as a byte stream.  They also only
+// help if more than one pair can be in the driver at a time, so in this
+// mode our default Queue uses parallel dispatching.
+//
+#define NOTHING_CHANNELS FALSE
+
+//
+// Pool tag for our allocations ('NthR' in the debugger)
+//
+#define NOTHING_POOL_TAG 'RhtN'
+
+//
+// Limits on each of our manual ReadQueues and WriteQueues (see
+// IOCTL_OSR_NOTHING_GET_CREDITS).  These are what we use if there are no
+// MaxQueueDepth and MaxQueueBytes values in the device's hardware key.
+// Zero means no limit.
+//
+#define NOTHING_DEFAULT_MAX_QUEUE_DEPTH 256
+#define NOTHING_DEFAULT_MAX_QUEUE_BYTES (64 * 1024 * 1024)
+
+//
+// One processor's performance counters
+//
+// Each processor bumps only its own set (on its own cache line), and we
+// add them all up when someone asks for them.  We still use interlocked
+// operations, because a thread can get moved to another processor in the
+// middle of an update, but they're essentially never contended.
+//
+typedef struct DECLSPEC_CACHEALIGN _NOTHING_CPU_COUNTERS {
+
+    volatile LONG64 Reads;
+    volatile LONG64 Writes;
+    volatile LONG64 BytesRead;
+    volatile LONG64 BytesWritten;
+    volatile LONG64 ReadsParked;
+    volatile LONG64 WritesParked;
+    volatile LONG64 DeviceBusyRejections;
+
+    volatile LONG64 Latency[NOTHING_LATENCY_HISTOGRAMS][NOTHING_LATENCY_BUCKETS];
+
+} NOTHING_CPU_COUNTERS, *PNOTHING_CPU_COUNTERS;
+
+//
+// Instances of our device are named \DosDevices\Nothing0, Nothing1, and so
+// on, up to this many.  NOTHING_LINK_NAME_LENGTH has room for the longest
+// name.
+//
+#define NOTHING_MAX_INSTANCES    100
+#define NOTHING_LINK_NAME_LENGTH 32
+
 //
 // Nothing device context structure
 //
@@ -57,6 +143,11 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
 
     ULONG Nothing;
 
+    //
+    // Which instance of the device this is, the N in \DosDevices\NothingN
+    //
+    ULONG InstanceNumber;
+
     //
     // Manual queues for holding incoming requests if no data
     // pending.
@@ -65,15 +156,30 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
     WDFQUEUE WriteQueue;
 
     //
-    // We'll keep all the outstanding WDFFILEOBJECTs in a
-    // collection.
+    // Guards the above two Queues, since with channels enabled our
+    // default Queue dispatches in parallel.
     //
-    WDFCOLLECTION FileObjectsCollection;
+    WDFSPINLOCK QueueLock;
 
     //
-    // Lock that guards removals from the above collection
+    // Manual queue for holding IOCTL_OSR_NOTHING_CHANNEL_PAIR requests
+    // that are waiting for their peer, and the lock that guards it.
     //
-    WDFSPINLOCK FileObjectsCollectionLock;
+    WDFQUEUE    PairQueue;
+    WDFSPINLOCK PairLock;
+
+    //
+    // We'll keep all the outstanding WDFFILEOBJECTs that are waiting
+    // for their turn to write on a FIFO list, linked through their file
+    // contexts.  Adding, removing, and promoting the next writer are all
+    // O(1), no matter how many handles are open.
+    //
+    LIST_ENTRY WaitingWriters;
+
+    //
+    // Lock that guards the above list and AllowedWriter
+    //
+    WDFSPINLOCK WaitingWritersLock;
 
     //
     // The WDFILEOBJECT of the only caller allowed to write to the
@@ -81,6 +187,41 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
     //
     WDFFILEOBJECT AllowedWriter;
 
+    //
+    // Bumped every time AllowedWriter changes.  The writer is handed the
+    // new value in its file context BEFORE we publish it here, so our write
+    // path can check ownership by comparing the two, without taking any
+    // lock.  Zero is never a valid epoch.
+    //
+    volatile LONG64 WriterEpoch;
+
+    //
+    // Our performance counters, one set per processor, and the deepest
+    // our ReadQueues and WriteQueues have ever been
+    //
+    WDFMEMORY             CounterMemory;
+    PNOTHING_CPU_COUNTERS Counters;
+    ULONG                 CounterCount;
+    volatile LONG64       ReadQueueMaxDepth;
+    volatile LONG64       WriteQueueMaxDepth;
+
+    //
+    // The limits on each of our ReadQueues and WriteQueues
+    //
+    ULONG                 MaxQueueDepth;
+    size_t                MaxQueueBytes;
+
+    //
+    // Ticks per second of the performance counter, which is what we
+    // time requests with
+    //
+    LONGLONG              PerformanceFrequency;
+
+    //
+    // How we copy data from writes to reads (see osrcopy.h)
+    //
+    OSR_COPY              Copy;
+
 }  NOTHING_DEVICE_CONTEXT, *PNOTHING_DEVICE_CONTEXT;
 
 //
@@ -92,6 +233,195 @@ typedef struct _NOTHING_DEVICE_CONTEXT {
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_DEVICE_CONTEXT,
                                    NothingGetContextFromDevice)
 
+//
+// Nothing request context structure
+//
+// KMDF will associate this structure with every read and write Request
+// sent to our device.  In streaming mode it tracks how many bytes of the
+// Request's buffer we've filled (for a read) or consumed (for a write) so
+// far.
+//
+// It also holds the timestamps for our latency histograms.  ArrivalTime
+// stays zero for anything that isn't a read or a write.
+//
+typedef struct _NOTHING_REQUEST_CONTEXT {
+
+    size_t BytesTransferred;
+
+    struct _NOTHING_DEVICE_CONTEXT *DevContext;
+    BOOLEAN                         IsWrite;
+    LONGLONG                        ArrivalTime;
+    LONGLONG                        ParkedTime;
+
+    //
+    // The Queue we charged for parking the Request, and how much, so we
+    // can give it back when the Request completes
+    //
+    struct _NOTHING_QUEUE_CONTEXT  *ChargedQueue;
+    size_t                          ChargedBytes;
+
+    //
+    // For an IOCTL_OSR_NOTHING_POLL, the handles it's watching
+    //
+    struct _NOTHING_POLL_WAITER    *PollWaiter;
+
+} NOTHING_REQUEST_CONTEXT, *PNOTHING_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_REQUEST_CONTEXT,
+                                   NothingGetRequestContext)
+
+//
+// Nothing queue context structure
+//
+// KMDF will associate this structure with each of our manual ReadQueues
+// and WriteQueues.  It counts the Requests parked on the Queue and the
+// bytes of buffer they're holding on to.  A Request is counted from when
+// it's parked until it's completed, even if it's off the Queue for a
+// moment in between, so that each Request is counted exactly once.
+//
+// The counts only go up with the lock that guards the Queue held, so
+// checking them against the limits and then adding to them is safe.  They
+// go down whenever a Request completes, with no lock, so they're updated
+// with interlocked operations.
+//
+typedef struct _NOTHING_QUEUE_CONTEXT {
+
+    volatile LONG   Depth;
+    volatile LONG64 Bytes;
+
+} NOTHING_QUEUE_CONTEXT, *PNOTHING_QUEUE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_QUEUE_CONTEXT,
+                                   NothingGetQueueContext)
+
+struct _NOTHING_FILE_CONTEXT;
+
+//
+// Nothing channel structure
+//
+// KMDF will associate this structure with the WDFOBJECT we create for
+// each pair of channel handles.  It lives until both ends are closed.
+//
+typedef struct _NOTHING_CHANNEL {
+
+    //
+    // Guards End[] and all the Queues of both ends
+    //
+    WDFSPINLOCK Lock;
+
+    //
+    // The two ends.  An end is set to nullptr when its handle is closed.
+    //
+    struct _NOTHING_FILE_CONTEXT *End[2];
+
+} NOTHING_CHANNEL, *PNOTHING_CHANNEL;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_CHANNEL,
+                                   NothingGetChannel)
+
+//
+// Nothing file context structure
+//
+// KMDF will associate this structure with each open instance of our
+// device.
+//
+typedef struct _NOTHING_FILE_CONTEXT {
+
+    //
+    // Our entry on the device's WaitingWriters list.  It points to
+    // itself whenever we're not on the list.
+    //
+    LIST_ENTRY WaitingWritersLink;
+
+    //
+    // The WriterEpoch at which we were made the allowed writer (zero if we
+    // never were)
+    //
+    LONG64 WriterEpoch;
+
+    //
+    // This handle's reads that are waiting for the peer to write, and
+    // this handle's writes that are waiting for the peer to read.  These
+    // get created the first time the handle asks to be paired.
+    //
+    WDFQUEUE ReadQueue;
+    WDFQUEUE WriteQueue;
+
+    //
+    // The key we asked to be paired with
+    //
+    ULONGLONG ChannelKey;
+
+    //
+    // Once we're paired, our channel and which end of it we are
+    //
+    WDFOBJECT ChannelObject;
+    ULONG     ChannelEnd;
+
+} NOTHING_FILE_CONTEXT, *PNOTHING_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_FILE_CONTEXT,
+                                   NothingGetFileContext)
+
+//
+// Nothing poll waiter structure
+//
+// We allocate one of these for each IOCTL_OSR_NOTHING_POLL.  The handles
+// in the IOCTL only mean something in the caller's process, so we turn
+// them into referenced file objects while we're still in its context (see
+// NothingEvtIoInCallerContext).  Holding the references means none of the
+// handles can be closed all the way, so their file contexts stay put until
+// the IOCTL completes.  They're dropped, and this is freed, in
+// NothingEvtRequestCleanup.
+//
+typedef struct _NOTHING_POLL_WAITER_ENTRY {
+
+    PFILE_OBJECT  FileObject;
+    WDFFILEOBJECT WdfFileObject;
+    ULONG         Events;
+    ULONG         ReadyEvents;
+
+} NOTHING_POLL_WAITER_ENTRY, *PNOTHING_POLL_WAITER_ENTRY;
+
+typedef struct _NOTHING_POLL_WAITER {
+
+    //
+    // Our entry on the driver's PollWaiters list, while we're waiting
+    //
+    LIST_ENTRY                Link;
+    WDFREQUEST                Request;
+
+    ULONG                     Flags;
+    ULONG                     EntryCount;
+    NOTHING_POLL_WAITER_ENTRY Entries[1];
+
+} NOTHING_POLL_WAITER, *PNOTHING_POLL_WAITER;
+
+//
+// Nothing driver context structure
+//
+// KMDF will associate this structure with our WDFDRIVER.  A poll can watch
+// handles on any of our device instances, so the polls that are waiting
+// are kept here rather than with any one device.
+//
+// Whenever one of our ReadQueues or WriteQueues goes from empty to not
+// empty, or a channel loses one of its ends, we queue PollDpc, which
+// checks all the waiting polls again.  Queuing a DPC that's already
+// queued does nothing, so a burst of changes gets one check, and nobody
+// has to take the PollLock while holding one of the Queue locks.
+//
+typedef struct _NOTHING_DRIVER_CONTEXT {
+
+    WDFSPINLOCK   PollLock;
+    LIST_ENTRY    PollWaiters;
+    volatile LONG PollWaiterCount;
+    KDPC          PollDpc;
+
+} NOTHING_DRIVER_CONTEXT, *PNOTHING_DRIVER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(NOTHING_DRIVER_CONTEXT,
+                                   NothingGetDriverContext)
+
 //
 // Forward declarations
 //
@@ -102,13 +432,118 @@ EVT_WDF_DRIVER_DEVICE_ADD          NothingEvtDeviceAdd;
 EVT_WDF_IO_QUEUE_IO_READ           NothingEvtRead;
 EVT_WDF_IO_QUEUE_IO_WRITE          NothingEvtWrite;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL NothingEvtDeviceControl;
+EVT_WDF_IO_IN_CALLER_CONTEXT       NothingEvtIoInCallerContext;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP     NothingEvtDriverCleanup;
 
 EVT_WDF_DEVICE_D0_ENTRY            NothingEvtDeviceD0Entry;
 EVT_WDF_DEVICE_D0_EXIT             NothingEvtDeviceD0Exit;
 
+NTSTATUS
+NothingCreateSymbolicLink(WDFDEVICE Device);
+
 EVT_WDF_DEVICE_FILE_CREATE NothingEvtFdoCreate;
 EVT_WDF_FILE_CLOSE NothingEvtFdoClose;
 
+VOID
+NothingStreamRead(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFQUEUE                ReadQueue,
+                  WDFQUEUE                WriteQueue,
+                  WDFREQUEST              Request);
+
+VOID
+NothingStreamWrite(PNOTHING_DEVICE_CONTEXT DevContext,
+                   WDFQUEUE                ReadQueue,
+                   WDFQUEUE                WriteQueue,
+                   WDFREQUEST              Request);
+
+size_t
+NothingStreamCopy(PNOTHING_DEVICE_CONTEXT  DevContext,
+                  PVOID                    ReadBuffer,
+                  size_t                   ReadBufferLen,
+                  PNOTHING_REQUEST_CONTEXT ReadContext,
+                  PVOID                    WriteBuffer,
+                  size_t                   WriteBufferLen,
+                  PNOTHING_REQUEST_CONTEXT WriteContext);
+
+VOID
+NothingSetAllowedWriter(PNOTHING_DEVICE_CONTEXT DevContext,
+                        WDFFILEOBJECT           NewWriter);
+
+VOID
+NothingChannelPair(PNOTHING_DEVICE_CONTEXT DevContext,
+                   WDFREQUEST              Request);
+
+VOID
+NothingChannelIo(PNOTHING_DEVICE_CONTEXT DevContext,
+                 WDFREQUEST              Request,
+                 BOOLEAN                 IsWrite);
+
+VOID
+NothingChannelClose(PNOTHING_FILE_CONTEXT FileContext);
+
+VOID
+NothingChannelFlush(PNOTHING_FILE_CONTEXT FileContext);
+
+NTSTATUS
+NothingParkRequest(PNOTHING_DEVICE_CONTEXT DevContext,
+                   WDFREQUEST              Request,
+                   WDFQUEUE                Queue,
+                   BOOLEAN                 IsRead);
+
+VOID
+NothingCountBytes(PNOTHING_DEVICE_CONTEXT DevContext,
+                  size_t                  Length);
+
+PNOTHING_CPU_COUNTERS
+NothingGetCpuCounters(PNOTHING_DEVICE_CONTEXT DevContext);
+
+VOID
+NothingGetStats(PNOTHING_DEVICE_CONTEXT DevContext,
+                WDFREQUEST              Request);
+
+EVT_WDF_OBJECT_CONTEXT_CLEANUP NothingEvtRequestCleanup;
+
+VOID
+NothingStampArrival(PNOTHING_DEVICE_CONTEXT DevContext,
+                    WDFREQUEST              Request,
+                    BOOLEAN                 IsWrite);
+
+VOID
+NothingRecordLatency(PNOTHING_DEVICE_CONTEXT DevContext,
+                     ULONG                   Histogram,
+                     LONGLONG                Ticks);
+
+VOID
+NothingGetLatency(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFREQUEST              Request);
+
+VOID
+NothingGetCredits(PNOTHING_DEVICE_CONTEXT DevContext,
+                  WDFREQUEST              Request);
+
+VOID
+NothingReadConfiguration(WDFDEVICE               Device,
+                         PNOTHING_DEVICE_CONTEXT DevContext);
+
+NTSTATUS
+NothingPollPrepare(WDFREQUEST Request);
+
+VOID
+NothingPoll(WDFREQUEST Request);
+
+BOOLEAN
+NothingPollCheck(PNOTHING_POLL_WAITER Waiter);
+
+VOID
+NothingPollComplete(PNOTHING_POLL_WAITER Waiter,
+                    NTSTATUS             Status);
+
+VOID
+NothingPollKick();
+
+EVT_WDF_REQUEST_CANCEL NothingEvtPollCancel;
+KDEFERRED_ROUTINE      NothingPollDpc;
+
 //
 CHAR const *
 NothingPowerDeviceStateToString(WDF_POWER_DEVICE_STATE DeviceState);
@@ -0,0 +1,520 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+//
+// OSR binary trace ring
+//
+// A trace facility that's cheap enough to leave on in a free build.
+// Recording an event is an interlocked increment and a 48 byte store into
+// the current processor's ring; nothing is formatted until the ring is
+// dumped and decoded in user mode (see osrtrace_format.h).
+//
+// A driver keeps one OSR_TRACE, calls OsrTraceInitialize once its WDFDRIVER
+// exists, and then records events with OsrTrace<Level>(...).  Events above
+// OSR_TRACE_COMPILED_LEVEL cost nothing at all, since the check is against
+// a constant and the compiler throws the call away.  Events at or below it
+// are recorded if they're also at or below the run-time level, which an
+// app can change with the driver's OSR_TRACE_IOCTL_LEVEL IOCTL.
+//
+// Each ring simply wraps, so a dump holds the most recent
+// OSR_TRACE_RING_EVENTS events from each processor.
+//
+
+#include "osrtrace_format.h"
+
+//
+// Define this (to one of the OSR_TRACE_LEVEL_XXX values) before including
+// this file to change what gets compiled in
+//
+#ifndef OSR_TRACE_COMPILED_LEVEL
+#if DBG
+#define OSR_TRACE_COMPILED_LEVEL OSR_TRACE_LEVEL_VERBOSE
+#else
+#define OSR_TRACE_COMPILED_LEVEL OSR_TRACE_LEVEL_INFO
+#endif
+#endif
+
+constexpr UCHAR OsrTraceCompiledLevel = OSR_TRACE_COMPILED_LEVEL;
+
+//
+// Events per processor.  Must be a power of two.
+//
+#define OSR_TRACE_RING_EVENTS 1024
+
+#define OSR_TRACE_POOL_TAG 'rTrO'
+
+//
+// One processor's ring
+//
+typedef struct DECLSPEC_CACHEALIGN _OSR_TRACE_RING {
+
+    volatile LONG64 Next;
+
+    OSR_TRACE_EVENT Events[OSR_TRACE_RING_EVENTS];
+
+} OSR_TRACE_RING, *POSR_TRACE_RING;
+
+//
+// A driver's trace state
+//
+typedef struct _OSR_TRACE {
+
+    WDFMEMORY       RingMemory;
+    POSR_TRACE_RING Rings;
+    ULONG           RingCount;
+
+    volatile LONG   Level;
+
+    LONGLONG        Frequency;
+
+    //
+    // Mixed into every request cookie, so that a dump doesn't give away
+    // our WDFREQUEST handles
+    //
+    ULONG64         CookieKey;
+
+} OSR_TRACE, *POSR_TRACE;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrTraceInitialize
+//
+//    This routine allocates the rings for a driver's trace
+//
+//  INPUTS:
+//
+//      Trace  - The driver's trace state
+//
+//      Parent - The object that owns the rings, usually the WDFDRIVER
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the rings couldn't
+//                      be allocated.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      Until this succeeds, tracing quietly does nothing.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline NTSTATUS
+OsrTraceInitialize(POSR_TRACE Trace,
+                   WDFOBJECT  Parent)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    LARGE_INTEGER         frequency;
+    ULONG                 ringCount;
+    ULONG                 seed;
+
+    ringCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+
+    attributes.ParentObject = Parent;
+
+    status = WdfMemoryCreate(&attributes,
+                             NonPagedPoolNx,
+                             OSR_TRACE_POOL_TAG,
+                             ringCount * sizeof(OSR_TRACE_RING),
+                             &Trace->RingMemory,
+                             (PVOID *)&Trace->Rings);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for trace rings failed 0x%0x\n",
+                 status);
+#endif
+        Trace->Rings = nullptr;
+        return status;
+    }
+
+    RtlZeroMemory(Trace->Rings,
+                  ringCount * sizeof(OSR_TRACE_RING));
+
+    KeQueryPerformanceCounter(&frequency);
+
+    Trace->Frequency = frequency.QuadPart;
+    Trace->Level     = OsrTraceCompiledLevel;
+
+    //
+    // A new key every time the driver loads
+    //
+    seed = (ULONG)KeQueryPerformanceCounter(nullptr).QuadPart ^
+           (ULONG)KeQueryInterruptTime();
+
+    Trace->CookieKey = ((ULONG64)RtlRandomEx(&seed) << 32) | RtlRandomEx(&seed);
+    Trace->CookieKey ^= (ULONG64)KeQueryInterruptTime() << 17;
+
+    //
+    // Only now can anyone start using the rings
+    //
+    WriteRelease((volatile LONG *)&Trace->RingCount,
+                 (LONG)ringCount);
+
+    return STATUS_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrTraceRequestCookie
+//
+//    This routine returns the number that stands for a Request in the trace
+//
+//  INPUTS:
+//
+//      Trace    - The driver's trace state
+//
+//      Request  - The Request, or nullptr
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The Request's cookie, or zero if there's no Request
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      Events are about Requests, but a WDFREQUEST handle is just an
+//      encoded pointer, and a dump mustn't hand kernel addresses to
+//      whoever asked for it.  So we hash the handle with our key and keep
+//      only 32 bits of the result, which is plenty to tell the Requests in
+//      a dump apart but can't be turned back into the handle.
+//
+//      Use this for any Request that goes in an event's Arg1 or Arg2, too.
+//
+///////////////////////////////////////////////////////////////////////////////
+FORCEINLINE ULONG64
+OsrTraceRequestCookie(POSR_TRACE Trace,
+                      WDFREQUEST Request)
+{
+    ULONG64 value;
+
+    if (Request == nullptr) {
+        return 0;
+    }
+
+    value = (ULONG64)(ULONG_PTR)Request ^ Trace->CookieKey;
+
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+
+    value >>= 32;
+
+    return (value != 0) ? value : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrTrace
+//
+//    This routine records one event in the current processor's ring
+//
+//  INPUTS:
+//
+//      Level    - The event's level (a template argument, so that events
+//                 above OsrTraceCompiledLevel compile to nothing)
+//
+//      Trace    - The driver's trace state
+//
+//      EventId  - Which event (see OSR_TRACE_EVENT_TABLE)
+//
+//      Request  - The Request the event is about, or nullptr
+//
+//      Arg1     - The event's first value
+//
+//      Arg2     - The event's second value
+//
+//      Status   - A status to go with the event
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at any IRQL
+//
+//  NOTES:
+//
+//      A thread can be moved to another processor after it's picked a
+//      ring, which is why we claim the slot with an interlocked operation.
+//
+///////////////////////////////////////////////////////////////////////////////
+template <UCHAR Level>
+FORCEINLINE VOID
+OsrTrace(POSR_TRACE         Trace,
+         OSR_TRACE_EVENT_ID EventId,
+         WDFREQUEST         Request,
+         ULONG64            Arg1,
+         ULONG64            Arg2,
+         NTSTATUS           Status)
+{
+    POSR_TRACE_RING  ring;
+    POSR_TRACE_EVENT event;
+    ULONG            ringCount;
+    ULONG            processor;
+    LONG64           sequence;
+
+    if (Level > OsrTraceCompiledLevel) {
+        return;
+    }
+
+    if (Level > ReadNoFence(&Trace->Level)) {
+        return;
+    }
+
+    ringCount = (ULONG)ReadAcquire((volatile LONG *)&Trace->RingCount);
+
+    if (ringCount == 0) {
+        return;
+    }
+
+    processor = KeGetCurrentProcessorNumberEx(nullptr);
+
+    ring = &Trace->Rings[processor % ringCount];
+
+    sequence = InterlockedIncrementNoFence64(&ring->Next);
+
+    event = &ring->Events[(sequence - 1) & (OSR_TRACE_RING_EVENTS - 1)];
+
+    WriteNoFence64((volatile LONG64 *)&event->Sequence,
+                   0);
+
+    event->Timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+    event->Request   = OsrTraceRequestCookie(Trace,
+                                             Request);
+    event->Arg1      = Arg1;
+    event->Arg2      = Arg2;
+    event->Status    = Status;
+    event->EventId   = EventId;
+    event->Level     = Level;
+    event->Processor = (UCHAR)processor;
+
+    WriteRelease64((volatile LONG64 *)&event->Sequence,
+                   sequence);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrTraceProcessLevel
+//
+//    This routine processes a driver's OSR_TRACE_IOCTL_LEVEL request
+//
+//  INPUTS:
+//
+//      Trace   - The driver's trace state
+//
+//      Request - The level request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We complete the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrTraceProcessLevel(POSR_TRACE Trace,
+                     WDFREQUEST Request)
+{
+    NTSTATUS                 status;
+    POSR_TRACE_LEVEL_SETTING setting;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(OSR_TRACE_LEVEL_SETTING),
+                                           (PVOID *)&setting,
+                                           nullptr);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    if (setting->Level != OSR_TRACE_LEVEL_QUERY) {
+
+        if (setting->Level > OSR_TRACE_LEVEL_VERBOSE) {
+            WdfRequestComplete(Request,
+                               STATUS_INVALID_PARAMETER);
+            return;
+        }
+
+        InterlockedExchange(&Trace->Level,
+                            (LONG)setting->Level);
+    }
+
+    //
+    // METHOD_BUFFERED, so the output goes back in the same buffer
+    //
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(OSR_TRACE_LEVEL_SETTING),
+                                            (PVOID *)&setting,
+                                            nullptr);
+    if (!NT_SUCCESS(status)) {
+
+        //
+        // No output buffer is fine, they just don't get to see it
+        //
+        WdfRequestComplete(Request,
+                           STATUS_SUCCESS);
+        return;
+    }
+
+    setting->Level         = (ULONG)ReadNoFence(&Trace->Level);
+    setting->CompiledLevel = OsrTraceCompiledLevel;
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      sizeof(OSR_TRACE_LEVEL_SETTING));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OsrTraceProcessDump
+//
+//    This routine processes a driver's OSR_TRACE_IOCTL_DUMP request
+//
+//  INPUTS:
+//
+//      Trace   - The driver's trace state
+//
+//      Request - The dump request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL
+//
+//  NOTES:
+//
+//      We complete the Request.
+//
+//      We don't stop anyone from tracing while we copy, so events keep
+//      landing in the rings as we go.  The decoder sorts that out using
+//      each event's Sequence.
+//
+///////////////////////////////////////////////////////////////////////////////
+inline VOID
+OsrTraceProcessDump(POSR_TRACE Trace,
+                    WDFREQUEST Request)
+{
+    NTSTATUS               status;
+    POSR_TRACE_DUMP_HEADER header;
+    size_t                 bufferLength;
+    size_t                 ringsLength;
+    ULONG                  ringCount;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(OSR_TRACE_DUMP_HEADER),
+                                            (PVOID *)&header,
+                                            &bufferLength);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request,
+                           status);
+        return;
+    }
+
+    ringCount   = (ULONG)ReadAcquire((volatile LONG *)&Trace->RingCount);
+    ringsLength = (size_t)ringCount * OSR_TRACE_RING_EVENTS * sizeof(OSR_TRACE_EVENT);
+
+    RtlZeroMemory(header,
+                  sizeof(OSR_TRACE_DUMP_HEADER));
+
+    header->Version       = OSR_TRACE_DUMP_VERSION;
+    header->HeaderSize    = sizeof(OSR_TRACE_DUMP_HEADER);
+    header->EventSize     = sizeof(OSR_TRACE_EVENT);
+    header->RingCount     = ringCount;
+    header->EventsPerRing = OSR_TRACE_RING_EVENTS;
+    header->Frequency     = Trace->Frequency;
+    header->DumpSize      = sizeof(OSR_TRACE_DUMP_HEADER) + ringsLength;
+
+    if (bufferLength < header->DumpSize) {
+
+        //
+        // Just the header, so they know how much to ask for
+        //
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_SUCCESS,
+                                          sizeof(OSR_TRACE_DUMP_HEADER));
+        return;
+    }
+
+    for (ULONG index = 0; index < ringCount; index++) {
+
+        RtlCopyMemory((PUCHAR)(header + 1) +
+                          (size_t)index * OSR_TRACE_RING_EVENTS * sizeof(OSR_TRACE_EVENT),
+                      Trace->Rings[index].Events,
+                      OSR_TRACE_RING_EVENTS * sizeof(OSR_TRACE_EVENT));
+    }
+
+    WdfRequestCompleteWithInformation(Request,
+                                      STATUS_SUCCESS,
+                                      (ULONG_PTR)header->DumpSize);
+}
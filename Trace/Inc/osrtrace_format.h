@@ -0,0 +1,166 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+// CONSEQUENTIAL DAMAGES(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+// POSSIBILITY OF SUCH DAMAGE
+// 
+#pragma once
+
+//
+// OSR binary trace format
+//
+// This header is shared by the drivers that use our trace ring (see
+// osrtrace.h) and by the user mode tool that dumps and decodes it.
+//
+// Instead of formatting a string with DbgPrint, a driver records a fixed
+// size binary event: which event it was, when, on what processor, which
+// Request it was about, and up to two numbers and a status.  The text that
+// goes with each event lives only in the table below, and it's the
+// decoder that does the formatting, long after the fact.
+//
+
+//
+// Trace levels.  An event is recorded only if its level is at or below
+// both the level the driver was compiled with (anything above that is
+// compiled out entirely) and the level that's currently set.
+//
+constexpr UCHAR OSR_TRACE_LEVEL_OFF     = 0;
+constexpr UCHAR OSR_TRACE_LEVEL_ERROR   = 1;
+constexpr UCHAR OSR_TRACE_LEVEL_WARNING = 2;
+constexpr UCHAR OSR_TRACE_LEVEL_INFO    = 3;
+constexpr UCHAR OSR_TRACE_LEVEL_VERBOSE = 4;
+
+//
+// The events
+//
+// Each entry is the event's name, its number, and the printf format the
+// decoder uses for it.  The format gets Arg1 and Arg2, in that order, both
+// as 64-bit values.  The high byte of the number says which driver the
+// event belongs to.
+//
+#define OSR_TRACE_EVENT_TABLE(X)                                                          \
+    X(OSR_TRACE_NOTHING_READ,             0x0101, "Nothing: read of %llu bytes")           \
+    X(OSR_TRACE_NOTHING_WRITE,            0x0102, "Nothing: write of %llu bytes")          \
+    X(OSR_TRACE_NOTHING_READ_PARKED,      0x0103, "Nothing: no write waiting, read parked") \
+    X(OSR_TRACE_NOTHING_WRITE_PARKED,     0x0104, "Nothing: no read waiting, write parked") \
+    X(OSR_TRACE_NOTHING_PAIRED,           0x0105, "Nothing: paired with request 0x%llx, %llu bytes copied") \
+    X(OSR_TRACE_NOTHING_FORWARD_FAILED,   0x0106, "Nothing: couldn't park request")        \
+    X(OSR_TRACE_NOTHING_BUFFER_FAILED,    0x0107, "Nothing: couldn't get buffer of request 0x%llx") \
+    X(OSR_TRACE_NOTHING_IOCTL,            0x0108, "Nothing: IOCTL 0x%llx")                 \
+    X(OSR_TRACE_CDFILTER_READ,            0x0201, "CDFilter: read of %llu bytes at offset 0x%llx") \
+    X(OSR_TRACE_CDFILTER_READ_COMPLETE,   0x0202, "CDFilter: read completed, %llu bytes")  \
+    X(OSR_TRACE_CDFILTER_SEND_FAILED,     0x0203, "CDFilter: couldn't send request")       \
+    X(OSR_TRACE_CDFILTER_IOCTL,           0x0204, "CDFilter: IOCTL 0x%llx")                \
+    X(OSR_TRACE_CDFILTER_CACHE_HIT,       0x0205, "CDFilter: cache hit, %llu bytes at offset 0x%llx") \
+    X(OSR_TRACE_CDFILTER_CACHE_FLUSHED,   0x0206, "CDFilter: cache emptied, IOCTL or status 0x%llx") \
+    X(OSR_TRACE_CDFILTER_READ_AHEAD,      0x0207, "CDFilter: read-ahead of %llu bytes at offset 0x%llx") \
+    X(OSR_TRACE_CDFILTER_SPLIT,           0x0208, "CDFilter: read of %llu bytes split into %llu chunks") \
+    X(OSR_TRACE_CDFILTER_COALESCED,       0x0209, "CDFilter: %llu reads merged into one of %llu bytes") \
+    X(OSR_TRACE_BASICUSB_READ,            0x0301, "BasicUSB: read of %llu bytes")          \
+    X(OSR_TRACE_BASICUSB_WRITE,           0x0302, "BasicUSB: write of %llu bytes")         \
+    X(OSR_TRACE_BASICUSB_WRITE_COMPLETE,  0x0303, "BasicUSB: write completed, %llu bytes") \
+    X(OSR_TRACE_BASICUSB_SEND_FAILED,     0x0304, "BasicUSB: couldn't send request")       \
+    X(OSR_TRACE_BASICUSB_INTERRUPT,       0x0305, "BasicUSB: switches 0x%llx, %llu bytes") \
+    X(OSR_TRACE_BASICUSB_IOCTL,           0x0306, "BasicUSB: IOCTL 0x%llx")                \
+    X(OSR_TRACE_BASICUSB_BAR_GRAPH,       0x0307, "BasicUSB: bar graph set to 0x%llx")
+
+#define OSR_TRACE_EVENT_ID(Name, Id, Format) Name = Id,
+
+enum OSR_TRACE_EVENT_ID : USHORT {
+    OSR_TRACE_EVENT_TABLE(OSR_TRACE_EVENT_ID)
+};
+
+#undef OSR_TRACE_EVENT_ID
+
+//
+// One event, exactly as it sits in the ring
+//
+// Sequence is the event's position in its processor's ring, counting from
+// one.  The driver zeroes it before filling the event in and sets it last,
+// so the decoder can throw away any event that was being written while the
+// ring was dumped.
+//
+typedef struct _OSR_TRACE_EVENT {
+
+    ULONGLONG Sequence;
+    LONGLONG  Timestamp;        // Performance counter ticks
+    ULONGLONG Request;          // Cookie for the Request, if any (never its handle)
+    ULONGLONG Arg1;
+    ULONGLONG Arg2;
+    LONG      Status;
+    USHORT    EventId;
+    UCHAR     Level;
+    UCHAR     Processor;
+
+} OSR_TRACE_EVENT, *POSR_TRACE_EVENT;
+
+//
+// Trace IOCTLs
+//
+// Each driver defines these for its own device type.  The function codes
+// are the same for all of them, so one tool can talk to any of them.
+//
+// OSR_TRACE_IOCTL_LEVEL takes an OSR_TRACE_LEVEL_SETTING.  If Level isn't
+// OSR_TRACE_LEVEL_QUERY it becomes the driver's new trace level.  Either
+// way the driver returns the current level and the level it was compiled
+// with.
+//
+// OSR_TRACE_IOCTL_DUMP returns an OSR_TRACE_DUMP_HEADER, followed by
+// RingCount rings of EventsPerRing events each.  If the output buffer is
+// too small for all that, the driver returns just the header, and DumpSize
+// tells the caller how big a buffer it needs.
+//
+// Both need a handle that was opened for writing, so that someone who can
+// only read the device can't see what everyone else is doing or slow them
+// all down with VERBOSE tracing.
+//
+#define OSR_TRACE_IOCTL_LEVEL(DeviceType) CTL_CODE(DeviceType, 4032, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define OSR_TRACE_IOCTL_DUMP(DeviceType)  CTL_CODE(DeviceType, 4033, METHOD_OUT_DIRECT, FILE_WRITE_ACCESS)
+
+#define OSR_TRACE_LEVEL_QUERY 0xFFFFFFFF
+
+typedef struct _OSR_TRACE_LEVEL_SETTING {
+
+    ULONG Level;
+    ULONG CompiledLevel;
+
+} OSR_TRACE_LEVEL_SETTING, *POSR_TRACE_LEVEL_SETTING;
+
+#define OSR_TRACE_DUMP_VERSION 1
+
+typedef struct _OSR_TRACE_DUMP_HEADER {
+
+    ULONG     Version;
+    ULONG     HeaderSize;
+    ULONG     EventSize;
+    ULONG     RingCount;
+    ULONG     EventsPerRing;
+    ULONG     Reserved;
+    ULONGLONG Frequency;        // Ticks per second
+    ULONGLONG DumpSize;         // Header plus all the rings
+
+} OSR_TRACE_DUMP_HEADER, *POSR_TRACE_DUMP_HEADER;
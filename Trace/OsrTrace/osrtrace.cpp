@@ -0,0 +1,409 @@
+//
+// Copyright 2007-2022 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// OSRTRACE.CPP
+//
+// Utility for the OSR trace ring: sets a driver's trace level, dumps its
+// rings to a file, and decodes a dump into text.
+//
+// This code is purely functional, and is definitely not designed to be any
+// sort of example.
+//
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Windows.h>
+#include <winioctl.h>
+#include <osrtrace_format.h>
+
+//
+// The drivers we know how to talk to.  The device types come from each
+// driver's own headers.
+//
+typedef struct _TRACE_TARGET {
+
+    const char *Name;
+    const char *DefaultPath;
+    DWORD       DeviceType;
+
+} TRACE_TARGET, *PTRACE_TARGET;
+
+static const TRACE_TARGET Targets[] = {
+    { "nothing",  "\\\\.\\Nothing0", 0xCF53 },  // FILE_DEVICE_NOTHING
+    { "basicusb", "\\\\.\\BasicUsb", 0xCF53 },  // FILE_DEVICE_BASICUSB
+    { "cdfilter", "\\\\.\\CdRom0",   0xCF54 },  // FILE_DEVICE_CDFILTER
+};
+
+//
+// The events, for decoding
+//
+typedef struct _TRACE_EVENT_INFO {
+
+    USHORT      Id;
+    const char *Name;
+    const char *Format;
+
+} TRACE_EVENT_INFO;
+
+#define TRACE_EVENT_INFO_ENTRY(Name, Id, Format) { Id, #Name, Format },
+
+static const TRACE_EVENT_INFO EventInfo[] = {
+    OSR_TRACE_EVENT_TABLE(TRACE_EVENT_INFO_ENTRY)
+};
+
+static const char *LevelNames[] = {
+    "OFF", "ERR", "WRN", "INF", "VRB"
+};
+
+static void
+Usage()
+{
+    printf("Usage: osrtrace <driver> level [<level> [<device>]]\n");
+    printf("       osrtrace <driver> dump <file> [<device>]\n");
+    printf("       osrtrace decode <file>\n");
+    printf("\n");
+    printf("  <driver> is nothing, basicusb or cdfilter\n");
+    printf("  <level> is 0 (off) through 4 (verbose)\n");
+}
+
+static HANDLE
+OpenTarget(const TRACE_TARGET *Target,
+           const char         *Path)
+{
+    HANDLE handle;
+
+    handle = CreateFileA(Path != nullptr ? Path : Target->DefaultPath,
+                         GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         nullptr,
+                         OPEN_EXISTING,
+                         0,
+                         nullptr);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        printf("CreateFile of %s failed with error 0x%lx\n",
+               Path != nullptr ? Path : Target->DefaultPath,
+               GetLastError());
+    }
+
+    return handle;
+}
+
+static int
+SetLevel(const TRACE_TARGET *Target,
+         const char         *Level,
+         const char         *Path)
+{
+    HANDLE                  handle;
+    OSR_TRACE_LEVEL_SETTING setting;
+    DWORD                   bytesReturned;
+
+    handle = OpenTarget(Target,
+                        Path);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+
+    setting.Level         = Level != nullptr ? strtoul(Level, nullptr, 0) : OSR_TRACE_LEVEL_QUERY;
+    setting.CompiledLevel = 0;
+
+    if (!DeviceIoControl(handle,
+                         OSR_TRACE_IOCTL_LEVEL(Target->DeviceType),
+                         &setting,
+                         sizeof(setting),
+                         &setting,
+                         sizeof(setting),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        CloseHandle(handle);
+        return 1;
+    }
+
+    printf("Trace level %lu (compiled with %lu)\n",
+           setting.Level,
+           setting.CompiledLevel);
+
+    CloseHandle(handle);
+    return 0;
+}
+
+static int
+Dump(const TRACE_TARGET *Target,
+     const char         *File,
+     const char         *Path)
+{
+    HANDLE                handle;
+    OSR_TRACE_DUMP_HEADER header;
+    PUCHAR                buffer;
+    DWORD                 bytesReturned;
+    FILE                 *output;
+
+    handle = OpenTarget(Target,
+                        Path);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+
+    //
+    // Ask for just the header first, to find out how big the dump is
+    //
+    if (!DeviceIoControl(handle,
+                         OSR_TRACE_IOCTL_DUMP(Target->DeviceType),
+                         nullptr,
+                         0,
+                         &header,
+                         sizeof(header),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        CloseHandle(handle);
+        return 1;
+    }
+
+    buffer = (PUCHAR)malloc((size_t)header.DumpSize);
+
+    if (buffer == nullptr) {
+        printf("Out of memory\n");
+        CloseHandle(handle);
+        return 1;
+    }
+
+    if (!DeviceIoControl(handle,
+                         OSR_TRACE_IOCTL_DUMP(Target->DeviceType),
+                         nullptr,
+                         0,
+                         buffer,
+                         (DWORD)header.DumpSize,
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("DeviceIoControl failed with error 0x%lx\n",
+               GetLastError());
+        free(buffer);
+        CloseHandle(handle);
+        return 1;
+    }
+
+    CloseHandle(handle);
+
+    output = fopen(File,
+                   "wb");
+
+    if (output == nullptr) {
+        printf("Can't create %s\n",
+               File);
+        free(buffer);
+        return 1;
+    }
+
+    fwrite(buffer,
+           1,
+           bytesReturned,
+           output);
+
+    fclose(output);
+
+    printf("Wrote %lu bytes to %s\n",
+           bytesReturned,
+           File);
+
+    free(buffer);
+    return 0;
+}
+
+static int
+CompareEvents(const void *First,
+              const void *Second)
+{
+    const OSR_TRACE_EVENT *first  = (const OSR_TRACE_EVENT *)First;
+    const OSR_TRACE_EVENT *second = (const OSR_TRACE_EVENT *)Second;
+
+    if (first->Timestamp != second->Timestamp) {
+        return first->Timestamp < second->Timestamp ? -1 : 1;
+    }
+
+    return first->Sequence < second->Sequence ? -1 : (first->Sequence > second->Sequence);
+}
+
+static int
+Decode(const char *File)
+{
+    FILE                  *input;
+    long                   fileSize;
+    PUCHAR                 buffer;
+    POSR_TRACE_DUMP_HEADER header;
+    POSR_TRACE_EVENT       events;
+    POSR_TRACE_EVENT       sorted;
+    ULONGLONG              eventCount;
+    ULONG                  validCount = 0;
+    const char            *format;
+    const char            *name;
+
+    input = fopen(File,
+                  "rb");
+
+    if (input == nullptr) {
+        printf("Can't open %s\n",
+               File);
+        return 1;
+    }
+
+    fseek(input, 0, SEEK_END);
+    fileSize = ftell(input);
+    fseek(input, 0, SEEK_SET);
+
+    buffer = (PUCHAR)malloc(fileSize);
+
+    if (buffer == nullptr ||
+        fread(buffer, 1, fileSize, input) != (size_t)fileSize) {
+
+        printf("Can't read %s\n",
+               File);
+        fclose(input);
+        free(buffer);
+        return 1;
+    }
+
+    fclose(input);
+
+    header = (POSR_TRACE_DUMP_HEADER)buffer;
+
+    if ((size_t)fileSize < sizeof(OSR_TRACE_DUMP_HEADER) ||
+        header->Version != OSR_TRACE_DUMP_VERSION ||
+        header->EventSize != sizeof(OSR_TRACE_EVENT) ||
+        header->DumpSize > (ULONGLONG)fileSize ||
+        header->Frequency == 0) {
+
+        printf("%s isn't a trace dump we understand\n",
+               File);
+        free(buffer);
+        return 1;
+    }
+
+    events     = (POSR_TRACE_EVENT)(buffer + header->HeaderSize);
+    eventCount = (ULONGLONG)header->RingCount * header->EventsPerRing;
+
+    sorted = (POSR_TRACE_EVENT)malloc((size_t)eventCount * sizeof(OSR_TRACE_EVENT));
+
+    if (sorted == nullptr) {
+        printf("Out of memory\n");
+        free(buffer);
+        return 1;
+    }
+
+    //
+    // Keep only the events that were completely written.  A slot that's
+    // never been used, or was being rewritten when the dump was taken,
+    // doesn't have the Sequence that matches its position in the ring.
+    //
+    for (ULONGLONG index = 0; index < eventCount; index++) {
+
+        ULONGLONG slot = index % header->EventsPerRing;
+
+        if (events[index].Sequence == 0 ||
+            (events[index].Sequence - 1) % header->EventsPerRing != slot) {
+            continue;
+        }
+
+        sorted[validCount++] = events[index];
+    }
+
+    qsort(sorted,
+          validCount,
+          sizeof(OSR_TRACE_EVENT),
+          CompareEvents);
+
+    for (ULONG index = 0; index < validCount; index++) {
+
+        format = "unknown event";
+        name   = "?";
+
+        for (size_t info = 0; info < sizeof(EventInfo) / sizeof(EventInfo[0]); info++) {
+
+            if (EventInfo[info].Id == sorted[index].EventId) {
+                format = EventInfo[info].Format;
+                name   = EventInfo[info].Name;
+                break;
+            }
+        }
+
+        printf("%14.3f us  cpu %3u  %s  %016llx  0x%08lx  %-34s ",
+               (double)(sorted[index].Timestamp - sorted[0].Timestamp) * 1000000.0 /
+                   (double)header->Frequency,
+               sorted[index].Processor,
+               sorted[index].Level <= OSR_TRACE_LEVEL_VERBOSE ?
+                   LevelNames[sorted[index].Level] : "???",
+               sorted[index].Request,
+               (ULONG)sorted[index].Status,
+               name);
+
+        printf(format,
+               sorted[index].Arg1,
+               sorted[index].Arg2);
+
+        printf("\n");
+    }
+
+    printf("%lu events\n",
+           validCount);
+
+    free(sorted);
+    free(buffer);
+    return 0;
+}
+
+int
+main(int   argc,
+     char *argv[])
+{
+    const TRACE_TARGET *target = nullptr;
+
+    if (argc >= 3 && _stricmp(argv[1], "decode") == 0) {
+        return Decode(argv[2]);
+    }
+
+    if (argc < 3) {
+        Usage();
+        return 1;
+    }
+
+    for (size_t index = 0; index < sizeof(Targets) / sizeof(Targets[0]); index++) {
+
+        if (_stricmp(argv[1], Targets[index].Name) == 0) {
+            target = &Targets[index];
+            break;
+        }
+    }
+
+    if (target == nullptr) {
+        Usage();
+        return 1;
+    }
+
+    if (_stricmp(argv[2], "level") == 0) {
+
+        return SetLevel(target,
+                        argc > 3 ? argv[3] : nullptr,
+                        argc > 4 ? argv[4] : nullptr);
+    }
+
+    if (_stricmp(argv[2], "dump") == 0 && argc > 3) {
+
+        return Dump(target,
+                    argv[3],
+                    argc > 4 ? argv[4] : nullptr);
+    }
+
+    Usage();
+    return 1;
+}